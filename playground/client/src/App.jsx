@@ -62,6 +62,8 @@ function App() {
   const [errors, setErrors] = useState('');
   const [activeTab, setActiveTab] = useState('output');
   const [status, setStatus] = useState('idle');
+  // lets the server keep an incremental compiler around for this tab
+  const [sessionId] = useState(() => Math.random().toString(36).slice(2, 14));
 
   const handleRun = async () => {
     setStatus('loading');
@@ -72,7 +74,7 @@ function App() {
     if (activeTab === 'asm') setActiveTab('output');
 
     try {
-      const response = await axios.post('/compile', { code });
+      const response = await axios.post('/compile', { code, sessionId });
       const data = response.data;
 
       if (data.success) {
@@ -1,7 +1,7 @@
 const express = require('express');
 const cors = require('cors');
 const bodyParser = require('body-parser');
-const { exec } = require('child_process');
+const { exec, spawn } = require('child_process');
 const fs = require('fs');
 const path = require('path');
 
@@ -10,49 +10,121 @@ app.use(cors());
 app.use(bodyParser.json());
 
 const COMPILER_PATH = path.resolve(__dirname, '../../build/baby');
-const TEMP_FILE = path.resolve(__dirname, 'temp.by');
+const SESSIONS_DIR = path.resolve(__dirname, 'sessions');
 const OUT_ASM = 'out.asm'; // Compiler generates this in CWD
 const OUT_EXEC = './out'; // Compiler generates this in CWD
+const SESSION_IDLE_MS = 10 * 60 * 1000;
+const MAX_SESSIONS = 32; // live compiler processes; past this the least recently used one is closed
+const COMPILE_TIMEOUT_MS = 20 * 1000; // a compiler that hasn't answered by then is killed
+const RUN_TIMEOUT_MS = 5 * 1000; // and so is a program still running after this
 
-// Ensure we are working in the server directory so compiler outputs are contained
-// Actually, the compiler generates outputs in CWD. So we should run exec with cwd options.
+// One long-lived `baby --session` per editor session. It keeps the tokens, AST and
+// assembly of every top-level function between requests, so a compile only redoes
+// what the edit touched. Each compiler process gets a fresh directory for
+// temp.by/out.asm/out, so one that replaces it under the same id never shares it.
+// Protocol: we write the source path as a line on stdin, the compiler answers on
+// stdout with its diagnostics (if any) and a final "%%done <status>" line.
+// The map is kept in order of use, least recent first.
+const sessions = new Map();
 
+// exitCode stays null for a compiler killed by a signal
+function alive(session) {
+    return session.proc.exitCode === null && session.proc.signalCode === null;
+}
 
-// Serve static frontend files
-app.use(express.static(path.join(__dirname, '../client/dist')));
+// Answers the request waiting on the session, if any, as a failed compile.
+function failWaiting(session, message) {
+    if (session.waiting) {
+        const resolve = session.waiting;
+        session.waiting = null;
+        resolve({ status: 1, diagnostics: '', stderr: session.stderr || message });
+    }
+}
 
-app.post('/compile', (req, res) => {
-    const { code } = req.body;
+// Lets the compiler finish what's queued, then ends it and removes its directory.
+// Every compile and run in the queue has a deadline, so this always happens.
+function closeSession(id, session) {
+    if (sessions.get(id) === session) {
+        sessions.delete(id);
+    }
+    session.queue.then(() => {
+        session.proc.stdin.end();
+        fs.rmSync(session.dir, { recursive: true, force: true });
+    });
+}
+
+function sessionFor(id) {
+    let session = sessions.get(id);
+    if (session && alive(session)) {
+        session.lastUsed = Date.now();
+        sessions.delete(id);
+        sessions.set(id, session);
+        return session;
+    }
+    if (session) {
+        closeSession(id, session); // it died, its directory goes once its queue is done
+    }
+    while (sessions.size >= MAX_SESSIONS) {
+        const [oldestId, oldest] = sessions.entries().next().value;
+        closeSession(oldestId, oldest);
+    }
 
-    // Save code to temp file
-    fs.writeFileSync(TEMP_FILE, code);
-
-    // Run compiler
-    // We run in the current directory so out.asm and out are generated here
-    exec(`${COMPILER_PATH} ${TEMP_FILE}`, { cwd: __dirname }, (error, stdout, stderr) => {
-        if (error || stderr) {
-            // Compilation failed
-            const errorMsg = stderr || error.message;
-            // Try to make it sarcastic if it's a generic error, but relying on compiler's output is better
-            return res.json({
-                success: false,
-                output: '',
-                assembly: '',
-                errors: errorMsg
-            });
+    fs.mkdirSync(SESSIONS_DIR, { recursive: true });
+    const dir = fs.mkdtempSync(path.join(SESSIONS_DIR, `${id}-`));
+    const proc = spawn(COMPILER_PATH, ['--session', '--emit-asm'], { cwd: dir }); // out.asm is only for the Assembly tab
+    session = { id, dir, proc, stdout: '', stderr: '', waiting: null, queue: Promise.resolve(), lastUsed: Date.now() };
+
+    proc.stdout.on('data', (chunk) => {
+        session.stdout += chunk;
+        const done = session.stdout.match(/^%%done (\d+)\n/m);
+        if (done && session.waiting) {
+            const diagnostics = session.stdout.slice(0, done.index);
+            const stderr = session.stderr;
+            session.stdout = session.stdout.slice(done.index + done[0].length);
+            session.stderr = '';
+            const resolve = session.waiting;
+            session.waiting = null;
+            resolve({ status: Number(done[1]), diagnostics, stderr });
         }
+    });
+    proc.stderr.on('data', (chunk) => { session.stderr += chunk; });
+    proc.on('exit', () => failWaiting(session, 'Compiler session crashed'));
+    // a compiler that couldn't start, or died before reading a request (EPIPE), fails that request
+    proc.on('error', (err) => failWaiting(session, `Compiler session failed: ${err.message}`));
+    proc.stdin.on('error', (err) => failWaiting(session, `Compiler session failed: ${err.message}`));
 
-        // Compilation success
-        // Read assembly
-        let assembly = '';
-        try {
-            assembly = fs.readFileSync(path.resolve(__dirname, OUT_ASM), 'utf-8');
-        } catch (e) {
-            assembly = '; Assembly file not found. Distinctly odd.';
+    sessions.set(id, session);
+    return session;
+}
+
+// Sends one source file to the session's compiler, resolves with its reply. One
+// that doesn't answer in time is killed, and the next request starts a new one.
+function compileOnce(session, code) {
+    return new Promise((resolve) => {
+        const tempFile = path.join(session.dir, 'temp.by');
+        fs.writeFileSync(tempFile, code);
+        const timer = setTimeout(() => {
+            if (session.waiting) {
+                session.proc.kill('SIGKILL');
+                failWaiting(session, 'Compiler took too long and was stopped');
+            }
+        }, COMPILE_TIMEOUT_MS);
+        session.waiting = (reply) => {
+            clearTimeout(timer);
+            resolve(reply);
+        };
+        if (!alive(session)) {
+            failWaiting(session, 'Compiler session crashed');
+            return;
         }
+        session.proc.stdin.write(tempFile + '\n');
+    });
+}
 
-        // Run the executable
-        exec(OUT_EXEC, { cwd: __dirname }, (runError, runStdout, runStderr) => {
+// Runs the program the last compile wrote, killing it if it runs too long.
+function runProgram(session) {
+    return new Promise((resolve) => {
+        exec(OUT_EXEC, { cwd: session.dir, timeout: RUN_TIMEOUT_MS, killSignal: 'SIGKILL' }, (runError, runStdout, runStderr) => {
             const output = runStdout + runStderr; // Capture both
 
             let runtimeError = null;
@@ -60,21 +132,81 @@ app.post('/compile', (req, res) => {
             // But for our language, bye(400) is a valid exit.
             // We only consider it a REAL runtime error if there is stuff in stderr,
             // OR if the error signal is something else (like killed).
-            if (runError && runError.code !== undefined && !runStderr) {
+            if (runError && runError.killed) {
+                runtimeError = `Program ran longer than ${RUN_TIMEOUT_MS / 1000} seconds and was stopped`;
+            } else if (runError && runError.signal) {
+                runtimeError = runStderr || `Program was killed by ${runError.signal}`;
+            } else if (runError && runError.code !== undefined && !runStderr) {
                 // It's just a non-zero exit code.
                 console.log(`Program finished with exit code ${runError.code}`);
             } else if (runError) {
                 runtimeError = runStderr || runError.message;
             }
+            resolve({ output, runtimeError });
+        });
+    });
+}
 
-            res.json({
-                success: !runtimeError,
-                output: output,
-                assembly: assembly,
-                errors: runtimeError ? `Runtime Error:\n${runtimeError}` : ''
-            });
+// Requests of one session run one after another, they share the same output files:
+// the compile, reading out.asm and running out all happen before the next one starts,
+// and closeSession waits for all of it before removing the directory.
+function compileInSession(session, code) {
+    const run = session.queue.then(async () => {
+        const { status, diagnostics, stderr } = await compileOnce(session, code);
+        if (status !== 0 || stderr) {
+            return { status: status || 1, diagnostics: diagnostics || stderr, assembly: '', output: '' };
+        }
 
+        let assembly = '';
+        try {
+            assembly = fs.readFileSync(path.resolve(session.dir, OUT_ASM), 'utf-8');
+        } catch (e) {
+            assembly = '; Assembly file not found. Distinctly odd.';
+        }
+        const { output, runtimeError } = await runProgram(session);
+        return { status: 0, diagnostics: '', assembly, output, runtimeError };
+    });
+    session.queue = run.catch(() => {});
+    return run;
+}
+
+setInterval(() => {
+    const now = Date.now();
+    for (const [id, session] of sessions) {
+        if (now - session.lastUsed > SESSION_IDLE_MS) {
+            closeSession(id, session);
+        }
+    }
+}, 60 * 1000).unref();
+
+// Serve static frontend files
+app.use(express.static(path.join(__dirname, '../client/dist')));
+
+app.post('/compile', async (req, res) => {
+    const { code } = req.body;
+    const sessionId = /^[A-Za-z0-9_-]{1,64}$/.test(req.body.sessionId || '') ? req.body.sessionId : 'default';
+    const session = sessionFor(sessionId);
+
+    // Run compiler and program
+    // The session works in its own directory so out.asm and out are generated there
+    const { status, diagnostics, assembly, output, runtimeError } = await compileInSession(session, code);
+
+    if (status !== 0) {
+        // Compilation failed
+        // Try to make it sarcastic if it's a generic error, but relying on compiler's output is better
+        return res.json({
+            success: false,
+            output: '',
+            assembly: '',
+            errors: diagnostics
         });
+    }
+
+    res.json({
+        success: !runtimeError,
+        output: output,
+        assembly: assembly,
+        errors: runtimeError ? `Runtime Error:\n${runtimeError}` : ''
     });
 });
 
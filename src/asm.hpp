@@ -0,0 +1,317 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "regalloc.hpp"
+
+// Condition codes, numbered as the low nibble of jcc/setcc encodes them.
+enum class Cond : uint8_t { o, no, b, ae, e, ne, be, a, s, ns, p, np, l, ge, le, g };
+
+inline Cond negate(Cond cc)
+{
+    return static_cast<Cond>(static_cast<uint8_t>(cc) ^ 1);
+}
+
+inline const char* cond_name(Cond cc)
+{
+    static const char* const names[] = {"o", "no", "b", "ae", "e", "ne", "be", "a", "s", "ns", "p", "np", "l", "ge", "le", "g"};
+    return names[static_cast<int>(cc)];
+}
+
+// An instruction operand: a register (of some width), memory at reg + index *
+// scale + disp (a frame slot is a QWORD at rbp + disp), an immediate, or a
+// symbol (a label, or a rip-relative address). For memory the width is the
+// size accessed, 0 when the other operand's register says it or for lea.
+struct Operand {
+    enum class Kind : uint8_t { none, reg, mem, imm, sym, rip };
+    Kind kind = Kind::none;
+    uint8_t width = 64; // reg: 8, 16, 32 or 64; mem and rip: 0, 8, 16 or 64
+    Reg reg = Reg::rax; // reg, and mem's base
+    Reg index = Reg::rax; // mem
+    uint8_t scale = 0; // mem: 1, 2, 4 or 8, 0 for no index
+    int32_t disp = 0;
+    int64_t imm = 0; // imm: the value; sym and rip: index into the unit's symbols
+
+    bool operator==(const Operand& other) const
+    {
+        if(kind != other.kind) return false;
+        switch(kind)
+        {
+            case Kind::none: return true;
+            case Kind::reg: return reg == other.reg && width == other.width;
+            case Kind::mem: return reg == other.reg && scale == other.scale && (scale == 0 || index == other.index) && disp == other.disp && width == other.width;
+            default: return imm == other.imm;
+        }
+    }
+
+    [[nodiscard]] bool is_reg() const { return kind == Kind::reg; }
+    [[nodiscard]] bool is_mem() const { return kind == Kind::mem; }
+    [[nodiscard]] bool is_imm() const { return kind == Kind::imm; }
+    [[nodiscard]] bool fits_imm32() const { return kind != Kind::imm || (imm >= INT32_MIN && imm <= INT32_MAX); }
+
+    // whether this operand reads the 64-bit register r (a memory operand reads its base and index)
+    [[nodiscard]] bool uses(Reg r) const
+    {
+        return (kind == Kind::reg || kind == Kind::mem) && (reg == r || (kind == Kind::mem && scale != 0 && index == r));
+    }
+};
+
+inline Operand reg_op(Reg reg, uint8_t width = 64)
+{
+    return {.kind=Operand::Kind::reg, .width=width, .reg=reg};
+}
+
+// a frame slot
+inline Operand mem_op(int32_t disp)
+{
+    return {.kind=Operand::Kind::mem, .reg=Reg::rbp, .disp=disp};
+}
+
+inline Operand mem_op(Reg base, int32_t disp, uint8_t width = 0)
+{
+    return {.kind=Operand::Kind::mem, .width=width, .reg=base, .disp=disp};
+}
+
+// base + index * scale + disp, as lea computes it or as memory
+inline Operand addr_op(Reg base, Reg index, uint8_t scale, int32_t disp = 0, uint8_t width = 0)
+{
+    return {.kind=Operand::Kind::mem, .width=width, .reg=base, .index=index, .scale=scale, .disp=disp};
+}
+
+inline Operand imm_op(int64_t value)
+{
+    return {.kind=Operand::Kind::imm, .imm=value};
+}
+
+inline Operand sym_op(uint32_t symbol)
+{
+    return {.kind=Operand::Kind::sym, .imm=symbol};
+}
+
+inline Operand rip_op(uint32_t symbol, uint8_t width = 0)
+{
+    return {.kind=Operand::Kind::rip, .width=width, .imm=symbol};
+}
+
+enum class AsmOp : uint8_t { nop, label, mov, movzx, lea, add, sub, sbb, or_, imul, mul, div, idiv, cqo, neg, inc, dec, shl, shr, sar, bsr, cmp, test, xor_, setcc,
+                             jmp, jcc, call, push, pop, leave, ret, syscall, rep_movsb, repne_scasb };
+
+// One instruction (or a label, whose symbol is in a). nop is what the peephole
+// pass leaves behind; it's dropped when the code is printed.
+struct AsmInst {
+    AsmOp op = AsmOp::nop;
+    Cond cc = Cond::e; // jcc, setcc
+    Operand a {}, b {}, c {};
+};
+
+// The code of a unit being emitted, and the names its symbol operands refer to.
+struct AsmCode {
+    std::vector<AsmInst> insts;
+    std::vector<std::string> symbols;
+
+    uint32_t symbol(std::string name)
+    {
+        symbols.push_back(std::move(name));
+        return static_cast<uint32_t>(symbols.size() - 1);
+    }
+
+    void clear()
+    {
+        insts.clear();
+        symbols.clear();
+    }
+
+    // NASM syntax
+    void print(std::string& out) const
+    {
+        for(const AsmInst& inst : insts)
+        {
+            switch(inst.op)
+            {
+                case AsmOp::nop:
+                    break;
+                case AsmOp::label:
+                    out += symbols[inst.a.imm];
+                    out += ":\n";
+                    break;
+                case AsmOp::setcc:
+                    out += "    set";
+                    out += cond_name(inst.cc);
+                    out += ' ';
+                    operand(out, inst.a);
+                    out += '\n';
+                    break;
+                case AsmOp::jcc:
+                    out += "    j";
+                    out += cond_name(inst.cc);
+                    out += ' ';
+                    operand(out, inst.a);
+                    out += '\n';
+                    break;
+                default:
+                    out += "    ";
+                    out += mnemonic(inst.op);
+                    if(inst.a.kind != Operand::Kind::none)
+                    {
+                        out += ' ';
+                        operand(out, inst.a);
+                    }
+                    if(inst.b.kind != Operand::Kind::none)
+                    {
+                        out += ", ";
+                        operand(out, inst.b);
+                    }
+                    if(inst.c.kind != Operand::Kind::none)
+                    {
+                        out += ", ";
+                        operand(out, inst.c);
+                    }
+                    out += '\n';
+                    break;
+            }
+        }
+    }
+
+private:
+    static const char* mnemonic(AsmOp op)
+    {
+        switch(op)
+        {
+            case AsmOp::mov: return "mov";
+            case AsmOp::movzx: return "movzx";
+            case AsmOp::lea: return "lea";
+            case AsmOp::add: return "add";
+            case AsmOp::sub: return "sub";
+            case AsmOp::sbb: return "sbb";
+            case AsmOp::or_: return "or";
+            case AsmOp::imul: return "imul";
+            case AsmOp::mul: return "mul";
+            case AsmOp::div: return "div";
+            case AsmOp::idiv: return "idiv";
+            case AsmOp::cqo: return "cqo";
+            case AsmOp::neg: return "neg";
+            case AsmOp::inc: return "inc";
+            case AsmOp::dec: return "dec";
+            case AsmOp::shl: return "shl";
+            case AsmOp::shr: return "shr";
+            case AsmOp::sar: return "sar";
+            case AsmOp::bsr: return "bsr";
+            case AsmOp::cmp: return "cmp";
+            case AsmOp::test: return "test";
+            case AsmOp::xor_: return "xor";
+            case AsmOp::jmp: return "jmp";
+            case AsmOp::call: return "call";
+            case AsmOp::push: return "push";
+            case AsmOp::pop: return "pop";
+            case AsmOp::leave: return "leave";
+            case AsmOp::ret: return "ret";
+            case AsmOp::syscall: return "syscall";
+            case AsmOp::rep_movsb: return "rep movsb";
+            case AsmOp::repne_scasb: return "repne scasb";
+            default: return "nop";
+        }
+    }
+
+    static void size(std::string& out, uint8_t width)
+    {
+        if(width != 0)
+        {
+            out += width == 8 ? "BYTE " : width == 16 ? "WORD " : width == 32 ? "DWORD " : "QWORD ";
+        }
+    }
+
+    void operand(std::string& out, const Operand& op) const
+    {
+        switch(op.kind)
+        {
+            case Operand::Kind::reg:
+                out += op.width == 64 ? reg_name(op.reg) : op.width == 32 ? reg_name32(op.reg) : op.width == 16 ? reg_name16(op.reg) : reg_name8(op.reg);
+                break;
+            case Operand::Kind::mem:
+                size(out, op.width);
+                out += '[';
+                out += reg_name(op.reg);
+                if(op.scale != 0)
+                {
+                    out += " + ";
+                    out += reg_name(op.index);
+                    if(op.scale != 1) out += "*" + std::to_string(op.scale);
+                }
+                if(op.disp != 0)
+                {
+                    out += op.disp < 0 ? " - " + std::to_string(-static_cast<int64_t>(op.disp)) : " + " + std::to_string(op.disp);
+                }
+                out += ']';
+                break;
+            case Operand::Kind::imm:
+                out += std::to_string(op.imm);
+                break;
+            case Operand::Kind::sym:
+                out += symbols[op.imm];
+                break;
+            case Operand::Kind::rip:
+                size(out, op.width);
+                out += "[rel ";
+                out += symbols[op.imm];
+                out += ']';
+                break;
+            case Operand::Kind::none:
+                break;
+        }
+    }
+};
+
+// A labelled piece of .rodata, .data or .bss: bytes, or reserve zero bytes
+// when it's in .bss. qwords prints the bytes as 64-bit numbers.
+struct AsmData {
+    std::string label {};
+    std::string bytes {};
+    uint32_t reserve = 0;
+    bool qwords = false;
+
+    // NASM syntax
+    void print(std::string& out) const
+    {
+        out += label;
+        if(reserve != 0)
+        {
+            out += ": resb " + std::to_string(reserve) + "\n";
+            return;
+        }
+        if(qwords)
+        {
+            out += ": dq ";
+            for(size_t i = 0; i + 8 <= bytes.size(); i += 8)
+            {
+                uint64_t value = 0;
+                for(size_t b = 0; b < 8; b++) value |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[i + b])) << (8 * b);
+                if(i != 0) out += ", ";
+                out += std::to_string(value);
+            }
+            out += "\n";
+            return;
+        }
+        // printable runs quoted, anything else (a newline in a literal, the 0 after it) as a number
+        out += ": db ";
+        bool quoted = false;
+        for(size_t i = 0; i < bytes.size(); i++)
+        {
+            const uint8_t c = static_cast<uint8_t>(bytes[i]);
+            const bool printable = c >= 0x20 && c < 0x7F && c != '"';
+            if(quoted && !printable)
+            {
+                out += '"';
+                quoted = false;
+            }
+            if(!quoted)
+            {
+                out += i == 0 ? "" : ", ";
+                out += printable ? "\"" : std::to_string(c);
+                quoted = printable;
+            }
+            if(printable) out += static_cast<char>(c);
+        }
+        out += quoted ? "\"\n" : bytes.empty() ? "\"\"\n" : "\n";
+    }
+};
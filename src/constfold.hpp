@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include "ir.hpp"
+
+// What a bin instruction computes, when the emitted code would compute the
+// same: arithmetic wraps, comparisons and division are signed (division
+// truncates toward zero), and a division that traps, by zero or INT64_MIN by
+// -1, is left to fault at run time.
+[[nodiscard]] inline std::optional<int64_t> fold_bin(BinOp op, int64_t lhs, int64_t rhs)
+{
+    const uint64_t a = static_cast<uint64_t>(lhs);
+    const uint64_t b = static_cast<uint64_t>(rhs);
+    switch(op)
+    {
+        case BinOp::add: return static_cast<int64_t>(a + b);
+        case BinOp::sub: return static_cast<int64_t>(a - b);
+        case BinOp::mul: return static_cast<int64_t>(a * b);
+        case BinOp::div:
+            if(rhs == 0 || (lhs == INT64_MIN && rhs == -1)) return std::nullopt;
+            return lhs / rhs;
+        case BinOp::eq: return lhs == rhs;
+        case BinOp::neq: return lhs != rhs;
+        case BinOp::lt: return lhs < rhs;
+        case BinOp::gt: return lhs > rhs;
+        case BinOp::lte: return lhs <= rhs;
+        case BinOp::gte: return lhs >= rhs;
+    }
+    return std::nullopt;
+}
+
+// Sparse conditional constant propagation (Wegman & Zadeck). Every value starts
+// unknown and only moves down to a constant and then to varying; a block is
+// only looked at once an edge into it is known to be taken, so a constant
+// flowing into a maybe or a wait decides the branch and the other side never
+// gets to spoil the phis after it. Afterwards values that are constant become
+// constant instructions, branches with a known outcome become jumps, and the
+// blocks nothing takes anymore are dropped.
+class ConstantFolder {
+public:
+    inline explicit ConstantFolder(IrFunction& func) : m_func(func)
+    {}
+
+    // true if the function changed
+    inline bool run()
+    {
+        const size_t count = m_func.insts.size();
+        m_cells.assign(count, {});
+        m_block_of.assign(count, no_id);
+        m_executable.assign(m_func.blocks.size(), 0);
+        m_taken.assign(m_func.blocks.size(), {});
+        build_users();
+
+        mark_executable(0);
+        while(!m_block_work.empty() || !m_value_work.empty())
+        {
+            while(!m_value_work.empty())
+            {
+                const ValueId value = m_value_work.back();
+                m_value_work.pop_back();
+                for(uint32_t u = m_user_begin[value]; u < m_user_begin[value + 1]; u++)
+                {
+                    const ValueId user = m_users[u];
+                    if(m_executable[m_block_of[user]])
+                    {
+                        visit(user);
+                    }
+                }
+            }
+            if(!m_block_work.empty())
+            {
+                const BlockId block = m_block_work.back();
+                m_block_work.pop_back();
+                for(ValueId id : m_func.blocks[block].insts)
+                {
+                    visit(id);
+                }
+            }
+        }
+        return rewrite();
+    }
+
+private:
+    enum class Lattice : uint8_t { unknown, constant, varying };
+
+    struct Cell {
+        Lattice state = Lattice::unknown;
+        int64_t value = 0;
+    };
+
+    static inline Cell meet(Cell a, Cell b)
+    {
+        if(a.state == Lattice::unknown) return b;
+        if(b.state == Lattice::unknown) return a;
+        if(a.state == Lattice::constant && b.state == Lattice::constant && a.value == b.value) return a;
+        return {.state=Lattice::varying};
+    }
+
+    // users of each value, flattened: m_users[m_user_begin[v] .. m_user_begin[v + 1])
+    inline void build_users()
+    {
+        m_user_begin.assign(m_func.insts.size() + 1, 0);
+        for(BlockId b = 0; b < m_func.blocks.size(); b++)
+        {
+            for(ValueId id : m_func.blocks[b].insts)
+            {
+                m_block_of[id] = b;
+                for_each_operand(m_func.insts[id], [&](ValueId v){ m_user_begin[v + 1]++; });
+            }
+            m_taken[b].assign(m_func.blocks[b].preds.size(), 0);
+        }
+        for(size_t v = 0; v < m_func.insts.size(); v++)
+        {
+            m_user_begin[v + 1] += m_user_begin[v];
+        }
+        m_users.assign(m_user_begin.back(), 0);
+        std::vector<uint32_t> fill(m_user_begin.begin(), m_user_begin.end() - 1);
+        for(const IrBlock& block : m_func.blocks)
+        {
+            for(ValueId id : block.insts)
+            {
+                for_each_operand(m_func.insts[id], [&](ValueId v){ m_users[fill[v]++] = id; });
+            }
+        }
+    }
+
+    inline void lower(ValueId id, Cell cell)
+    {
+        const Cell old = m_cells[id];
+        const Cell merged = meet(old, cell);
+        if(merged.state != old.state || merged.value != old.value)
+        {
+            m_cells[id] = merged;
+            m_value_work.push_back(id);
+        }
+    }
+
+    inline void mark_executable(BlockId block)
+    {
+        m_executable[block] = 1;
+        m_block_work.push_back(block);
+    }
+
+    inline void take_edge(BlockId from, BlockId to)
+    {
+        const std::vector<BlockId>& preds = m_func.blocks[to].preds;
+        bool fresh = false;
+        for(size_t i = 0; i < preds.size(); i++)
+        {
+            if(preds[i] == from && !m_taken[to][i])
+            {
+                m_taken[to][i] = 1;
+                fresh = true;
+            }
+        }
+        if(!fresh)
+        {
+            return;
+        }
+        if(!m_executable[to])
+        {
+            mark_executable(to);
+            return;
+        }
+        for(ValueId id : m_func.blocks[to].insts) // a new way in, only the phis can change
+        {
+            if(m_func.insts[id].op != IrOp::phi) break;
+            visit(id);
+        }
+    }
+
+    inline void visit(ValueId id)
+    {
+        const IrInst& inst = m_func.insts[id];
+        switch(inst.op)
+        {
+            case IrOp::constant:
+                lower(id, {.state=Lattice::constant, .value=inst.imm});
+                break;
+
+            case IrOp::param:
+            case IrOp::call:
+                lower(id, {.state=Lattice::varying});
+                break;
+
+            case IrOp::bin:
+            {
+                const Cell a = m_cells[inst.a];
+                const Cell b = m_cells[inst.b];
+                if(a.state == Lattice::varying || b.state == Lattice::varying)
+                {
+                    lower(id, {.state=Lattice::varying});
+                }
+                else if(a.state == Lattice::constant && b.state == Lattice::constant)
+                {
+                    std::optional<int64_t> folded = fold_bin(inst.bin, a.value, b.value);
+                    lower(id, folded ? Cell{.state=Lattice::constant, .value=*folded} : Cell{.state=Lattice::varying});
+                }
+                break;
+            }
+
+            case IrOp::phi:
+            {
+                const BlockId block = m_block_of[id];
+                Cell cell;
+                for(size_t i = 0; i < inst.args.size(); i++)
+                {
+                    if(m_taken[block][i]) cell = meet(cell, m_cells[inst.args[i]]);
+                }
+                lower(id, cell);
+                break;
+            }
+
+            case IrOp::jmp:
+                take_edge(m_block_of[id], inst.target[0]);
+                break;
+
+            case IrOp::br:
+            {
+                const Cell cond = m_cells[inst.a];
+                if(cond.state == Lattice::constant)
+                {
+                    take_edge(m_block_of[id], cond.value != 0 ? inst.target[0] : inst.target[1]);
+                }
+                else if(cond.state == Lattice::varying)
+                {
+                    take_edge(m_block_of[id], inst.target[0]);
+                    take_edge(m_block_of[id], inst.target[1]);
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    inline bool edge_taken(BlockId from, BlockId to) const
+    {
+        const std::vector<BlockId>& preds = m_func.blocks[to].preds;
+        for(size_t i = 0; i < preds.size(); i++)
+        {
+            if(preds[i] == from && m_taken[to][i]) return true;
+        }
+        return false;
+    }
+
+    inline bool rewrite()
+    {
+        bool changed = false;
+        for(BlockId b = 0; b < m_func.blocks.size(); b++)
+        {
+            if(!m_executable[b])
+            {
+                changed = true; // dropped below
+                continue;
+            }
+            IrBlock& block = m_func.blocks[b];
+            bool folded_phi = false;
+            for(ValueId id : block.insts)
+            {
+                IrInst& inst = m_func.insts[id];
+                if(inst.op != IrOp::constant && has_value(inst.op) && m_cells[id].state == Lattice::constant)
+                {
+                    folded_phi = folded_phi || inst.op == IrOp::phi;
+                    inst = {.op=IrOp::constant, .imm=m_cells[id].value};
+                    changed = true;
+                }
+            }
+            if(folded_phi) // phis have to stay first
+            {
+                std::stable_partition(block.insts.begin(), block.insts.end(), [&](ValueId id){ return m_func.insts[id].op == IrOp::phi; });
+            }
+
+            IrInst& term = m_func.insts[block.insts.back()];
+            if(term.op == IrOp::br)
+            {
+                const bool take_true = edge_taken(b, term.target[0]);
+                const bool take_false = edge_taken(b, term.target[1]);
+                if(take_true != take_false)
+                {
+                    const BlockId kept = take_true ? term.target[0] : term.target[1];
+                    const BlockId dropped = take_true ? term.target[1] : term.target[0];
+                    if(dropped != kept)
+                    {
+                        m_func.remove_pred(dropped, b);
+                    }
+                    term = {.op=IrOp::jmp, .target={kept, no_id}};
+                    changed = true;
+                }
+            }
+        }
+        if(changed)
+        {
+            m_func.remove_unreachable();
+            m_func.remove_trivial_phis();
+        }
+        return changed;
+    }
+
+    IrFunction& m_func;
+    std::vector<Cell> m_cells; // per value
+    std::vector<BlockId> m_block_of; // per value
+    std::vector<uint32_t> m_user_begin;
+    std::vector<ValueId> m_users;
+    std::vector<uint8_t> m_executable; // per block
+    std::vector<std::vector<uint8_t>> m_taken; // per block, per predecessor: that edge is taken
+    std::vector<BlockId> m_block_work;
+    std::vector<ValueId> m_value_work;
+};
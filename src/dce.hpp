@@ -0,0 +1,49 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include "ir.hpp"
+
+// Dead code elimination: an instruction stays if it has an effect (calls,
+// printing, terminators, a division that could still fault) or if
+// something that stays uses its value; the rest goes. Assignments nobody
+// reads, whole chains of arithmetic feeding them and loop phis that only feed
+// themselves are all dropped this way. True if the function changed.
+inline bool eliminate_dead_code(IrFunction& func)
+{
+    std::vector<uint8_t> live(func.insts.size(), 0);
+    std::vector<ValueId> work;
+    for(const IrBlock& block : func.blocks)
+    {
+        for(ValueId id : block.insts)
+        {
+            const IrInst& inst = func.insts[id];
+            if(!has_value(inst.op) || inst.op == IrOp::call || func.may_fault(inst))
+            {
+                live[id] = 1;
+                work.push_back(id);
+            }
+        }
+    }
+    while(!work.empty())
+    {
+        const ValueId id = work.back();
+        work.pop_back();
+        for_each_operand(func.insts[id], [&](ValueId v){
+            if(!live[v])
+            {
+                live[v] = 1;
+                work.push_back(v);
+            }
+        });
+    }
+
+    bool changed = false;
+    for(IrBlock& block : func.blocks)
+    {
+        const size_t before = block.insts.size();
+        std::erase_if(block.insts, [&](ValueId id){ return !live[id]; });
+        changed = changed || block.insts.size() != before;
+    }
+    return changed;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "source.hpp"
+
+// Printed as prefix, then "Line L:C" and at when at is set, then msg. Formatting
+// waits until print() so a diagnostic can be moved to another source position.
+struct Diagnostic {
+    size_t offset; // where in the source it points, also the sort key
+    std::string prefix {};
+    std::string at {}; // empty for messages without a location
+    std::string msg;
+};
+
+// Every error found during a compile. The lexer, parser and generator keep
+// going after reporting one, so a single run lists all of them; main prints
+// them in source order and stops before writing any assembly. Past max_kept
+// only the first ones in the source are kept, whatever order they came in, so
+// lists merged from pieces compiled apart print as the whole file's would. In
+// pipelined mode the lexer reports from its own thread, hence the lock.
+class Diagnostics {
+public:
+    inline explicit Diagnostics(const LineIndex& lines) : m_lines(lines)
+    {}
+
+    inline Diagnostics(const Diagnostics&) = delete;
+    inline Diagnostics& operator=(const Diagnostics&) = delete;
+
+    inline void report(Diagnostic diag)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        keep(std::move(diag));
+        m_count++;
+    }
+
+    // diagnostics of a piece compiled on its own, which starts base bytes into this
+    // source: its entries() and its count(), which can be more than it kept
+    inline void append(const std::vector<Diagnostic>& diags, size_t count, size_t base)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(const Diagnostic& diag : diags)
+        {
+            Diagnostic moved = diag;
+            moved.offset += base;
+            keep(std::move(moved));
+        }
+        m_count += count;
+    }
+
+    // the ones print() lists, in source order
+    [[nodiscard]] inline std::vector<Diagnostic> entries() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return sorted();
+    }
+
+    [[nodiscard]] inline size_t count() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_count;
+    }
+
+    [[nodiscard]] inline bool empty() const
+    {
+        return count() == 0;
+    }
+
+    inline void print(std::ostream& out) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const std::vector<Diagnostic> kept = sorted();
+        for(const Diagnostic& diag : kept)
+        {
+            out << diag.prefix;
+            if(!diag.at.empty())
+            {
+                SourceLocation loc = m_lines.locate(diag.offset);
+                out << "Line " << loc.line << ":" << loc.col << diag.at;
+            }
+            out << diag.msg << "\n";
+        }
+        if(m_count > kept.size())
+        {
+            out << "... and " << m_count - kept.size() << " more" << "\n";
+        }
+        out << m_count << (m_count == 1 ? " error" : " errors") << std::endl;
+    }
+
+private:
+    static constexpr size_t max_kept = 100; // a file of garbage shouldn't turn into a wall of text
+
+    // the list is cut back to the first max_kept only once it doubles, not on every report
+    inline void keep(Diagnostic diag)
+    {
+        m_list.push_back(std::move(diag));
+        if(m_list.size() >= 2 * max_kept)
+        {
+            m_list = sorted();
+        }
+    }
+
+    [[nodiscard]] inline std::vector<Diagnostic> sorted() const
+    {
+        std::vector<Diagnostic> list = m_list;
+        std::stable_sort(list.begin(), list.end(), [](const Diagnostic& a, const Diagnostic& b){
+            return a.offset < b.offset;
+        });
+        list.resize(std::min(list.size(), max_kept));
+        return list;
+    }
+
+    const LineIndex& m_lines;
+    mutable std::mutex m_mutex;
+    std::vector<Diagnostic> m_list;
+    size_t m_count = 0;
+};
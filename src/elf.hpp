@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Where a static executable's pieces go. The headers, .text and .rodata share
+// one read-only executable segment from the start of the file; .data and .bss
+// are a writable one that starts on a page of its own in memory, at the same
+// offset within the page as in the file, so both map straight from the file.
+struct ElfLayout {
+    static constexpr uint64_t base = 0x400000;
+    static constexpr uint64_t headers = 64 + 2 * 56; // ELF header, two program headers
+
+    uint64_t text_offset = headers, text_size = 0;
+    uint64_t rodata_offset = 0, rodata_size = 0;
+    uint64_t data_offset = 0, data_size = 0;
+    uint64_t bss_size = 0;
+
+    [[nodiscard]] uint64_t text_addr() const { return base + text_offset; }
+    [[nodiscard]] uint64_t rodata_addr() const { return base + rodata_offset; }
+    [[nodiscard]] uint64_t data_addr() const { return base + 0x1000 + data_offset; }
+    [[nodiscard]] uint64_t bss_addr() const { return align(data_addr() + data_size, 16); }
+
+    static uint64_t align(uint64_t value, uint64_t to)
+    {
+        return (value + to - 1) / to * to;
+    }
+};
+
+inline ElfLayout elf_layout(uint64_t text_size, uint64_t rodata_size, uint64_t data_size, uint64_t bss_size)
+{
+    ElfLayout layout;
+    layout.text_size = text_size;
+    layout.rodata_offset = ElfLayout::align(layout.text_offset + text_size, 16);
+    layout.rodata_size = rodata_size;
+    layout.data_offset = ElfLayout::align(layout.rodata_offset + rodata_size, 16);
+    layout.data_size = data_size;
+    layout.bss_size = bss_size;
+    return layout;
+}
+
+// A name in the symbol table, for objdump and gdb; section is 1 .text, 2 .rodata, 3 .data, 4 .bss.
+struct ElfSymbol {
+    std::string name;
+    uint64_t addr;
+    uint16_t section;
+};
+
+// The executable: what elf_layout() placed, with the section headers and the
+// symbol table after it. Nothing in it is needed to run, the kernel only reads
+// the program headers.
+inline std::vector<uint8_t> write_elf(const ElfLayout& layout, const std::vector<uint8_t>& text, const std::vector<uint8_t>& rodata,
+                                      const std::vector<uint8_t>& data, const std::vector<ElfSymbol>& symbols, uint64_t entry)
+{
+    std::vector<uint8_t> out;
+    auto put = [&](uint64_t value, int bytes){
+        for(int i = 0; i < bytes; i++) out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    };
+    auto pad_to = [&](uint64_t offset){
+        out.resize(offset, 0);
+    };
+
+    std::string strtab(1, '\0');
+    std::vector<uint32_t> names;
+    for(const ElfSymbol& symbol : symbols)
+    {
+        names.push_back(static_cast<uint32_t>(strtab.size()));
+        strtab += symbol.name;
+        strtab += '\0';
+    }
+    const std::string shstrtab = std::string("\0.text\0.rodata\0.data\0.bss\0.symtab\0.strtab\0.shstrtab\0", 52);
+    const uint64_t symtab_offset = ElfLayout::align(layout.data_offset + layout.data_size, 8);
+    const uint64_t symtab_size = (symbols.size() + 1) * 24;
+    const uint64_t strtab_offset = symtab_offset + symtab_size;
+    const uint64_t shstrtab_offset = strtab_offset + strtab.size();
+    const uint64_t sections_offset = ElfLayout::align(shstrtab_offset + shstrtab.size(), 8);
+
+    // ELF header: 64-bit, little endian, SysV, an executable for x86-64
+    for(uint8_t b : {0x7F, 0x45, 0x4C, 0x46, 2, 1, 1, 0}) out.push_back(b);
+    put(0, 8);
+    put(2, 2); // ET_EXEC
+    put(62, 2); // EM_X86_64
+    put(1, 4);
+    put(entry, 8);
+    put(64, 8); // program headers right after
+    put(sections_offset, 8);
+    put(0, 4);
+    put(64, 2);
+    put(56, 2);
+    put(2, 2);
+    put(64, 2);
+    put(8, 2);
+    put(7, 2); // .shstrtab
+
+    // PT_LOAD, R+X: the headers, .text and .rodata
+    const uint64_t code_end = layout.rodata_offset + layout.rodata_size;
+    put(1, 4);
+    put(5, 4);
+    put(0, 8);
+    put(ElfLayout::base, 8);
+    put(ElfLayout::base, 8);
+    put(code_end, 8);
+    put(code_end, 8);
+    put(0x1000, 8);
+    // PT_LOAD, R+W: .data, then .bss zeroed after it (PT_NULL when there's neither)
+    const uint64_t data_memory = layout.bss_addr() + layout.bss_size - layout.data_addr();
+    const bool writable = layout.data_size + layout.bss_size != 0;
+    put(writable ? 1 : 0, 4);
+    put(6, 4);
+    put(layout.data_offset, 8);
+    put(layout.data_addr(), 8);
+    put(layout.data_addr(), 8);
+    put(layout.data_size, 8);
+    put(writable ? data_memory : 0, 8);
+    put(0x1000, 8);
+
+    pad_to(layout.text_offset);
+    out.insert(out.end(), text.begin(), text.end());
+    pad_to(layout.rodata_offset);
+    out.insert(out.end(), rodata.begin(), rodata.end());
+    pad_to(layout.data_offset);
+    out.insert(out.end(), data.begin(), data.end());
+
+    pad_to(symtab_offset);
+    put(0, 24);
+    for(size_t i = 0; i < symbols.size(); i++)
+    {
+        put(names[i], 4);
+        put(0x10, 1); // STB_GLOBAL, STT_NOTYPE
+        put(0, 1);
+        put(symbols[i].section, 2);
+        put(symbols[i].addr, 8);
+        put(0, 8);
+    }
+    out.insert(out.end(), strtab.begin(), strtab.end());
+    out.insert(out.end(), shstrtab.begin(), shstrtab.end());
+
+    // section headers: name, type, flags, addr, offset, size, link, info, align, entry size
+    pad_to(sections_offset);
+    auto section = [&](uint32_t name, uint32_t type, uint64_t flags, uint64_t addr, uint64_t offset, uint64_t size,
+                       uint32_t link, uint32_t info, uint64_t align, uint64_t entsize){
+        put(name, 4);
+        put(type, 4);
+        put(flags, 8);
+        put(addr, 8);
+        put(offset, 8);
+        put(size, 8);
+        put(link, 4);
+        put(info, 4);
+        put(align, 8);
+        put(entsize, 8);
+    };
+    constexpr uint64_t write = 1, alloc = 2, exec = 4;
+    section(0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    section(1, 1, alloc | exec, layout.text_addr(), layout.text_offset, layout.text_size, 0, 0, 16, 0);
+    section(7, 1, alloc, layout.rodata_addr(), layout.rodata_offset, layout.rodata_size, 0, 0, 16, 0);
+    section(15, 1, write | alloc, layout.data_addr(), layout.data_offset, layout.data_size, 0, 0, 16, 0);
+    section(21, 8, write | alloc, layout.bss_addr(), layout.data_offset + layout.data_size, layout.bss_size, 0, 0, 16, 0);
+    section(26, 2, 0, 0, symtab_offset, symtab_size, 6, 1, 8, 24);
+    section(34, 3, 0, 0, strtab_offset, strtab.size(), 0, 0, 1, 0);
+    section(42, 3, 0, 0, shstrtab_offset, shstrtab.size(), 0, 0, 1, 0);
+    return out;
+}
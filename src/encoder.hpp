@@ -0,0 +1,482 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <initializer_list>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "asm.hpp"
+
+// A reference encode() leaves to the linker: the rel32 at offset becomes the
+// symbol's address minus the address the instruction ends at, which is tail
+// bytes (an immediate) past the rel32.
+struct Fixup {
+    uint32_t offset;
+    uint32_t symbol; // index into the AsmCode's symbols
+    uint8_t tail = 0;
+};
+
+// AsmCode as x86-64 machine code. Jumps and calls to the code's own labels are
+// resolved already; calls to other units, the runtime and data are fixups.
+struct MachineCode {
+    std::vector<uint8_t> bytes;
+    std::vector<Fixup> fixups;
+    std::vector<uint32_t> labels; // per symbol, its offset when it's a label of this code, UINT32_MAX otherwise
+};
+
+// Encodes the instructions the generator and the runtime use, in the forms
+// NASM would pick or close to them: the short immediate forms, mov r32, imm
+// for 64-bit constants that fit, and for each jump to a label of the same
+// code the short rel8 form unless the distance needs rel32. Those jumps are
+// left out of the bytes at first and placed once their sizes are known,
+// growing short ones that don't reach until none changes.
+class Encoder {
+public:
+    inline explicit Encoder(const AsmCode& code) : m_code(code)
+    {}
+
+    inline MachineCode run()
+    {
+        m_label_of.assign(m_code.symbols.size(), no_label);
+        for(const AsmInst& inst : m_code.insts)
+        {
+            if(inst.op == AsmOp::label)
+            {
+                const uint32_t symbol = static_cast<uint32_t>(inst.a.imm);
+                m_label_of[symbol] = symbol;
+                m_by_name.emplace(m_code.symbols[symbol], symbol);
+            }
+        }
+        for(const AsmInst& inst : m_code.insts)
+        {
+            const size_t fixups = m_fixups.size();
+            encode(inst);
+            for(size_t f = fixups; f < m_fixups.size(); f++)
+            {
+                m_fixups[f].tail = static_cast<uint8_t>(m_bytes.size() - m_fixups[f].offset - 4);
+            }
+        }
+        return place();
+    }
+
+private:
+    static constexpr uint32_t no_label = UINT32_MAX;
+
+    // A label, or a jmp, jcc or call to a label of this code, coming before m_bytes[at].
+    struct Event {
+        uint32_t at;
+        uint32_t label; // the label's symbol, or the one jumped to
+        AsmOp op;
+        Cond cc = Cond::e;
+        bool wide = false; // rel32, not rel8
+    };
+
+    static inline uint32_t size(const Event& e)
+    {
+        if(e.op == AsmOp::label) return 0;
+        if(e.op == AsmOp::call) return 5;
+        return e.wide ? (e.op == AsmOp::jcc ? 6 : 5) : 2;
+    }
+
+    // the symbol of the label sym names, if it's one of ours
+    inline uint32_t local_label(const Operand& sym)
+    {
+        const uint32_t symbol = static_cast<uint32_t>(sym.imm);
+        if(m_label_of[symbol] != no_label) return m_label_of[symbol];
+        auto it = m_by_name.find(m_code.symbols[symbol]);
+        return it == m_by_name.end() ? no_label : it->second;
+    }
+
+    inline MachineCode place()
+    {
+        MachineCode out;
+        out.labels.assign(m_code.symbols.size(), UINT32_MAX);
+        for(bool changed = true; changed;)
+        {
+            changed = false;
+            uint32_t growth = 0;
+            for(const Event& e : m_events)
+            {
+                if(e.op == AsmOp::label) out.labels[e.label] = e.at + growth;
+                growth += size(e);
+            }
+            growth = 0;
+            for(Event& e : m_events)
+            {
+                const int64_t end = e.at + growth + size(e);
+                growth += size(e);
+                if(e.op != AsmOp::label && !e.wide)
+                {
+                    const int64_t distance = static_cast<int64_t>(out.labels[e.label]) - end;
+                    if(distance < INT8_MIN || distance > INT8_MAX)
+                    {
+                        e.wide = true;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        out.bytes.reserve(m_bytes.size() + 6 * m_events.size());
+        size_t from = 0;
+        for(const Event& e : m_events)
+        {
+            out.bytes.insert(out.bytes.end(), m_bytes.begin() + static_cast<std::ptrdiff_t>(from), m_bytes.begin() + e.at);
+            from = e.at;
+            if(e.op == AsmOp::label) continue;
+            const int64_t target = out.labels[e.label];
+            const int64_t end = static_cast<int64_t>(out.bytes.size()) + size(e);
+            if(e.op == AsmOp::call) out.bytes.push_back(0xE8);
+            else if(e.op == AsmOp::jmp) out.bytes.push_back(e.wide ? 0xE9 : 0xEB);
+            else if(e.wide)
+            {
+                out.bytes.push_back(0x0F);
+                out.bytes.push_back(static_cast<uint8_t>(0x80 | static_cast<uint8_t>(e.cc)));
+            }
+            else out.bytes.push_back(static_cast<uint8_t>(0x70 | static_cast<uint8_t>(e.cc)));
+            const int64_t rel = target - end;
+            for(uint32_t i = 0; i < (size(e) == 2 ? 1u : 4u); i++)
+            {
+                out.bytes.push_back(static_cast<uint8_t>(rel >> (8 * i)));
+            }
+        }
+        out.bytes.insert(out.bytes.end(), m_bytes.begin() + static_cast<std::ptrdiff_t>(from), m_bytes.end());
+
+        // fixups move by what the jumps before them came to
+        size_t e = 0;
+        uint32_t growth = 0;
+        for(Fixup& fixup : m_fixups)
+        {
+            while(e < m_events.size() && m_events[e].at <= fixup.offset)
+            {
+                growth += size(m_events[e++]);
+            }
+            fixup.offset += growth;
+        }
+        out.fixups = std::move(m_fixups);
+        return out;
+    }
+
+    inline void byte(uint8_t b)
+    {
+        m_bytes.push_back(b);
+    }
+
+    inline void immediate(int64_t value, int bytes)
+    {
+        for(int i = 0; i < bytes; i++)
+        {
+            byte(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    static inline bool fits8(int64_t v)
+    {
+        return v >= INT8_MIN && v <= INT8_MAX;
+    }
+
+    static inline uint8_t num(Reg r)
+    {
+        return static_cast<uint8_t>(r);
+    }
+
+    // spl, bpl, sil and dil only exist with a REX prefix, without one they're ah, ch, dh and bh
+    static inline bool needs_rex8(uint8_t width, uint8_t r)
+    {
+        return width == 8 && r >= 4 && r <= 7;
+    }
+
+    // [66] [REX] opcode ModRM [SIB] [disp]. reg goes in ModRM.reg: a register,
+    // or the opcode extension of a one-operand form. width is the operand size:
+    // 16 adds 66, 64 sets REX.W. reg_width is reg's own size when it's a register.
+    inline void modrm(uint8_t width, std::initializer_list<uint8_t> opcode, uint8_t reg, const Operand& rm, uint8_t reg_width = 0)
+    {
+        if(width == 16) byte(0x66);
+        uint8_t rex = width == 64 ? 0x48 : 0x40;
+        bool rex_needed = width == 64 || needs_rex8(reg_width, reg);
+        if(reg & 8) rex |= 0x04;
+        if(rm.kind == Operand::Kind::reg)
+        {
+            if(num(rm.reg) & 8) rex |= 0x01;
+            rex_needed = rex_needed || needs_rex8(rm.width, num(rm.reg));
+        }
+        else if(rm.kind == Operand::Kind::mem)
+        {
+            if(num(rm.reg) & 8) rex |= 0x01;
+            if(rm.scale != 0 && (num(rm.index) & 8)) rex |= 0x02;
+        }
+        if(rex != 0x40 || rex_needed) byte(rex);
+        for(uint8_t op : opcode) byte(op);
+
+        const uint8_t field = static_cast<uint8_t>((reg & 7) << 3);
+        if(rm.kind == Operand::Kind::reg)
+        {
+            byte(static_cast<uint8_t>(0xC0 | field | (num(rm.reg) & 7)));
+            return;
+        }
+        if(rm.kind == Operand::Kind::rip)
+        {
+            byte(static_cast<uint8_t>(0x05 | field));
+            m_fixups.push_back({.offset=static_cast<uint32_t>(m_bytes.size()), .symbol=static_cast<uint32_t>(rm.imm)});
+            immediate(0, 4);
+            return;
+        }
+        assert(rm.kind == Operand::Kind::mem);
+        const uint8_t base = num(rm.reg) & 7;
+        const bool sib = rm.scale != 0 || base == 4; // rsp and r12 as a base need a SIB
+        const uint8_t mod = rm.disp == 0 && base != 5 ? 0 : fits8(rm.disp) ? 1 : 2; // rbp and r13 always take a displacement
+        byte(static_cast<uint8_t>((mod << 6) | field | (sib ? 4 : base)));
+        if(sib)
+        {
+            const uint8_t scale = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+            const uint8_t index = rm.scale != 0 ? num(rm.index) & 7 : 4; // 4: none
+            byte(static_cast<uint8_t>((scale << 6) | (index << 3) | base));
+        }
+        if(mod == 1) immediate(rm.disp, 1);
+        if(mod == 2) immediate(rm.disp, 4);
+    }
+
+    // opcode + register in its low bits (push, pop, mov r, imm)
+    inline void short_form(uint8_t width, uint8_t opcode, Reg r)
+    {
+        uint8_t rex = width == 64 ? 0x48 : 0x40;
+        if(num(r) & 8) rex |= 0x01;
+        if(rex != 0x40) byte(rex);
+        byte(static_cast<uint8_t>(opcode | (num(r) & 7)));
+    }
+
+    // the operand size of a two-operand instruction: a register's, or the memory's when there's none
+    static inline uint8_t width_of(const Operand& a, const Operand& b)
+    {
+        if(a.kind == Operand::Kind::reg) return a.width;
+        if(b.kind == Operand::Kind::reg) return b.width;
+        return a.width == 0 ? 64 : a.width;
+    }
+
+    // add, or, sbb, sub, xor and cmp share their encodings, told apart by digit
+    inline void alu(uint8_t digit, const Operand& a, const Operand& b)
+    {
+        const uint8_t width = width_of(a, b);
+        const uint8_t narrow = width == 8 ? 1 : 0;
+        if(b.is_imm())
+        {
+            if(width == 8)
+            {
+                modrm(width, {0x80}, digit, a);
+                immediate(b.imm, 1);
+            }
+            else if(fits8(b.imm))
+            {
+                modrm(width, {0x83}, digit, a);
+                immediate(b.imm, 1);
+            }
+            else
+            {
+                modrm(width, {0x81}, digit, a);
+                immediate(b.imm, width == 16 ? 2 : 4);
+            }
+        }
+        else if(b.is_reg())
+        {
+            modrm(width, {static_cast<uint8_t>((digit << 3) | (1 - narrow))}, num(b.reg), a, b.width);
+        }
+        else
+        {
+            modrm(width, {static_cast<uint8_t>((digit << 3) | (3 - narrow))}, num(a.reg), b, a.width);
+        }
+    }
+
+    // the F7 (F6 for bytes) group: neg, mul, imul, div and idiv of one operand
+    inline void unary(uint8_t digit, const Operand& a, uint8_t byte_opcode = 0xF6, uint8_t opcode = 0xF7)
+    {
+        const uint8_t width = width_of(a, {});
+        modrm(width, {width == 8 ? byte_opcode : opcode}, digit, a);
+    }
+
+    inline void shift(uint8_t digit, const Operand& a, const Operand& count)
+    {
+        const uint8_t width = width_of(a, {});
+        if(count.imm == 1)
+        {
+            modrm(width, {static_cast<uint8_t>(width == 8 ? 0xD0 : 0xD1)}, digit, a);
+            return;
+        }
+        modrm(width, {static_cast<uint8_t>(width == 8 ? 0xC0 : 0xC1)}, digit, a);
+        immediate(count.imm, 1);
+    }
+
+    inline void mov(const Operand& a, const Operand& b)
+    {
+        if(a.is_reg() && b.is_imm())
+        {
+            if(a.width == 8)
+            {
+                short_form(8, 0xB0, a.reg);
+                immediate(b.imm, 1);
+            }
+            else if(a.width == 32 || (b.imm >= 0 && b.imm <= UINT32_MAX))
+            {
+                short_form(32, 0xB8, a.reg); // writing the low half clears the rest
+                immediate(b.imm, 4);
+            }
+            else if(b.fits_imm32())
+            {
+                modrm(64, {0xC7}, 0, a);
+                immediate(b.imm, 4);
+            }
+            else
+            {
+                short_form(64, 0xB8, a.reg);
+                immediate(b.imm, 8);
+            }
+            return;
+        }
+        if(b.is_imm())
+        {
+            const uint8_t width = width_of(a, b);
+            modrm(width, {static_cast<uint8_t>(width == 8 ? 0xC6 : 0xC7)}, 0, a);
+            immediate(b.imm, width == 8 ? 1 : width == 16 ? 2 : 4);
+            return;
+        }
+        const uint8_t width = width_of(a, b);
+        const uint8_t narrow = width == 8 ? 1 : 0;
+        if(b.is_reg())
+        {
+            modrm(width, {static_cast<uint8_t>(0x89 - narrow)}, num(b.reg), a, b.width);
+        }
+        else
+        {
+            modrm(width, {static_cast<uint8_t>(0x8B - narrow)}, num(a.reg), b, a.width);
+        }
+    }
+
+    // a jump or call to a symbol: ours become events, the rest rel32 fixups
+    inline void branch(const AsmInst& inst)
+    {
+        const uint32_t label = local_label(inst.a);
+        if(label != no_label)
+        {
+            m_events.push_back({.at=static_cast<uint32_t>(m_bytes.size()), .label=label, .op=inst.op, .cc=inst.cc});
+            return;
+        }
+        if(inst.op == AsmOp::jcc)
+        {
+            byte(0x0F);
+            byte(static_cast<uint8_t>(0x80 | static_cast<uint8_t>(inst.cc)));
+        }
+        else
+        {
+            byte(inst.op == AsmOp::call ? 0xE8 : 0xE9);
+        }
+        m_fixups.push_back({.offset=static_cast<uint32_t>(m_bytes.size()), .symbol=static_cast<uint32_t>(inst.a.imm)});
+        immediate(0, 4);
+    }
+
+    inline void encode(const AsmInst& inst)
+    {
+        const Operand& a = inst.a;
+        const Operand& b = inst.b;
+        switch(inst.op)
+        {
+            case AsmOp::nop:
+                break;
+            case AsmOp::label:
+                m_events.push_back({.at=static_cast<uint32_t>(m_bytes.size()), .label=static_cast<uint32_t>(a.imm), .op=AsmOp::label});
+                break;
+            case AsmOp::mov: mov(a, b); break;
+            case AsmOp::movzx:
+                modrm(a.width, {0x0F, static_cast<uint8_t>(b.width == 16 ? 0xB7 : 0xB6)}, num(a.reg), b);
+                break;
+            case AsmOp::lea: modrm(64, {0x8D}, num(a.reg), b); break;
+            case AsmOp::add: alu(0, a, b); break;
+            case AsmOp::or_: alu(1, a, b); break;
+            case AsmOp::sbb: alu(3, a, b); break;
+            case AsmOp::sub: alu(5, a, b); break;
+            case AsmOp::xor_: alu(6, a, b); break;
+            case AsmOp::cmp: alu(7, a, b); break;
+            case AsmOp::test:
+                modrm(width_of(a, b), {static_cast<uint8_t>(a.width == 8 ? 0x84 : 0x85)}, num(b.reg), a, b.width);
+                break;
+            case AsmOp::imul:
+                if(b.kind == Operand::Kind::none)
+                {
+                    unary(5, a);
+                }
+                else if(inst.c.is_imm())
+                {
+                    modrm(a.width, {static_cast<uint8_t>(fits8(inst.c.imm) ? 0x6B : 0x69)}, num(a.reg), b);
+                    immediate(inst.c.imm, fits8(inst.c.imm) ? 1 : 4);
+                }
+                else
+                {
+                    modrm(a.width, {0x0F, 0xAF}, num(a.reg), b);
+                }
+                break;
+            case AsmOp::mul: unary(4, a); break;
+            case AsmOp::div: unary(6, a); break;
+            case AsmOp::idiv: unary(7, a); break;
+            case AsmOp::neg: unary(3, a); break;
+            case AsmOp::inc: unary(0, a, 0xFE, 0xFF); break;
+            case AsmOp::dec: unary(1, a, 0xFE, 0xFF); break;
+            case AsmOp::cqo:
+                byte(0x48);
+                byte(0x99);
+                break;
+            case AsmOp::shl: shift(4, a, b); break;
+            case AsmOp::shr: shift(5, a, b); break;
+            case AsmOp::sar: shift(7, a, b); break;
+            case AsmOp::bsr: modrm(a.width, {0x0F, 0xBD}, num(a.reg), b); break;
+            case AsmOp::setcc:
+                modrm(8, {0x0F, static_cast<uint8_t>(0x90 | static_cast<uint8_t>(inst.cc))}, 0, a);
+                break;
+            case AsmOp::jmp:
+            case AsmOp::jcc:
+            case AsmOp::call:
+                branch(inst);
+                break;
+            case AsmOp::push:
+                if(a.is_reg())
+                {
+                    short_form(32, 0x50, a.reg);
+                }
+                else if(a.is_imm())
+                {
+                    byte(fits8(a.imm) ? 0x6A : 0x68);
+                    immediate(a.imm, fits8(a.imm) ? 1 : 4);
+                }
+                else
+                {
+                    modrm(32, {0xFF}, 6, a); // 64 bits without REX.W, push has no other size
+                }
+                break;
+            case AsmOp::pop: short_form(32, 0x58, a.reg); break;
+            case AsmOp::leave: byte(0xC9); break;
+            case AsmOp::ret: byte(0xC3); break;
+            case AsmOp::syscall:
+                byte(0x0F);
+                byte(0x05);
+                break;
+            case AsmOp::rep_movsb:
+                byte(0xF3);
+                byte(0xA4);
+                break;
+            case AsmOp::repne_scasb:
+                byte(0xF2);
+                byte(0xAE);
+                break;
+        }
+    }
+
+    const AsmCode& m_code;
+    std::vector<uint8_t> m_bytes; // the code without the jumps to our own labels
+    std::vector<Event> m_events; // labels and those jumps, in order
+    std::vector<Fixup> m_fixups;
+    std::vector<uint32_t> m_label_of; // per symbol, the label symbol it's the definition of
+    std::unordered_map<std::string_view, uint32_t> m_by_name; // label name -> its symbol
+};
+
+inline MachineCode encode(const AsmCode& code)
+{
+    return Encoder(code).run();
+}
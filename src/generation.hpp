@@ -1,635 +1,919 @@
 #pragma once
 #include "parser.hpp"
 #include "tokenizer.hpp"
-#include <sstream>
-#include <unordered_map>
-#include <cassert>
-#include <map>
+#include "diagnostics.hpp"
+#include "ir.hpp"
+#include "lowering.hpp"
+#include "optimize.hpp"
+#include "regalloc.hpp"
+#include "asm.hpp"
+#include "peephole.hpp"
+#include "encoder.hpp"
+#include "runtime.hpp"
+#include "elf.hpp"
 #include <algorithm>
+#include <bit>
+#include <optional>
+#include <unordered_map>
+#include <string_view>
 #include <vector>
-
-
+#include <span>
+#include <string>
+
+
+// Code for one top-level function, or for _start, plus the string literals it
+// uses. A unit names its labels after itself, so units are generated one at a
+// time (the --session compiler caches them) and link() puts them together.
+struct AsmUnit {
+    AsmCode code; // printed for --emit-asm
+    MachineCode machine; // code, encoded
+    std::vector<uint32_t> offsets; // where each of defines starts in machine.bytes
+    std::vector<AsmData> data; // for section .data
+    std::vector<std::string> defines; // labels of the functions in code, the unit's own first
+    std::vector<std::string> calls; // labels of the functions code calls, each once
+    uint8_t runtime = 0; // RuntimeHelper bits, what link() has to add for it
+};
+
+// What link() makes of a program: the executable, and the same program as
+// NASM source when it's asked for.
+struct LinkedProgram {
+    std::vector<uint8_t> executable;
+    std::string asm_text;
+};
+
+// Multiplier and shift that divide by d, signed, as the high half of a 64x64
+// multiply shifted right (Hacker's Delight 10-1). d is not 0, 1, -1 or a power
+// of two.
+struct SignedMagic {
+    int64_t multiplier;
+    int shift;
+};
+
+inline SignedMagic signed_magic(int64_t d)
+{
+    constexpr uint64_t two63 = 1ull << 63;
+    const uint64_t ad = d < 0 ? 0 - static_cast<uint64_t>(d) : static_cast<uint64_t>(d);
+    const uint64_t t = two63 + (static_cast<uint64_t>(d) >> 63);
+    const uint64_t anc = t - 1 - t % ad; // |nc|
+    int p = 63;
+    uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc; // 2^p / |nc|
+    uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad; // 2^p / |d|
+    uint64_t delta = 0;
+    do{
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if(r1 >= anc){
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if(r2 >= ad){
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while(q1 < delta || (q1 == delta && r1 == 0));
+    const uint64_t multiplier = q2 + 1;
+    return {.multiplier = static_cast<int64_t>(d < 0 ? 0 - multiplier : multiplier), .shift = p - 64};
+}
+
+// x86-64 emitter. Each unit is lowered to IR first (lowering.hpp, which also
+// reports the errors) and the IR is turned into instructions here (asm.hpp),
+// which the peephole pass tidies at -O1 before they're encoded (encoder.hpp,
+// or printed as NASM for --emit-asm). Values
+// live where the register allocator (regalloc.hpp) put them, constants are
+// used as immediates, and phis are resolved by parallel copies on the incoming
+// edges.
 class Generator{
     private:
-        struct var{
-            std::string name;
-            size_t stack_loc;
-        };
-        // Removed duplicate label count line 18
-        const NodeProgram m_prog;   
-        std::stringstream asm_code;
-        std::vector<var> m_vars {};
-        std::unordered_map<std::string, std::string> m_str_vars {};
-        size_t m_stack_size = 0;
-        std::unordered_map<std::string, std::string> m_str_labels {};
-        std::unordered_map<std::string, size_t> m_str_lens {};
-        size_t m_str_count = 0;
-        int m_label_count = 0;
-        std::vector<size_t> m_scope {};
-        bool m_inside_func = false;
-
-
-
-        void push(const std::string& line) {
-            asm_code << "    push " << line << "\n";
-            m_stack_size++;
-        }
-        void pop(const std::string& line) {
-            asm_code << "    pop " << line << "\n";
-            m_stack_size--;
-        }
-
-        void begin_scope(){
-            m_scope.push_back(m_vars.size());
-        }
-
-        void end_scope(){
-            size_t pop_count = m_vars.size() - m_scope.back();
-            asm_code << "    add rsp, " << pop_count * 8 << "\n";
-            m_stack_size -= pop_count;
-            for(size_t i=0;i<pop_count ; i++)
-            {
-                m_vars.pop_back();
-            }
-            m_scope.pop_back();
+        Lowering m_lowering;
+        const Interner& m_interner; // symbol id -> name, for call targets
+        Diagnostics& m_diags; // the lowering's, gen_program() doesn't link after an error
+        AsmCode m_code; // the unit being emitted
+        const IrUnit* m_unit = nullptr;
+        const IrFunction* m_func = nullptr;
+        Allocation m_alloc;
+        std::vector<Reg> m_saved; // callee-saved registers this function uses, kept below rbp
+        std::vector<uint32_t> m_labels; // per block, its label's symbol
+        int m_edge_count = 0;
+        int m_opt_level; // -O, which IR passes run before emitting
+        PeepholeStats m_peephole_stats{};
+
+        void emit(AsmOp op, Operand a = {}, Operand b = {}, Operand c = {}) {
+            m_code.insts.push_back({.op=op, .a=a, .b=b, .c=c});
         }
 
-        std::string create_label(){
-            return "label" + std::to_string(m_label_count++);
+        void emit_cc(AsmOp op, Cond cc, Operand a) {
+            m_code.insts.push_back({.op=op, .cc=cc, .a=a});
         }
 
+        void emit_label(uint32_t symbol) {
+            emit(AsmOp::label, sym_op(symbol));
+        }
 
-    public:
-        inline explicit Generator(const NodeProgram& prog) : m_prog(std::move(prog)) {
-        }   
+        // where a value is; only valid for constants and values that are used
+        Operand place(ValueId v) const {
+            const IrInst& inst = m_func->insts[v];
+            if(inst.op == IrOp::constant){
+                return imm_op(inst.imm);
+            }
+            const Location& loc = m_alloc.where[v];
+            if(loc.kind == Location::Kind::reg){
+                return reg_op(loc.reg);
+            }
+            // Frame: [saved registers] [spill slots], going down from rbp
+            return mem_op(-static_cast<int32_t>((m_saved.size() + loc.slot + 1) * 8));
+        }
 
-        void gen_term(const NodeTerm* term)
-        {
-            struct TermVisitor{
-                Generator*gen;
-                void operator()(const NodeTermIntLit* int_lit){
-                    
-                    gen->asm_code << "    mov rax, " << int_lit->int_lit.value.value() << "\n";
-                    gen->push("rax");
-                }
+        bool unused(ValueId v) const {
+            return m_alloc.where[v].kind == Location::Kind::none;
+        }
 
-                void operator()(const NodeTermIdent* term_ident)const{
-                    const std::string var_name = term_ident->ident.value.value();
-                    
-                    // Logic removed that incorrectly errored on declared variables
-
-                    // Check if it's a string variable
-                    if(gen->m_str_vars.find(var_name) != gen->m_str_vars.end()){
-                       const std::string label = gen->m_str_vars.at(var_name);
-                        // Find the original string to get its length
-                        size_t str_len = 0;
-                        for(const auto& p : gen->m_str_labels){
-                            if(p.second == label){
-                                str_len = gen->m_str_lens.at(p.first);
-                                break;
-                            }
-                        }
-                        gen->asm_code << "    mov rax, 1\n";
-                        gen->asm_code << "    mov rdi, 1\n";
-                        gen->asm_code << "    lea rsi, [rel " << label << "]\n";
-                        gen->asm_code << "    mov rdx, " << str_len << "\n";
-                        gen->asm_code << "    syscall\n";
-                    } else {
-                        auto it = std::find_if(gen->m_vars.rbegin(), gen->m_vars.rend(), [&](const var& var){
-                            return var.name == var_name;
-                        });
-                        if(it != gen->m_vars.rend()) {
-                            // Integer variable
-                            gen->asm_code << "    mov rax, QWORD [rsp + " << (gen->m_stack_size - it->stack_loc - 1)*8 << "]\n";
-                            gen->push("rax");
-                        } else {
-                            std::cerr<<"Undeclared variable: " << var_name <<std::endl;
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-                }
-                void operator()(const NodeTermParen* term_paren){
-                    gen->gen_expr(term_paren->expr);
-                }
-                void operator()(const NodeTermStringLit* string_lit){
-                    const std::string s = string_lit->string_lit.value.value();
-                    std::string label;
-                    if(gen->m_str_labels.find(s) == gen->m_str_labels.end()){
-                        label = "msg_" + std::to_string(gen->m_str_count++);
-                        gen->m_str_labels.emplace(s, label);
-                        gen->m_str_lens.emplace(s, s.size());
-                    } else {
-                        label = gen->m_str_labels.at(s);
-                    }
-                    gen->asm_code << "    mov rax, 1\n";
-                    gen->asm_code << "    mov rdi, 1\n";
-                    gen->asm_code << "    lea rsi, [rel " << label << "]" << "\n";
-                    gen->asm_code << "    mov rdx, " << gen->m_str_lens.at(s) << "\n";
-                    gen->asm_code << "    syscall\n";
-                }
+        void move(const Operand& dst, const Operand& src) {
+            if(dst == src) return;
+            if(dst.is_reg() && src.is_imm() && src.imm == 0){
+                emit(AsmOp::xor_, reg_op(dst.reg, 32), reg_op(dst.reg, 32));
+                return;
+            }
+            if(dst.is_mem() && (src.is_mem() || !src.fits_imm32())){
+                emit(AsmOp::mov, reg_op(Reg::r10), src);
+                emit(AsmOp::mov, dst, reg_op(Reg::r10));
+                return;
+            }
+            emit(AsmOp::mov, dst, src);
+        }
 
-                void operator()(const NodeTermFuncCall* term_call) const{
-                    // Push arguments in reverse order (Convention preference, but for stack it doesn't matter as long as we pop consistently)
-                    // Let's push left-to-right (first arg pushed first). 
-                    // To access them in callee: [rbp + 16 + (N-1-i)*8] ?
-                    // Actually, if we push Arg1, Arg2. Stack: Arg2 (top), Arg1.
-                    // Callee RBP+16 is Arg2. RBP+24 is Arg1.
-                    // Let's invert push order so Arg1 is at top?
-                    // Standard C (cdecl) pushes Right-to-Left. ArgN ... Arg1. Stack: Arg1 (top).
-                    // let's do that.
-                    for(auto it = term_call->args.rbegin(); it != term_call->args.rend(); ++it)
-                    {
-                        gen->gen_expr(*it);
+        // Moves that all read their sources before any destination is written.
+        // A move goes once nothing else still reads its destination; what's
+        // left are cycles, broken by setting one destination's value aside in r11.
+        void parallel_move(std::vector<std::pair<Operand, Operand>> moves) { // (destination, source)
+            std::erase_if(moves, [](const auto& m){ return m.first == m.second; });
+            while(!moves.empty()){
+                bool progress = false;
+                for(size_t i = 0; i < moves.size();){
+                    const bool read = std::any_of(moves.begin(), moves.end(), [&](const auto& m){ return m.second == moves[i].first; });
+                    if(read){
+                        i++;
+                        continue;
                     }
-                    gen->asm_code << "    call func_" << term_call->ident.value.value() << "\n";
-                    // Clean up stack
-                    size_t args_size = term_call->args.size();
-                    if(args_size > 0){
-                        gen->asm_code << "    add rsp, " << args_size * 8 << "\n";
-                        gen->m_stack_size -= args_size;
+                    move(moves[i].first, moves[i].second);
+                    moves.erase(moves.begin() + static_cast<std::ptrdiff_t>(i));
+                    progress = true;
+                }
+                if(!progress){
+                    const Operand blocked = moves.front().first;
+                    move(reg_op(Reg::r11), blocked);
+                    for(auto& m : moves){
+                        if(m.second == blocked) m.second = reg_op(Reg::r11);
                     }
-                    gen->push("rax"); // Result
                 }
-
-            };
-
-            TermVisitor visitor({.gen=this});
-            std::visit(visitor, term->var);
-            
+            }
         }
 
-        void gen_bin_expr(const NodeBinExpr* bin_expr)
-        {
-            struct BinExprVisitor{
-                Generator* gen;
-
-                void operator()(const NodeBinExprSub* sub) const{
-                    gen->gen_expr(sub->left);
-                    gen->gen_expr(sub->right);
-                    gen->pop("rbx");
-                    gen->pop("rax");
-                    gen->asm_code << "    sub rax, rbx\n";
-                    gen->push("rax");
-                }
-                void operator()(const NodeBinExprDiv* div) const{
-                    gen->gen_expr(div->left);
-                    gen->gen_expr(div->right);  
-                    gen->pop("rbx");
-                    gen->pop("rax");
-                    gen->asm_code << "    xor rdx, rdx\n";
-                    gen->asm_code << "    div rbx\n";
-                    gen->push("rax");
-                }
-
-                void operator()(const NodeBinExprAdd* add) const{
-                    gen->gen_expr(add->left);
-                    gen->gen_expr(add->right);
-                    gen->pop("rbx");
-                    gen->pop("rax");
-                    gen->asm_code << "    add rax, rbx\n";
-                    gen->push("rax");
-                }
-                void operator()(const NodeBinExprMulti* multi) const{
-                    gen->gen_expr(multi->left);
-                    gen->gen_expr(multi->right);
-                    gen->pop("rbx");
-                    gen->pop("rax");
-                    gen->asm_code << "    mul rbx\n";
-                    gen->push("rax");
-                }
-                void operator()(const NodeBinExprEq* eq) const{
-                    gen->gen_expr(eq->left);
-                    gen->gen_expr(eq->right);
-                    gen->pop("rbx");
-                    gen->pop("rax");
-                    gen->asm_code << "    cmp rax, rbx\n";
-                    gen->asm_code << "    sete al\n";
-                    gen->asm_code << "    movzx rax, al\n";
-                    gen->push("rax");
-                }
-                void operator()(const NodeBinExprNeq* neq) const{
-                    gen->gen_expr(neq->left);
-                    gen->gen_expr(neq->right);
-                    gen->pop("rbx");
-                    gen->pop("rax");
-                    gen->asm_code << "    cmp rax, rbx\n";
-                    gen->asm_code << "    setne al\n";
-                    gen->asm_code << "    movzx rax, al\n";
-                    gen->push("rax");
-                }
-                void operator()(const NodeBinExprLt* lt) const{
-                    gen->gen_expr(lt->left);
-                    gen->gen_expr(lt->right);
-                    gen->pop("rbx");
-                    gen->pop("rax");
-                    gen->asm_code << "    cmp rax, rbx\n";
-                    gen->asm_code << "    setl al\n";
-                    gen->asm_code << "    movzx rax, al\n";
-                    gen->push("rax");
-                }
-                void operator()(const NodeBinExprGt* gt) const{
-                    gen->gen_expr(gt->left);
-                    gen->gen_expr(gt->right);
-                    gen->pop("rbx");
-                    gen->pop("rax");
-                    gen->asm_code << "    cmp rax, rbx\n";
-                    gen->asm_code << "    setg al\n";
-                    gen->asm_code << "    movzx rax, al\n";
-                    gen->push("rax");
-                }
-                void operator()(const NodeBinExprLte* lte) const{
-                    gen->gen_expr(lte->left);
-                    gen->gen_expr(lte->right);
-                    gen->pop("rbx");
-                    gen->pop("rax");
-                    gen->asm_code << "    cmp rax, rbx\n";
-                    gen->asm_code << "    setle al\n";
-                    gen->asm_code << "    movzx rax, al\n";
-                    gen->push("rax");
-                }
-                void operator()(const NodeBinExprGte* gte) const{
-                    gen->gen_expr(gte->left);
-                    gen->gen_expr(gte->right);
-                    gen->pop("rbx");
-                    gen->pop("rax");
-                    gen->asm_code << "    cmp rax, rbx\n";
-                    gen->asm_code << "    setge al\n";
-                    gen->asm_code << "    movzx rax, al\n";
-                    gen->push("rax");
-                }
+        static Cond condition(BinOp op){
+            switch(op){
+                case BinOp::eq: return Cond::e;
+                case BinOp::neq: return Cond::ne;
+                case BinOp::lt: return Cond::l;
+                case BinOp::gt: return Cond::g;
+                case BinOp::lte: return Cond::le;
+                default: return Cond::ge;
+            }
+        }
 
-            };
+        // the copies taking the edge from -> to feeds the phis of to
+        std::vector<std::pair<Operand, Operand>> edge_moves(BlockId from, BlockId to) const {
+            std::vector<std::pair<Operand, Operand>> moves;
+            const size_t pred = m_func->pred_index(to, from);
+            for(ValueId id : m_func->blocks[to].insts){
+                const IrInst& inst = m_func->insts[id];
+                if(inst.op != IrOp::phi) break;
+                if(unused(id)) continue;
+                const Operand dst = place(id);
+                const Operand src = place(inst.args[pred]);
+                if(!(dst == src)) moves.emplace_back(dst, src);
+            }
+            return moves;
+        }
 
-            BinExprVisitor visitor{.gen=this};
-            std::visit(visitor, bin_expr->var);
+        void jump(BlockId from, BlockId to) {
+            parallel_move(edge_moves(from, to));
+            if(to != from + 1) emit(AsmOp::jmp, sym_op(m_labels[to]));
+        }
 
+        // dst op= src, for add, sub and imul with dst a register
+        void arith(AsmOp op, Reg dst, Operand src) {
+            if(!src.fits_imm32()){
+                move(reg_op(Reg::r10), src);
+                src = reg_op(Reg::r10);
+            }
+            if(src.is_imm() && op == AsmOp::imul){
+                emit(AsmOp::imul, reg_op(dst), reg_op(dst), src);
+                return;
+            }
+            emit(op, reg_op(dst), src);
         }
 
+        // cmp a, b, with whichever operand can't be there as it is in a scratch register
+        void compare(Operand lhs, Operand rhs) {
+            if(lhs.is_imm() || (lhs.is_mem() && rhs.is_mem())){
+                move(reg_op(Reg::r11), lhs);
+                lhs = reg_op(Reg::r11);
+            }
+            if(!rhs.fits_imm32()){
+                move(reg_op(Reg::r10), rhs);
+                rhs = reg_op(Reg::r10);
+            }
+            emit(AsmOp::cmp, lhs, rhs);
+        }
 
+        // dst = x * c: a shift for a power of two, lea for 3, 5 and 9, imul with
+        // the constant as its third operand otherwise
+        void multiply(const Operand& dst, Operand x, int64_t c) {
+            if(c == 0 || c == 1){
+                move(dst, c == 0 ? imm_op(0) : x);
+                return;
+            }
+            const Reg out = dst.is_reg() ? dst.reg : Reg::r11;
+            if(c > 0 && (c & (c - 1)) == 0){
+                move(reg_op(out), x);
+                emit(AsmOp::shl, reg_op(out), imm_op(std::countr_zero(static_cast<uint64_t>(c))));
+            }
+            else if(c == 3 || c == 5 || c == 9){
+                if(!x.is_reg()){
+                    move(reg_op(out), x);
+                    x = reg_op(out);
+                }
+                emit(AsmOp::lea, reg_op(out), addr_op(x.reg, x.reg, static_cast<uint8_t>(c - 1)));
+            }
+            else if(c == -1){
+                move(reg_op(out), x);
+                emit(AsmOp::neg, reg_op(out));
+            }
+            else if(imm_op(c).fits_imm32()){
+                emit(AsmOp::imul, reg_op(out), x, imm_op(c));
+            }
+            else{
+                move(reg_op(out), x);
+                arith(AsmOp::imul, out, imm_op(c));
+            }
+            move(dst, reg_op(out));
+        }
 
+        // dst = x + y (x - y if subtract) as one lea, when dst is a register of
+        // its own and the operands fit; false if it doesn't apply
+        bool sum_into(const Operand& dst, const Operand& x, const Operand& y, bool subtract) {
+            if(!dst.is_reg() || !x.is_reg() || x == dst || y == dst){
+                return false;
+            }
+            if(y.is_reg() && !subtract){
+                emit(AsmOp::lea, dst, addr_op(x.reg, y.reg, 1));
+                return true;
+            }
+            if(y.is_imm() && y.imm > INT32_MIN && y.imm <= INT32_MAX){
+                emit(AsmOp::lea, dst, addr_op(x.reg, x.reg, 0, static_cast<int32_t>(subtract ? -y.imm : y.imm)));
+                return true;
+            }
+            return false;
+        }
 
-        void gen_expr(const NodeExpr* expr) {
-            
-            struct ExprVisitor{
-                Generator* gen;
+        // dst = x / d without idiv: shifts for a power of two, otherwise a multiply
+        // by the divisor's reciprocal (Granlund & Montgomery) and a fixup. Both
+        // truncate toward zero like idiv. False for the divisors only idiv handles
+        // right: 0 and -1 trap, INT64_MIN has no magic number.
+        bool divide_by_constant(const Operand& dst, const Operand& x, int64_t d) {
+            if(d == 0 || d == -1 || d == INT64_MIN){
+                return false;
+            }
+            if(d == 1){
+                move(dst, x);
+                return true;
+            }
+            const uint64_t magnitude = d < 0 ? static_cast<uint64_t>(-d) : static_cast<uint64_t>(d);
+            const Operand r11 = reg_op(Reg::r11);
+            if((magnitude & (magnitude - 1)) == 0){
+                // a negative dividend is biased by the divisor - 1 first, so the shift rounds up toward zero
+                const int k = std::countr_zero(magnitude);
+                move(r11, x);
+                if(k > 1) emit(AsmOp::sar, r11, imm_op(63));
+                emit(AsmOp::shr, r11, imm_op(64 - k));
+                emit(AsmOp::add, r11, x);
+                emit(AsmOp::sar, r11, imm_op(k));
+                if(d < 0) emit(AsmOp::neg, r11);
+                move(dst, r11);
+                return true;
+            }
+            // the allocator keeps rax and rdx free of anything live across this
+            const SignedMagic magic = signed_magic(d);
+            const Operand rax = reg_op(Reg::rax);
+            const Operand rdx = reg_op(Reg::rdx);
+            move(r11, x);
+            emit(AsmOp::mov, rax, imm_op(magic.multiplier));
+            emit(AsmOp::imul, r11); // rdx = the high half of x * multiplier
+            if(d > 0 && magic.multiplier < 0) emit(AsmOp::add, rdx, r11);
+            if(d < 0 && magic.multiplier > 0) emit(AsmOp::sub, rdx, r11);
+            if(magic.shift > 0) emit(AsmOp::sar, rdx, imm_op(magic.shift));
+            emit(AsmOp::mov, rax, rdx);
+            emit(AsmOp::shr, rax, imm_op(63));
+            emit(AsmOp::add, rdx, rax); // + 1 when negative, to truncate toward zero
+            move(dst, rdx);
+            return true;
+        }
 
-                void operator()(NodeTerm* term)const{
-                    gen->gen_term(term);
+        void gen_bin(ValueId id, const IrInst& inst) {
+            const Operand a = place(inst.a);
+            const Operand b = place(inst.b);
+            const Operand dst = place(id);
+            switch(inst.bin){
+                case BinOp::add:
+                case BinOp::sub:
+                case BinOp::mul: {
+                    if(inst.bin == BinOp::mul && (a.is_imm() != b.is_imm())){
+                        multiply(dst, a.is_imm() ? b : a, a.is_imm() ? a.imm : b.imm);
+                        break;
+                    }
+                    if(inst.bin != BinOp::mul && sum_into(dst, inst.bin == BinOp::add && a.is_imm() ? b : a, inst.bin == BinOp::add && a.is_imm() ? a : b, inst.bin == BinOp::sub)){
+                        break;
+                    }
+                    // imul leaves the same low 64 bits as an unsigned multiply
+                    const AsmOp op = inst.bin == BinOp::add ? AsmOp::add : inst.bin == BinOp::sub ? AsmOp::sub : AsmOp::imul;
+                    if(!dst.is_reg()){
+                        move(reg_op(Reg::r11), a);
+                        arith(op, Reg::r11, b);
+                        move(dst, reg_op(Reg::r11));
+                    }
+                    else if(b == dst && !(a == dst)){
+                        if(inst.bin != BinOp::sub){
+                            arith(op, dst.reg, a);
+                        }
+                        else{
+                            move(reg_op(Reg::r11), b);
+                            move(dst, a);
+                            arith(op, dst.reg, reg_op(Reg::r11));
+                        }
+                    }
+                    else{
+                        move(dst, a);
+                        arith(op, dst.reg, b);
+                    }
+                    break;
                 }
-                void operator()(NodeBinExpr* bin_exp) const{
-                    gen->gen_bin_expr(bin_exp);
+                case BinOp::div:
+                    if(b.is_imm() && !a.is_imm() && divide_by_constant(dst, a, b.imm)){
+                        break;
+                    }
+                    // the allocator keeps rax and rdx free of anything live across this
+                    move(reg_op(Reg::r11), b);
+                    move(reg_op(Reg::rax), a);
+                    emit(AsmOp::cqo);
+                    emit(AsmOp::idiv, reg_op(Reg::r11));
+                    if(!unused(id)) move(dst, reg_op(Reg::rax));
+                    break;
+                default: {
+                    compare(a, b);
+                    const Reg out = dst.is_reg() ? dst.reg : Reg::r11;
+                    emit_cc(AsmOp::setcc, condition(inst.bin), reg_op(out, 8));
+                    emit(AsmOp::movzx, reg_op(out, 32), reg_op(out, 8));
+                    move(dst, reg_op(out));
+                    break;
                 }
+            }
+        }
 
-            };
-            ExprVisitor visitor{.gen=this};
-            std::visit(visitor, expr->var);
+        void gen_return(const Operand& value) {
+            move(reg_op(Reg::rax), value);
+            for(size_t i = 0; i < m_saved.size(); i++){
+                emit(AsmOp::mov, reg_op(m_saved[i]), mem_op(-static_cast<int32_t>((i + 1) * 8)));
+            }
+            emit(AsmOp::leave);
+            emit(AsmOp::ret);
+        }
 
+        // At -O1 a call whose value the function returns right away is a sibling
+        // call, made from this frame's place: when the callee takes no more
+        // arguments on the stack than this function got, they fit where this
+        // function's own came in, and the callee returns straight to our caller.
+        bool tail_call(BlockId block, ValueId call) const {
+            const std::vector<ValueId>& insts = m_func->blocks[block].insts;
+            const IrInst& inst = m_func->insts[call];
+            if(m_opt_level < 1 || inst.op != IrOp::call || insts.size() < 2 || insts[insts.size() - 2] != call){
+                return false;
+            }
+            const IrInst& ret = m_func->insts[insts.back()];
+            const size_t stack_args = inst.args.size() > std::size(arg_regs) ? inst.args.size() - std::size(arg_regs) : 0;
+            const size_t own_stack_args = m_func->param_count > std::size(arg_regs) ? m_func->param_count - std::size(arg_regs) : 0;
+            return ret.op == IrOp::ret && ret.a == call && stack_args <= own_stack_args;
         }
 
-        void gen_scope(const NodeScope* scope)
-        {
-            begin_scope();
-            for(const auto* stmt : scope->stmts)
-            {
-                gen_stmt(*stmt);
+        void gen_tail_call(const IrInst& inst) {
+            std::vector<std::pair<Operand, Operand>> moves;
+            for(size_t i = 0; i < inst.args.size(); i++){
+                // the stack arguments go over our own, which were moved elsewhere on entry
+                moves.emplace_back(i < std::size(arg_regs) ? reg_op(arg_regs[i]) : mem_op(static_cast<int32_t>(16 + (i - std::size(arg_regs)) * 8)),
+                                   place(inst.args[i]));
+            }
+            parallel_move(std::move(moves));
+            for(size_t i = 0; i < m_saved.size(); i++){
+                emit(AsmOp::mov, reg_op(m_saved[i]), mem_op(-static_cast<int32_t>((i + 1) * 8)));
             }
-            end_scope();
+            emit(AsmOp::leave);
+            emit(AsmOp::jmp, sym_op(m_code.symbol("func_" + std::string(m_interner.name(static_cast<SymbolId>(inst.imm))))));
         }
 
-        void gen_stmt(const NodeStmt& stmt) {
 
-            struct StmtVisitor{
-                Generator* gen;
-                
-                void operator()(NodeStmtExit* stmt_exit) const
+        void gen_inst(BlockId block, ValueId id)
+        {
+            const IrInst& inst = m_func->insts[id];
+            switch(inst.op)
+            {
+                case IrOp::constant:
+                case IrOp::param:
+                case IrOp::phi:
+                    break; // constants are used in place, parameters are moved on entry, phis are written by their edges
+
+                case IrOp::bin:
+                    // a division that could fault still runs when nothing reads it, as DCE keeps it
+                    if(!unused(id) || m_func->may_fault(inst)) gen_bin(id, inst);
+                    break;
+
+                case IrOp::call:
                 {
-                    gen->gen_expr(stmt_exit->expr);
-                    if(gen->m_inside_func)
-                    {
-                        // Return from function
-                        gen->pop("rax");
-                        gen->asm_code << "    leave\n";
-                        gen->asm_code << "    ret\n";
+                    if(tail_call(block, id)){
+                        gen_tail_call(inst);
+                        break;
                     }
-                    else
-                    {
-                        // Exit program
-                        gen->asm_code << "    mov rax, 60\n";
-                        gen->pop("rdi");
-                        gen->asm_code << "    syscall\n";
+                    // the first arguments in registers, the rest pushed right to left,
+                    // so the callee finds argument i at [rbp + 16 + (i - 6)*8]
+                    const size_t in_regs = std::min(inst.args.size(), std::size(arg_regs));
+                    for(size_t i = inst.args.size(); i-- > in_regs;){
+                        const Operand arg = place(inst.args[i]);
+                        if(!arg.fits_imm32()){
+                            move(reg_op(Reg::r11), arg);
+                            emit(AsmOp::push, reg_op(Reg::r11));
+                        }
+                        else{
+                            emit(AsmOp::push, arg);
+                        }
                     }
-                }
-                void operator()(NodeStmtHope* stmt_hope) const
-                {
-                    auto scope_start = gen->m_scope.empty() ? gen->m_vars.begin() : gen->m_vars.begin() + gen->m_scope.back();
-                    auto it = std::find_if(scope_start, gen->m_vars.end(), [&](const var& var){
-                        return var.name == stmt_hope->ident.value.value();
-                    });
-                    if(it != gen->m_vars.end())
-                    {
-                        std::cerr<<"Variable already declared in this scope: " << stmt_hope->ident.value.value() <<std::endl;
-                        exit(EXIT_FAILURE);
+                    std::vector<std::pair<Operand, Operand>> moves;
+                    for(size_t i = 0; i < in_regs; i++){
+                        moves.emplace_back(reg_op(arg_regs[i]), place(inst.args[i]));
                     }
-
-                    gen->m_vars.push_back({.name=stmt_hope->ident.value.value(), .stack_loc=gen->m_stack_size});
-                    gen->gen_expr(stmt_hope->expr);
+                    parallel_move(std::move(moves));
+                    emit(AsmOp::call, sym_op(m_code.symbol("func_" + std::string(m_interner.name(static_cast<SymbolId>(inst.imm))))));
+                    if(inst.args.size() > in_regs){
+                        emit(AsmOp::add, reg_op(Reg::rsp), imm_op(static_cast<int64_t>((inst.args.size() - in_regs) * 8)));
+                    }
+                    if(!unused(id)) move(place(id), reg_op(Reg::rax));
+                    break;
                 }
 
-                void operator()(const NodeScope* scope) const
+                case IrOp::print_int:
+                    move(reg_op(Reg::rdi), place(inst.a));
+                    emit(AsmOp::call, sym_op(m_code.symbol("print_int")));
+                    break;
+
+                case IrOp::print_str:
                 {
-                    gen->gen_scope(scope);
+                    const IrString& str = m_unit->strings[inst.imm];
+                    emit(AsmOp::lea, reg_op(Reg::rsi), rip_op(m_code.symbol(str.label)));
+                    emit(AsmOp::mov, reg_op(Reg::rdx, 32), imm_op(str.len));
+                    emit(AsmOp::call, sym_op(m_code.symbol("print_str")));
+                    break;
                 }
 
-                void operator()(NodeStmtMaybe* stmt_maybe) const {
-                    std::string label_end = gen->create_label();
-                    std::string label_next = gen->create_label();
-
-                    // IF
-                    gen->gen_expr(stmt_maybe->condition);
-                    gen->pop("rax");
-                    gen->asm_code << "    test rax, rax \n";
-                    gen->asm_code << "    jz " << label_next << "\n";
-                    gen->gen_scope(stmt_maybe->scope);
-                    gen->asm_code << "    jmp " << label_end << "\n";
-                    gen->asm_code << label_next << ":\n";
-
-                    // ELIFS
-                    for(const auto* elif : stmt_maybe->elifs)
-                    {
-                        label_next = gen->create_label();
-                        gen->gen_expr(elif->condition);
-                        gen->pop("rax");
-                        gen->asm_code << "    test rax, rax \n";
-                        gen->asm_code << "    jz " << label_next << "\n";
-                        gen->gen_scope(elif->scope);
-                        gen->asm_code << "    jmp " << label_end << "\n";
-                        gen->asm_code << label_next << ":\n";
+                case IrOp::newline:
+                    emit(AsmOp::call, sym_op(m_code.symbol("print_newline")));
+                    break;
+
+                case IrOp::jmp:
+                    jump(block, inst.target[0]);
+                    break;
+
+                case IrOp::br:
+                {
+                    const BlockId if_true = inst.target[0];
+                    const BlockId if_false = inst.target[1];
+                    const Operand cond = place(inst.a);
+                    Cond if_false_cc = Cond::e;
+                    if(m_alloc.fused[block] == inst.a){
+                        // cmp and jcc on the inverted condition, no 0 or 1 in between
+                        const IrInst& cmp = m_func->insts[inst.a];
+                        compare(place(cmp.a), place(cmp.b));
+                        if_false_cc = negate(condition(cmp.bin));
+                    }
+                    else if(cond.is_imm()){
+                        jump(block, cond.imm != 0 ? if_true : if_false);
+                        break;
+                    }
+                    else if(cond.is_reg()){
+                        emit(AsmOp::test, cond, cond);
                     }
+                    else{
+                        emit(AsmOp::cmp, cond, imm_op(0));
+                    }
+                    // an edge with copies gets a stub of its own, they mustn't run on the other path
+                    const std::vector<std::pair<Operand, Operand>> false_moves = edge_moves(block, if_false);
+                    const uint32_t false_label = !false_moves.empty() ? m_code.symbol(m_func->name + ".edge" + std::to_string(m_edge_count++)) : m_labels[if_false];
+                    emit_cc(AsmOp::jcc, if_false_cc, sym_op(false_label));
+                    parallel_move(edge_moves(block, if_true));
+                    if(if_true != block + 1 || !false_moves.empty()) emit(AsmOp::jmp, sym_op(m_labels[if_true]));
+                    if(!false_moves.empty()){
+                        emit_label(false_label);
+                        parallel_move(false_moves);
+                        if(if_false != block + 1) emit(AsmOp::jmp, sym_op(m_labels[if_false]));
+                    }
+                    break;
+                }
 
-                    // ELSE
-                    if(stmt_maybe->else_stmt.has_value())
-                    {
-                        gen->gen_scope(stmt_maybe->else_stmt.value()->scope);
+                case IrOp::ret:
+                    if(!tail_call(block, inst.a)){
+                        gen_return(place(inst.a));
                     }
+                    break;
 
-                    gen->asm_code << label_end << ":\n";
-                }
+                case IrOp::exit:
+                    // the output still buffered goes out first
+                    move(reg_op(Reg::rdi), place(inst.a));
+                    emit(AsmOp::jmp, sym_op(m_code.symbol("exit_program")));
+                    break;
+            }
+        }
 
-                void operator()(NodeStmtWait* stmt) const {
-                    std::string label_start = gen->create_label();
-                    std::string label_end = gen->create_label();
-                    gen->asm_code << label_start << ":\n";
-                    gen->gen_expr(stmt->condition);
-                    gen->pop("rax");
-                    gen->asm_code << "    test rax, rax \n";
-                    gen->asm_code << "    jz " << label_end << "\n";
-                    gen->gen_scope(stmt->scope);
-                    gen->asm_code << "    jmp " << label_start << "\n";
-                    gen->asm_code << label_end << ":\n";
+        void gen_function(const IrFunction& func)
+        {
+            m_func = &func;
+            m_edge_count = 0;
+            m_alloc = RegisterAllocator(func).run();
+            m_saved.clear();
+            if(func.name != "_start"){ // _start never returns, nothing to preserve
+                for(Reg reg : {Reg::rbx, Reg::r12, Reg::r13, Reg::r14, Reg::r15}){
+                    if(m_alloc.used & reg_bit(reg)) m_saved.push_back(reg);
                 }
+            }
+            m_labels.clear();
+            for(BlockId b = 0; b < func.blocks.size(); b++){
+                m_labels.push_back(func.blocks[b].preds.empty() ? 0 : m_code.symbol(func.name + ".label" + std::to_string(b)));
+            }
+
+            emit_label(m_code.symbol(func.name));
+            emit(AsmOp::push, reg_op(Reg::rbp));
+            emit(AsmOp::mov, reg_op(Reg::rbp), reg_op(Reg::rsp));
+            const size_t frame = (m_saved.size() + m_alloc.slot_count) * 8;
+            if(frame > 0){
+                emit(AsmOp::sub, reg_op(Reg::rsp), imm_op(static_cast<int64_t>(frame)));
+            }
+            for(size_t i = 0; i < m_saved.size(); i++){
+                emit(AsmOp::mov, mem_op(-static_cast<int32_t>((i + 1) * 8)), reg_op(m_saved[i]));
+            }
+            // Stack at entry: [OldRBP] [RetIP] [Arg7] [Arg8] ... past the register arguments
+            std::vector<std::pair<Operand, Operand>> params;
+            for(ValueId id : func.blocks.front().insts){
+                const IrInst& inst = func.insts[id];
+                if(inst.op != IrOp::param || unused(id)) continue;
+                const size_t index = static_cast<size_t>(inst.imm);
+                params.emplace_back(place(id), index < std::size(arg_regs) ? reg_op(arg_regs[index])
+                                                                           : mem_op(static_cast<int32_t>(16 + (index - std::size(arg_regs)) * 8)));
+            }
+            parallel_move(std::move(params));
 
-                void operator()(NodeStmtMoveOn* stmt) const {
-                    // This should not be visited directly anymore via proper parsing, 
-                    // but keeping basic impl just in case or empty
-                    gen->gen_scope(stmt->scope);
+            for(BlockId b = 0; b < func.blocks.size(); b++){
+                if(!func.blocks[b].preds.empty()){
+                    emit_label(m_labels[b]);
                 }
-               
-                 void operator()(NodeStmtOrMaybe* stmt) const {
-                    // Should not be visited directly
-                 }
+                for(ValueId id : func.blocks[b].insts){
+                    gen_inst(b, id);
+                }
+            }
+        }
 
 
-                void operator()(NodeStmtDillusion* stmt_dillusion) const
-                {
-                    const std::string var_name = stmt_dillusion->ident.value.value();
-                    if(gen->m_str_vars.find(var_name) != gen->m_str_vars.end())
-                    {
-                        std::cerr<<"String variable already declared: " << var_name <<std::endl;
-                        exit(EXIT_FAILURE);
-                    }
+    public:
+        inline explicit Generator(const NodeProgram& prog, const Interner& interner, Diagnostics& diags, int opt_level = 1) : m_lowering(prog, interner, diags), m_interner(interner), m_diags(diags), m_opt_level(opt_level) {
+        }
 
-                    // Extract the string from the expression
-                    if(std::holds_alternative<NodeTerm*>(stmt_dillusion->expr->var)){
-                        NodeTerm* term = std::get<NodeTerm*>(stmt_dillusion->expr->var);
-                        if(std::holds_alternative<NodeTermStringLit*>(term->var)){
-                            NodeTermStringLit* str_lit = std::get<NodeTermStringLit*>(term->var);
-                            const std::string s = str_lit->string_lit.value.value();
-                            std::string label;
-                            if(gen->m_str_labels.find(s) == gen->m_str_labels.end()){
-                                label = "msg_" + std::to_string(gen->m_str_count++);
-                                gen->m_str_labels.emplace(s, label);
-                                gen->m_str_lens.emplace(s, s.size());
-                            } else {
-                                label = gen->m_str_labels.at(s);
-                            }
-                            gen->m_str_vars.emplace(var_name, label);
-                            return;
-                        }
+        // The code and data of a unit, after optimize().
+        AsmUnit emit_unit(const IrUnit& unit)
+        {
+            m_unit = &unit;
+            m_code.clear();
+            AsmUnit out;
+            std::vector<uint32_t> entries; // per function, its label's symbol
+            for(const IrFunction& func : unit.functions){
+                const size_t first = m_code.insts.size();
+                gen_function(func);
+                entries.push_back(static_cast<uint32_t>(m_code.insts[first].a.imm));
+                out.defines.push_back(func.name);
+                for(const IrBlock& block : func.blocks){
+                    for(ValueId id : block.insts){
+                        const IrInst& inst = func.insts[id];
+                        if(inst.op == IrOp::call) out.calls.push_back("func_" + std::string(m_interner.name(static_cast<SymbolId>(inst.imm))));
+                        if(inst.op == IrOp::print_int) out.runtime |= runtime_print_int | runtime_output;
+                        if(inst.op == IrOp::print_str || inst.op == IrOp::newline) out.runtime |= runtime_output;
+                        if(inst.op == IrOp::exit) out.runtime |= runtime_exit;
                     }
-                    std::cerr<<"String variable must be initialized with a string literal"<<std::endl;
-                    exit(EXIT_FAILURE);
                 }
-                void operator()(NodeStmtAssign* stmt_assign) const
-                {
-                    auto it = std::find_if(gen->m_vars.rbegin(), gen->m_vars.rend(), [&](const var& var){
-                        return var.name == stmt_assign->ident.value.value();
-                    });
+            }
+            std::sort(out.calls.begin(), out.calls.end());
+            out.calls.erase(std::unique(out.calls.begin(), out.calls.end()), out.calls.end());
+            if(m_opt_level >= 1){
+                peephole(m_code, m_peephole_stats);
+            }
+            out.machine = encode(m_code);
+            for(uint32_t entry : entries){
+                out.offsets.push_back(out.machine.labels[entry]);
+            }
+            out.code = std::move(m_code);
+            for(const IrString& str : unit.strings){
+                if(str.defined){
+                    out.data.push_back({.label=str.label, .bytes=std::string(str.text) + '\0'});
+                }
+            }
+            return out;
+        }
 
-                    if(it != gen->m_vars.rend())
-                    {
-                        // Found in current scope - Update it
-                        gen->gen_expr(stmt_assign->expr);
-                        gen->pop("rax");
-                        gen->asm_code << "    mov [rsp + " << (gen->m_stack_size - it->stack_loc - 1)*8 << "], rax\n";
-                    }
-                    else
+        // how often each peephole rule fired, over every unit generated so far
+        [[nodiscard]] const PeepholeStats& peephole_stats() const { return m_peephole_stats; }
+
+        // A top-level function definition lowered to IR, as a unit of its own.
+        IrUnit lower_function(NodeIndex func_def)
+        {
+            return m_lowering.lower_function(func_def);
+        }
+
+        // _start lowered to IR: every top-level statement that isn't a function definition, then exit(0).
+        IrUnit lower_start(std::span<const NodeIndex> stmts)
+        {
+            return m_lowering.lower_start(stmts);
+        }
+
+        // dillusions declared so far; set before generating a unit on its own
+        [[nodiscard]] inline const StringVars& string_vars() const { return m_lowering.string_vars(); }
+        inline void set_string_vars(StringVars vars) { m_lowering.set_string_vars(std::move(vars)); }
+        [[nodiscard]] inline const FunctionRefs& functions() const { return m_lowering.functions(); }
+
+        // The program linked, as NASM source too for --emit-asm. Nothing if there was any error:
+        // linking needs every function a call names.
+        [[nodiscard]] std::optional<LinkedProgram> gen_program(bool emit_asm = false) {
+            // Functions first, then _start. The whole program is optimized at once, so
+            // calls can be inlined from one unit into another.
+            std::vector<IrUnit> lowered = m_lowering.lower_program();
+            if(!m_diags.empty()){
+                return std::nullopt;
+            }
+            optimize(lowered, m_opt_level);
+            std::vector<AsmUnit> units;
+            for(const IrUnit& unit : lowered)
+            {
+                units.push_back(emit_unit(unit));
+            }
+
+            std::vector<const AsmUnit*> order;
+            for(const AsmUnit& unit : units)
+            {
+                order.push_back(&unit);
+            }
+            return link(order, m_opt_level, emit_asm);
+        }
+
+        // Which units link() keeps at -O1: _start and every unit it calls into, transitively.
+        static std::vector<uint8_t> reachable(const std::vector<const AsmUnit*>& units)
+        {
+            std::unordered_map<std::string_view, std::vector<size_t>> defined_in;
+            std::vector<uint8_t> keep(units.size(), 0);
+            std::vector<size_t> work;
+            for(size_t i = 0; i < units.size(); i++)
+            {
+                for(const std::string& label : units[i]->defines)
+                {
+                    defined_in[label].push_back(i);
+                }
+                if(!units[i]->defines.empty() && units[i]->defines.front() == "_start")
+                {
+                    keep[i] = 1;
+                    work.push_back(i);
+                }
+            }
+            while(!work.empty())
+            {
+                const size_t i = work.back();
+                work.pop_back();
+                for(const std::string& callee : units[i]->calls)
+                {
+                    auto it = defined_in.find(callee);
+                    if(it == defined_in.end()) continue;
+                    for(size_t j : it->second)
                     {
-                         // Not found in current scope - Implicitly declare it (Shadowing)
-                        gen->m_vars.push_back({.name=stmt_assign->ident.value.value(), .stack_loc=gen->m_stack_size});
-                        gen->gen_expr(stmt_assign->expr);
+                        if(!keep[j])
+                        {
+                            keep[j] = 1;
+                            work.push_back(j);
+                        }
                     }
                 }
+            }
+            return keep;
+        }
+
+        // A function unit's code and data with its own name blanked out: two units
+        // with the same key link to the same code, calls to themselves included.
+        static std::string body_key(const AsmUnit& unit)
+        {
+            const std::string& name = unit.defines.front();
+            std::string key;
+            key.reserve(unit.machine.bytes.size() + 16 * unit.machine.fixups.size() + 64);
+            auto add_name = [&](const std::string& symbol){
+                const bool own = symbol.starts_with(name) && (symbol.size() == name.size() || symbol[name.size()] == '.');
+                if(own) key += '\x01';
+                key.append(symbol, own ? name.size() : 0);
+                key += '\0';
+            };
+            key += std::to_string(unit.machine.bytes.size()) + ':' + std::to_string(unit.offsets.front()) + ':';
+            key.append(reinterpret_cast<const char*>(unit.machine.bytes.data()), unit.machine.bytes.size());
+            for(const Fixup& fixup : unit.machine.fixups)
+            {
+                key += std::to_string(fixup.offset) + ':' + std::to_string(fixup.tail) + ':';
+                add_name(unit.code.symbols[fixup.symbol]);
+            }
+            for(const AsmData& data : unit.data)
+            {
+                add_name(data.label);
+                key += data.bytes;
+                key += '\0';
+            }
+            return key;
+        }
 
-                void operator()(NodeStmtTellMe* stmt_tell_me) const
+        // Lays data out one after another, each at an address it can be read from
+        // whole, and notes where in addrs (relative to the section, for now).
+        static void place_data(const std::vector<AsmData>& items, std::vector<uint8_t>& bytes, uint64_t& size,
+                               std::vector<std::pair<std::string_view, uint64_t>>& addrs)
+        {
+            for(const AsmData& item : items)
+            {
+                const uint64_t length = item.reserve != 0 ? item.reserve : item.bytes.size();
+                const uint64_t align = item.qwords || item.reserve >= 16 ? 16 : item.reserve >= 8 ? 8 : 1; // strings are read a byte at a time
+                size = ElfLayout::align(size, align);
+                addrs.emplace_back(item.label, size);
+                if(item.reserve == 0)
                 {
-                    bool is_string = false;
-                    
-                    // Check if it's a string literal
-                    if(std::holds_alternative<NodeTerm*>(stmt_tell_me->expr->var)){
-                        NodeTerm* term = std::get<NodeTerm*>(stmt_tell_me->expr->var);
-                        if(std::holds_alternative<NodeTermStringLit*>(term->var)){
-                            is_string = true;
-                        }
-                        // Check if it's a string variable (identifier)
-                        else if(std::holds_alternative<NodeTermIdent*>(term->var)){
-                            NodeTermIdent* ident = std::get<NodeTermIdent*>(term->var);
-                            const std::string var_name = ident->ident.value.value();
-                            if(gen->m_str_vars.find(var_name) != gen->m_str_vars.end()){
-                                is_string = true;
-                            }
-                        }
-                    }
-                    
-                    gen->gen_expr(stmt_tell_me->expr);
-                    if(!is_string){
-                        gen->pop("rdi");
-                        gen->asm_code << "    call print_int\n";
-                    }
+                    bytes.resize(size, 0);
+                    bytes.insert(bytes.end(), item.bytes.begin(), item.bytes.end());
                 }
+                size += length;
+            }
+        }
 
-                void operator()(NodeStmtThen* stmt_then) const
+        // rel32s of code placed at base in text, pointed at what they name
+        static void resolve(std::vector<uint8_t>& text, uint64_t text_addr, size_t base, const AsmCode& code, const MachineCode& machine,
+                            const std::unordered_map<std::string_view, uint64_t>& addrs)
+        {
+            for(const Fixup& fixup : machine.fixups)
+            {
+                const uint64_t target = addrs.at(code.symbols[fixup.symbol]); // an undefined call never gets this far
+                const uint64_t at = base + fixup.offset;
+                const int64_t rel = static_cast<int64_t>(target - (text_addr + at + 4 + fixup.tail));
+                for(int i = 0; i < 4; i++)
                 {
-                    gen->asm_code << "    mov rax, 1\n";
-                    gen->asm_code << "    mov rdi, 1\n";
-                    gen->asm_code << "    lea rsi, [rel newline_const]\n";
-                    gen->asm_code << "    mov rdx, 1\n";
-                    gen->asm_code << "    syscall\n";
+                    text[at + i] = static_cast<uint8_t>(rel >> (8 * i));
                 }
+            }
+        }
 
-                void operator()(NodeFuncDef* func_def) const
+        // The whole program: units in order (functions, then _start), the runtime helpers and the data,
+        // as a static executable that starts at _start. At -O1 functions nothing reachable from _start
+        // calls are left out, and a function whose body is the same as an earlier one's becomes a second
+        // label on that one. Data is always kept whole, dillusion strings can be defined in one unit and
+        // used from another. With emit_asm the same program comes back as NASM source as well.
+        static LinkedProgram link(const std::vector<const AsmUnit*>& units, int opt_level = 1, bool emit_asm = false)
+        {
+            std::vector<uint8_t> keep(units.size(), 1);
+            std::vector<std::vector<std::string_view>> aliases(units.size()); // labels to put in front of a unit
+            if(opt_level >= 1)
+            {
+                keep = reachable(units);
+                std::unordered_map<size_t, std::vector<size_t>> bodies; // key hash -> units kept with it
+                for(size_t i = 0; i < units.size(); i++)
                 {
-                    // Function definition should not be executed inline in main flow. 
-                    // It is handled by the first pass in gen_program or skipped if we iterate naively.
-                    // We will generate the code here, but we assume gen_program calls this at the right time (outside _start).
-                    
-                    std::string func_label = "func_" + func_def->name.value.value();
-                    gen->asm_code << "\n" << func_label << ":\n";
-                    gen->asm_code << "    push rbp\n";
-                    gen->asm_code << "    mov rbp, rsp\n";
-                    
-                    // Reset stack tracking for function scope
-                    size_t old_stack_size = gen->m_stack_size;
-                    std::vector<var> old_vars = gen->m_vars;
-                    gen->m_stack_size = 0;
-                    gen->m_vars.clear();
-                    gen->m_inside_func = true;
-                    
-                    // Bind Arguments
-                    // Stack at entry: [RetIP] [OldRBP] [Arg1] [Arg2] ... (Assuming Right-to-Left push)
-                    // Arg1 is at RBP+16. Arg2 is at RBP+24.
-                    // We want to access them as if they are local variables.
-                    // We can Copy them to local stack or map them.
-                    // Mapping is complex because 'gen_term' expects 'rsp + offset'. 
-                    // Simplest: Push them from [rbp+offset] to stack to make them local vars.
-                    
-                    size_t arg_count = func_def->args.size();
-                    for(size_t i=0; i<arg_count; ++i)
+                    if(!keep[i] || units[i]->defines.size() != 1 || units[i]->defines.front() == "_start") continue;
+                    const std::string key = body_key(*units[i]);
+                    std::vector<size_t>& same_hash = bodies[std::hash<std::string>{}(key)];
+                    auto twin = std::find_if(same_hash.begin(), same_hash.end(), [&](size_t j){ return body_key(*units[j]) == key; });
+                    if(twin == same_hash.end())
                     {
-                        // Arg i (0-index) is at RBP + 16 + i*8
-                        gen->asm_code << "    push QWORD [rbp + " << 16 + i*8 << "]\n";
-                        gen->m_stack_size++;
-                        gen->m_vars.push_back({.name=func_def->args[i].second.value.value(), .stack_loc=gen->m_stack_size-1}); // stack_loc matches current pos
+                        same_hash.push_back(i);
+                        continue;
                     }
-                    
-                    gen->gen_scope(func_def->scope);
-                    
-                    // Default return 0 if no generic return found (just safety)
-                    gen->asm_code << "    mov rax, 0\n";
-                    gen->asm_code << "    leave\n";
-                    gen->asm_code << "    ret\n";
-                    
-                    // Restore state
-                    gen->m_inside_func = false;
-                    gen->m_vars = old_vars;
-                    gen->m_stack_size = old_stack_size;
+                    aliases[*twin].push_back(units[i]->defines.front());
+                    keep[i] = 0;
                 }
+            }
 
+            uint8_t runtime = 0;
+            size_t text_size = 0;
+            std::vector<AsmData> data;
+            for(size_t i = 0; i < units.size(); i++)
+            {
+                text_size += keep[i] ? units[i]->machine.bytes.size() : 0;
+                runtime |= keep[i] ? units[i]->runtime : 0;
+                data.insert(data.end(), units[i]->data.begin(), units[i]->data.end());
+            }
+            const RuntimeCode helpers = runtime_code(runtime);
+            const MachineCode helpers_machine = encode(helpers.code);
+
+            // everything placed, then every address known before a rel32 is filled in
+            std::vector<uint8_t> text;
+            text.reserve(text_size + helpers_machine.bytes.size());
+            std::vector<size_t> bases(units.size());
+            for(size_t i = 0; i < units.size(); i++)
+            {
+                if(!keep[i]) continue;
+                bases[i] = text.size();
+                text.insert(text.end(), units[i]->machine.bytes.begin(), units[i]->machine.bytes.end());
+            }
+            const size_t helpers_base = text.size();
+            text.insert(text.end(), helpers_machine.bytes.begin(), helpers_machine.bytes.end());
+            std::vector<uint8_t> rodata, data_bytes, no_bytes;
+            uint64_t rodata_size = 0, data_size = 0, bss_size = 0;
+            std::vector<std::pair<std::string_view, uint64_t>> rodata_addrs, data_addrs, bss_addrs;
+            place_data(helpers.rodata, rodata, rodata_size, rodata_addrs);
+            place_data(data, data_bytes, data_size, data_addrs);
+            place_data(helpers.bss, no_bytes, bss_size, bss_addrs);
+            rodata.resize(rodata_size, 0);
+            data_bytes.resize(data_size, 0);
+            const ElfLayout layout = elf_layout(text.size(), rodata_size, data_size, bss_size);
+
+            std::unordered_map<std::string_view, uint64_t> addrs;
+            std::vector<ElfSymbol> symbols;
+            auto define = [&](std::string_view name, uint64_t addr, uint16_t section){
+                addrs.emplace(name, addr);
+                symbols.push_back({.name=std::string(name), .addr=addr, .section=section});
             };
-            StmtVisitor visitor{.gen=this};
-            std::visit(visitor, stmt.var);
-
-        }
-
-        [[nodiscard]] std::string gen_program() {
-            asm_code << "section .text\n";
-            asm_code << "global _start\n";
-            // Generate Functions First
-            for(const NodeStmt & stmt: m_prog.stmts)
+            for(size_t i = 0; i < units.size(); i++)
             {
-                if(std::holds_alternative<NodeFuncDef*>(stmt.var)) {
-                    gen_stmt(stmt);
+                if(!keep[i]) continue;
+                for(std::string_view alias : aliases[i])
+                {
+                    define(alias, layout.text_addr() + bases[i] + units[i]->offsets.front(), 1);
+                }
+                for(size_t f = 0; f < units[i]->defines.size(); f++)
+                {
+                    define(units[i]->defines[f], layout.text_addr() + bases[i] + units[i]->offsets[f], 1);
                 }
             }
-            
-            asm_code << "\n_start:\n";
-            // Generate Main Body (Skip functions)
-            for(const NodeStmt & stmt: m_prog.stmts)
+            for(uint32_t symbol = 0; symbol < helpers.code.symbols.size(); symbol++)
             {
-                 if(!std::holds_alternative<NodeFuncDef*>(stmt.var)) {
-                    gen_stmt(stmt);
+                if(helpers_machine.labels[symbol] != UINT32_MAX)
+                {
+                    define(helpers.code.symbols[symbol], layout.text_addr() + helpers_base + helpers_machine.labels[symbol], 1);
                 }
             }
-            
-            
-            asm_code << "    mov rax, 60\n"; // syscall: exit
-            asm_code << "    mov rdi, 0\n";
-            asm_code << "    syscall\n";
-            
-            // Helper function to print integer
-            asm_code << "\nprint_int:\n";
-            asm_code << "    push rbp\n";
-            asm_code << "    mov rbp, rsp\n";
-            asm_code << "    sub rsp, 32\n";
-            asm_code << "    mov rax, rdi\n";
-            asm_code << "    lea rsi, [rel buffer]\n";
-            asm_code << "    mov rcx, 0\n";
-            asm_code << "    cmp rax, 0\n";
-            asm_code << "    jge .L1\n";
-            asm_code << "    neg rax\n";
-            asm_code << "    mov byte [rsi], '-'\n";
-            asm_code << "    inc rsi\n";
-            asm_code << "    inc rcx\n";
-            asm_code << ".L1:\n";
-            asm_code << "    mov r8, 10\n";
-            asm_code << "    mov r9, 0\n";
-            asm_code << ".L2:\n";
-            asm_code << "    xor edx, edx\n";
-            asm_code << "    div r8\n";
-            asm_code << "    add dl, '0'\n";
-            asm_code << "    push rdx\n";
-            asm_code << "    inc r9\n";
-            asm_code << "    cmp rax, 0\n";
-            asm_code << "    jne .L2\n";
-            asm_code << ".L3:\n";
-            asm_code << "    pop rax\n";
-            asm_code << "    mov byte [rsi], al\n";
-            asm_code << "    inc rsi\n";
-            asm_code << "    inc rcx\n";
-            asm_code << "    dec r9\n";
-            asm_code << "    jne .L3\n";
-            asm_code << "    mov byte [rsi], 10\n";
-            asm_code << "    inc rcx\n";
-            asm_code << "    mov rax, 1\n";
-            asm_code << "    mov rdi, 1\n";
-            asm_code << "    lea rsi, [rel buffer]\n";
-            asm_code << "    mov rdx, rcx\n";
-            asm_code << "    syscall\n";
-            asm_code << "    leave\n";
-            asm_code << "    ret\n";
-            asm_code << "\nsection .bss\n";
-            asm_code << "buffer: resb 32\n";
-
-            // Emit data section for string literals
-            asm_code << "\nsection .data\n";
-            asm_code << "newline_const: db 10, 0\n";
-
-            if(!m_str_labels.empty()){
-                for(const auto &p : m_str_labels){
-                    const std::string &str = p.first;
-                    const std::string &label = p.second;
-                    // escape double quotes by replacing with \" if present
-                    std::string out;
-                    for(char c: str){
-                        if(c == '"') out += "\\\"";
-                        else out += c;
+            for(const auto& [name, offset] : rodata_addrs) define(name, layout.rodata_addr() + offset, 2);
+            for(const auto& [name, offset] : data_addrs) define(name, layout.data_addr() + offset, 3);
+            for(const auto& [name, offset] : bss_addrs) define(name, layout.bss_addr() + offset, 4);
+
+            for(size_t i = 0; i < units.size(); i++)
+            {
+                if(keep[i]) resolve(text, layout.text_addr(), bases[i], units[i]->code, units[i]->machine, addrs);
+            }
+            resolve(text, layout.text_addr(), helpers_base, helpers.code, helpers_machine, addrs);
+
+            LinkedProgram out;
+            out.executable = write_elf(layout, text, rodata, data_bytes, symbols, addrs.at("_start"));
+            if(emit_asm)
+            {
+                out.asm_text = "section .text\nglobal _start\n";
+                for(size_t i = 0; i < units.size(); i++)
+                {
+                    if(!keep[i]) continue;
+                    for(std::string_view alias : aliases[i])
+                    {
+                        out.asm_text += "\n";
+                        out.asm_text += alias;
+                        out.asm_text += ":";
+                    }
+                    out.asm_text += "\n";
+                    units[i]->code.print(out.asm_text);
+                }
+                if(!helpers.code.insts.empty())
+                {
+                    out.asm_text += "\n";
+                    helpers.code.print(out.asm_text);
+                }
+                const std::pair<const char*, const std::vector<AsmData>*> sections[] = {
+                    {"\nsection .rodata\n", &helpers.rodata}, {"\nsection .data\n", &data}, {"\nsection .bss\n", &helpers.bss}};
+                for(const auto& [header, items] : sections)
+                {
+                    if(items->empty()) continue;
+                    out.asm_text += header;
+                    for(const AsmData& item : *items)
+                    {
+                        item.print(out.asm_text);
                     }
-                    asm_code << label << ": db \"" << out << "\"" << ", 0\n";
                 }
             }
-            
-            return asm_code.str();
+            return out;
         }
-        
-        
-        
-};
\ No newline at end of file
+};
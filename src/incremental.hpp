@@ -0,0 +1,505 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include "source.hpp"
+#include "diagnostics.hpp"
+#include "interner.hpp"
+#include "tokenizer.hpp"
+#include "parser.hpp"
+#include "generation.hpp"
+
+// A unit's code, valid while what it's made from (Session::code_key) is key.
+struct CachedCode {
+    bool valid = false;
+    uint64_t key = 0;
+    AsmUnit unit;
+};
+
+// One top-level function definition, or the run of top-level statements
+// between two of them, with everything compiled from it. It owns a copy of its
+// text, so its tokens, AST and diagnostics are relative to the chunk and stay
+// valid wherever an edit moves it in the file.
+struct Chunk {
+    inline Chunk(std::string_view source, bool function, uint64_t content_hash)
+        : text(source), hash(content_hash), is_function(function), lines(text), tokens(text)
+    {}
+
+    std::string text;
+    uint64_t hash;
+    bool is_function;
+    LineIndex lines;
+    TokenStream tokens;
+    NodeProgram prog;
+    std::vector<Diagnostic> front_diags; // lexer and parser
+    size_t front_count = 0; // all they reported, front_diags stops at the cap
+
+    // function chunks only: the unit lowered and optimized function by function,
+    // valid while the dillusions declared before it hash to gen_env
+    bool generated = false;
+    uint64_t gen_env = 0;
+    IrUnit ir;
+    std::vector<Diagnostic> gen_diags;
+    size_t gen_count = 0;
+    FunctionRefs functions; // checked against every other unit's on each compile
+    std::vector<std::pair<SymbolId, Symbol>> declared; // dillusions the unit adds
+    InlineUnit inlining; // ir with calls inlined
+    CachedCode code;
+};
+
+// What a --session compile redid, for --stats.
+struct SessionStats {
+    size_t chunks = 0;
+    size_t relexed_bytes = 0;
+    size_t rebuilt_chunks = 0;
+    size_t generated_units = 0; // functions plus _start, whose code was emitted again
+};
+
+// Incremental compiler for an edit session. Each compile() gets the whole new
+// text, but only the part that differs from the previous one (between the
+// common prefix and suffix) is lexed again to find chunk boundaries. Chunks
+// whose text didn't change keep their tokens and AST; a function's assembly is
+// lowered as long as its text and the dillusions visible to it are the same, and
+// _start only when a top-level statement run changes. Inlining goes across
+// units as in a from-scratch compile, but a unit's code is only emitted (and
+// encoded) again when its own IR or that of a callee it could inline changed
+// (InlineUnit); linking the cached machine code is all that's left. The
+// output is the same as a from-scratch compile whenever there are no errors,
+// and so are the diagnostics: after a syntax error the whole file is checked
+// again in one piece (check_whole).
+class Session {
+public:
+    inline explicit Session(int opt_level, bool emit_asm = false) : m_interner(true), m_opt_level(opt_level), m_emit_asm(emit_asm) // names must outlive the chunks they were first seen in
+    {}
+
+    inline Session(const Session&) = delete;
+    inline Session& operator=(const Session&) = delete;
+
+    // The new version of the program linked (with its assembly when emit_asm was
+    // asked for), or nothing when diags got errors. diags has to be over the same source.
+    inline std::optional<LinkedProgram> compile(std::string_view source, Diagnostics& diags)
+    {
+        m_stats = {};
+        update_chunks(source);
+        m_source.assign(source);
+        m_stats.chunks = m_chunks.size();
+
+        std::vector<size_t> begins(m_chunks.size());
+        bool parsed = true;
+        for(size_t i = 0, at = 0; i < m_chunks.size(); at += m_chunks[i]->text.size(), i++)
+        {
+            begins[i] = at;
+            parsed = parsed && m_chunks[i]->front_count == 0;
+        }
+        if(!parsed)
+        {
+            check_whole(source, diags);
+            return {};
+        }
+
+        // functions first, in order, threading the dillusion environment through
+        StringVars env;
+        uint64_t env_hash = 0;
+        for(size_t i = 0; i < m_chunks.size(); i++)
+        {
+            Chunk& chunk = *m_chunks[i];
+            if(!chunk.is_function)
+            {
+                continue;
+            }
+            if(!chunk.generated || chunk.gen_env != env_hash)
+            {
+                lower_function(chunk, env, env_hash);
+            }
+            diags.append(chunk.gen_diags, chunk.gen_count, begins[i]);
+            for(const auto& [sym, var] : chunk.declared)
+            {
+                env.emplace(sym, var);
+                env_hash ^= hash_string_var(sym, var);
+            }
+        }
+
+        // _start from every statement run; its diagnostics are absolute, so a
+        // cached one with errors is only reused if the runs didn't move
+        uint64_t start_key = env_hash * 31 + 7;
+        uint64_t start_layout = 0;
+        for(size_t i = 0; i < m_chunks.size(); i++)
+        {
+            if(!m_chunks[i]->is_function)
+            {
+                start_key = start_key * 1099511628211ull ^ m_chunks[i]->hash;
+                start_layout = start_layout * 1099511628211ull ^ begins[i];
+            }
+        }
+        if(!m_start_valid || m_start_key != start_key || (!m_start_diags.empty() && m_start_layout != start_layout))
+        {
+            lower_start(source, begins, env);
+            m_start_key = start_key;
+            m_start_layout = start_layout;
+            m_start_valid = true;
+        }
+        diags.append(m_start_diags, m_start_count, 0);
+
+        // a call can go to a function in any chunk, so this isn't cached with one
+        std::vector<std::pair<const FunctionRefs*, size_t>> functions;
+        for(size_t i = 0, run = 0; i < m_chunks.size(); i++)
+        {
+            functions.emplace_back(m_chunks[i]->is_function ? &m_chunks[i]->functions : &m_start_functions[run++], begins[i]);
+        }
+        check_functions(functions, m_interner, diags);
+
+        if(!diags.empty())
+        {
+            return {};
+        }
+
+        // the same units in the same order as a from-scratch compile
+        std::vector<InlineUnit*> inlining;
+        std::vector<CachedCode*> code;
+        for(const std::unique_ptr<Chunk>& chunk : m_chunks)
+        {
+            if(chunk->is_function)
+            {
+                inlining.push_back(&chunk->inlining);
+                code.push_back(&chunk->code);
+            }
+        }
+        inlining.push_back(&m_start_inlining);
+        code.push_back(&m_start_code);
+        if(m_opt_level >= 1)
+        {
+            Inliner(inlining, optimize_function).run();
+        }
+        std::vector<const AsmUnit*> units;
+        for(size_t i = 0; i < inlining.size(); i++)
+        {
+            const uint64_t key = code_key(*inlining[i]);
+            if(!code[i]->valid || code[i]->key != key)
+            {
+                code[i]->unit = emit(inlining[i]->output());
+                code[i]->key = key;
+                code[i]->valid = true;
+            }
+            units.push_back(&code[i]->unit);
+        }
+        return Generator::link(units, m_opt_level, m_emit_asm);
+    }
+
+    [[nodiscard]] inline const SessionStats& stats() const
+    {
+        return m_stats;
+    }
+
+private:
+    static inline uint64_t hash_bytes(std::string_view text, uint64_t hash = 14695981039346656037ull) // FNV-1a
+    {
+        for(unsigned char c : text)
+        {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    static inline uint64_t hash_string_var(SymbolId sym, const Symbol& var)
+    {
+        return hash_bytes(var.label, (static_cast<uint64_t>(sym) << 32 | var.len) * 0x9e3779b97f4a7c15ull);
+    }
+
+    // Re-lexes the edited region of source and replaces the chunks it covers.
+    inline void update_chunks(std::string_view source)
+    {
+        const std::string_view old = m_source;
+        if(m_chunks.empty())
+        {
+            replace_chunks(source, 0, 0, 0, source.size());
+            return;
+        }
+
+        const size_t common = std::min(old.size(), source.size());
+        const size_t prefix = static_cast<size_t>(std::mismatch(old.begin(), old.begin() + common, source.begin()).first - old.begin());
+        size_t suffix = 0;
+        while(suffix < common - prefix && old[old.size() - 1 - suffix] == source[source.size() - 1 - suffix])
+        {
+            suffix++;
+        }
+        if(prefix == old.size() && old.size() == source.size())
+        {
+            return; // nothing changed
+        }
+
+        std::vector<size_t> ends(m_chunks.size());
+        for(size_t i = 0, at = 0; i < m_chunks.size(); i++)
+        {
+            at += m_chunks[i]->text.size();
+            ends[i] = at;
+        }
+        auto chunk_at = [&](size_t offset){ // chunk holding byte offset of the old text
+            return std::min(static_cast<size_t>(std::upper_bound(ends.begin(), ends.end(), offset) - ends.begin()), m_chunks.size() - 1);
+        };
+
+        // the chunks around the edit, widened by one where the edit touches a boundary
+        // (a token on the other side could merge with the new text)
+        const size_t edit_end = old.size() - suffix;
+        size_t first = chunk_at(prefix);
+        if(first > 0 && ends[first - 1] == prefix)
+        {
+            first--;
+        }
+        size_t last = std::max(first, edit_end > prefix ? chunk_at(edit_end - 1) : chunk_at(prefix));
+        if(last + 1 < m_chunks.size() && ends[last] == edit_end)
+        {
+            last++;
+        }
+
+        const size_t region_begin = first == 0 ? 0 : ends[first - 1];
+        const size_t region_end = ends[last] + source.size() - old.size();
+        replace_chunks(source, first, last + 1, region_begin, region_end);
+    }
+
+    // Splits source[region_begin, region_end) into chunks, standing in for old
+    // chunks [first, last). When the region can't be split on its own (unbalanced
+    // braces, or a comment or string running off its end) it grows to the end of
+    // the file, and if even that fails it becomes one statement-run chunk whose
+    // parse reports what is wrong.
+    inline void replace_chunks(std::string_view source, size_t first, size_t last, size_t region_begin, size_t region_end)
+    {
+        std::vector<std::pair<size_t, bool>> cuts; // (begin, is_function), relative to region_begin
+        while(!split(source.substr(region_begin, region_end - region_begin), region_end == source.size(), cuts))
+        {
+            if(region_end == source.size())
+            {
+                cuts.assign({{0, false}}); // braces never balance, parsing it says where
+                break;
+            }
+            region_end = source.size();
+            last = m_chunks.size();
+        }
+        m_stats.relexed_bytes = region_end - region_begin;
+
+        std::unordered_multimap<uint64_t, std::unique_ptr<Chunk>> reusable;
+        for(size_t i = first; i < last; i++)
+        {
+            reusable.emplace(m_chunks[i]->hash, std::move(m_chunks[i]));
+        }
+        std::vector<std::unique_ptr<Chunk>> fresh;
+        for(size_t c = 0; c < cuts.size(); c++)
+        {
+            const size_t begin = region_begin + cuts[c].first;
+            const size_t end = c + 1 < cuts.size() ? region_begin + cuts[c + 1].first : region_end;
+            const std::string_view text = source.substr(begin, end - begin);
+            const bool is_function = cuts[c].second;
+            const uint64_t hash = hash_bytes(text, is_function ? 1 : 2);
+
+            std::unique_ptr<Chunk> chunk;
+            auto [match, match_end] = reusable.equal_range(hash);
+            for(; match != match_end; ++match)
+            {
+                if(match->second->is_function == is_function && match->second->text == text)
+                {
+                    chunk = std::move(match->second);
+                    reusable.erase(match);
+                    break;
+                }
+            }
+            if(!chunk)
+            {
+                chunk = build(text, is_function, hash);
+            }
+            fresh.push_back(std::move(chunk));
+        }
+        m_chunks.erase(m_chunks.begin() + static_cast<std::ptrdiff_t>(first), m_chunks.begin() + static_cast<std::ptrdiff_t>(last));
+        m_chunks.insert(m_chunks.begin() + static_cast<std::ptrdiff_t>(first), std::make_move_iterator(fresh.begin()), std::make_move_iterator(fresh.end()));
+    }
+
+    // Chunk starts in region, false if it can't be split without the text after it
+    // (at_eof: there is none, so a comment or string running off the end is fine).
+    inline bool split(std::string_view region, bool at_eof, std::vector<std::pair<size_t, bool>>& cuts)
+    {
+        cuts.clear();
+        LineIndex lines(region);
+        Diagnostics diags(lines);
+        Tokenizer tokenizer(lines, m_interner, diags);
+        TokenStream tokens = tokenizer.tokenize();
+        if(!at_eof && (!diags.empty() || tokenizer.ended_in_comment()))
+        {
+            return false;
+        }
+        std::vector<TopLevelSpan> spans = top_level_spans(tokens);
+        if(spans.empty() && tokens.size() > 0)
+        {
+            return false;
+        }
+        if(spans.empty())
+        {
+            if(!region.empty())
+            {
+                cuts.emplace_back(0, false); // whitespace and comments only
+            }
+            return true;
+        }
+        auto offset = [&](size_t token){
+            return static_cast<size_t>(tokens[token].value.data() - region.data());
+        };
+        for(size_t s = 0; s < spans.size(); s++)
+        {
+            // a function starts at its first token, a run right after the '}' before it,
+            // so whitespace and comments between two functions go with the first one
+            const size_t begin = s == 0 ? 0 : spans[s].is_function ? offset(spans[s].begin) : offset(spans[s - 1].end - 1) + 1;
+            cuts.emplace_back(begin, spans[s].is_function);
+        }
+        return true;
+    }
+
+    inline std::unique_ptr<Chunk> build(std::string_view text, bool is_function, uint64_t hash)
+    {
+        m_stats.rebuilt_chunks++;
+        auto chunk = std::make_unique<Chunk>(text, is_function, hash);
+        Diagnostics diags(chunk->lines);
+        Tokenizer tokenizer(chunk->lines, m_interner, diags);
+        chunk->tokens = tokenizer.tokenize();
+        chunk->prog = Parser(chunk->tokens, chunk->lines, diags).parse_prog().value();
+        chunk->front_diags = diags.entries();
+        chunk->front_count = diags.count();
+        return chunk;
+    }
+
+    // A function chunk's unit, lowered and optimized function by function.
+    inline void lower_function(Chunk& chunk, const StringVars& env, uint64_t env_hash)
+    {
+        Diagnostics diags(chunk.lines);
+        Generator generator(chunk.prog, m_interner, diags, m_opt_level);
+        generator.set_string_vars(env);
+        chunk.ir = {};
+        for(NodeIndex stmt : chunk.prog.stmts) // one func_def, or none if it didn't parse
+        {
+            if(chunk.prog[stmt].tag == NodeTag::func_def)
+            {
+                chunk.ir = generator.lower_function(stmt);
+            }
+        }
+        prepare(chunk.ir, chunk.inlining);
+        chunk.declared.clear();
+        for(const auto& [sym, var] : generator.string_vars())
+        {
+            if(!env.contains(sym))
+            {
+                chunk.declared.emplace_back(sym, var);
+            }
+        }
+        chunk.gen_diags = diags.entries();
+        chunk.gen_count = diags.count();
+        chunk.functions = generator.functions();
+        chunk.gen_env = env_hash;
+        chunk.generated = true;
+    }
+
+    // A syntax error anywhere: the file is parsed and lowered again as one piece, as
+    // a one-shot compile does, since recovering from an error can skip past the end
+    // of its chunk (a '{' ... '}' block after it is skipped whole, even a function's).
+    // Nothing is linked, so no cache is touched.
+    inline void check_whole(std::string_view source, Diagnostics& diags)
+    {
+        LineIndex lines(source);
+        Tokenizer tokenizer(lines, m_interner, diags);
+        const TokenStream tokens = tokenizer.tokenize();
+        const NodeProgram prog = Parser(tokens, lines, diags).parse_prog().value();
+        (void)Lowering(prog, m_interner, diags).lower_program();
+    }
+
+    inline void lower_start(std::string_view source, const std::vector<size_t>& begins, const StringVars& env)
+    {
+        NodeProgram runs;
+        for(size_t i = 0; i < m_chunks.size(); i++)
+        {
+            if(!m_chunks[i]->is_function)
+            {
+                runs.append(m_chunks[i]->prog, static_cast<uint32_t>(begins[i]));
+            }
+        }
+        LineIndex lines(source);
+        Diagnostics diags(lines);
+        Generator generator(runs, m_interner, diags, m_opt_level);
+        generator.set_string_vars(env);
+        m_start_ir = generator.lower_start(runs.stmts); // its strings point into the chunks' text, not into runs
+        prepare(m_start_ir, m_start_inlining);
+        m_start_diags = diags.entries();
+        m_start_count = diags.count();
+        // per run and relative to it, unlike the diagnostics, since _start is reused wherever the runs move
+        m_start_functions.clear();
+        std::vector<size_t> run_begins;
+        for(size_t i = 0; i < m_chunks.size(); i++)
+        {
+            if(!m_chunks[i]->is_function)
+            {
+                run_begins.push_back(begins[i]);
+                m_start_functions.emplace_back();
+            }
+        }
+        auto run_of = [&](size_t at){
+            return static_cast<size_t>(std::upper_bound(run_begins.begin(), run_begins.end(), at) - run_begins.begin()) - 1;
+        };
+        for(const auto& [sym, at] : generator.functions().defined)
+        {
+            const size_t run = run_of(at);
+            m_start_functions[run].defined.emplace_back(sym, at - run_begins[run]);
+        }
+        for(const auto& [sym, at] : generator.functions().called)
+        {
+            const size_t run = run_of(at);
+            m_start_functions[run].called.emplace_back(sym, at - run_begins[run]);
+        }
+    }
+
+    // what optimize() does to a unit before inlining, and a new version of it for the inliner
+    inline void prepare(IrUnit& unit, InlineUnit& inlining)
+    {
+        if(m_opt_level >= 1)
+        {
+            for(IrFunction& func : unit.functions)
+            {
+                optimize_function(func);
+            }
+        }
+        inlining.source = &unit;
+        inlining.version = ++m_versions;
+    }
+
+    // what a unit's code is made from: its IR, and at -O1 the callees that could be inlined into it
+    [[nodiscard]] inline uint64_t code_key(const InlineUnit& unit) const
+    {
+        return m_opt_level >= 1 ? unit.key : unit.version;
+    }
+
+    // Emitting reports nothing, so the generator doing it needs no program of its own.
+    inline AsmUnit emit(const IrUnit& unit)
+    {
+        m_stats.generated_units++;
+        const NodeProgram none;
+        const LineIndex lines({});
+        Diagnostics diags(lines);
+        return Generator(none, m_interner, diags, m_opt_level).emit_unit(unit);
+    }
+
+    Interner m_interner;
+    int m_opt_level;
+    bool m_emit_asm; // print the NASM text along with the executable
+    std::string m_source; // the previous version, to find what an edit changed
+    std::vector<std::unique_ptr<Chunk>> m_chunks; // in file order, together exactly m_source
+    IrUnit m_start_ir;
+    InlineUnit m_start_inlining;
+    CachedCode m_start_code;
+    uint64_t m_versions = 0; // of lowered units, never reused
+    std::vector<Diagnostic> m_start_diags;
+    size_t m_start_count = 0;
+    std::vector<FunctionRefs> m_start_functions; // one per statement run
+    uint64_t m_start_key = 0;
+    uint64_t m_start_layout = 0;
+    bool m_start_valid = false;
+    SessionStats m_stats;
+};
@@ -0,0 +1,425 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "ir.hpp"
+
+// Calls visit(component) for each strongly connected component of a graph of
+// n nodes, a component only after every component it has edges into
+// (Tarjan's algorithm, without recursion: call chains can be as deep as the
+// program is long).
+template<typename Visit>
+inline void for_each_component(uint32_t n, const std::vector<std::vector<uint32_t>>& edges, Visit&& visit)
+{
+    std::vector<uint32_t> index(n, no_id);
+    std::vector<uint32_t> low(n, 0);
+    std::vector<uint8_t> on_stack(n, 0);
+    std::vector<uint32_t> stack;
+    std::vector<std::pair<uint32_t, size_t>> walk; // node, edges looked at
+    std::vector<uint32_t> component;
+    uint32_t next = 0;
+    auto enter = [&](uint32_t v){
+        index[v] = low[v] = next++;
+        stack.push_back(v);
+        on_stack[v] = 1;
+        walk.emplace_back(v, 0);
+    };
+    for(uint32_t root = 0; root < n; root++)
+    {
+        if(index[root] != no_id) continue;
+        enter(root);
+        while(!walk.empty())
+        {
+            const uint32_t v = walk.back().first;
+            if(walk.back().second < edges[v].size())
+            {
+                const uint32_t w = edges[v][walk.back().second++];
+                if(index[w] == no_id)
+                {
+                    enter(w);
+                }
+                else if(on_stack[w])
+                {
+                    low[v] = std::min(low[v], index[w]);
+                }
+                continue;
+            }
+            walk.pop_back();
+            if(!walk.empty())
+            {
+                low[walk.back().first] = std::min(low[walk.back().first], low[v]);
+            }
+            if(low[v] != index[v]) continue;
+            component.clear();
+            do
+            {
+                component.push_back(stack.back());
+                on_stack[stack.back()] = 0;
+                stack.pop_back();
+            } while(component.back() != v);
+            visit(component);
+        }
+    }
+}
+
+// A unit as the inliner sees it: its functions optimized one by one, and what
+// they become with calls inlined. --session keeps one per unit between
+// compiles, and a unit is only redone when its key changes.
+struct InlineUnit {
+    const IrUnit* source = nullptr; // left as it is
+    uint64_t version = 0; // changes whenever source does
+    bool valid = false; // the rest is for key
+    uint64_t key = 0; // of version and of the callees that could be inlined into it
+    bool inlined = false; // whether result holds anything, otherwise source is all there is
+    IrUnit result {};
+    std::vector<uint32_t> cost {}; // per function, see Inliner
+    std::vector<uint8_t> recursive {}; // per function, calls itself through functions of this unit
+    std::vector<SymbolId> calls {}; // what source calls, each once
+    uint64_t calls_version = UINT64_MAX;
+
+    [[nodiscard]] inline const IrUnit& output() const
+    {
+        return inlined ? result : *source;
+    }
+};
+
+// Inlines small functions into their callers. Units are visited callees
+// first, one strongly connected component of the call graph between them at a
+// time, and inside a unit its functions the same way, so a callee has had its
+// own calls inlined and been cleaned up before anyone measures or copies it:
+// calls nested several levels deep flatten out like that. Recursive functions
+// are never inlined, though calls inside them can be; neither are the ones in
+// units that call each other round in a circle, which would leave no order
+// to do them in.
+//
+// The cost of a function is what it would cost to copy: its instructions, not
+// counting parameters and constants, which become registers and immediates.
+// Anything up to always_cost goes in everywhere, it's no bigger than the call
+// sequence it replaces; bigger ones, up to max_cost, while the caller stays
+// under max_caller_cost.
+class Inliner {
+public:
+    static constexpr uint32_t always_cost = 12;
+    static constexpr uint32_t max_cost = 40;
+    static constexpr uint32_t max_caller_cost = 2000;
+
+    // cleanup runs on each function calls were inlined into, before its own
+    // cost is taken (the usual passes, see optimize())
+    inline Inliner(std::vector<InlineUnit*> units, void (*cleanup)(IrFunction&)) : m_units(std::move(units)), m_cleanup(cleanup)
+    {}
+
+    inline void run()
+    {
+        const uint32_t n = static_cast<uint32_t>(m_units.size());
+        for(uint32_t u = 0; u < n; u++)
+        {
+            InlineUnit& unit = *m_units[u];
+            const std::vector<IrFunction>& functions = unit.source->functions;
+            for(uint32_t f = 0; f < functions.size(); f++)
+            {
+                const SymbolId symbol = functions[f].symbol;
+                if(symbol == no_id) continue;
+                if(symbol >= m_by_symbol.size()) m_by_symbol.resize(symbol + 1, {no_id, no_id});
+                // defined twice is an error check_functions() reports, leave those calls alone
+                FuncRef& ref = m_by_symbol[symbol];
+                ref = ref.index == no_id ? FuncRef {u, f} : FuncRef {no_id, 0};
+            }
+            if(unit.calls_version != unit.version)
+            {
+                unit.calls.clear();
+                for(const IrFunction& func : functions)
+                {
+                    for(const IrBlock& block : func.blocks)
+                    {
+                        for(ValueId id : block.insts)
+                        {
+                            if(func.insts[id].op == IrOp::call) unit.calls.push_back(static_cast<SymbolId>(func.insts[id].imm));
+                        }
+                    }
+                }
+                std::sort(unit.calls.begin(), unit.calls.end());
+                unit.calls.erase(std::unique(unit.calls.begin(), unit.calls.end()), unit.calls.end());
+                unit.calls_version = unit.version;
+            }
+        }
+
+        std::vector<std::vector<uint32_t>> callees(n);
+        for(uint32_t u = 0; u < n; u++)
+        {
+            for(SymbolId symbol : m_units[u]->calls)
+            {
+                const FuncRef callee = lookup(symbol);
+                if(callee.unit != no_id && callee.unit != u) callees[u].push_back(callee.unit);
+            }
+        }
+        m_component.assign(n, no_id);
+        m_shared.assign(n, 0);
+        uint32_t components = 0;
+        for_each_component(n, callees, [&](const std::vector<uint32_t>& component){
+            for(uint32_t u : component)
+            {
+                m_component[u] = components;
+                m_shared[u] = component.size() > 1;
+            }
+            components++;
+            for(uint32_t u : component)
+            {
+                visit(u);
+            }
+        });
+    }
+
+private:
+    struct FuncRef {
+        uint32_t unit;
+        uint32_t index; // in the unit's functions
+    };
+
+    [[nodiscard]] inline FuncRef lookup(SymbolId symbol) const
+    {
+        return symbol < m_by_symbol.size() ? m_by_symbol[symbol] : FuncRef {no_id, no_id};
+    }
+
+    [[nodiscard]] inline const IrFunction& function(FuncRef ref) const
+    {
+        return m_units[ref.unit]->output().functions[ref.index];
+    }
+
+    [[nodiscard]] inline bool inlinable(FuncRef ref) const
+    {
+        const InlineUnit& unit = *m_units[ref.unit];
+        return !m_shared[ref.unit] && !unit.recursive[ref.index] && unit.cost[ref.index] <= max_cost
+            && function(ref).blocks[0].preds.empty();
+    }
+
+    static inline uint64_t mix(uint64_t hash, uint64_t value)
+    {
+        return (hash ^ (value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2))) * 1099511628211ull;
+    }
+
+    static inline uint32_t cost(const IrFunction& func)
+    {
+        uint32_t total = 0;
+        for(const IrBlock& block : func.blocks)
+        {
+            for(ValueId id : block.insts)
+            {
+                const IrOp op = func.insts[id].op;
+                total += op != IrOp::param && op != IrOp::constant;
+            }
+        }
+        return total;
+    }
+
+    // Does unit u, unless it's up to date already: what could be inlined into
+    // it is all done by now, the callees in other components at least.
+    inline void visit(uint32_t u)
+    {
+        InlineUnit& unit = *m_units[u];
+        uint64_t key = mix(unit.version, m_shared[u]);
+        for(SymbolId symbol : unit.calls)
+        {
+            const FuncRef callee = lookup(symbol);
+            if(callee.unit == u) continue;
+            key = mix(key, symbol);
+            if(callee.unit == no_id) key = mix(key, 1);
+            else if(m_component[callee.unit] == m_component[u] || !inlinable(callee)) key = mix(key, 2);
+            else key = mix(key, m_units[callee.unit]->key);
+        }
+        if(unit.valid && unit.key == key)
+        {
+            return;
+        }
+        unit.valid = true;
+        unit.key = key;
+        unit.inlined = false;
+        unit.result = {};
+        m_labels.clear();
+
+        const std::vector<IrFunction>& functions = unit.source->functions;
+        const uint32_t n = static_cast<uint32_t>(functions.size());
+        unit.cost.assign(n, UINT32_MAX);
+        unit.recursive.assign(n, 0);
+        std::vector<std::vector<uint32_t>> callees(n);
+        for(uint32_t f = 0; f < n; f++)
+        {
+            for(const IrBlock& block : functions[f].blocks)
+            {
+                for(ValueId id : block.insts)
+                {
+                    const IrInst& inst = functions[f].insts[id];
+                    const FuncRef callee = inst.op == IrOp::call ? lookup(static_cast<SymbolId>(inst.imm)) : FuncRef {no_id, no_id};
+                    if(callee.unit == u) callees[f].push_back(callee.index);
+                }
+            }
+        }
+        for_each_component(n, callees, [&](const std::vector<uint32_t>& component){
+            for(uint32_t f : component)
+            {
+                unit.recursive[f] = component.size() > 1 || std::find(callees[f].begin(), callees[f].end(), f) != callees[f].end();
+            }
+            for(uint32_t f : component)
+            {
+                inline_into(u, f);
+                unit.cost[f] = cost(unit.output().functions[f]);
+            }
+        });
+    }
+
+    // Inlines the calls in function f of unit u that are worth it. A call
+    // splits its block, so the loop simply goes on with the block holding the rest.
+    inline void inline_into(uint32_t u, uint32_t f)
+    {
+        InlineUnit& unit = *m_units[u];
+        uint32_t size = cost(unit.output().functions[f]);
+        std::vector<ValueId> forward;
+        for(BlockId b = 0; b < unit.output().functions[f].blocks.size(); b++)
+        {
+            for(size_t i = 0; i < unit.output().functions[f].blocks[b].insts.size(); i++)
+            {
+                const IrFunction& func = unit.output().functions[f];
+                const IrInst& inst = func.insts[func.blocks[b].insts[i]];
+                const FuncRef callee = inst.op == IrOp::call ? lookup(static_cast<SymbolId>(inst.imm)) : FuncRef {no_id, no_id};
+                if(callee.unit == no_id || (callee.unit != u && m_component[callee.unit] == m_component[u]) || !inlinable(callee))
+                {
+                    continue;
+                }
+                const uint32_t callee_cost = m_units[callee.unit]->cost[callee.index];
+                if(inst.args.size() != function(callee).param_count || (callee_cost > always_cost && size + callee_cost > max_caller_cost))
+                {
+                    continue;
+                }
+                if(!unit.inlined)
+                {
+                    unit.result = *unit.source;
+                    unit.inlined = true;
+                }
+                splice(u, f, b, i, callee, forward);
+                size += callee_cost;
+                break;
+            }
+        }
+        if(forward.empty())
+        {
+            return;
+        }
+        IrFunction& func = unit.result.functions[f];
+        func.substitute(forward);
+        m_cleanup(func);
+    }
+
+    // Replaces the call at blocks[b].insts[i] with a copy of the callee's
+    // blocks: the call's block jumps to the copy's entry, its returns jump to
+    // a new block holding what came after the call, and a phi there (or the
+    // one value returned) stands for the call's result from then on.
+    inline void splice(uint32_t u, uint32_t f, BlockId b, size_t i, FuncRef ref, std::vector<ValueId>& forward)
+    {
+        IrFunction& func = m_units[u]->result.functions[f];
+        const IrFunction& callee = function(ref);
+        const ValueId call = func.blocks[b].insts[i];
+        const std::vector<ValueId> args = func.insts[call].args;
+
+        const BlockId rest = static_cast<BlockId>(func.blocks.size());
+        func.blocks.emplace_back();
+        func.blocks[rest].insts.assign(func.blocks[b].insts.begin() + static_cast<std::ptrdiff_t>(i) + 1, func.blocks[b].insts.end());
+        func.blocks[b].insts.resize(i);
+        for(BlockId succ : func.succs(rest))
+        {
+            for(BlockId& pred : func.blocks[succ].preds)
+            {
+                if(pred == b) pred = rest;
+            }
+        }
+
+        // every callee value gets its copy first, so phis can refer forward
+        std::vector<ValueId> value(callee.insts.size(), no_id);
+        for(const IrBlock& block : callee.blocks)
+        {
+            for(ValueId id : block.insts)
+            {
+                const IrInst& inst = callee.insts[id];
+                value[id] = inst.op == IrOp::param ? args[static_cast<size_t>(inst.imm)] : func.add(inst);
+            }
+        }
+        const BlockId base = static_cast<BlockId>(func.blocks.size());
+        func.blocks.resize(base + callee.blocks.size());
+        std::vector<ValueId> returned;
+        for(BlockId cb = 0; cb < callee.blocks.size(); cb++)
+        {
+            IrBlock& copy = func.blocks[base + cb];
+            for(BlockId pred : callee.blocks[cb].preds) copy.preds.push_back(base + pred);
+            for(ValueId id : callee.blocks[cb].insts)
+            {
+                if(callee.insts[id].op == IrOp::param) continue;
+                IrInst& inst = func.insts[value[id]];
+                for_each_operand(inst, [&](ValueId& v){ v = value[v]; });
+                for(BlockId& target : inst.target)
+                {
+                    if(target != no_id) target += base;
+                }
+                if(inst.op == IrOp::print_str)
+                {
+                    inst.imm = string_index(u, ref.unit, static_cast<uint32_t>(inst.imm));
+                }
+                if(inst.op == IrOp::ret)
+                {
+                    returned.push_back(inst.a);
+                    inst = {.op=IrOp::jmp, .target={rest, no_id}};
+                    func.blocks[rest].preds.push_back(base + cb);
+                }
+                copy.insts.push_back(value[id]);
+            }
+        }
+        func.blocks[base].preds.push_back(b);
+        func.blocks[b].insts.push_back(func.add({.op=IrOp::jmp, .target={base, no_id}}));
+
+        ValueId result = returned.empty() ? no_id : returned.front();
+        if(returned.size() > 1)
+        {
+            result = func.add({.op=IrOp::phi, .args=std::move(returned)});
+            func.blocks[rest].insts.insert(func.blocks[rest].insts.begin(), result);
+        }
+        else if(returned.empty())
+        {
+            // the callee never returns, so neither does anything after the call
+            result = func.add({.op=IrOp::constant, .imm=0});
+            func.blocks[rest].insts.insert(func.blocks[rest].insts.begin(), result);
+        }
+
+        for(ValueId v = static_cast<ValueId>(forward.size()); v < func.insts.size(); v++) forward.push_back(v);
+        forward[call] = result;
+    }
+
+    // the index in unit into's strings of string index of unit from; another
+    // unit's literal becomes an extern there, its label is global
+    inline int64_t string_index(uint32_t into, uint32_t from, uint32_t index)
+    {
+        if(into == from)
+        {
+            return index;
+        }
+        IrUnit& unit = m_units[into]->result;
+        const IrString& str = m_units[from]->output().strings[index];
+        if(m_labels.empty())
+        {
+            for(uint32_t s = 0; s < unit.strings.size(); s++) m_labels.emplace(unit.strings[s].label, s);
+        }
+        auto [it, fresh] = m_labels.emplace(str.label, static_cast<uint32_t>(unit.strings.size()));
+        if(fresh)
+        {
+            unit.strings.push_back({.label=str.label, .len=str.len});
+        }
+        return it->second;
+    }
+
+    std::vector<InlineUnit*> m_units;
+    void (*m_cleanup)(IrFunction&);
+    std::vector<FuncRef> m_by_symbol {}; // per symbol, the function calls to it go to: {no_id, no_id} if none, {no_id, 0} if several
+    std::vector<uint32_t> m_component {}; // per unit, its component of the call graph
+    std::vector<uint8_t> m_shared {}; // per unit, in a component with others
+    std::unordered_map<std::string, uint32_t> m_labels {}; // label -> index in the strings of the unit being done
+};
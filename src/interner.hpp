@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include "types.hpp"
+
+// Maps every distinct identifier to a dense SymbolId, handed out in order of
+// first appearance. Names are views into the mapped source so nothing is
+// copied, unless own_names is set for an interner that outlives the text it
+// saw (the --session compiler). Open addressing with linear probing, kept at
+// most half full.
+class Interner {
+public:
+    inline explicit Interner(bool own_names = false) : m_slots(initial_slots, empty_slot), m_own_names(own_names)
+    {}
+
+    inline Interner(const Interner&) = delete;
+    inline Interner& operator=(const Interner&) = delete;
+
+    inline SymbolId intern(std::string_view name)
+    {
+        const uint64_t hash = hash_name(name);
+        size_t slot = hash & (m_slots.size() - 1);
+        while(m_slots[slot] != empty_slot)
+        {
+            const SymbolId id = m_slots[slot];
+            if(m_hashes[id] == hash && m_names[id] == name)
+            {
+                return id;
+            }
+            slot = (slot + 1) & (m_slots.size() - 1);
+        }
+
+        const SymbolId id = static_cast<SymbolId>(m_names.size());
+        if(m_own_names)
+        {
+            name = m_storage.emplace_back(name); // deque elements never move, so the view stays valid
+        }
+        m_names.push_back(name);
+        m_hashes.push_back(hash);
+        m_slots[slot] = id;
+        if(m_names.size() * 2 > m_slots.size())
+        {
+            grow();
+        }
+        return id;
+    }
+
+    [[nodiscard]] inline std::string_view name(SymbolId id) const
+    {
+        return m_names[id];
+    }
+
+    // number of symbols, ids are 0 .. size()-1 so they can index plain vectors
+    [[nodiscard]] inline size_t size() const
+    {
+        return m_names.size();
+    }
+
+private:
+    static constexpr size_t initial_slots = 1024;
+    static constexpr SymbolId empty_slot = UINT32_MAX;
+
+    static inline uint64_t hash_name(std::string_view name) // FNV-1a
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for(unsigned char c : name)
+        {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    inline void grow()
+    {
+        std::vector<SymbolId> slots(m_slots.size() * 2, empty_slot);
+        for(SymbolId id = 0; id < m_names.size(); id++)
+        {
+            size_t slot = m_hashes[id] & (slots.size() - 1);
+            while(slots[slot] != empty_slot)
+            {
+                slot = (slot + 1) & (slots.size() - 1);
+            }
+            slots[slot] = id;
+        }
+        m_slots = std::move(slots);
+    }
+
+    std::vector<SymbolId> m_slots;
+    std::vector<std::string_view> m_names;
+    std::vector<uint64_t> m_hashes; // kept so probing and growing never rehash a name
+    bool m_own_names;
+    std::deque<std::string> m_storage; // owned copies of the names, own_names only
+};
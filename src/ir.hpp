@@ -0,0 +1,515 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "types.hpp"
+#include "interner.hpp"
+
+// Linear IR between the AST and the x86 emitter. A function is a list of basic
+// blocks; control only enters a block at its top and every block ends in exactly
+// one terminator (jmp, br, ret or exit). Values are in SSA form: an instruction
+// that produces one defines it exactly once, and the phis at the top of a block
+// pick their incoming value by predecessor, in the order of IrBlock::preds.
+using ValueId = uint32_t; // index into IrFunction::insts
+using BlockId = uint32_t; // index into IrFunction::blocks
+inline constexpr uint32_t no_id = UINT32_MAX;
+
+enum class IrOp : uint8_t {
+    constant, // imm
+    param, // imm  parameter index
+    bin, // a bin b, comparisons give 0 or 1
+    call, // imm  callee symbol, args  arguments
+    phi, // args  one per predecessor
+    print_int, // a, followed by a newline
+    print_str, // imm  index into IrUnit::strings
+    newline,
+    // terminators
+    jmp, // target[0]
+    br, // a  condition, target[0] when it's nonzero, target[1] otherwise
+    ret, // a
+    exit, // a  exit status, ends the program
+};
+
+[[nodiscard]] inline bool is_terminator(IrOp op)
+{
+    return op == IrOp::jmp || op == IrOp::br || op == IrOp::ret || op == IrOp::exit;
+}
+
+[[nodiscard]] inline bool has_value(IrOp op)
+{
+    return op == IrOp::constant || op == IrOp::param || op == IrOp::bin || op == IrOp::call || op == IrOp::phi;
+}
+
+[[nodiscard]] inline bool is_compare(BinOp op)
+{
+    return op != BinOp::add && op != BinOp::sub && op != BinOp::mul && op != BinOp::div;
+}
+
+struct IrInst {
+    IrOp op;
+    BinOp bin {}; // bin only
+    ValueId a = no_id;
+    ValueId b = no_id;
+    BlockId target[2] = {no_id, no_id};
+    int64_t imm = 0;
+    std::vector<ValueId> args {}; // call, phi
+};
+
+// every value operand of inst, by reference
+template<typename Inst, typename Fn>
+inline void for_each_operand(Inst& inst, Fn&& fn)
+{
+    if(inst.a != no_id) fn(inst.a);
+    if(inst.b != no_id) fn(inst.b);
+    for(auto& arg : inst.args) fn(arg);
+}
+
+struct IrBlock {
+    std::vector<ValueId> insts; // phis first, the terminator last
+    std::vector<BlockId> preds;
+};
+
+struct IrFunction {
+    std::string name; // its label: func_<name>, or _start
+    SymbolId symbol = no_id; // the name calls to it use, no_id for _start
+    uint32_t param_count = 0;
+    std::vector<IrBlock> blocks; // blocks[0] is the entry
+    std::vector<IrInst> insts; // every instruction ever made; blocks list the live ones
+
+    inline ValueId add(IrInst inst)
+    {
+        insts.push_back(std::move(inst));
+        return static_cast<ValueId>(insts.size() - 1);
+    }
+
+    [[nodiscard]] inline const IrInst& terminator(BlockId block) const
+    {
+        return insts[blocks[block].insts.back()];
+    }
+
+    // a division that could trap at run time: by zero, or INT64_MIN by -1
+    [[nodiscard]] inline bool may_fault(const IrInst& inst) const
+    {
+        if(inst.op != IrOp::bin || inst.bin != BinOp::div) return false;
+        const IrInst& divisor = insts[inst.b];
+        return divisor.op != IrOp::constant || divisor.imm == 0 || divisor.imm == -1;
+    }
+
+    // Per block, the comparison its br decides on when the two can be fused:
+    // the same block computes it and nothing but the br uses it. The emitter
+    // then compares right at the branch and jumps on the flags, and the
+    // allocator keeps the operands alive up to there instead of the 0 or 1.
+    // no_id otherwise. Both read the same result, see Allocation::fused.
+    [[nodiscard]] inline std::vector<ValueId> branch_compares() const
+    {
+        std::vector<uint32_t> uses(insts.size(), 0);
+        for(const IrBlock& block : blocks)
+        {
+            for(ValueId id : block.insts)
+            {
+                for_each_operand(insts[id], [&](ValueId v){ uses[v]++; });
+            }
+        }
+        std::vector<ValueId> fused(blocks.size(), no_id);
+        for(BlockId b = 0; b < blocks.size(); b++)
+        {
+            const IrInst& term = terminator(b);
+            if(term.op != IrOp::br || uses[term.a] != 1 || insts[term.a].op != IrOp::bin || !is_compare(insts[term.a].bin))
+            {
+                continue;
+            }
+            const std::vector<ValueId>& list = blocks[b].insts;
+            fused[b] = std::find(list.begin(), list.end(), term.a) != list.end() ? term.a : no_id;
+        }
+        return fused;
+    }
+
+    [[nodiscard]] inline std::span<const BlockId> succs(BlockId block) const
+    {
+        const IrInst& term = terminator(block);
+        switch(term.op)
+        {
+            case IrOp::jmp: return {term.target, 1};
+            case IrOp::br: return {term.target, 2};
+            default: return {};
+        }
+    }
+
+    // index of pred in block's predecessor list, i.e. which phi argument comes from it
+    [[nodiscard]] inline size_t pred_index(BlockId block, BlockId pred) const
+    {
+        const std::vector<BlockId>& preds = blocks[block].preds;
+        size_t i = 0;
+        while(preds[i] != pred) i++;
+        return i;
+    }
+
+    // The edge pred -> block is gone: forgets the predecessor and its phi arguments.
+    inline void remove_pred(BlockId block, BlockId pred)
+    {
+        IrBlock& target = blocks[block];
+        const size_t index = pred_index(block, pred);
+        target.preds.erase(target.preds.begin() + static_cast<std::ptrdiff_t>(index));
+        for(ValueId id : target.insts)
+        {
+            if(insts[id].op != IrOp::phi)
+            {
+                break;
+            }
+            insts[id].args.erase(insts[id].args.begin() + static_cast<std::ptrdiff_t>(index));
+        }
+    }
+
+    // Drops blocks that can't be reached from the entry, with the phi arguments
+    // that came from them. The rest keep their relative order.
+    inline void remove_unreachable()
+    {
+        std::vector<BlockId> remap(blocks.size(), no_id);
+        std::vector<BlockId> work {0};
+        remap[0] = 0;
+        while(!work.empty())
+        {
+            BlockId block = work.back();
+            work.pop_back();
+            for(BlockId succ : succs(block))
+            {
+                if(remap[succ] == no_id)
+                {
+                    remap[succ] = 0;
+                    work.push_back(succ);
+                }
+            }
+        }
+        BlockId kept = 0;
+        for(BlockId& id : remap)
+        {
+            if(id != no_id) id = kept++;
+        }
+        if(kept == blocks.size())
+        {
+            return;
+        }
+
+        std::vector<IrBlock> live;
+        live.reserve(kept);
+        for(BlockId b = 0; b < blocks.size(); b++)
+        {
+            if(remap[b] == no_id)
+            {
+                continue;
+            }
+            IrBlock& block = blocks[b];
+            std::vector<BlockId> preds;
+            for(size_t i = 0; i < block.preds.size(); i++)
+            {
+                if(remap[block.preds[i]] != no_id)
+                {
+                    preds.push_back(remap[block.preds[i]]);
+                }
+            }
+            if(preds.size() != block.preds.size())
+            {
+                for(ValueId id : block.insts)
+                {
+                    IrInst& inst = insts[id];
+                    if(inst.op != IrOp::phi)
+                    {
+                        break;
+                    }
+                    size_t out = 0;
+                    for(size_t i = 0; i < block.preds.size(); i++)
+                    {
+                        if(remap[block.preds[i]] != no_id) inst.args[out++] = inst.args[i];
+                    }
+                    inst.args.resize(out);
+                }
+            }
+            block.preds = std::move(preds);
+            IrInst& term = insts[block.insts.back()];
+            for(BlockId& target : term.target)
+            {
+                if(target != no_id) target = remap[target];
+            }
+            live.push_back(std::move(block));
+        }
+        blocks = std::move(live);
+    }
+
+    // Lays the (reachable) blocks out in reverse postorder: each after its
+    // dominators, so the only edges going back up are loop back edges. The
+    // false side of a branch is searched first, which puts the true side (a
+    // maybe's body, a wait's body) right after the branch.
+    inline void order_blocks()
+    {
+        remove_unreachable();
+        std::vector<BlockId> post;
+        post.reserve(blocks.size());
+        std::vector<uint8_t> seen(blocks.size(), 0);
+        std::vector<std::pair<BlockId, size_t>> stack {{0, 0}}; // block, successors left to look at
+        seen[0] = 1;
+        while(!stack.empty())
+        {
+            const BlockId block = stack.back().first;
+            const std::span<const BlockId> next = succs(block);
+            if(stack.back().second < next.size())
+            {
+                const BlockId succ = next[next.size() - 1 - stack.back().second++];
+                if(!seen[succ])
+                {
+                    seen[succ] = 1;
+                    stack.emplace_back(succ, 0);
+                }
+                continue;
+            }
+            post.push_back(block);
+            stack.pop_back();
+        }
+
+        std::vector<BlockId> remap(blocks.size());
+        for(size_t i = 0; i < post.size(); i++)
+        {
+            remap[post[post.size() - 1 - i]] = static_cast<BlockId>(i);
+        }
+        std::vector<IrBlock> ordered(blocks.size());
+        for(BlockId b = 0; b < blocks.size(); b++)
+        {
+            IrBlock& block = blocks[b];
+            for(BlockId& pred : block.preds) pred = remap[pred];
+            for(BlockId& target : insts[block.insts.back()].target)
+            {
+                if(target != no_id) target = remap[target];
+            }
+            ordered[remap[b]] = std::move(block);
+        }
+        blocks = std::move(ordered);
+    }
+
+    // A block that jumps to one with no other way in absorbs it.
+    inline void merge_blocks()
+    {
+        bool any = false;
+        for(BlockId b = 0; b < blocks.size(); b++)
+        {
+            while(!blocks[b].insts.empty() && insts[blocks[b].insts.back()].op == IrOp::jmp)
+            {
+                const BlockId next = insts[blocks[b].insts.back()].target[0];
+                if(next == b || blocks[next].preds.size() != 1 || insts[blocks[next].insts.front()].op == IrOp::phi)
+                {
+                    break;
+                }
+                blocks[b].insts.pop_back();
+                blocks[b].insts.insert(blocks[b].insts.end(), blocks[next].insts.begin(), blocks[next].insts.end());
+                blocks[next].insts.clear(); // unreachable now, and skipped until it's dropped
+                blocks[next].preds.clear();
+                for(BlockId succ : succs(b))
+                {
+                    for(BlockId& pred : blocks[succ].preds)
+                    {
+                        if(pred == next) pred = b;
+                    }
+                }
+                any = true;
+            }
+        }
+        if(any)
+        {
+            remove_unreachable();
+        }
+    }
+
+    // Replaces every use of a value v with forward[v], following chains.
+    // forward holds every value id, mapping the untouched ones to themselves.
+    inline void substitute(std::vector<ValueId>& forward)
+    {
+        for(IrBlock& block : blocks)
+        {
+            for(ValueId id : block.insts)
+            {
+                for_each_operand(insts[id], [&](ValueId& v){ v = resolve(forward, v); });
+            }
+        }
+    }
+
+    static inline ValueId resolve(std::vector<ValueId>& forward, ValueId v)
+    {
+        ValueId root = v;
+        while(forward[root] != root) root = forward[root];
+        while(forward[v] != root) // path compression, chains of removed phis get long
+        {
+            ValueId next = forward[v];
+            forward[v] = root;
+            v = next;
+        }
+        return root;
+    }
+
+    // A phi whose arguments are all one value (or itself) is just that value.
+    // Removing one can make the phis using it trivial too, hence the loop.
+    inline void remove_trivial_phis()
+    {
+        std::vector<ValueId> forward(insts.size());
+        for(ValueId v = 0; v < forward.size(); v++) forward[v] = v;
+        bool changed = true;
+        bool any = false;
+        while(changed)
+        {
+            changed = false;
+            for(IrBlock& block : blocks)
+            {
+                size_t out = 0;
+                for(size_t i = 0; i < block.insts.size(); i++)
+                {
+                    const ValueId id = block.insts[i];
+                    if(insts[id].op == IrOp::phi)
+                    {
+                        ValueId same = no_id;
+                        bool trivial = true;
+                        for(ValueId arg : insts[id].args)
+                        {
+                            arg = resolve(forward, arg);
+                            if(arg == id || arg == same) continue;
+                            if(same != no_id)
+                            {
+                                trivial = false;
+                                break;
+                            }
+                            same = arg;
+                        }
+                        if(trivial && same != no_id)
+                        {
+                            forward[id] = same;
+                            changed = any = true;
+                            continue;
+                        }
+                    }
+                    block.insts[out++] = id;
+                }
+                block.insts.resize(out);
+            }
+        }
+        if(any)
+        {
+            substitute(forward);
+        }
+    }
+};
+
+// A string a unit prints: one of its own literals, which it defines in .data,
+// or a dillusion declared by another unit, known only by label and length.
+struct IrString {
+    std::string label;
+    size_t len = 0;
+    std::string_view text {}; // defined ones only
+    bool defined = false;
+};
+
+// What becomes one AsmUnit: a top-level function (plus any function defined
+// inside it) or _start, with the strings they print.
+struct IrUnit {
+    std::string name;
+    std::vector<IrFunction> functions;
+    std::vector<IrString> strings;
+
+    // --emit-ir. Values are numbered in order of appearance rather than by id.
+    inline void print(std::ostream& out, const Interner& interner) const
+    {
+        out << "; unit " << name << "\n";
+        for(const IrString& str : strings)
+        {
+            if(str.defined)
+            {
+                out << "string " << str.label << " = \"" << str.text << "\"\n";
+            }
+            else
+            {
+                out << "extern string " << str.label << ", " << str.len << " bytes\n";
+            }
+        }
+        for(const IrFunction& func : functions)
+        {
+            std::vector<uint32_t> number(func.insts.size(), no_id);
+            uint32_t next = 0;
+            for(const IrBlock& block : func.blocks)
+            {
+                for(ValueId id : block.insts)
+                {
+                    if(has_value(func.insts[id].op)) number[id] = next++;
+                }
+            }
+            auto value = [&](ValueId v){
+                return number[v] == no_id ? std::string("%?") : "%" + std::to_string(number[v]);
+            };
+
+            out << "\nfunction " << func.name << "(" << func.param_count << ")\n";
+            for(BlockId b = 0; b < func.blocks.size(); b++)
+            {
+                const IrBlock& block = func.blocks[b];
+                out << "b" << b << ":";
+                if(!block.preds.empty())
+                {
+                    out << " ; preds";
+                    for(BlockId pred : block.preds) out << " b" << pred;
+                }
+                out << "\n";
+                for(ValueId id : block.insts)
+                {
+                    const IrInst& inst = func.insts[id];
+                    out << "    ";
+                    if(has_value(inst.op))
+                    {
+                        out << value(id) << " = ";
+                    }
+                    switch(inst.op)
+                    {
+                        case IrOp::constant: out << "const " << inst.imm; break;
+                        case IrOp::param: out << "param " << inst.imm; break;
+                        case IrOp::bin: out << bin_op_name(inst.bin) << " " << value(inst.a) << ", " << value(inst.b); break;
+                        case IrOp::call:
+                            out << "call " << interner.name(static_cast<SymbolId>(inst.imm)) << "(";
+                            for(size_t i = 0; i < inst.args.size(); i++) out << (i ? ", " : "") << value(inst.args[i]);
+                            out << ")";
+                            break;
+                        case IrOp::phi:
+                            out << "phi ";
+                            for(size_t i = 0; i < inst.args.size(); i++) out << (i ? ", " : "") << "[" << value(inst.args[i]) << ", b" << block.preds[i] << "]";
+                            break;
+                        case IrOp::print_int: out << "print_int " << value(inst.a); break;
+                        case IrOp::print_str: out << "print_str " << strings[inst.imm].label; break;
+                        case IrOp::newline: out << "newline"; break;
+                        case IrOp::jmp: out << "jmp b" << inst.target[0]; break;
+                        case IrOp::br: out << "br " << value(inst.a) << ", b" << inst.target[0] << ", b" << inst.target[1]; break;
+                        case IrOp::ret: out << "ret " << value(inst.a); break;
+                        case IrOp::exit: out << "exit " << value(inst.a); break;
+                    }
+                    out << "\n";
+                }
+            }
+        }
+        out << "\n";
+    }
+
+private:
+    static inline const char* bin_op_name(BinOp op)
+    {
+        switch(op)
+        {
+            case BinOp::add: return "add";
+            case BinOp::sub: return "sub";
+            case BinOp::mul: return "mul";
+            case BinOp::div: return "div";
+            case BinOp::eq: return "eq";
+            case BinOp::neq: return "neq";
+            case BinOp::lt: return "lt";
+            case BinOp::gt: return "gt";
+            case BinOp::lte: return "lte";
+            default: return "gte";
+        }
+    }
+};
@@ -0,0 +1,484 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+#include "ir.hpp"
+#include "constfold.hpp"
+
+// A natural loop, which is what a wait lowers to: the header evaluates the
+// condition, the latch is the one block jumping back to it, and the preheader
+// is the only way in from outside.
+struct Loop {
+    BlockId header = no_id;
+    BlockId latch = no_id;
+    BlockId preheader = no_id;
+    std::vector<BlockId> blocks {}; // sorted, so the header comes first
+
+    [[nodiscard]] inline bool contains(BlockId block) const
+    {
+        return std::binary_search(blocks.begin(), blocks.end(), block);
+    }
+};
+
+// Loops of a function whose blocks are in reverse postorder (order_blocks()).
+// Our control flow is structured, so every edge going back up the layout is a
+// back edge and its target the loop header. Loops whose shape isn't the one a
+// wait gives (several back edges, a way in that isn't a plain jump) are left out.
+// Innermost loops come first.
+inline std::vector<Loop> find_loops(const IrFunction& func)
+{
+    std::vector<Loop> loops;
+    std::vector<BlockId> mark(func.blocks.size(), no_id);
+    std::vector<BlockId> work;
+    for(BlockId header = 0; header < func.blocks.size(); header++)
+    {
+        Loop loop {.header=header};
+        bool shaped = true;
+        for(BlockId pred : func.blocks[header].preds)
+        {
+            if(pred >= header)
+            {
+                shaped = shaped && loop.latch == no_id;
+                loop.latch = pred;
+            }
+            else
+            {
+                shaped = shaped && loop.preheader == no_id;
+                loop.preheader = pred;
+            }
+        }
+        if(loop.latch == no_id || !shaped || loop.preheader == no_id || func.succs(loop.preheader).size() != 1)
+        {
+            continue;
+        }
+        mark[header] = header;
+        loop.blocks.push_back(header);
+        work.push_back(loop.latch);
+        while(!work.empty())
+        {
+            const BlockId block = work.back();
+            work.pop_back();
+            if(mark[block] == header) continue;
+            mark[block] = header;
+            loop.blocks.push_back(block);
+            for(BlockId pred : func.blocks[block].preds) work.push_back(pred);
+        }
+        std::sort(loop.blocks.begin(), loop.blocks.end());
+        loops.push_back(std::move(loop));
+    }
+    std::stable_sort(loops.begin(), loops.end(), [](const Loop& a, const Loop& b){ return a.blocks.size() < b.blocks.size(); });
+    return loops;
+}
+
+// Optimizations on wait loops:
+//  - innermost loops with a trip count known at compile time, small enough,
+//    are unrolled completely: a copy of the body per iteration, no branches left;
+//  - arithmetic whose operands don't change in the loop is computed once in
+//    the preheader instead of on every iteration;
+//  - a product of an induction variable (a header phi stepped by an invariant
+//    amount) and an invariant becomes an induction variable of its own, stepped
+//    by an add instead of multiplied out every time.
+class LoopOptimizer {
+public:
+    static constexpr uint64_t max_trip_count = 8;
+    static constexpr size_t max_unrolled_insts = 256; // per loop, the copies together
+
+    inline explicit LoopOptimizer(IrFunction& func) : m_func(func)
+    {}
+
+    // true if the function changed
+    inline bool run()
+    {
+        m_func.order_blocks();
+        bool changed = false;
+        if(unroll_innermost())
+        {
+            // the copies mostly fold away, each iteration's counter is a constant
+            m_func.remove_unreachable();
+            m_func.remove_trivial_phis();
+            ConstantFolder(m_func).run();
+            m_func.merge_blocks();
+            m_func.order_blocks();
+            changed = true;
+        }
+
+        const std::vector<Loop> loops = find_loops(m_func);
+        if(loops.empty())
+        {
+            return changed;
+        }
+        m_block_of.assign(m_func.insts.size(), no_id);
+        for(BlockId b = 0; b < m_func.blocks.size(); b++)
+        {
+            for(ValueId id : m_func.blocks[b].insts) m_block_of[id] = b;
+        }
+        bool reduced = false;
+        for(const Loop& loop : loops) // inner ones first, what they hoist can go on out of the outer ones
+        {
+            changed = hoist_invariants(loop) || changed;
+            reduced = reduce_strength(loop) || reduced;
+        }
+        if(reduced)
+        {
+            ConstantFolder(m_func).run(); // the starting products are often constant
+            m_func.merge_blocks();
+        }
+        return changed || reduced;
+    }
+
+private:
+    // a value the loop never changes
+    [[nodiscard]] inline bool invariant(const Loop& loop, ValueId v) const
+    {
+        return m_func.insts[v].op == IrOp::constant || !loop.contains(m_block_of[v]);
+    }
+
+    inline void insert_before_terminator(BlockId block, ValueId id)
+    {
+        std::vector<ValueId>& insts = m_func.blocks[block].insts;
+        insts.insert(insts.end() - 1, id);
+        if(id >= m_block_of.size()) m_block_of.resize(id + 1, no_id);
+        m_block_of[id] = block;
+    }
+
+    // Hoisting is speculative, the body may never run, so only what can't fault goes.
+    inline bool hoist_invariants(const Loop& loop)
+    {
+        bool changed = false;
+        for(BlockId b : loop.blocks)
+        {
+            std::vector<ValueId>& insts = m_func.blocks[b].insts;
+            size_t out = 0;
+            for(size_t i = 0; i < insts.size(); i++)
+            {
+                const ValueId id = insts[i];
+                const IrInst& inst = m_func.insts[id];
+                const bool hoist = inst.op == IrOp::constant // free either way, but hoisted code may use it
+                                || (inst.op == IrOp::bin && invariant(loop, inst.a) && invariant(loop, inst.b) && !m_func.may_fault(inst));
+                if(hoist)
+                {
+                    insert_before_terminator(loop.preheader, id);
+                    changed = true;
+                    continue;
+                }
+                insts[out++] = id;
+            }
+            insts.resize(out);
+        }
+        return changed;
+    }
+
+    struct Induction {
+        ValueId start; // value coming in from the preheader
+        ValueId step;  // invariant
+        bool down;     // stepped by a sub
+    };
+
+    // phi = phi(start, phi +/- step)
+    [[nodiscard]] inline std::optional<Induction> induction(const Loop& loop, ValueId phi) const
+    {
+        const IrInst& inst = m_func.insts[phi];
+        const IrInst& next = m_func.insts[inst.args[m_func.pred_index(loop.header, loop.latch)]];
+        const ValueId start = inst.args[m_func.pred_index(loop.header, loop.preheader)];
+        if(next.op != IrOp::bin) return std::nullopt;
+        if(next.bin == BinOp::add && next.a == phi && invariant(loop, next.b)) return Induction{start, next.b, false};
+        if(next.bin == BinOp::add && next.b == phi && invariant(loop, next.a)) return Induction{start, next.a, false};
+        if(next.bin == BinOp::sub && next.a == phi && invariant(loop, next.b)) return Induction{start, next.b, true};
+        return std::nullopt;
+    }
+
+    inline bool reduce_strength(const Loop& loop)
+    {
+        std::map<ValueId, Induction> ivs;
+        for(ValueId id : m_func.blocks[loop.header].insts)
+        {
+            if(m_func.insts[id].op != IrOp::phi) break;
+            if(std::optional<Induction> iv = induction(loop, id)) ivs.emplace(id, *iv);
+        }
+        if(ivs.empty())
+        {
+            return false;
+        }
+
+        std::map<std::pair<ValueId, ValueId>, ValueId> reduced; // (iv, factor) -> the phi standing for their product
+        std::vector<std::pair<ValueId, ValueId>> replaced; // product -> that phi
+        for(BlockId b : loop.blocks)
+        {
+            std::vector<ValueId>& insts = m_func.blocks[b].insts;
+            size_t out = 0;
+            for(size_t i = 0; i < insts.size(); i++)
+            {
+                const ValueId id = insts[i];
+                const IrInst& inst = m_func.insts[id];
+                ValueId iv = no_id;
+                ValueId factor = no_id;
+                if(inst.op == IrOp::bin && inst.bin == BinOp::mul)
+                {
+                    if(ivs.contains(inst.a) && invariant(loop, inst.b)) { iv = inst.a; factor = inst.b; }
+                    else if(ivs.contains(inst.b) && invariant(loop, inst.a)) { iv = inst.b; factor = inst.a; }
+                }
+                if(iv == no_id)
+                {
+                    insts[out++] = id;
+                    continue;
+                }
+                auto [it, fresh] = reduced.emplace(std::make_pair(iv, factor), no_id);
+                if(fresh)
+                {
+                    it->second = new_induction(loop, ivs.at(iv), factor);
+                }
+                replaced.emplace_back(id, it->second);
+            }
+            insts.resize(out);
+        }
+        if(replaced.empty())
+        {
+            return false;
+        }
+        std::vector<ValueId> forward(m_func.insts.size());
+        for(ValueId v = 0; v < forward.size(); v++) forward[v] = v;
+        for(const auto& [from, to] : replaced) forward[from] = to;
+        m_func.substitute(forward);
+        return true;
+    }
+
+    // j = phi(start * factor, j +/- step * factor), the header phi standing for iv * factor
+    inline ValueId new_induction(const Loop& loop, const Induction& iv, ValueId factor)
+    {
+        const ValueId start = m_func.add({.op=IrOp::bin, .bin=BinOp::mul, .a=iv.start, .b=factor});
+        insert_before_terminator(loop.preheader, start);
+        const ValueId step = m_func.add({.op=IrOp::bin, .bin=BinOp::mul, .a=iv.step, .b=factor});
+        insert_before_terminator(loop.preheader, step);
+
+        const ValueId phi = m_func.add({.op=IrOp::phi});
+        const ValueId next = m_func.add({.op=IrOp::bin, .bin=iv.down ? BinOp::sub : BinOp::add, .a=phi, .b=step});
+        insert_before_terminator(loop.latch, next);
+        for(BlockId pred : m_func.blocks[loop.header].preds)
+        {
+            m_func.insts[phi].args.push_back(pred == loop.preheader ? start : next);
+        }
+        std::vector<ValueId>& header = m_func.blocks[loop.header].insts;
+        header.insert(header.begin(), phi);
+        if(phi >= m_block_of.size()) m_block_of.resize(phi + 1, no_id);
+        m_block_of[phi] = loop.header;
+        return phi;
+    }
+
+    // --- full unrolling ---
+
+    // How many times the body runs, when that only depends on constants: the
+    // branch leaving the header compares counters (constant start, constant
+    // step) and constants.
+    [[nodiscard]] inline std::optional<uint64_t> trip_count(const Loop& loop, BlockId body) const
+    {
+        const IrInst& br = m_func.terminator(loop.header);
+        const size_t from_pre = m_func.pred_index(loop.header, loop.preheader);
+        const size_t from_latch = m_func.pred_index(loop.header, loop.latch);
+        const bool stay_if_true = br.target[0] == body;
+        for(uint64_t k = 0; k <= max_trip_count; k++)
+        {
+            std::optional<int64_t> cond = evaluate(loop, br.a, k, from_pre, from_latch, 0);
+            if(!cond) return std::nullopt;
+            if((*cond != 0) != stay_if_true) return k;
+        }
+        return std::nullopt;
+    }
+
+    // v on iteration k, if it's a constant, a counter or arithmetic on those computed in the header
+    [[nodiscard]] inline std::optional<int64_t> evaluate(const Loop& loop, ValueId v, uint64_t k, size_t from_pre, size_t from_latch, int depth) const
+    {
+        const IrInst& inst = m_func.insts[v];
+        if(inst.op == IrOp::constant) return inst.imm;
+        if(depth > 8 || m_block_of_unroll[v] != loop.header) return std::nullopt;
+        if(inst.op == IrOp::phi)
+        {
+            const IrInst& start = m_func.insts[inst.args[from_pre]];
+            const IrInst& next = m_func.insts[inst.args[from_latch]];
+            if(start.op != IrOp::constant || next.op != IrOp::bin || (next.bin != BinOp::add && next.bin != BinOp::sub)) return std::nullopt;
+            if(next.a != v || m_func.insts[next.b].op != IrOp::constant) return std::nullopt;
+            const uint64_t step = static_cast<uint64_t>(m_func.insts[next.b].imm) * k;
+            const uint64_t base = static_cast<uint64_t>(start.imm);
+            return static_cast<int64_t>(next.bin == BinOp::add ? base + step : base - step);
+        }
+        if(inst.op != IrOp::bin) return std::nullopt;
+        std::optional<int64_t> a = evaluate(loop, inst.a, k, from_pre, from_latch, depth + 1);
+        std::optional<int64_t> b = a ? evaluate(loop, inst.b, k, from_pre, from_latch, depth + 1) : std::nullopt;
+        if(!b) return std::nullopt;
+        return fold_bin(inst.bin, *a, *b);
+    }
+
+    inline bool unroll_innermost()
+    {
+        const std::vector<Loop> loops = find_loops(m_func);
+        if(loops.empty())
+        {
+            return false;
+        }
+        m_block_of_unroll.assign(m_func.insts.size(), no_id);
+        for(BlockId b = 0; b < m_func.blocks.size(); b++)
+        {
+            for(ValueId id : m_func.blocks[b].insts) m_block_of_unroll[id] = b;
+        }
+        std::vector<uint8_t> is_header(m_func.blocks.size(), 0);
+        for(const Loop& loop : loops) is_header[loop.header] = 1;
+
+        bool changed = false;
+        for(const Loop& loop : loops)
+        {
+            // innermost, left only from the header's branch
+            bool simple = m_func.terminator(loop.header).op == IrOp::br;
+            size_t size = 0;
+            for(BlockId b : loop.blocks)
+            {
+                simple = simple && (b == loop.header || !is_header[b]);
+                for(BlockId succ : m_func.succs(b))
+                {
+                    simple = simple && (loop.contains(succ) || b == loop.header);
+                }
+                size += m_func.blocks[b].insts.size();
+            }
+            if(!simple) continue;
+            const IrInst& br = m_func.terminator(loop.header);
+            const bool body_first = loop.contains(br.target[0]);
+            const BlockId body = body_first ? br.target[0] : br.target[1];
+            const BlockId exit = body_first ? br.target[1] : br.target[0];
+            if(loop.contains(exit) || !loop.contains(body) || body == loop.header) continue;
+            std::optional<uint64_t> trips = trip_count(loop, body);
+            if(!trips || *trips * size > max_unrolled_insts) continue;
+            unroll(loop, body, exit, *trips);
+            changed = true;
+        }
+        if(changed)
+        {
+            std::vector<ValueId> forward(m_func.insts.size());
+            for(ValueId v = 0; v < forward.size(); v++) forward[v] = v;
+            for(const auto& [from, to] : m_unrolled) forward[from] = to;
+            m_func.substitute(forward);
+        }
+        return changed;
+    }
+
+    // Replaces the loop with trips copies of it, each header copy's phis
+    // replaced by the values of the copy before, and one last copy of the
+    // header that goes on to the exit.
+    inline void unroll(const Loop& loop, BlockId body, BlockId exit, uint64_t trips)
+    {
+        const size_t old_count = m_func.insts.size();
+        std::vector<ValueId> value_map(old_count, no_id); // loop value -> its copy in the current iteration
+        auto map = [&](ValueId v){ return v < old_count && value_map[v] != no_id ? value_map[v] : v; };
+        std::vector<BlockId> block_map(m_func.blocks.size(), no_id);
+
+        std::vector<BlockId> headers;
+        for(uint64_t k = 0; k <= trips; k++)
+        {
+            headers.push_back(static_cast<BlockId>(m_func.blocks.size()));
+            m_func.blocks.emplace_back();
+        }
+        const size_t from_pre = m_func.pred_index(loop.header, loop.preheader);
+        const size_t from_latch = m_func.pred_index(loop.header, loop.latch);
+        BlockId prev_latch = loop.preheader;
+
+        for(uint64_t k = 0; k <= trips; k++)
+        {
+            const BlockId header = headers[k];
+            m_func.blocks[header].preds.push_back(prev_latch);
+
+            // the phis take this iteration's values, all read before any is set
+            std::vector<std::pair<ValueId, ValueId>> incoming;
+            const std::vector<ValueId> header_insts = m_func.blocks[loop.header].insts;
+            for(ValueId id : header_insts)
+            {
+                const IrInst& inst = m_func.insts[id];
+                if(inst.op != IrOp::phi) break;
+                incoming.emplace_back(id, k == 0 ? inst.args[from_pre] : map(inst.args[from_latch]));
+            }
+            for(const auto& [phi, value] : incoming) value_map[phi] = value;
+
+            if(k < trips)
+            {
+                for(BlockId b : loop.blocks)
+                {
+                    if(b != loop.header)
+                    {
+                        block_map[b] = static_cast<BlockId>(m_func.blocks.size());
+                        m_func.blocks.emplace_back();
+                    }
+                }
+            }
+            for(ValueId id : header_insts)
+            {
+                const IrInst& inst = m_func.insts[id];
+                if(inst.op == IrOp::phi) continue;
+                if(inst.op == IrOp::br)
+                {
+                    copy_into(header, {.op=IrOp::jmp, .target={k < trips ? block_map[body] : exit, no_id}});
+                    continue;
+                }
+                value_map[id] = copy_into(header, copy_inst(inst, map));
+            }
+            if(k == trips)
+            {
+                break;
+            }
+
+            for(BlockId b : loop.blocks)
+            {
+                if(b == loop.header) continue;
+                const BlockId copy = block_map[b];
+                for(BlockId pred : m_func.blocks[b].preds)
+                {
+                    m_func.blocks[copy].preds.push_back(pred == loop.header ? header : block_map[pred]);
+                }
+                const std::vector<ValueId> insts = m_func.blocks[b].insts;
+                for(ValueId id : insts)
+                {
+                    IrInst inst = copy_inst(m_func.insts[id], map);
+                    for(BlockId& target : inst.target)
+                    {
+                        if(target == loop.header) target = headers[k + 1];
+                        else if(target != no_id) target = block_map[target];
+                    }
+                    value_map[id] = copy_into(copy, std::move(inst));
+                }
+            }
+            prev_latch = block_map[loop.latch];
+        }
+
+        // into the first copy instead of the loop, out of the last one
+        IrInst& enter = m_func.insts[m_func.blocks[loop.preheader].insts.back()];
+        enter.target[0] = headers[0];
+        for(BlockId& pred : m_func.blocks[exit].preds)
+        {
+            if(pred == loop.header) pred = headers[trips];
+        }
+        // the header's values are the only ones seen after the loop, they become the last copy's
+        for(ValueId id : m_func.blocks[loop.header].insts)
+        {
+            if(has_value(m_func.insts[id].op)) m_unrolled.emplace_back(id, value_map[id]);
+        }
+    }
+
+    template<typename Map>
+    [[nodiscard]] static inline IrInst copy_inst(const IrInst& inst, Map&& map)
+    {
+        IrInst copy = inst;
+        for_each_operand(copy, [&](ValueId& v){ v = map(v); });
+        return copy;
+    }
+
+    inline ValueId copy_into(BlockId block, IrInst inst)
+    {
+        const ValueId id = m_func.add(std::move(inst));
+        m_func.blocks[block].insts.push_back(id);
+        return id;
+    }
+
+    IrFunction& m_func;
+    std::vector<BlockId> m_block_of; // per value, for hoisting and strength reduction
+    std::vector<BlockId> m_block_of_unroll; // per value, as it was before unrolling
+    std::vector<std::pair<ValueId, ValueId>> m_unrolled; // header value of an unrolled loop -> its last copy
+};
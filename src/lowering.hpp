@@ -0,0 +1,648 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <cassert>
+#include "ir.hpp"
+#include "parser.hpp"
+#include "symbols.hpp"
+#include "diagnostics.hpp"
+
+// The functions a piece of the program defines and calls, by offset in its
+// source. A call can go to a function defined anywhere, later or in another
+// --session chunk, so these are only checked once every unit is lowered.
+struct FunctionRefs {
+    std::vector<std::pair<SymbolId, size_t>> defined;
+    std::vector<std::pair<SymbolId, size_t>> called;
+};
+
+// Reports each call to a name no function has, and each definition of a name
+// after its first. pieces are (refs, where their offsets start in the source).
+inline void check_functions(std::span<const std::pair<const FunctionRefs*, size_t>> pieces, const Interner& interner, Diagnostics& diags)
+{
+    auto error = [&](size_t at, const std::string& msg){
+        diags.report({.offset=at, .prefix="[Generator Error] ", .at=" >>> ", .msg=msg});
+    };
+    std::vector<std::pair<size_t, SymbolId>> defined;
+    for(const auto& [refs, base] : pieces)
+    {
+        for(const auto& [sym, at] : refs->defined) defined.emplace_back(base + at, sym);
+    }
+    std::sort(defined.begin(), defined.end()); // the first one in the file is the definition
+    std::vector<uint8_t> is_defined(interner.size(), 0);
+    for(const auto& [at, sym] : defined)
+    {
+        if(is_defined[sym])
+        {
+            error(at, "Function already defined: " + std::string(interner.name(sym)));
+        }
+        is_defined[sym] = 1;
+    }
+    for(const auto& [refs, base] : pieces)
+    {
+        for(const auto& [sym, at] : refs->called)
+        {
+            if(!is_defined[sym])
+            {
+                error(base + at, "Undefined function: " + std::string(interner.name(sym)));
+            }
+        }
+    }
+}
+
+// Lowers the AST to IR, one unit at a time: a top-level function, or _start
+// made of every other top-level statement. This is also where names are
+// resolved, so the generator's diagnostics come from here.
+//
+// SSA form is built while walking the tree. The language only has structured
+// control flow, so it's enough to track the current value of every variable:
+// a maybe merges what its branches wrote with phis where they disagree, and a
+// wait puts a phi at the loop header for each outer variable its body assigns.
+class Lowering {
+public:
+    inline Lowering(const NodeProgram& prog, const Interner& interner, Diagnostics& diags) : m_prog(prog), m_interner(interner), m_diags(diags)
+    {}
+
+    // a top-level function definition, as a unit of its own
+    inline IrUnit lower_function(NodeIndex func_def)
+    {
+        begin_unit("func_" + std::string(m_interner.name(m_prog.func_def(func_def).name)));
+        lower_func_def(func_def);
+        return std::move(m_unit);
+    }
+
+    // _start: every top-level statement that isn't a function definition, then exit(0)
+    inline IrUnit lower_start(std::span<const NodeIndex> stmts)
+    {
+        begin_unit("_start");
+        const size_t at = m_unit.functions.size();
+        m_unit.functions.emplace_back();
+        FunctionState state;
+        state.func.name = "_start";
+        state.is_start = true;
+        FunctionState* outer = m_fn;
+        m_fn = &state;
+        new_block();
+        for(NodeIndex stmt : stmts)
+        {
+            if(m_prog[stmt].tag != NodeTag::func_def)
+            {
+                lower_stmt(stmt);
+            }
+        }
+        emit({.op=IrOp::exit, .a=constant(0)});
+        finish(state.func);
+        m_unit.functions[at] = std::move(state.func);
+        m_fn = outer;
+        return std::move(m_unit);
+    }
+
+    // functions first, then _start, the order gen_program links them in
+    inline std::vector<IrUnit> lower_program()
+    {
+        std::vector<IrUnit> units;
+        for(NodeIndex stmt : m_prog.stmts)
+        {
+            if(m_prog[stmt].tag == NodeTag::func_def)
+            {
+                units.push_back(lower_function(stmt));
+            }
+        }
+        units.push_back(lower_start(m_prog.stmts));
+        const std::pair<const FunctionRefs*, size_t> whole[] = {{&m_functions, 0}};
+        check_functions(whole, m_interner, m_diags);
+        return units;
+    }
+
+    // what every unit lowered so far defined and called, for check_functions()
+    [[nodiscard]] inline const FunctionRefs& functions() const { return m_functions; }
+
+    // dillusions declared so far; set before lowering a unit on its own
+    [[nodiscard]] inline const StringVars& string_vars() const { return m_symbols.strings(); }
+    inline void set_string_vars(StringVars vars) { m_symbols.set_strings(std::move(vars)); }
+
+private:
+    // One function being lowered. Functions defined inside another one are
+    // lowered when they're met, so these nest.
+    struct FunctionState {
+        IrFunction func;
+        BlockId block = 0; // where instructions go
+        bool is_start = false; // bye exits the program instead of returning
+        std::vector<ValueId> vars; // variable id -> its current value, no_id before it has one
+        std::vector<std::pair<uint32_t, ValueId>> log; // (variable, previous value) of each write inside a maybe or wait
+        uint32_t open = 0; // maybe branches and wait bodies being lowered, writes are only logged inside one
+        std::vector<uint32_t> seen; // per variable, scratch for dedup
+        uint32_t epoch = 0;
+        ValueId zero = no_id; // const 0 at the top of the entry block
+    };
+
+    // what a maybe branch (or the way around all of them) hands to the join
+    struct Arm {
+        BlockId block; // where it ends, jumps to the join
+        std::vector<std::pair<uint32_t, ValueId>> written; // outer variables it changed, final values
+    };
+
+    inline void begin_unit(std::string name)
+    {
+        m_unit = {};
+        m_unit.name = std::move(name);
+        m_literals.clear();
+        m_labels.clear();
+    }
+
+    inline void finish(IrFunction& func)
+    {
+        func.remove_unreachable();
+        func.remove_trivial_phis();
+    }
+
+    inline void error(NodeIndex at, const std::string& msg)
+    {
+        m_diags.report({.offset=m_prog.locs[at], .prefix="[Generator Error] ", .at=" >>> ", .msg=msg});
+    }
+
+    inline BlockId new_block()
+    {
+        m_fn->func.blocks.emplace_back();
+        return static_cast<BlockId>(m_fn->func.blocks.size() - 1);
+    }
+
+    inline ValueId emit(IrInst inst)
+    {
+        const bool ends_block = is_terminator(inst.op);
+        const ValueId id = m_fn->func.add(std::move(inst));
+        m_fn->func.blocks[m_fn->block].insts.push_back(id);
+        if(ends_block)
+        {
+            // anything after a terminator (statements after a bye) goes to a
+            // block nothing jumps to, remove_unreachable drops it
+            m_fn->block = new_block();
+        }
+        return id;
+    }
+
+    inline ValueId constant(int64_t value)
+    {
+        return emit({.op=IrOp::constant, .imm=value});
+    }
+
+    // the value of anything an error replaced
+    inline ValueId zero()
+    {
+        if(m_fn->zero == no_id)
+        {
+            m_fn->zero = m_fn->func.add({.op=IrOp::constant, .imm=0});
+            std::vector<ValueId>& entry = m_fn->func.blocks[0].insts;
+            entry.insert(entry.begin(), m_fn->zero);
+        }
+        return m_fn->zero;
+    }
+
+    inline void jump(BlockId to)
+    {
+        m_fn->func.blocks[to].preds.push_back(m_fn->block);
+        emit({.op=IrOp::jmp, .target={to, no_id}});
+    }
+
+    inline void branch(ValueId cond, BlockId if_true, BlockId if_false)
+    {
+        m_fn->func.blocks[if_true].preds.push_back(m_fn->block);
+        m_fn->func.blocks[if_false].preds.push_back(m_fn->block);
+        emit({.op=IrOp::br, .a=cond, .target={if_true, if_false}});
+    }
+
+    // a variable read before it's been given one (hope x = x) is 0
+    inline ValueId current(uint32_t var)
+    {
+        return m_fn->vars[var] == no_id ? zero() : m_fn->vars[var];
+    }
+
+    inline uint32_t new_var(ValueId value)
+    {
+        m_fn->vars.push_back(value);
+        m_fn->seen.push_back(0);
+        return static_cast<uint32_t>(m_fn->vars.size() - 1);
+    }
+
+    inline void write(uint32_t var, ValueId value)
+    {
+        if(m_fn->open > 0)
+        {
+            m_fn->log.emplace_back(var, m_fn->vars[var]);
+        }
+        m_fn->vars[var] = value;
+    }
+
+    // The variables below live_vars written since log position mark, with their
+    // current values, and then undoes those writes.
+    inline std::vector<std::pair<uint32_t, ValueId>> take_writes(size_t mark, uint32_t live_vars)
+    {
+        std::vector<std::pair<uint32_t, ValueId>> written;
+        const uint32_t epoch = ++m_fn->epoch;
+        for(size_t i = mark; i < m_fn->log.size(); i++)
+        {
+            const uint32_t var = m_fn->log[i].first;
+            if(var < live_vars && m_fn->seen[var] != epoch)
+            {
+                m_fn->seen[var] = epoch;
+                written.emplace_back(var, m_fn->vars[var]);
+            }
+        }
+        for(size_t i = m_fn->log.size(); i > mark; i--)
+        {
+            m_fn->vars[m_fn->log[i - 1].first] = m_fn->log[i - 1].second;
+        }
+        m_fn->log.resize(mark);
+        return written;
+    }
+
+    inline uint32_t string_literal(std::string_view text)
+    {
+        auto it = m_literals.find(text);
+        if(it == m_literals.end())
+        {
+            const uint32_t index = static_cast<uint32_t>(m_unit.strings.size());
+            std::string label = m_unit.name + ".msg_" + std::to_string(m_literals.size());
+            m_labels.emplace(label, index);
+            m_unit.strings.push_back({.label=std::move(label), .len=text.size(), .text=text, .defined=true});
+            it = m_literals.emplace(text, index).first;
+        }
+        return it->second;
+    }
+
+    // a dillusion, which may live in another unit
+    inline uint32_t string_ref(const Symbol& var)
+    {
+        auto it = m_labels.find(var.label);
+        if(it == m_labels.end())
+        {
+            it = m_labels.emplace(var.label, static_cast<uint32_t>(m_unit.strings.size())).first;
+            m_unit.strings.push_back({.label=var.label, .len=var.len});
+        }
+        return it->second;
+    }
+
+    // Strings print themselves when evaluated; as a value they're 0.
+    inline ValueId lower_expr(NodeIndex expr)
+    {
+        const Node& node = m_prog[expr];
+        switch(node.tag)
+        {
+            case NodeTag::int_lit:
+                return constant(m_prog.int_value(expr));
+
+            case NodeTag::ident:
+            {
+                const Symbol* var = m_symbols.lookup(node.lhs);
+                if(var && var->kind == SymbolKind::string_var)
+                {
+                    emit({.op=IrOp::print_str, .imm=string_ref(*var)});
+                    return zero();
+                }
+                if(var)
+                {
+                    return current(var->var_id);
+                }
+                error(expr, "Undeclared variable: " + std::string(m_interner.name(node.lhs)));
+                return zero();
+            }
+
+            case NodeTag::string_lit:
+                emit({.op=IrOp::print_str, .imm=string_literal(m_prog.string(expr))});
+                return zero();
+
+            case NodeTag::call:
+            {
+                // arguments are evaluated right to left, the order they used to be pushed in
+                std::span<const NodeIndex> args = m_prog.call_args(expr);
+                std::vector<ValueId> values(args.size());
+                for(size_t i = args.size(); i > 0; i--)
+                {
+                    values[i - 1] = lower_expr(args[i - 1]);
+                }
+                m_functions.called.emplace_back(node.lhs, m_prog.locs[expr]);
+                return emit({.op=IrOp::call, .imm=node.lhs, .args=std::move(values)});
+            }
+
+            case NodeTag::bin_op:
+            {
+                const ValueId lhs = lower_expr(node.lhs);
+                const ValueId rhs = lower_expr(node.rhs);
+                return emit({.op=IrOp::bin, .bin=node.op, .a=lhs, .b=rhs});
+            }
+
+            default:
+                assert(false && "statement node used as an expression");
+                return zero();
+        }
+    }
+
+    inline void lower_scope(NodeIndex scope)
+    {
+        m_symbols.push_scope();
+        for(NodeIndex stmt : m_prog.scope_stmts(scope))
+        {
+            lower_stmt(stmt);
+        }
+        m_symbols.pop_scope();
+    }
+
+    inline void lower_stmt(NodeIndex stmt)
+    {
+        const Node& node = m_prog[stmt];
+        switch(node.tag)
+        {
+            case NodeTag::exit:
+            {
+                const ValueId value = lower_expr(node.lhs);
+                emit({.op=m_fn->is_start ? IrOp::exit : IrOp::ret, .a=value});
+                break;
+            }
+
+            case NodeTag::hope:
+            {
+                if(m_symbols.declared_in_scope(node.lhs))
+                {
+                    error(stmt, "Variable already declared in this scope: " + std::string(m_interner.name(node.lhs)));
+                }
+                // declared before its initializer is evaluated, which sees this variable
+                const uint32_t var = new_var(no_id);
+                m_symbols.declare_int(node.lhs, var);
+                write(var, lower_expr(node.rhs));
+                break;
+            }
+
+            case NodeTag::scope:
+                lower_scope(stmt);
+                break;
+
+            case NodeTag::maybe:
+                lower_maybe(stmt);
+                break;
+
+            case NodeTag::wait:
+                lower_wait(stmt);
+                break;
+
+            case NodeTag::dillusion:
+            {
+                const SymbolId var_name = node.lhs;
+                if(m_symbols.is_string(var_name))
+                {
+                    error(stmt, "String variable already declared: " + std::string(m_interner.name(var_name)));
+                    break;
+                }
+                if(m_prog[node.rhs].tag == NodeTag::string_lit)
+                {
+                    const IrString& str = m_unit.strings[string_literal(m_prog.string(node.rhs))];
+                    m_symbols.declare_string(var_name, str.label, str.len);
+                    break;
+                }
+                error(stmt, "String variable must be initialized with a string literal");
+                break;
+            }
+
+            case NodeTag::assign:
+            {
+                if(const Symbol* var = m_symbols.find_int(node.lhs))
+                {
+                    const uint32_t var_id = var->var_id;
+                    write(var_id, lower_expr(node.rhs));
+                }
+                else
+                {
+                    // not declared yet: declares it in the current scope
+                    const uint32_t var_id = new_var(no_id);
+                    m_symbols.declare_int(node.lhs, var_id);
+                    write(var_id, lower_expr(node.rhs));
+                }
+                break;
+            }
+
+            case NodeTag::tell_me:
+            {
+                // strings print themselves when evaluated, integers go through print_int
+                const Node& expr = m_prog[node.lhs];
+                const bool is_string = expr.tag == NodeTag::string_lit
+                                    || (expr.tag == NodeTag::ident && m_symbols.is_string(expr.lhs));
+                const ValueId value = lower_expr(node.lhs);
+                if(!is_string)
+                {
+                    emit({.op=IrOp::print_int, .a=value});
+                }
+                break;
+            }
+
+            case NodeTag::then:
+                emit({.op=IrOp::newline});
+                break;
+
+            case NodeTag::func_def:
+                lower_func_def(stmt);
+                break;
+
+            default:
+                assert(false && "expression node used as a statement");
+        }
+    }
+
+    // A branch of a maybe: its scope, lowered from block, with the outer
+    // variables it wrote undone afterwards so the next branch starts clean.
+    inline Arm lower_arm(BlockId block, NodeIndex scope, uint32_t live_vars)
+    {
+        m_fn->block = block;
+        const size_t mark = m_fn->log.size();
+        m_fn->open++;
+        lower_scope(scope);
+        m_fn->open--;
+        const BlockId end = m_fn->block;
+        return {.block=end, .written=take_writes(mark, live_vars)};
+    }
+
+    inline void lower_maybe(NodeIndex stmt)
+    {
+        MaybeView maybe = m_prog.maybe(stmt);
+        const uint32_t live_vars = static_cast<uint32_t>(m_fn->vars.size()); // variables declared inside die with their branch
+        std::vector<Arm> arms;
+
+        auto test = [&](NodeIndex condition, NodeIndex scope){
+            const ValueId cond = lower_expr(condition);
+            const BlockId then = new_block();
+            const BlockId next = new_block();
+            branch(cond, then, next);
+            arms.push_back(lower_arm(then, scope, live_vars));
+            m_fn->block = next;
+        };
+        test(maybe.condition, maybe.scope);
+        for(size_t i = 0; i < maybe.elifs.size(); i += 2)
+        {
+            test(maybe.elifs[i], maybe.elifs[i + 1]);
+        }
+        if(maybe.else_scope != null_node)
+        {
+            arms.push_back(lower_arm(m_fn->block, maybe.else_scope, live_vars));
+        }
+        else
+        {
+            arms.push_back({.block=m_fn->block, .written={}});
+        }
+
+        const BlockId join = new_block();
+        for(const Arm& arm : arms)
+        {
+            m_fn->block = arm.block;
+            jump(join);
+        }
+        m_fn->block = join;
+
+        // each variable some branch wrote gets its value per incoming edge, in
+        // the order the edges were added; a phi where they differ
+        std::vector<std::pair<uint32_t, std::vector<ValueId>>> merged;
+        std::unordered_map<uint32_t, size_t> index;
+        for(size_t a = 0; a < arms.size(); a++)
+        {
+            for(const auto& [var, value] : arms[a].written)
+            {
+                auto [it, fresh] = index.emplace(var, merged.size());
+                if(fresh)
+                {
+                    merged.emplace_back(var, std::vector<ValueId>(arms.size(), current(var)));
+                }
+                merged[it->second].second[a] = value;
+            }
+        }
+        for(auto& [var, incoming] : merged)
+        {
+            bool same = true;
+            for(ValueId value : incoming)
+            {
+                same = same && value == incoming.front();
+            }
+            write(var, same ? incoming.front() : emit({.op=IrOp::phi, .args=std::move(incoming)}));
+        }
+    }
+
+    inline void lower_wait(NodeIndex stmt)
+    {
+        const Node& node = m_prog[stmt];
+        const uint32_t live_vars = static_cast<uint32_t>(m_fn->vars.size());
+
+        // the outer variables the body may assign each get a phi at the header;
+        // the ones it doesn't after all (an inner one shadowed them) turn out
+        // trivial and go away
+        std::vector<uint32_t> carried = assigned_vars(node.rhs);
+        const BlockId header = new_block();
+        jump(header);
+        m_fn->block = header;
+        std::vector<ValueId> phis;
+        for(uint32_t var : carried)
+        {
+            phis.push_back(emit({.op=IrOp::phi, .args={current(var)}}));
+            write(var, phis.back());
+        }
+
+        const size_t mark = m_fn->log.size();
+        m_fn->open++;
+        const ValueId cond = lower_expr(node.lhs);
+        const BlockId body = new_block();
+        const BlockId exit = new_block();
+        branch(cond, body, exit);
+        m_fn->block = body;
+        lower_scope(node.rhs);
+        for(size_t i = 0; i < carried.size(); i++)
+        {
+            const ValueId value = current(carried[i]);
+            m_fn->func.insts[phis[i]].args.push_back(value);
+        }
+        jump(header);
+        m_fn->open--;
+        take_writes(mark, live_vars);
+        m_fn->block = exit;
+    }
+
+    // the visible variables that assignments somewhere in scope may refer to
+    inline std::vector<uint32_t> assigned_vars(NodeIndex scope)
+    {
+        std::vector<uint32_t> vars;
+        const uint32_t epoch = ++m_fn->epoch;
+        std::vector<NodeIndex> work {scope};
+        while(!work.empty())
+        {
+            const NodeIndex at = work.back();
+            work.pop_back();
+            const Node& node = m_prog[at];
+            switch(node.tag)
+            {
+                case NodeTag::scope:
+                    for(NodeIndex stmt : m_prog.scope_stmts(at)) work.push_back(stmt);
+                    break;
+                case NodeTag::maybe:
+                {
+                    MaybeView maybe = m_prog.maybe(at);
+                    work.push_back(maybe.scope);
+                    for(size_t i = 1; i < maybe.elifs.size(); i += 2) work.push_back(maybe.elifs[i]);
+                    if(maybe.else_scope != null_node) work.push_back(maybe.else_scope);
+                    break;
+                }
+                case NodeTag::wait:
+                    work.push_back(node.rhs);
+                    break;
+                case NodeTag::assign:
+                    if(const Symbol* var = m_symbols.find_int(node.lhs); var && m_fn->seen[var->var_id] != epoch)
+                    {
+                        m_fn->seen[var->var_id] = epoch;
+                        vars.push_back(var->var_id);
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        return vars;
+    }
+
+    inline void lower_func_def(NodeIndex stmt)
+    {
+        FuncDefView func_def = m_prog.func_def(stmt);
+        m_functions.defined.emplace_back(func_def.name, m_prog.locs[stmt]);
+        const size_t at = m_unit.functions.size();
+        m_unit.functions.emplace_back();
+        FunctionState state;
+        state.func.name = "func_" + std::string(m_interner.name(func_def.name));
+        state.func.symbol = func_def.name;
+        state.func.param_count = static_cast<uint32_t>(func_def.params.size() / 2);
+        FunctionState* outer = m_fn;
+        m_fn = &state;
+        const uint32_t outer_vars = m_symbols.enter_function();
+        new_block();
+
+        for(uint32_t i = 0; i < state.func.param_count; i++)
+        {
+            const ValueId param = emit({.op=IrOp::param, .imm=i});
+            m_symbols.declare_int(func_def.params[i * 2 + 1], new_var(param));
+        }
+        lower_scope(func_def.scope);
+        emit({.op=IrOp::ret, .a=constant(0)}); // falling off the end returns 0
+
+        m_symbols.leave_function(outer_vars);
+        finish(state.func);
+        m_unit.functions[at] = std::move(state.func);
+        m_fn = outer;
+    }
+
+    const NodeProgram& m_prog;
+    const Interner& m_interner; // symbol id -> name, for labels and error messages
+    Diagnostics& m_diags;
+    SymbolTable m_symbols {};
+    FunctionState* m_fn = nullptr;
+    IrUnit m_unit {};
+    std::unordered_map<std::string_view, uint32_t> m_literals {}; // contents -> index in m_unit.strings
+    std::unordered_map<std::string, uint32_t> m_labels {}; // label -> index in m_unit.strings
+    FunctionRefs m_functions {};
+};
@@ -1,53 +1,265 @@
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
-#include <sstream>
+#include <chrono>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
 #include "types.hpp"
+#include "source.hpp"
 #include "tokenizer.hpp"
+#include "diagnostics.hpp"
 #include "parser.hpp"
+#include "lowering.hpp"
+#include "optimize.hpp"
 #include "generation.hpp"
+#include "incremental.hpp"
 
 
+// Writes the executable to out (and the assembly to out.asm for --emit-asm). out
+// is unlinked first, so a copy that's still running keeps its own file.
+static bool write_program(const LinkedProgram& program, bool emit_asm)
+{
+    if(emit_asm)
+    {
+        std::fstream output("out.asm", std::ios::out); //opening output file in write mode
+        output<<program.asm_text; //writing generated assembly code to output file
+    }
+    unlink("out");
+    const int fd = open("out", O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    if(fd < 0)
+    {
+        std::cerr << "cannot create out" << std::endl;
+        return false;
+    }
+    size_t written = 0;
+    while(written < program.executable.size())
+    {
+        const ssize_t n = write(fd, program.executable.data() + written, program.executable.size() - written);
+        if(n <= 0)
+        {
+            std::cerr << "cannot write out" << std::endl;
+            close(fd);
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    close(fd);
+    return true;
+}
+
+// --session : stay alive for an editor session. Every line on stdin names a source
+// file holding the latest version of the program; it is compiled incrementally
+// against the previous one, out (and out.asm) are written as usual, and the reply on
+// stdout is the diagnostics (if any) followed by a "%%done <status>" line.
+static int run_session(bool print_stats, int opt_level, bool emit_asm)
+{
+    Session session(opt_level, emit_asm);
+    std::string path;
+    while(std::getline(std::cin, path))
+    {
+        if(path.empty())
+        {
+            continue;
+        }
+        auto start = std::chrono::steady_clock::now();
+        SourceFile source(path.c_str());
+        if(!source.error().empty())
+        {
+            std::cout << source.error() << "\n%%done 1" << std::endl;
+            continue;
+        }
+        LineIndex lines(source.view());
+        Diagnostics diags(lines);
+        std::optional<LinkedProgram> program = session.compile(source.view(), diags);
+        if(print_stats)
+        {
+            std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+            const SessionStats& stats = session.stats();
+            std::cerr << "[stats] session: " << took.count() * 1000.0 << " ms, relexed " << stats.relexed_bytes << " bytes, rebuilt "
+                      << stats.rebuilt_chunks << " of " << stats.chunks << " chunks, generated " << stats.generated_units << " units" << std::endl;
+        }
+        bool ok = program.has_value();
+        if(ok)
+        {
+            ok = write_program(program.value(), emit_asm);
+        }
+        else
+        {
+            diags.print(std::cout);
+        }
+        std::cout << "%%done " << (ok ? 0 : 1) << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char* argv[]) { //args tells the total size of command line arguments & argv is an array of character pointers listing all the arguments
-    if(argc < 2 )
+    const char* input_path = nullptr;
+    bool print_stats = false; //--stats : report front-end timings on stderr
+    bool pipeline = false; //--pipeline : tokenize on a second thread while parsing
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency()); //--jobs=N : threads for parsing top-level functions
+    bool session = false; //--session : incremental compiles driven from stdin, see run_session
+    bool emit_ir = false; //--emit-ir : print the IR on stdout instead of building
+    bool emit_asm = false; //--emit-asm : write the NASM text to out.asm as well as building out
+    int opt_level = 1; //-O0 / -O1 : optimization level, see optimize()
+    for(int i = 1; i < argc; i++)
+    {
+        std::string_view arg = argv[i];
+        if(arg == "--stats")
+        {
+            print_stats = true;
+        }
+        else if(arg == "--pipeline")
+        {
+            pipeline = true;
+        }
+        else if(arg == "--session")
+        {
+            session = true;
+        }
+        else if(arg == "--emit-ir")
+        {
+            emit_ir = true;
+        }
+        else if(arg == "--emit-asm")
+        {
+            emit_asm = true;
+        }
+        else if(arg.size() == 3 && arg.starts_with("-O") && arg[2] >= '0' && arg[2] <= '9')
+        {
+            opt_level = arg[2] - '0';
+        }
+        else if(arg.starts_with("--jobs=") && arg.size() > 7)
+        {
+            jobs = static_cast<unsigned>(std::max(1, atoi(argv[i] + 7)));
+        }
+        else if(input_path == nullptr && !arg.starts_with("--"))
+        {
+            input_path = argv[i];
+        }
+        else
+        {
+            input_path = nullptr;
+            break;
+        }
+    }
+    if(session && input_path == nullptr)
+    {
+        return run_session(print_stats, opt_level, emit_asm);
+    }
+    if(input_path == nullptr)
     {
         std::cerr<<"you enter wrong less number of arguments"<<std::endl;
-        std::cerr<<"baby <input.by>"<<std::endl;
+        std::cerr<<"baby [--stats] [--pipeline] [--jobs=N] [-O0|-O1] [--emit-ir] [--emit-asm] <input.by>"<<std::endl;
+        std::cerr<<"baby [--stats] [-O0|-O1] [--emit-asm] --session"<<std::endl;
         return EXIT_FAILURE;
     }
     
-    std::string contents;
+    SourceFile source(input_path); //memory-mapping the input, tokens are views into this mapping
+    if(!source.error().empty())
     {
-        std::stringstream contents_stream; //string stream to hold file contents
-        std::fstream input(argv[1], std::ios::in); //opening file in read mode
-        contents_stream << input.rdbuf(); //reading file contents into string stream
-        contents = contents_stream.str(); //converting string stream to string
+        std::cerr << source.error() << std::endl;
+        return EXIT_FAILURE;
     }
-    Tokenizer tokenizer(std::move(contents));
-    std::vector<Token> things=tokenizer.tokenize(); //tokenizing the input source code
+    LineIndex lines(source.view()); //line/column lookup, only built if a diagnostic needs it
+    Interner interner; //identifier -> dense symbol id, filled while lexing
+    Diagnostics diags(lines); //every lexer, parser and generator error, printed together at the end
+    Tokenizer tokenizer(lines, interner, diags);
+    auto lex_start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> lex_time {};
+    size_t token_count = 0;
+    size_t token_bytes = 0;
 
-    Parser parser(std::move(things));
-    std::optional<NodeProgram> prog = parser.parse_prog();
+    std::unique_ptr<TokenRing> ring; //only used in pipelined mode
+    std::thread lexer_thread;
+    std::optional<NodeProgram> prog;
+    if(pipeline)
+    {
+        ring = std::make_unique<TokenRing>();
+        lexer_thread = std::thread([&]{
+            token_count = tokenizer.tokenize_into(*ring);
+            lex_time = std::chrono::steady_clock::now() - lex_start;
+        });
+        auto parser = std::make_unique<Parser>(*ring, lines, diags);
+        prog = parser->parse_prog();
+        lexer_thread.join();
+    }
+    else
+    {
+        TokenStream things=tokenizer.tokenize(); //tokenizing the input source code
+        lex_time = std::chrono::steady_clock::now() - lex_start;
+        token_count = things.size();
+        token_bytes = things.bytes();
+        prog = parse_prog_parallel(things, lines, diags, jobs); //functions are parsed on up to `jobs` threads
+    }
+    if(print_stats)
+    {
+        std::chrono::duration<double> front_time = std::chrono::steady_clock::now() - lex_start;
+        double megabytes = static_cast<double>(source.view().size()) / (1024.0 * 1024.0);
+        std::cerr << "[stats] lexer (" << scan_kernels.name << (pipeline ? ", pipelined" : "") << "): " << source.view().size() << " bytes, " << token_count << " tokens in "
+                  << lex_time.count() * 1000.0 << " ms (" << (lex_time.count() > 0 ? megabytes / lex_time.count() : 0.0) << " MB/s)" << std::endl;
+        if(!pipeline)
+        {
+            std::cerr << "[stats] token stream: " << token_bytes / 1024 << " KB packed" << std::endl;
+        }
+        std::cerr << "[stats] lexer + parser" << (pipeline ? "" : " (" + std::to_string(jobs) + " jobs)") << ": " << front_time.count() * 1000.0 << " ms" << std::endl;
+        if(prog.has_value())
+        {
+            std::cerr << "[stats] AST: " << prog->nodes.size() << " nodes, " << prog->bytes() / 1024 << " KB of " << prog->reserved_bytes() / 1024 << " KB reserved" << std::endl;
+            std::cerr << "[stats] AST parts: " << prog->parts.size() << ", KB used/reserved:";
+            size_t scratch_bytes = 0;
+            for(const AstPartMemory& part : prog->parts)
+            {
+                std::cerr << " " << part.used_bytes / 1024 << "/" << part.reserved_bytes / 1024;
+                scratch_bytes = std::max(scratch_bytes, part.scratch_bytes);
+            }
+            std::cerr << ", child lists up to " << scratch_bytes << " bytes" << std::endl;
+        }
+    }
     if(!prog.has_value())
     {
         std::cerr<<"Parsing failed due to syntax error"<<std::endl;
         return EXIT_FAILURE;
     }
 
-
-    Generator generator(prog.value()); 
+    if(emit_ir)
     {
-        std::fstream output("out.asm", std::ios::out); //opening output file in write mode
-        output<<generator.gen_program(); //writing generated assembly code to output file
+        Lowering lowering(prog.value(), interner, diags);
+        std::vector<IrUnit> units = lowering.lower_program();
+        if(!diags.empty())
+        {
+            diags.print(std::cerr);
+            return EXIT_FAILURE;
+        }
+        optimize(units, opt_level);
+        for(const IrUnit& unit : units)
+        {
+            unit.print(std::cout, interner);
+        }
+        return EXIT_SUCCESS;
     }
 
-
-    system("nasm -felf64 out.asm"); //assembling the generated assembly code into an object file
-    system("ld out.o -o out"); //linking the object file to create an executable
-
-
-    return EXIT_SUCCESS;
+    Generator generator(prog.value(), interner, diags, opt_level); //runs even after syntax errors, the recovered AST can still have undeclared variables
+    std::optional<LinkedProgram> program = generator.gen_program(emit_asm);
+    if(print_stats && opt_level >= 1)
+    {
+        std::cerr << "[stats] peephole:";
+        for(size_t r = 0; r < std::size(peephole_rules); r++)
+        {
+            std::cerr << " " << peephole_rules[r].name << "=" << generator.peephole_stats()[r];
+        }
+        std::cerr << std::endl;
+    }
+    if(!diags.empty())
+    {
+        diags.print(std::cerr);
+        return EXIT_FAILURE;
+    }
+    return write_program(*program, emit_asm) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
\ No newline at end of file
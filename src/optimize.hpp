@@ -0,0 +1,49 @@
+#pragma once
+
+#include <span>
+#include <vector>
+#include "ir.hpp"
+#include "constfold.hpp"
+#include "dce.hpp"
+#include "loops.hpp"
+#include "inline.hpp"
+#include "tailcall.hpp"
+
+// The passes each function goes through at -O1, and again once calls have been
+// inlined into it.
+inline void optimize_function(IrFunction& func)
+{
+    eliminate_tail_recursion(func);
+    ConstantFolder(func).run();
+    func.merge_blocks();
+    LoopOptimizer(func).run();
+    eliminate_dead_code(func);
+}
+
+// The IR passes for an optimization level, over a whole program. -O0 emits
+// the IR as lowered; -O1, the default, runs everything, and inlines calls
+// between units too. (--session does the same, see Session.)
+inline void optimize(std::span<IrUnit> units, int level)
+{
+    if(level < 1)
+    {
+        return;
+    }
+    std::vector<InlineUnit> inlining(units.size());
+    std::vector<InlineUnit*> order;
+    for(size_t i = 0; i < units.size(); i++)
+    {
+        for(IrFunction& func : units[i].functions)
+        {
+            optimize_function(func);
+        }
+        inlining[i].source = &units[i];
+        inlining[i].version = i;
+        order.push_back(&inlining[i]);
+    }
+    Inliner(std::move(order), optimize_function).run();
+    for(size_t i = 0; i < units.size(); i++)
+    {
+        if(inlining[i].inlined) units[i] = std::move(inlining[i].result);
+    }
+}
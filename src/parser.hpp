@@ -1,198 +1,287 @@
 #pragma once
-#include "arena.hpp"
 #include <vector>
 #include <string>
+#include <string_view>
 #include <optional>
+#include <span>
 #include <iostream>
+#include <cstdint>
 #include <cstdlib>
-#include <variant>
+#include <atomic>
+#include <thread>
+#include <algorithm>
 #include "types.hpp"
+#include "tokenizer.hpp"
+#include "diagnostics.hpp"
 using ::bin_prec;
 
-// Forward declarations
-struct NodeStmt;
-struct NodeExpr;
-
-
-struct NodeTermStringLit{
-    Token string_lit;
-};
-
-struct NodeTermIntLit{
-    Token int_lit;
-};
-
-struct NodeTermIdent{
-    Token ident;
-};
-
-struct NodeTermParen{
-    NodeExpr* expr;
-};
-
-struct NodeTermFuncCall{
-    Token ident;
-    std::vector<NodeExpr*> args;
-};
-
-struct NodeTerm{
-    std::variant<NodeTermIntLit*, NodeTermIdent*,NodeTermParen*,NodeTermStringLit*, NodeTermFuncCall*> var;
-};
-
-struct NodeBinExprAdd {
-    NodeExpr* left;
-    NodeExpr* right;
-};
-
-struct NodeBinExprSub {
-    NodeExpr* left;
-    NodeExpr* right;
-};
-struct NodeBinExprDiv {
-    NodeExpr* left;
-    NodeExpr* right;
-};
-struct NodeBinExprMulti{
-     NodeExpr* left;
-     NodeExpr* right;
-};
-
-struct NodeBinExprEq{
-    NodeExpr* left;
-    NodeExpr* right;
-};
-struct NodeBinExprNeq{
-    NodeExpr* left;
-    NodeExpr* right;
-};
-struct NodeBinExprLt{
-    NodeExpr* left;
-    NodeExpr* right;
-};
-struct NodeBinExprGt{
-    NodeExpr* left;
-    NodeExpr* right;
-};
-struct NodeBinExprLte{
-    NodeExpr* left;
-    NodeExpr* right;
-};
-struct NodeBinExprGte{
-    NodeExpr* left;
-    NodeExpr* right;
-};
-
-struct NodeBinExpr{
-    std::variant<NodeBinExprAdd*, NodeBinExprSub*, NodeBinExprDiv*, NodeBinExprMulti*, NodeBinExprEq*, NodeBinExprNeq*, NodeBinExprLt*, NodeBinExprGt*, NodeBinExprLte*, NodeBinExprGte*> var;
-};
-
-struct NodeExpr{
-    std::variant<NodeTerm*, NodeBinExpr*> var;
-};
-
-struct NodeStmtExit{
-    NodeExpr* expr;
-};
-
-struct NodeStmtHope{
-    Token ident;
-    NodeExpr* expr;
-};
-
-struct NodeScope
-{
-    std::vector<NodeStmt*> stmts;
-};
-
-struct NodeStmtMoveOn
-{
-    NodeScope* scope;
-};
+// The AST is stored flat: every node lives in NodeProgram::nodes and refers
+// to its children by 32-bit index. Child lists of variable length (scope
+// statements, call arguments, elifs, parameters) live in NodeProgram::extra.
+using NodeIndex = uint32_t;
+inline constexpr NodeIndex null_node = UINT32_MAX;
+
+enum class NodeTag : uint8_t {
+    // expressions
+    int_lit,
+    ident,
+    string_lit,
+    call,
+    bin_op,
+    // statements
+    exit, // bye(...)
+    hope,
+    dillusion,
+    assign,
+    tell_me,
+    then,
+    scope,
+    maybe, // with its ormaybe / moveon branches
+    wait,
+    func_def,
+};
+
+// Hot part of a node, 12 bytes. What lhs/rhs hold depends on the tag:
+//   int_lit     lhs/rhs  low/high 32 bits of the value
+//   ident       lhs      symbol
+//   string_lit  lhs      index into NodeProgram::strings
+//   call        lhs      callee symbol, rhs  extra: [arg count, args...]
+//   bin_op      lhs/rhs  operands, op is the operator
+//   exit        lhs      expression
+//   hope        lhs      symbol, rhs  initializer
+//   dillusion   lhs      symbol, rhs  initializer
+//   assign      lhs      symbol, rhs  value
+//   tell_me     lhs      expression
+//   then        -
+//   scope       lhs/rhs  statements are extra[lhs .. lhs+rhs)
+//   maybe       lhs      condition, rhs  extra: [scope, elif count, (condition, scope)..., else scope or null_node]
+//   wait        lhs      condition, rhs  scope
+//   func_def    lhs      symbol, rhs  extra: [return type, scope, param count, (type, symbol)...]
+struct Node {
+    NodeTag tag;
+    BinOp op {}; // bin_op only
+    uint32_t lhs = 0;
+    uint32_t rhs = 0;
+};
+
+struct MaybeView {
+    NodeIndex condition;
+    NodeIndex scope;
+    std::span<const NodeIndex> elifs; // (condition, scope) pairs
+    NodeIndex else_scope; // null_node without a moveon
+};
+
+struct FuncDefView {
+    SymbolId name;
+    TokenType return_type; // hope or dillusion
+    NodeIndex scope;
+    std::span<const uint32_t> params; // (TokenType, symbol) pairs
+};
+
+// What one parse of part of the program allocated, for --stats. Its arrays only
+// grow, so what they reserved is their high-water mark.
+struct AstPartMemory {
+    size_t used_bytes = 0;
+    size_t reserved_bytes = 0;
+    size_t scratch_bytes = 0; // reserved for child lists while they were built
+};
+
+struct NodeProgram {
+    std::vector<Node> nodes;
+    std::vector<uint32_t> locs; // cold: source offset of each node's main token, only read for diagnostics
+    std::vector<uint32_t> extra;
+    std::vector<std::string_view> strings; // string literal contents, views into the source
+    std::vector<NodeIndex> stmts; // top level statements in source order
+    std::vector<AstPartMemory> parts; // per parse that built this, in source order
+
+    inline NodeIndex add(Node node, uint32_t loc)
+    {
+        nodes.push_back(node);
+        locs.push_back(loc);
+        return static_cast<NodeIndex>(nodes.size() - 1);
+    }
 
-struct NodeStmtOrMaybe
-{
-    NodeExpr* condition;
-    NodeScope* scope;
-};
+    [[nodiscard]] inline const Node& operator[](NodeIndex i) const
+    {
+        return nodes[i];
+    }
 
-struct NodeStmtMaybe
-{
-    NodeExpr* condition;
-    NodeScope* scope;
-    std::vector<NodeStmtOrMaybe*> elifs;
-    std::optional<NodeStmtMoveOn*> else_stmt;
-};
+    [[nodiscard]] inline int64_t int_value(NodeIndex i) const
+    {
+        return static_cast<int64_t>(static_cast<uint64_t>(nodes[i].lhs) | (static_cast<uint64_t>(nodes[i].rhs) << 32));
+    }
 
-struct NodeStmtWait
-{
-    NodeExpr* condition;
-    NodeScope* scope;
-};
+    [[nodiscard]] inline std::string_view string(NodeIndex i) const
+    {
+        return strings[nodes[i].lhs];
+    }
 
+    [[nodiscard]] inline std::span<const NodeIndex> scope_stmts(NodeIndex i) const
+    {
+        return {extra.data() + nodes[i].lhs, nodes[i].rhs};
+    }
 
-struct NodeStmtDillusion{
-    Token ident;
-    NodeExpr* expr;
-};
+    [[nodiscard]] inline std::span<const NodeIndex> call_args(NodeIndex i) const
+    {
+        const uint32_t at = nodes[i].rhs;
+        return {extra.data() + at + 1, extra[at]};
+    }
 
-struct NodeStmtTellMe{
-    NodeExpr* expr;
-};
+    [[nodiscard]] inline MaybeView maybe(NodeIndex i) const
+    {
+        const uint32_t at = nodes[i].rhs;
+        const uint32_t elif_count = extra[at + 1];
+        return {.condition=nodes[i].lhs, .scope=extra[at],
+                .elifs={extra.data() + at + 2, elif_count * 2}, .else_scope=extra[at + 2 + elif_count * 2]};
+    }
 
-struct NodeStmtAssign{
-    Token ident;
-    NodeExpr* expr;
-};
+    [[nodiscard]] inline FuncDefView func_def(NodeIndex i) const
+    {
+        const uint32_t at = nodes[i].rhs;
+        return {.name=nodes[i].lhs, .return_type=static_cast<TokenType>(extra[at]), .scope=extra[at + 1],
+                .params={extra.data() + at + 3, extra[at + 2] * 2}};
+    }
 
-struct NodeStmtThen{
-};
+    // Appends a program parsed separately from the statements that follow this
+    // one's. Its node, extra and string indices are rebased to where they land;
+    // every extra range belongs to exactly one node, so walking the new nodes
+    // fixes each range once. loc_base moves its source offsets, for a part that
+    // was parsed from its own copy of the text.
+    inline void append(const NodeProgram& part, uint32_t loc_base = 0)
+    {
+        const uint32_t node_base = static_cast<uint32_t>(nodes.size());
+        const uint32_t extra_base = static_cast<uint32_t>(extra.size());
+        const uint32_t string_base = static_cast<uint32_t>(strings.size());
+        nodes.insert(nodes.end(), part.nodes.begin(), part.nodes.end());
+        for(uint32_t loc : part.locs)
+        {
+            locs.push_back(loc + loc_base);
+        }
+        extra.insert(extra.end(), part.extra.begin(), part.extra.end());
+        strings.insert(strings.end(), part.strings.begin(), part.strings.end());
+        for(NodeIndex stmt : part.stmts)
+        {
+            stmts.push_back(stmt + node_base);
+        }
+        parts.insert(parts.end(), part.parts.begin(), part.parts.end());
 
+        auto rebase = [&](uint32_t& index){
+            if(index != null_node) index += node_base;
+        };
+        for(size_t i = node_base; i < nodes.size(); i++)
+        {
+            Node& node = nodes[i];
+            switch(node.tag)
+            {
+                case NodeTag::int_lit:
+                case NodeTag::ident:
+                case NodeTag::then:
+                    break;
+                case NodeTag::string_lit:
+                    node.lhs += string_base;
+                    break;
+                case NodeTag::call:
+                    node.rhs += extra_base;
+                    for(uint32_t a = 0; a < extra[node.rhs]; a++) rebase(extra[node.rhs + 1 + a]);
+                    break;
+                case NodeTag::bin_op:
+                case NodeTag::wait:
+                    rebase(node.lhs);
+                    rebase(node.rhs);
+                    break;
+                case NodeTag::exit:
+                case NodeTag::tell_me:
+                    rebase(node.lhs);
+                    break;
+                case NodeTag::hope:
+                case NodeTag::dillusion:
+                case NodeTag::assign:
+                    rebase(node.rhs);
+                    break;
+                case NodeTag::scope:
+                    node.lhs += extra_base;
+                    for(uint32_t s = 0; s < node.rhs; s++) rebase(extra[node.lhs + s]);
+                    break;
+                case NodeTag::maybe:
+                {
+                    rebase(node.lhs);
+                    node.rhs += extra_base;
+                    const uint32_t elif_count = extra[node.rhs + 1];
+                    rebase(extra[node.rhs]);
+                    for(uint32_t e = 0; e < elif_count * 2; e++) rebase(extra[node.rhs + 2 + e]);
+                    rebase(extra[node.rhs + 2 + elif_count * 2]);
+                    break;
+                }
+                case NodeTag::func_def:
+                    node.rhs += extra_base;
+                    rebase(extra[node.rhs + 1]);
+                    break;
+            }
+        }
+    }
 
-struct NodeFuncDef{
-    Token name;
-    std::vector<std::pair<Token, Token>> args; // Type, Name
-    NodeScope* scope;
-    Token return_type; // hope or dillusion
-};
+    [[nodiscard]] inline size_t bytes() const
+    {
+        return nodes.size() * (sizeof(Node) + sizeof(uint32_t)) + extra.size() * sizeof(uint32_t)
+             + strings.size() * sizeof(std::string_view) + stmts.size() * sizeof(NodeIndex);
+    }
 
-struct NodeStmt{
-    std::variant<NodeStmtExit*, NodeStmtHope*, NodeStmtDillusion*, NodeStmtTellMe*, NodeStmtMaybe*, NodeStmtMoveOn*, NodeStmtWait*, NodeStmtOrMaybe*, NodeScope*, NodeStmtAssign*, NodeStmtThen*, NodeFuncDef*> var;
+    [[nodiscard]] inline size_t reserved_bytes() const
+    {
+        return nodes.capacity() * sizeof(Node) + locs.capacity() * sizeof(uint32_t) + extra.capacity() * sizeof(uint32_t)
+             + strings.capacity() * sizeof(std::string_view) + stmts.capacity() * sizeof(NodeIndex);
+    }
 };
 
-struct NodeProgram{
-    std::vector<NodeStmt> stmts;
-};
 
+// Unwinds from a syntax error to the statement loop that recovers from it, or,
+// for a parser working on part of the stream, out to parse_prog_parallel.
+struct ParseAbort {};
 
 class Parser {
     public:
-        inline explicit Parser(std::vector<Token> tokens) : m_tokens(std::move(tokens)), m_alloc(1024 * 1024*4)
+        inline explicit Parser(const TokenStream& tokens, const LineIndex& lines, Diagnostics& diags)
+            : m_lines(lines), m_diags(&diags), m_window(lines.source()), m_tokens(&tokens), m_end(tokens.size())
         {}
 
+        // Parses only tokens [begin, end), which must hold whole top-level statements.
+        // The first error aborts with ParseAbort instead of being reported, the caller decides what to do.
+        inline explicit Parser(const TokenStream& tokens, const LineIndex& lines, size_t begin, size_t end)
+            : m_lines(lines), m_window(lines.source()), m_tokens(&tokens), position(begin), m_end(end), m_partial(true)
+        {}
 
-        std::optional<NodeTerm*> parse_term()
+        // Pipelined mode: tokens arrive in batches from a tokenizer running on another thread.
+        inline explicit Parser(TokenRing& ring, const LineIndex& lines, Diagnostics& diags)
+            : m_lines(lines), m_diags(&diags), m_window(lines.source()), m_tokens(&m_window), m_ring(&ring)
+        {}
+
+        inline Parser(const Parser&) = delete;
+        inline Parser& operator=(const Parser&) = delete;
+
+
+        std::optional<NodeIndex> parse_term()
         {
             if(auto int_lit =try_consume(TokenType::int_lit))
             {
-                auto Term_expr_int_lit = m_alloc.alloc<NodeTermIntLit>();
-                Term_expr_int_lit->int_lit=int_lit.value();
-                auto expr= m_alloc.alloc<NodeTerm>();
-                expr->var=Term_expr_int_lit;
-                return expr;
+                uint64_t value = 0; // wraps like the assembler would on an oversized literal
+                for(char c : int_lit.value().value)
+                {
+                    value = value * 10 + static_cast<uint64_t>(c - '0');
+                }
+                return add({.tag=NodeTag::int_lit, .lhs=static_cast<uint32_t>(value), .rhs=static_cast<uint32_t>(value >> 32)}, int_lit.value());
             }
             else if(auto ident = try_consume(TokenType::ident))
             {
                 if(try_consume(TokenType::open_paren))
                 {
-                     auto term_call = m_alloc.alloc<NodeTermFuncCall>();
-                     term_call->ident = ident.value();
+                     const size_t scratch_start = m_scratch.size();
                      if(!try_consume(TokenType::close_paren))
                      {
                          while(true)
                          {
                              if(auto arg = parse_expr())
                              {
-                                 term_call->args.push_back(arg.value());
+                                 m_scratch.push_back(arg.value());
                              }
                              else
                              {
@@ -202,16 +291,13 @@ class Parser {
                              try_consume(TokenType::comma, "Expected ',' or ')' in argument list");
                          }
                      }
-                     auto expr = m_alloc.alloc<NodeTerm>();
-                     expr->var = term_call;
-                     return expr;
+                     const uint32_t args = static_cast<uint32_t>(m_prog.extra.size());
+                     m_prog.extra.push_back(static_cast<uint32_t>(m_scratch.size() - scratch_start));
+                     flush_scratch(scratch_start);
+                     return add({.tag=NodeTag::call, .lhs=ident.value().sym, .rhs=args}, ident.value());
                 }
 
-                auto Term_expr_ident = m_alloc.alloc<NodeTermIdent>();
-                Term_expr_ident->ident = ident.value();
-                auto expr = m_alloc.alloc<NodeTerm>();
-                expr->var = Term_expr_ident;
-                return expr;
+                return add({.tag=NodeTag::ident, .lhs=ident.value().sym}, ident.value());
             }
             else if(auto open_paren = try_consume(TokenType::open_paren))
             {
@@ -221,11 +307,7 @@ class Parser {
                     error("Invalid expression inside parentheses");
                 }
                 try_consume(TokenType::close_paren, "expecting close parenthesis ')'");
-                auto term_paren = m_alloc.alloc<NodeTermParen>();
-                term_paren->expr=expr.value();
-                auto term=m_alloc.alloc<NodeTerm>();
-                term->var=term_paren;
-                return term;
+                return expr; // parentheses only steer parsing, they need no node of their own
             }
             else if(auto double_quote = try_consume(TokenType::double_quotes))
             {
@@ -233,11 +315,8 @@ class Parser {
                 {
                     if(auto close_quote = try_consume(TokenType::double_quotes))
                     {
-                        auto Term_expr_string_lit = m_alloc.alloc<NodeTermStringLit>();
-                        Term_expr_string_lit->string_lit=string_lit.value();
-                        auto expr= m_alloc.alloc<NodeTerm>();
-                        expr->var=Term_expr_string_lit;
-                        return expr;
+                        m_prog.strings.push_back(string_lit.value().value);
+                        return add({.tag=NodeTag::string_lit, .lhs=static_cast<uint32_t>(m_prog.strings.size() - 1)}, string_lit.value());
                     }
                 }
                 error("Invalid string literal");
@@ -246,18 +325,15 @@ class Parser {
             return {};
         }
 
-        std::optional<NodeExpr*> parse_expr(int min_prec=0)
-        { 
-            
-            std::optional<NodeTerm*> term_lhs=parse_term();
-            if(!term_lhs.has_value())
+        std::optional<NodeIndex> parse_expr(int min_prec=0)
+        {
+
+            std::optional<NodeIndex> expr_lhs=parse_term();
+            if(!expr_lhs.has_value())
             {
                 return {};
             }
 
-            auto expr_lhs=m_alloc.alloc<NodeExpr>();
-            expr_lhs->var=term_lhs.value();
-            
             while(true)
             {
                 std::optional<Token> curr_tok = peek();
@@ -283,291 +359,90 @@ class Parser {
                     error("Invalid right-hand side expression");
                 }
 
-                auto expr = m_alloc.alloc<NodeExpr>();
-                auto expr_lhs2=m_alloc.alloc<NodeExpr>();
-                if(op.type == TokenType::plus)
-                {
-                    auto add = m_alloc.alloc<NodeBinExprAdd>();
-                    expr_lhs2->var = expr_lhs->var;
-                    add->left=expr_lhs2;
-                    add->right=expr_rhs.value();
-                    auto bin_expr = m_alloc.alloc<NodeBinExpr>();
-                    bin_expr->var = add;
-                    expr->var = bin_expr;
-                }
-                else if(op.type == TokenType::mul)
-                {
-                    auto multi = m_alloc.alloc<NodeBinExprMulti>();
-                    expr_lhs2->var = expr_lhs->var;
-                    multi->left=expr_lhs2;
-                    multi->right=expr_rhs.value();
-                    auto bin_expr = m_alloc.alloc<NodeBinExpr>();
-                    bin_expr->var = multi;
-                    expr->var = bin_expr;
-                }
-                else if(op.type == TokenType::sub)
-                {
-                    auto sub = m_alloc.alloc<NodeBinExprSub>();
-                    expr_lhs2->var = expr_lhs->var;
-                    sub->left=expr_lhs2;
-                    sub->right=expr_rhs.value();
-                    auto bin_expr = m_alloc.alloc<NodeBinExpr>();
-                    bin_expr->var = sub;
-                    expr->var = bin_expr;
-                }
-                else if(op.type == TokenType::div)
-                {
-                    auto div = m_alloc.alloc<NodeBinExprDiv>();
-                    expr_lhs2->var = expr_lhs->var;
-                    div->left=expr_lhs2;
-                    div->right=expr_rhs.value();
-                    auto bin_expr = m_alloc.alloc<NodeBinExpr>();
-                    bin_expr->var = div;
-                    expr->var = bin_expr;
-                }
-                else if(op.type == TokenType::eq_eq)
-                {
-                    auto eq = m_alloc.alloc<NodeBinExprEq>();
-                    expr_lhs2->var = expr_lhs->var;
-                    eq->left=expr_lhs2;
-                    eq->right=expr_rhs.value();
-                    auto bin_expr = m_alloc.alloc<NodeBinExpr>();
-                    bin_expr->var = eq;
-                    expr->var = bin_expr;
-                }
-                else if(op.type == TokenType::neq)
-                {
-                    auto neq = m_alloc.alloc<NodeBinExprNeq>();
-                    expr_lhs2->var = expr_lhs->var;
-                    neq->left=expr_lhs2;
-                    neq->right=expr_rhs.value();
-                    auto bin_expr = m_alloc.alloc<NodeBinExpr>();
-                    bin_expr->var = neq;
-                    expr->var = bin_expr;
-                }
-                else if(op.type == TokenType::lt)
-                {
-                    auto lt = m_alloc.alloc<NodeBinExprLt>();
-                    expr_lhs2->var = expr_lhs->var;
-                    lt->left=expr_lhs2;
-                    lt->right=expr_rhs.value();
-                    auto bin_expr = m_alloc.alloc<NodeBinExpr>();
-                    bin_expr->var = lt;
-                    expr->var = bin_expr;
-                }
-                else if(op.type == TokenType::gt)
-                {
-                    auto gt = m_alloc.alloc<NodeBinExprGt>();
-                    expr_lhs2->var = expr_lhs->var;
-                    gt->left=expr_lhs2;
-                    gt->right=expr_rhs.value();
-                    auto bin_expr = m_alloc.alloc<NodeBinExpr>();
-                    bin_expr->var = gt;
-                    expr->var = bin_expr;
-                }
-                else if(op.type == TokenType::lte)
-                {
-                    auto lte = m_alloc.alloc<NodeBinExprLte>();
-                    expr_lhs2->var = expr_lhs->var;
-                    lte->left=expr_lhs2;
-                    lte->right=expr_rhs.value();
-                    auto bin_expr = m_alloc.alloc<NodeBinExpr>();
-                    bin_expr->var = lte;
-                    expr->var = bin_expr;
-                }
-                else if(op.type == TokenType::gte)
-                {
-                    auto gte = m_alloc.alloc<NodeBinExprGte>();
-                    expr_lhs2->var = expr_lhs->var;
-                    gte->left=expr_lhs2;
-                    gte->right=expr_rhs.value();
-                    auto bin_expr = m_alloc.alloc<NodeBinExpr>();
-                    bin_expr->var = gte;
-                    expr->var = bin_expr;
-                }
-                else{
-                    error("Unknown binary operator");
-                }
-
-                expr_lhs->var = expr->var;
+                expr_lhs = add({.tag=NodeTag::bin_op, .op=to_bin_op(op.type), .lhs=expr_lhs.value(), .rhs=expr_rhs.value()}, op);
             }
 
             return expr_lhs;
         }
 
 
-        std::optional<NodeScope*> parse_scope()
+        std::optional<NodeIndex> parse_scope()
         {
-            if(!try_consume(TokenType::open_curly).has_value())
+            auto open_curly = try_consume(TokenType::open_curly);
+            if(!open_curly.has_value())
             {
                 return {};
             }
-            auto scope = m_alloc.alloc<NodeScope>();
-            while(auto stmt = parse_stmt())
+            const size_t scratch_start = m_scratch.size();
+            m_scope_depth++;
+            while(!peek().has_value() || peek().value().type != TokenType::close_curly)
             {
-                auto node_stmt = m_alloc.alloc<NodeStmt>();
-                *node_stmt = stmt.value();
-                scope->stmts.push_back(node_stmt);
+                if(!peek().has_value())
+                {
+                    m_scope_depth--;
+                    error("Expected '}'");
+                }
+                recover_stmt([&]{
+                    if(auto stmt = parse_stmt())
+                    {
+                        m_scratch.push_back(stmt.value());
+                    }
+                    else
+                    {
+                        error("Expected '}'");
+                    }
+                });
             }
-            try_consume(TokenType::close_curly,"Expected '}'");
-            return scope;
+            consume(); // '}'
+            m_scope_depth--;
+            const uint32_t first = static_cast<uint32_t>(m_prog.extra.size());
+            const uint32_t count = static_cast<uint32_t>(m_scratch.size() - scratch_start);
+            flush_scratch(scratch_start);
+            return add({.tag=NodeTag::scope, .lhs=first, .rhs=count}, open_curly.value());
         }
 
-        std::optional<NodeStmt> parse_stmt()
+        std::optional<NodeIndex> parse_stmt()
         {
             if(peek().has_value() && peek().value().type==TokenType::bye && peek(1).has_value() && peek(1).value().type==TokenType::open_paren)
             {
+                Token bye = consume();
                 consume();
-                consume();
-                auto stmt_exit = m_alloc.alloc<NodeStmtExit>();
+                NodeIndex expr = null_node;
                 if(auto node_expr=parse_expr()) //parsing expression after 'bye' token
                 {
-                    stmt_exit->expr=node_expr.value();
+                    expr=node_expr.value();
                 }
                 else{
                     error("Unexpected token encountered during parsing");
                 }
                 try_consume(TokenType::close_paren, "expecting close parenthesis ')'");
                 try_consume(TokenType::semi, "expecting semicolon ';'");
-                return NodeStmt{.var=stmt_exit};
+                return add({.tag=NodeTag::exit, .lhs=expr}, bye);
             }
 
-            else if(peek().has_value() && peek().value().type == TokenType::hope && peek(1).has_value() && peek(1).value().type==TokenType::ident)
+            else if(peek().has_value() && (peek().value().type == TokenType::hope || peek().value().type == TokenType::dillusion)
+                    && peek(1).has_value() && peek(1).value().type==TokenType::ident)
             {
+                const bool is_hope = peek().value().type == TokenType::hope;
                 // Look ahead for '(' (Func Def) or '=' (Var Decl)
                 if(peek(2).has_value() && peek(2).value().type==TokenType::open_paren)
                 {
-                    // Function Definition: hope name ( ...
-                    Token ret_type = consume(); // hope
-                    Token name = consume(); // ident
-                    consume(); // open_paren
-                    
-                    auto func_def = m_alloc.alloc<NodeFuncDef>();
-                    func_def->return_type = ret_type;
-                    func_def->name = name;
-                    
-                    if(!try_consume(TokenType::close_paren))
-                    {
-                        while(true)
-                        {
-                            Token type_tok;
-                            if(peek().has_value() && (peek().value().type==TokenType::hope || peek().value().type==TokenType::dillusion))
-                            {
-                                type_tok = consume();
-                            }
-                            else
-                            {
-                                error("Expected type (hope/dillusion) in function arguments");
-                            }
-                            
-                            Token arg_name = try_consume(TokenType::ident, "Expected argument name");
-                            func_def->args.push_back({type_tok, arg_name});
-
-                            if(try_consume(TokenType::close_paren)) break;
-                            try_consume(TokenType::comma, "Expected ',' or ')' in parameter list");
-                        }
-                    }
-                    
-                    if(auto scope = parse_scope())
-                    {
-                        func_def->scope = scope.value();
-                    }
-                    else
-                    {
-                        error("Expected scope block for function definition");
-                    }
-                    return NodeStmt{.var=func_def};
+                    return parse_func_def();
                 }
                 else if(peek(2).has_value() && peek(2).value().type==TokenType::eq)
                 {
-                    // Variable Declaration: hope name = ...
-                    consume(); // consume 'hope' keyword
-                    auto stmt_hope = m_alloc.alloc<NodeStmtHope>();
-                    stmt_hope->ident=consume(); // consume identifier
+                    // Variable Declaration: hope name = ... / dillusion name = ...
+                    consume(); // consume 'hope' / 'dillusion' keyword
+                    Token ident=consume(); // consume identifier
                     consume(); // consume '='
-                    if(auto expr=parse_expr()) //parsing expression after 'hope' token
-                    {
-                        stmt_hope->expr=expr.value();
-                    }
-                    else{
-                        error("Invalid Expression after 'hope'");
-                    }
-                    try_consume(TokenType::semi, "expecting semicolon ';'"); 
-                    return NodeStmt{.var=stmt_hope};
-                }
-            }
-
-            else if(peek().has_value() && peek().value().type == TokenType::dillusion && peek(1).has_value() && peek(1).value().type==TokenType::ident)
-            {
-                 // Look ahead for '(' (Func Def) or '=' (Var Decl)
-                if(peek(2).has_value() && peek(2).value().type==TokenType::open_paren)
-                {
-                    // Function Definition: dillusion name ( ...
-                    Token ret_type = consume(); // dillusion
-                    Token name = consume(); // ident
-                    consume(); // open_paren
-                    
-                    auto func_def = m_alloc.alloc<NodeFuncDef>();
-                    func_def->return_type = ret_type;
-                    func_def->name = name;
-                    
-                    if(!try_consume(TokenType::close_paren))
-                    {
-                        while(true)
-                        {
-                            Token type_tok;
-                            if(peek().has_value() && (peek().value().type==TokenType::hope || peek().value().type==TokenType::dillusion))
-                            {
-                                type_tok = consume();
-                            }
-                            else
-                            {
-                                error("Expected type (hope/dillusion) in function arguments");
-                            }
-                            
-                            Token arg_name = try_consume(TokenType::ident, "Expected argument name");
-                            func_def->args.push_back({type_tok, arg_name});
-
-                            if(try_consume(TokenType::close_paren)) break;
-                            try_consume(TokenType::comma, "Expected ',' or ')' in parameter list");
-                        }
-                    }
-                    
-                    if(auto scope = parse_scope())
-                    {
-                        func_def->scope = scope.value();
-                    }
-                    else
-                    {
-                        error("Expected scope block for function definition");
-                    }
-                    return NodeStmt{.var=func_def};
-                }
-                else if(peek(2).has_value() && peek(2).value().type==TokenType::eq)
-                {
-                    consume(); // consume 'dillusion' keyword
-                    auto stmt_dillusion = m_alloc.alloc<NodeStmtDillusion>();
-                    stmt_dillusion->ident=consume(); // consume identifier
-                    consume(); // consume '='
-                    
-                    if(auto expr=parse_expr()) //parsing expression after 'dillusion' token
-                    {
-                        stmt_dillusion->expr=expr.value();
-                    }
-                    else{
-                        error("Invalid Expression after 'dillusion'");
-                    }
-
-                    try_consume(TokenType::semi, "expecting semicolon ';'"); 
-                    return NodeStmt{.var=stmt_dillusion};
+                    NodeIndex init = parse_value(is_hope ? "Invalid Expression after 'hope'" : "Invalid Expression after 'dillusion'", ident, !is_hope); //parsing expression after the declaration
+                    return add({.tag=is_hope ? NodeTag::hope : NodeTag::dillusion, .lhs=ident.sym, .rhs=init}, ident);
                 }
             }
             else if(peek().has_value() && peek().value().type == TokenType::open_curly)
             {
                 if(auto scope = parse_scope()){
-                    auto stmt = m_alloc.alloc<NodeStmt>();
-                    stmt->var = scope.value();
-                    return *stmt;
+                    return scope.value();
                 }
                 else{
                     error("Invalid scope");
@@ -575,188 +450,357 @@ class Parser {
             }
             else if(peek().has_value() && peek().value().type == TokenType::tell_me && peek(1).has_value() && peek(1).value().type==TokenType::open_paren)
             {
-                consume(); // consume 'tell_me' keyword
+                Token tell_me = consume(); // consume 'tell_me' keyword
                 consume(); // consume '('
-                auto stmt_tell_me = m_alloc.alloc<NodeStmtTellMe>();
+                NodeIndex expr_node = null_node;
                 if(auto expr=parse_expr()) //parsing expression after 'tell_me' token
                 {
-                    stmt_tell_me->expr=expr.value();
+                    expr_node=expr.value();
                 }
                 else{
                     error("Invalid Expression after 'tell_me'");
                 }
                 try_consume(TokenType::close_paren, "expecting close parenthesis ')'");
-                try_consume(TokenType::semi, "expecting semicolon ';'"); 
-                return NodeStmt{.var=stmt_tell_me};
+                try_consume(TokenType::semi, "expecting semicolon ';'");
+                return add({.tag=NodeTag::tell_me, .lhs=expr_node}, tell_me);
             }
             else if(auto maybe = try_consume(TokenType::maybe))
             {
-                try_consume(TokenType::open_paren,"Expected '(' after 'maybe'");
-                auto stmt_maybe = m_alloc.alloc<NodeStmtMaybe>();
-                if(auto expr = parse_expr())
-                {
-                    stmt_maybe->condition=expr.value();
-                }else
-                {
-                    error("Invalid expression inside parentheses");
-                }
-                try_consume(TokenType::close_paren,"Expected ')' after 'maybe'");
-                if(auto scope = parse_scope())
-                {
-                    stmt_maybe->scope=scope.value();
-                }
-                else{
-                    error("Invalid scope inside 'maybe'");
-                }
+                auto [condition, scope] = parse_condition_and_scope("maybe");
 
                 // Check for elifs (ormaybe)
+                const size_t scratch_start = m_scratch.size();
                 while(auto or_maybe_tok = try_consume(TokenType::ormaybe))
                 {
-                    try_consume(TokenType::open_paren,"Expected '(' after 'ormaybe'");
-                    auto stmt_or_maybe = m_alloc.alloc<NodeStmtOrMaybe>();
-                    if(auto expr = parse_expr())
-                    {
-                        stmt_or_maybe->condition=expr.value();
-                    }else
-                    {
-                        error("Invalid expression inside parentheses");
-                    }
-                    try_consume(TokenType::close_paren,"Expected ')' after 'ormaybe'");
-                    if(auto scope = parse_scope())
-                    {
-                        stmt_or_maybe->scope=scope.value();
-                    }
-                    else{
-                        error("Invalid scope inside 'ormaybe'");
-                    }
-                    stmt_maybe->elifs.push_back(stmt_or_maybe);
+                    auto [elif_condition, elif_scope] = parse_condition_and_scope("ormaybe");
+                    m_scratch.push_back(elif_condition);
+                    m_scratch.push_back(elif_scope);
                 }
 
                 // Check for else (moveon)
+                NodeIndex else_scope = null_node;
                 if(auto move_on_tok = try_consume(TokenType::moveon))
                 {
-                    auto stmt_move_on = m_alloc.alloc<NodeStmtMoveOn>();
                     if(auto scope = parse_scope())
                     {
-                        stmt_move_on->scope=scope.value();
+                        else_scope=scope.value();
                     }
                     else{
                         error("Invalid scope inside 'moveon'");
                     }
-                    stmt_maybe->else_stmt = stmt_move_on;
                 }
 
-                auto stmt=m_alloc.alloc<NodeStmt>();
-                stmt->var=stmt_maybe;
-                return *stmt;
+                const uint32_t branches = static_cast<uint32_t>(m_prog.extra.size());
+                m_prog.extra.push_back(scope);
+                m_prog.extra.push_back(static_cast<uint32_t>((m_scratch.size() - scratch_start) / 2));
+                flush_scratch(scratch_start);
+                m_prog.extra.push_back(else_scope);
+                return add({.tag=NodeTag::maybe, .lhs=condition, .rhs=branches}, maybe.value());
             }
             else if(auto wait = try_consume(TokenType::wait))
             {
-                try_consume(TokenType::open_paren,"Expected '(' after 'wait'");
-                auto stmt_wait = m_alloc.alloc<NodeStmtWait>();
-                if(auto expr = parse_expr())
-                {
-                    stmt_wait->condition=expr.value();
-                }else
-                {
-                    error("Invalid expression inside parentheses");
-                }
-                try_consume(TokenType::close_paren,"Expected ')' after 'wait'");
-                if(auto scope = parse_scope())
-                {
-                    stmt_wait->scope=scope.value();
-                }
-                else{
-                    error("Invalid scope inside 'wait'");
-                }
-                auto stmt=m_alloc.alloc<NodeStmt>();
-                stmt->var=stmt_wait;
-                return *stmt;
+                auto [condition, scope] = parse_condition_and_scope("wait");
+                return add({.tag=NodeTag::wait, .lhs=condition, .rhs=scope}, wait.value());
             }
             else if(peek().has_value() && peek().value().type==TokenType::ident && peek(1).has_value() && peek(1).value().type==TokenType::eq)
             {
-                auto stmt_assign = m_alloc.alloc<NodeStmtAssign>();
-                stmt_assign->ident = consume();
+                Token ident = consume();
                 consume(); // consume '='
-                if(auto expr=parse_expr())
-                {
-                    stmt_assign->expr = expr.value();
-                }
-                else{
-                    error("Invalid Expression after assignment");
-                }
-                try_consume(TokenType::semi, "expecting semicolon ';'");
-                return NodeStmt{.var=stmt_assign};
+                NodeIndex value = parse_value("Invalid Expression after assignment", ident, false);
+                return add({.tag=NodeTag::assign, .lhs=ident.sym, .rhs=value}, ident);
             }
             else if(auto then_tok=try_consume(TokenType::then_tok))
             {
                try_consume(TokenType::semi, "expecting semicolon ';'");
-               auto stmt_then = m_alloc.alloc<NodeStmtThen>();
-               return NodeStmt{.var=stmt_then}; 
+               return add({.tag=NodeTag::then}, then_tok.value());
             }
-            
+
             return {};
         }
 
 
         std::optional<NodeProgram> parse_prog()
         {
-            NodeProgram prog;
             while(peek().has_value())
             {
-                if(auto stmt=parse_stmt())
+                recover_stmt([&]{
+                    if(auto stmt=parse_stmt())
+                    {
+                        m_prog.stmts.push_back(stmt.value());
+                    }
+                    else{
+                        error("Invalid Statement encountered during parsing");
+                    }
+                });
+            }
+            m_prog.parts.push_back({.used_bytes=m_prog.bytes(), .reserved_bytes=m_prog.reserved_bytes(), .scratch_bytes=m_scratch.capacity() * sizeof(uint32_t)});
+            return std::move(m_prog);
+        }
+
+
+
+
+
+    private:
+    // Function Definition: (hope|dillusion) name ( [(hope|dillusion) arg [, ...]] ) { ... }
+    NodeIndex parse_func_def()
+    {
+        Token ret_type = consume(); // hope / dillusion
+        Token name = consume(); // ident
+        consume(); // open_paren
+
+        const size_t scratch_start = m_scratch.size();
+        if(!try_consume(TokenType::close_paren))
+        {
+            while(true)
+            {
+                Token type_tok;
+                if(peek().has_value() && (peek().value().type==TokenType::hope || peek().value().type==TokenType::dillusion))
                 {
-                    prog.stmts.push_back(stmt.value());
+                    type_tok = consume();
                 }
-                else{
-                    error("Invalid Statement encountered during parsing");
+                else
+                {
+                    error("Expected type (hope/dillusion) in function arguments");
                 }
+
+                Token arg_name = try_consume(TokenType::ident, "Expected argument name");
+                m_scratch.push_back(static_cast<uint32_t>(type_tok.type));
+                m_scratch.push_back(arg_name.sym);
+
+                if(try_consume(TokenType::close_paren)) break;
+                try_consume(TokenType::comma, "Expected ',' or ')' in parameter list");
             }
-            return prog;
         }
 
+        NodeIndex body = null_node;
+        if(auto scope = parse_scope())
+        {
+            body = scope.value();
+        }
+        else
+        {
+            error("Expected scope block for function definition");
+        }
 
+        const uint32_t signature = static_cast<uint32_t>(m_prog.extra.size());
+        m_prog.extra.push_back(static_cast<uint32_t>(ret_type.type));
+        m_prog.extra.push_back(body);
+        m_prog.extra.push_back(static_cast<uint32_t>((m_scratch.size() - scratch_start) / 2));
+        flush_scratch(scratch_start);
+        return add({.tag=NodeTag::func_def, .lhs=name.sym, .rhs=signature}, name);
+    }
 
+    // ( condition ) { scope } as used by maybe, ormaybe and wait
+    std::pair<NodeIndex, NodeIndex> parse_condition_and_scope(const std::string& keyword)
+    {
+        try_consume(TokenType::open_paren,"Expected '(' after '" + keyword + "'");
+        NodeIndex condition = null_node;
+        if(auto expr = parse_expr())
+        {
+            condition=expr.value();
+        }else
+        {
+            error("Invalid expression inside parentheses");
+        }
+        try_consume(TokenType::close_paren,"Expected ')' after '" + keyword + "'");
+        NodeIndex scope_node = null_node;
+        if(auto scope = parse_scope())
+        {
+            scope_node=scope.value();
+        }
+        else{
+            error("Invalid scope inside '" + keyword + "'");
+        }
+        return {condition, scope_node};
+    }
 
+    // Runs one statement's parse. After a syntax error the tokens up to and including
+    // the next ';' are skipped, or up to the next '}' (left for the enclosing scope,
+    // or dropped at the top level), and parsing carries on with the statement after.
+    template <typename ParseFn>
+    inline void recover_stmt(ParseFn parse)
+    {
+        const size_t start = position;
+        const size_t mark = m_scratch.size();
+        try
+        {
+            parse();
+        }
+        catch(const ParseAbort&)
+        {
+            if(m_partial)
+            {
+                throw;
+            }
+            m_scratch.resize(mark);
+            synchronize();
+            if(position == start && peek().has_value()) // always make progress
+            {
+                consume();
+            }
+        }
+    }
 
-    private:
-    [[nodiscard]] inline std::optional<Token> peek(int offset=0) const 
+    inline void synchronize()
     {
-        if(position+offset >= m_tokens.size())
+        while(peek().has_value())
+        {
+            const TokenType type = peek().value().type;
+            if(type == TokenType::semi)
+            {
+                consume();
+                return;
+            }
+            if(type == TokenType::open_curly) // the broken statement's block, skip it whole
+            {
+                for(size_t depth = 0; peek().has_value(); )
+                {
+                    const TokenType t = consume().type;
+                    if(t == TokenType::open_curly) depth++;
+                    else if(t == TokenType::close_curly && --depth == 0) return;
+                }
+                return;
+            }
+            if(type == TokenType::close_curly)
+            {
+                if(m_scope_depth == 0)
+                {
+                    consume();
+                }
+                return;
+            }
+            consume();
+        }
+    }
+
+    // value of a declaration or assignment, up to and including its ';'. If it
+    // doesn't parse the error is reported and the statement skipped as usual, but
+    // the name still gets declared (with 0, or "" for a dillusion) so later uses
+    // of it don't pile up undeclared-variable errors.
+    NodeIndex parse_value(const char* msg, const Token& name, bool string_placeholder)
+    {
+        const size_t mark = m_scratch.size();
+        try
+        {
+            NodeIndex value = null_node;
+            if(auto expr = parse_expr())
+            {
+                value = expr.value();
+            }
+            else
+            {
+                error(msg);
+            }
+            try_consume(TokenType::semi, "expecting semicolon ';'");
+            return value;
+        }
+        catch(const ParseAbort&)
+        {
+            if(m_partial)
+            {
+                throw;
+            }
+            m_scratch.resize(mark);
+            synchronize();
+            if(string_placeholder)
+            {
+                m_prog.strings.push_back({});
+                return add({.tag=NodeTag::string_lit, .lhs=static_cast<uint32_t>(m_prog.strings.size() - 1)}, name);
+            }
+            return add({.tag=NodeTag::int_lit}, name);
+        }
+    }
+
+    inline NodeIndex add(Node node, const Token& tok)
+    {
+        return m_prog.add(node, static_cast<uint32_t>(tok.value.data() - m_lines.source().data()));
+    }
+
+    // moves the child list collected in m_scratch since start to the end of extra.
+    // Children are parsed depth first, so an inner list is always flushed before
+    // its parent's list continues growing on top of it.
+    inline void flush_scratch(size_t start)
+    {
+        m_prog.extra.insert(m_prog.extra.end(), m_scratch.begin() + static_cast<std::ptrdiff_t>(start), m_scratch.end());
+        m_scratch.resize(start);
+    }
+
+    [[nodiscard]] inline std::optional<Token> peek(int offset=0)
+    {
+        if(!fill(offset))
         {
             return {};
         }
         else
         {
-            return m_tokens[position+offset];
+            return (*m_tokens)[position+offset];
         }
     }
 
-    inline Token consume() 
+    // makes sure token position+offset is loaded, pulling batches from the ring
+    // in pipelined mode. False when the token range ends before that.
+    inline bool fill(size_t offset)
     {
-        return m_tokens[position++];
+        while(position+offset >= m_end && m_ring != nullptr && !m_ring_done)
+        {
+            if(position > token_batch_size)
+            {
+                // drop consumed tokens, keeping the last one for "(after this)" errors
+                m_window.erase_front(position - 1);
+                position = 1;
+            }
+            TokenBatch& batch = m_ring->consumer_slot();
+            m_window.append(batch.tokens.begin(), batch.tokens.begin() + batch.count);
+            m_ring_done = batch.last;
+            m_ring->release();
+            m_end = m_window.size();
+        }
+        return position+offset < m_end;
     }
 
-    void error(const std::string& msg) const
+    inline Token consume()
     {
-        std::cerr << "[Parser Error] ";
-        if(peek().has_value())
+        return (*m_tokens)[position++];
+    }
+
+    // reports msg and unwinds to the statement loop that recovers, see recover_stmt
+    [[noreturn]] void error(const std::string& msg)
+    {
+        if(m_partial)
+        {
+            throw ParseAbort{};
+        }
+        const bool at_eof = !peek().has_value();
+        if(at_eof && m_eof_reported)
         {
-             const auto& tok = peek().value();
-             std::cerr << "Line " << tok.line << ":" << tok.col << " >>> ";
+            throw ParseAbort{}; // every scope still open at EOF would say the same thing again
         }
-        else if (position > 0 && position <= m_tokens.size()) {
-             const auto& tok = m_tokens[position-1];
-             std::cerr << "Line " << tok.line << ":" << tok.col << " (after this) >>> ";
+        m_eof_reported = at_eof;
+
+        Diagnostic diag {.offset=m_lines.source().size(), .prefix="[Parser Error] ", .msg=msg};
+        if(!at_eof)
+        {
+             diag.offset = offset_of(peek().value());
+             diag.at = " >>> ";
+        }
+        else if (position > 0 && position <= m_end) {
+             diag.offset = offset_of((*m_tokens)[position-1]);
+             diag.at = " (after this) >>> ";
         }
         else {
-             std::cerr << "(at EOF) >>> ";
+             diag.prefix += "(at EOF) >>> ";
         }
-        std::cerr << msg << std::endl;
-        exit(EXIT_FAILURE);
+        m_diags->report(std::move(diag));
+        throw ParseAbort{};
     }
 
-    inline Token try_consume(TokenType type,const std::string& err_msg) 
+    [[nodiscard]] inline size_t offset_of(const Token& tok) const
+    {
+        return static_cast<size_t>(tok.value.data() - m_lines.source().data());
+    }
+
+    inline Token try_consume(TokenType type,const std::string& err_msg)
     {
         if(peek().has_value() && peek().value().type==type)
         {
@@ -765,12 +809,11 @@ class Parser {
         else
         {
             error(err_msg);
-            return {}; // Unreachable
         }
     }
 
 
-    inline std::optional<Token> try_consume(TokenType type) 
+    inline std::optional<Token> try_consume(TokenType type)
     {
         if(peek().has_value() && peek().value().type==type)
         {
@@ -784,8 +827,165 @@ class Parser {
 
 
 
-    ArenaAllocation m_alloc; 
+        NodeProgram m_prog;
+        std::vector<uint32_t> m_scratch; // child lists under construction, see flush_scratch
 
-        const std::vector<Token> m_tokens; 
+        const LineIndex& m_lines;
+        Diagnostics* m_diags = nullptr; // null for a partial parser, which never reports
+        TokenStream m_window; // sliding window over the ring in pipelined mode
+        const TokenStream* m_tokens; // the caller's stream, or m_window
         size_t position = 0;
-};
\ No newline at end of file
+        size_t m_end = 0; // one past the last token this parser may read
+        TokenRing* m_ring = nullptr;
+        bool m_ring_done = false;
+        bool m_partial = false;
+        bool m_eof_reported = false;
+        size_t m_scope_depth = 0; // scopes being parsed, decides what synchronize() does with a '}' 
+};
+
+// A run of whole top-level statements, in tokens [begin, end): either one
+// function definition or everything between two of them.
+struct TopLevelSpan {
+    size_t begin;
+    size_t end;
+    bool is_function;
+};
+
+// Splits the top level into independently parsable spans, covering every token
+// in order. Only token types are looked at, matching parens and braces to find
+// where each top-level function definition ends. Empty when the braces don't
+// balance or a top-level scope is still open at the end; the sequential parser
+// reports that.
+inline std::vector<TopLevelSpan> top_level_spans(const TokenStream& tokens)
+{
+    std::vector<TopLevelSpan> spans;
+    const size_t n = tokens.size();
+    size_t depth = 0; // braces of top-level scopes, functions only start at 0
+    size_t run_begin = 0;
+    size_t i = 0;
+    while(i < n)
+    {
+        const TokenType type = tokens.type(i);
+        if(depth == 0 && (type == TokenType::hope || type == TokenType::dillusion)
+           && i + 2 < n && tokens.type(i + 1) == TokenType::ident && tokens.type(i + 2) == TokenType::open_paren)
+        {
+            size_t j = i + 2;
+            for(size_t parens = 0; j < n; j++)
+            {
+                if(tokens.type(j) == TokenType::open_paren) parens++;
+                else if(tokens.type(j) == TokenType::close_paren && --parens == 0) break;
+            }
+            if(++j >= n || tokens.type(j) != TokenType::open_curly)
+            {
+                return {};
+            }
+            for(size_t braces = 0; j < n; j++)
+            {
+                if(tokens.type(j) == TokenType::open_curly) braces++;
+                else if(tokens.type(j) == TokenType::close_curly && --braces == 0) break;
+            }
+            if(j >= n)
+            {
+                return {};
+            }
+            if(run_begin != i)
+            {
+                spans.push_back({.begin=run_begin, .end=i, .is_function=false});
+            }
+            spans.push_back({.begin=i, .end=j + 1, .is_function=true});
+            i = run_begin = j + 1;
+            continue;
+        }
+        if(type == TokenType::open_curly) depth++;
+        else if(type == TokenType::close_curly && depth > 0) depth--;
+        i++;
+    }
+    if(depth != 0)
+    {
+        return {};
+    }
+    if(run_begin != n)
+    {
+        spans.push_back({.begin=run_begin, .end=n, .is_function=false});
+    }
+    return spans;
+}
+
+// Parses the top level in parallel. The spans are grouped into a few work units
+// per thread, each parsed by its own Parser into its own NodeProgram (so workers
+// never share an allocation), and the parts are appended in source order, which
+// gives exactly the program a sequential parse would. If any unit fails, the
+// whole stream is parsed again sequentially, which does the error recovery and
+// reports every diagnostic in order.
+inline std::optional<NodeProgram> parse_prog_parallel(const TokenStream& tokens, const LineIndex& lines, Diagnostics& diags, unsigned jobs)
+{
+    static constexpr size_t min_parallel_tokens = 1 << 16; // below this, threads cost more than they save
+    std::vector<TopLevelSpan> spans;
+    if(jobs > 1 && tokens.size() >= min_parallel_tokens)
+    {
+        spans = top_level_spans(tokens);
+    }
+    if(spans.size() <= 1)
+    {
+        return Parser(tokens, lines, diags).parse_prog();
+    }
+
+    std::vector<std::pair<size_t, size_t>> units;
+    const size_t unit_tokens = tokens.size() / (static_cast<size_t>(jobs) * 4) + 1;
+    for(size_t s = 0, begin = 0; s < spans.size(); s++)
+    {
+        if(spans[s].end - begin >= unit_tokens || s + 1 == spans.size())
+        {
+            units.emplace_back(begin, spans[s].end);
+            begin = spans[s].end;
+        }
+    }
+
+    std::vector<NodeProgram> parts(units.size());
+    std::vector<uint8_t> parsed(units.size(), 0);
+    std::atomic<size_t> next_unit {0};
+    auto worker = [&]{
+        for(size_t u = next_unit++; u < units.size(); u = next_unit++)
+        {
+            try
+            {
+                parts[u] = Parser(tokens, lines, units[u].first, units[u].second).parse_prog().value();
+                parsed[u] = 1;
+            }
+            catch(const ParseAbort&)
+            {
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    const size_t threads = std::min<size_t>(jobs, units.size());
+    for(size_t t = 1; t < threads; t++)
+    {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for(std::thread& thread : pool)
+    {
+        thread.join();
+    }
+
+    if(std::find(parsed.begin(), parsed.end(), 0) != parsed.end())
+    {
+        return Parser(tokens, lines, diags).parse_prog();
+    }
+    NodeProgram prog;
+    size_t node_count = 0, extra_count = 0;
+    for(const NodeProgram& part : parts)
+    {
+        node_count += part.nodes.size();
+        extra_count += part.extra.size();
+    }
+    prog.nodes.reserve(node_count);
+    prog.locs.reserve(node_count);
+    prog.extra.reserve(extra_count);
+    for(const NodeProgram& part : parts)
+    {
+        prog.append(part);
+    }
+    return prog;
+}
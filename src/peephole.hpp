@@ -0,0 +1,176 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+#include "asm.hpp"
+
+// Where each label is in the code, for the rules that follow jumps.
+struct LabelTargets {
+    const std::vector<AsmInst>* insts = nullptr;
+    std::vector<size_t> at {}; // per symbol, index of its label instruction, or SIZE_MAX
+
+    // the first instruction that isn't a label or a nop at or after label symbol
+    [[nodiscard]] const AsmInst* first_after(int64_t symbol) const
+    {
+        size_t i = at[static_cast<size_t>(symbol)];
+        if(i == SIZE_MAX) return nullptr;
+        while(i < insts->size() && ((*insts)[i].op == AsmOp::label || (*insts)[i].op == AsmOp::nop))
+        {
+            i++;
+        }
+        return i < insts->size() ? &(*insts)[i] : nullptr;
+    }
+};
+
+// A rule sees the next `window` instructions (nops skipped) and rewrites them
+// in place; an instruction it deletes becomes a nop. Self-moves, jumps to the
+// next block and code after a jump are never emitted, so there are no rules for them.
+struct PeepholeRule {
+    const char* name;
+    size_t window;
+    bool (*apply)(AsmInst* const* w, const LabelTargets& labels);
+};
+
+namespace peephole_rules_impl {
+
+inline bool is_mov64(const AsmInst& inst)
+{
+    return inst.op == AsmOp::mov && inst.a.width == 64;
+}
+
+// mov [m], r / mov r2, [m]  ->  the load becomes a copy, or goes
+inline bool store_load(AsmInst* const* w, const LabelTargets&)
+{
+    if(!is_mov64(*w[0]) || !w[0]->a.is_mem() || !w[0]->b.is_reg()) return false;
+    if(!is_mov64(*w[1]) || !w[1]->b.is_mem() || !(w[1]->b == w[0]->a) || !w[1]->a.is_reg()) return false;
+    if(w[1]->a == w[0]->b)
+    {
+        w[1]->op = AsmOp::nop;
+    }
+    else
+    {
+        w[1]->b = w[0]->b;
+    }
+    return true;
+}
+
+// mov a, b / mov b, a
+inline bool move_back(AsmInst* const* w, const LabelTargets&)
+{
+    if(!is_mov64(*w[0]) || !is_mov64(*w[1])) return false;
+    if(!(w[0]->a == w[1]->b) || !(w[0]->b == w[1]->a)) return false;
+    w[1]->op = AsmOp::nop;
+    return true;
+}
+
+// mov r, x / mov r, y  where y doesn't read r
+inline bool dead_move(AsmInst* const* w, const LabelTargets&)
+{
+    if(!is_mov64(*w[0]) || !w[0]->a.is_reg() || !is_mov64(*w[1]) || !(w[1]->a == w[0]->a)) return false;
+    if(w[1]->b.uses(w[0]->a.reg)) return false;
+    w[0]->op = AsmOp::nop;
+    return true;
+}
+
+// mov r, x / imul r, r, imm  ->  imul r, x, imm
+inline bool imul_three(AsmInst* const* w, const LabelTargets&)
+{
+    if(!is_mov64(*w[0]) || !w[0]->a.is_reg() || w[0]->b.is_imm()) return false;
+    const AsmInst& mul = *w[1];
+    if(mul.op != AsmOp::imul || mul.c.kind != Operand::Kind::imm || !(mul.a == w[0]->a) || !(mul.b == w[0]->a)) return false;
+    w[1]->b = w[0]->b;
+    w[0]->op = AsmOp::nop;
+    return true;
+}
+
+// add x, 0 / sub x, 0 / imul r, x, 1
+inline bool identity(AsmInst* const* w, const LabelTargets&)
+{
+    AsmInst& inst = *w[0];
+    if((inst.op == AsmOp::add || inst.op == AsmOp::sub) && inst.b.is_imm() && inst.b.imm == 0)
+    {
+        inst.op = AsmOp::nop;
+        return true;
+    }
+    if(inst.op == AsmOp::imul && inst.c.is_imm() && inst.c.imm == 1)
+    {
+        inst = {.op=AsmOp::mov, .a=inst.a, .b=inst.b};
+        if(inst.a == inst.b) inst.op = AsmOp::nop;
+        return true;
+    }
+    return false;
+}
+
+// cmp r, 0  ->  test r, r  (the same flags, a shorter encoding)
+inline bool compare_zero(AsmInst* const* w, const LabelTargets&)
+{
+    AsmInst& inst = *w[0];
+    if(inst.op != AsmOp::cmp || !inst.a.is_reg() || !inst.b.is_imm() || inst.b.imm != 0) return false;
+    inst = {.op=AsmOp::test, .a=inst.a, .b=inst.a};
+    return true;
+}
+
+// a jump to a jump goes straight to where that one goes
+inline bool jump_thread(AsmInst* const* w, const LabelTargets& labels)
+{
+    if((w[0]->op != AsmOp::jmp && w[0]->op != AsmOp::jcc) || w[0]->a.kind != Operand::Kind::sym) return false;
+    const AsmInst* next = labels.first_after(w[0]->a.imm);
+    if(next == nullptr || next->op != AsmOp::jmp || next->a == w[0]->a) return false;
+    w[0]->a = next->a;
+    return true;
+}
+
+} // namespace peephole_rules_impl
+
+inline constexpr PeepholeRule peephole_rules[] = {
+    {"store-load", 2, peephole_rules_impl::store_load},
+    {"move-back", 2, peephole_rules_impl::move_back},
+    {"dead-move", 2, peephole_rules_impl::dead_move},
+    {"imul-three-operand", 2, peephole_rules_impl::imul_three},
+    {"identity-arith", 1, peephole_rules_impl::identity},
+    {"compare-zero", 1, peephole_rules_impl::compare_zero},
+    {"jump-thread", 1, peephole_rules_impl::jump_thread},
+};
+
+// how many times each rule fired, in table order
+using PeepholeStats = std::array<uint64_t, std::size(peephole_rules)>;
+
+// Runs the rule table over emitted code until nothing changes, then drops the nops.
+inline void peephole(AsmCode& code, PeepholeStats& stats)
+{
+    std::vector<AsmInst>& insts = code.insts;
+    LabelTargets labels {.insts=&insts};
+    labels.at.assign(code.symbols.size(), SIZE_MAX);
+    for(size_t i = 0; i < insts.size(); i++)
+    {
+        if(insts[i].op == AsmOp::label) labels.at[static_cast<size_t>(insts[i].a.imm)] = i;
+    }
+
+    bool changed = true;
+    for(int pass = 0; changed && pass < 8; pass++) // threading jump cycles could go on forever
+    {
+        changed = false;
+        for(size_t i = 0; i < insts.size(); i++)
+        {
+            if(insts[i].op == AsmOp::nop) continue;
+            AsmInst* window[2];
+            size_t filled = 0;
+            for(size_t j = i; j < insts.size() && filled < std::size(window); j++)
+            {
+                if(insts[j].op != AsmOp::nop) window[filled++] = &insts[j];
+            }
+            for(size_t r = 0; r < std::size(peephole_rules); r++)
+            {
+                if(filled >= peephole_rules[r].window && peephole_rules[r].apply(window, labels))
+                {
+                    stats[r]++;
+                    changed = true;
+                    break; // the window is stale, the next pass looks again
+                }
+            }
+        }
+    }
+    std::erase_if(insts, [](const AsmInst& inst){ return inst.op == AsmOp::nop; });
+}
@@ -0,0 +1,370 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "ir.hpp"
+
+// x86-64 general purpose registers, numbered the way instructions encode them.
+enum class Reg : uint8_t { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15 };
+
+inline const char* reg_name(Reg reg)
+{
+    static const char* const names[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+    return names[static_cast<int>(reg)];
+}
+
+inline const char* reg_name32(Reg reg)
+{
+    static const char* const names[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+    return names[static_cast<int>(reg)];
+}
+
+inline const char* reg_name16(Reg reg)
+{
+    static const char* const names[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"};
+    return names[static_cast<int>(reg)];
+}
+
+inline const char* reg_name8(Reg reg)
+{
+    static const char* const names[] = {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
+    return names[static_cast<int>(reg)];
+}
+
+using RegMask = uint16_t;
+
+inline constexpr RegMask reg_bit(Reg reg)
+{
+    return static_cast<RegMask>(1u << static_cast<int>(reg));
+}
+
+// Calling convention between functions, all of them compiled by us: the first
+// six arguments in these registers, the rest pushed right to left, the result
+// in rax. rbx and r12-r15 survive a call, every other register may not.
+inline constexpr Reg arg_regs[] = {Reg::rdi, Reg::rsi, Reg::rdx, Reg::rcx, Reg::r8, Reg::r9};
+inline constexpr RegMask callee_saved = reg_bit(Reg::rbx) | reg_bit(Reg::r12) | reg_bit(Reg::r13) | reg_bit(Reg::r14) | reg_bit(Reg::r15);
+inline constexpr RegMask caller_saved = reg_bit(Reg::rax) | reg_bit(Reg::rcx) | reg_bit(Reg::rdx) | reg_bit(Reg::rsi) | reg_bit(Reg::rdi)
+                                      | reg_bit(Reg::r8) | reg_bit(Reg::r9) | reg_bit(Reg::r10) | reg_bit(Reg::r11);
+
+// Where a value lives for the whole of its live range.
+struct Location {
+    enum class Kind : uint8_t { none, reg, slot };
+    Kind kind = Kind::none; // none: never used, nothing to keep
+    Reg reg = Reg::rax;
+    uint32_t slot = 0; // spill slots count from 0, the emitter places them in the frame
+};
+
+struct Allocation {
+    std::vector<Location> where; // per value; constants are never given one, they're immediates
+    uint32_t slot_count = 0;
+    RegMask used = 0; // registers handed out, to know which callee-saved ones need saving
+    std::vector<ValueId> fused; // per block, IrFunction::branch_compares()
+};
+
+// Linear scan register allocation (Poletto & Sarkar) over the SSA values of a
+// function. Instructions are numbered in block order; a value's live range is
+// one interval from its definition to the furthest point it's live, found by
+// walking back from each use to the definition (a phi argument is used at the
+// end of its predecessor). Intervals get registers in order of their start;
+// when none is free, whichever of the contenders ends last is spilled to a
+// stack slot for its whole range. Spilled intervals then share slots wherever
+// they don't overlap.
+//
+// r10 and r11 are left to the emitter as scratch registers, and rbp is the frame
+// pointer, so 12 registers are handed out. A value live across a call (print
+// helpers and syscalls count) only gets a callee-saved one, and a value live
+// across a div stays out of rax and rdx, which div uses. A br on a comparison
+// from its own block that nothing else uses (see IrFunction::branch_compares)
+// uses the comparison's operands instead, so that comparison never gets a location.
+class RegisterAllocator {
+public:
+    inline explicit RegisterAllocator(const IrFunction& func) : m_func(func)
+    {}
+
+    inline Allocation run()
+    {
+        number();
+        build_intervals();
+        scan();
+        assign_slots();
+        return std::move(m_alloc);
+    }
+
+    // every instruction that clobbers registers other than its own result
+    [[nodiscard]] static inline RegMask clobbers(const IrInst& inst)
+    {
+        switch(inst.op)
+        {
+            case IrOp::call:
+            case IrOp::print_int:
+            case IrOp::print_str:
+            case IrOp::newline:
+                return caller_saved;
+            case IrOp::bin:
+                return inst.bin == BinOp::div ? reg_bit(Reg::rax) | reg_bit(Reg::rdx) : 0;
+            default:
+                return 0;
+        }
+    }
+
+private:
+    struct Interval {
+        ValueId value;
+        uint32_t start;
+        uint32_t end;
+        RegMask allowed = 0;
+    };
+
+    // positions: instruction i of the layout is at 2 * i
+    inline void number()
+    {
+        m_pos.assign(m_func.insts.size(), 0);
+        m_block_of.assign(m_func.insts.size(), no_id);
+        m_block_start.assign(m_func.blocks.size(), 0);
+        m_block_end.assign(m_func.blocks.size(), 0);
+        uint32_t pos = 0;
+        for(BlockId b = 0; b < m_func.blocks.size(); b++)
+        {
+            m_block_start[b] = pos;
+            for(ValueId id : m_func.blocks[b].insts)
+            {
+                m_pos[id] = pos;
+                m_block_of[id] = b;
+                const RegMask mask = clobbers(m_func.insts[id]);
+                if(mask == caller_saved)
+                {
+                    m_call_points.push_back(pos);
+                }
+                else if(mask != 0)
+                {
+                    m_div_points.push_back(pos);
+                }
+                pos += 2;
+            }
+            m_block_end[b] = pos - 2;
+        }
+    }
+
+    inline void build_intervals()
+    {
+        m_lo.assign(m_func.insts.size(), UINT32_MAX);
+        m_hi.assign(m_func.insts.size(), 0);
+        m_live_in.assign(m_func.blocks.size(), no_id);
+        m_alloc.fused = m_func.branch_compares();
+
+        for(BlockId b = 0; b < m_func.blocks.size(); b++)
+        {
+            const IrBlock& block = m_func.blocks[b];
+            const ValueId compare = m_alloc.fused[b];
+            for(ValueId id : block.insts)
+            {
+                const IrInst& inst = m_func.insts[id];
+                if(inst.op == IrOp::br && inst.a == compare)
+                {
+                    // compared at the branch itself, the flags never become a value
+                    const IrInst& cmp = m_func.insts[compare];
+                    use(cmp.a, b, m_pos[id]);
+                    use(cmp.b, b, m_pos[id]);
+                }
+                else if(inst.op == IrOp::phi)
+                {
+                    for(size_t i = 0; i < inst.args.size(); i++)
+                    {
+                        use(inst.args[i], block.preds[i], m_block_end[block.preds[i]]);
+                    }
+                }
+                else
+                {
+                    for_each_operand(inst, [&](ValueId v){ use(v, b, m_pos[id]); });
+                }
+            }
+        }
+
+        for(BlockId b = 0; b < m_func.blocks.size(); b++)
+        {
+            for(ValueId id : m_func.blocks[b].insts)
+            {
+                const IrOp op = m_func.insts[id].op;
+                if(!has_value(op) || op == IrOp::constant || m_lo[id] == UINT32_MAX)
+                {
+                    continue; // no uses
+                }
+                // parameters are all moved into place on entry, before anything else
+                const uint32_t def = op == IrOp::param ? 0 : m_pos[id];
+                Interval interval {.value=id, .start=std::min(m_lo[id], def), .end=m_hi[id]};
+                interval.allowed = allocatable;
+                if(crosses(m_call_points, interval)) interval.allowed &= callee_saved;
+                if(crosses(m_div_points, interval)) interval.allowed &= static_cast<RegMask>(~(reg_bit(Reg::rax) | reg_bit(Reg::rdx)));
+                m_intervals.push_back(interval);
+            }
+        }
+        std::sort(m_intervals.begin(), m_intervals.end(), [](const Interval& a, const Interval& b){
+            return a.start != b.start ? a.start < b.start : a.value < b.value;
+        });
+    }
+
+    inline void extend(ValueId v, uint32_t pos)
+    {
+        m_lo[v] = std::min(m_lo[v], pos);
+        m_hi[v] = std::max(m_hi[v], pos);
+    }
+
+    // v is used at pos in block (for a phi argument, at the end of the predecessor)
+    inline void use(ValueId v, BlockId block, uint32_t pos)
+    {
+        if(m_func.insts[v].op == IrOp::constant)
+        {
+            return;
+        }
+        extend(v, pos);
+        const BlockId def = m_block_of[v];
+        if(block == def)
+        {
+            return;
+        }
+        // live into block, and so out of every predecessor, up to the definition
+        m_work.push_back(block);
+        while(!m_work.empty())
+        {
+            const BlockId b = m_work.back();
+            m_work.pop_back();
+            if(m_live_in[b] == v)
+            {
+                continue;
+            }
+            m_live_in[b] = v;
+            extend(v, m_block_start[b]);
+            for(BlockId pred : m_func.blocks[b].preds)
+            {
+                extend(v, m_block_end[pred]);
+                if(pred != def && m_live_in[pred] != v)
+                {
+                    m_work.push_back(pred);
+                }
+            }
+        }
+    }
+
+    [[nodiscard]] static inline bool crosses(const std::vector<uint32_t>& points, const Interval& interval)
+    {
+        auto it = std::upper_bound(points.begin(), points.end(), interval.start);
+        return it != points.end() && *it < interval.end;
+    }
+
+    inline void scan()
+    {
+        m_alloc.where.assign(m_func.insts.size(), {});
+        std::vector<size_t> active; // indices into m_intervals holding a register
+        RegMask free = allocatable;
+        for(size_t i = 0; i < m_intervals.size(); i++)
+        {
+            Interval& current = m_intervals[i];
+            // a value whose last use is here hands its register to the one defined here
+            for(size_t a = 0; a < active.size();)
+            {
+                const Interval& old = m_intervals[active[a]];
+                if(old.end <= current.start)
+                {
+                    free |= reg_bit(m_alloc.where[old.value].reg);
+                    active[a] = active.back();
+                    active.pop_back();
+                }
+                else
+                {
+                    a++;
+                }
+            }
+
+            const RegMask usable = free & current.allowed;
+            if(usable != 0)
+            {
+                const Reg reg = pick(usable);
+                m_alloc.where[current.value] = {.kind=Location::Kind::reg, .reg=reg};
+                m_alloc.used |= reg_bit(reg);
+                free &= static_cast<RegMask>(~reg_bit(reg));
+                active.push_back(i);
+                continue;
+            }
+
+            // spill whichever ends last, of this one and those holding a register it could have
+            size_t victim = SIZE_MAX;
+            for(size_t a = 0; a < active.size(); a++)
+            {
+                const Interval& other = m_intervals[active[a]];
+                if((current.allowed & reg_bit(m_alloc.where[other.value].reg)) && (victim == SIZE_MAX || other.end > m_intervals[active[victim]].end))
+                {
+                    victim = a;
+                }
+            }
+            if(victim != SIZE_MAX && m_intervals[active[victim]].end > current.end)
+            {
+                const ValueId spilled = m_intervals[active[victim]].value;
+                m_alloc.where[current.value] = m_alloc.where[spilled];
+                m_spilled.push_back(active[victim]);
+                active[victim] = i;
+            }
+            else
+            {
+                m_spilled.push_back(i);
+            }
+        }
+    }
+
+    // Caller-saved registers first, keeping the callee-saved ones (which cost a
+    // save and restore) for the values that need them.
+    [[nodiscard]] static inline Reg pick(RegMask usable)
+    {
+        static constexpr Reg order[] = {Reg::rcx, Reg::rsi, Reg::rdi, Reg::r8, Reg::r9, Reg::rdx, Reg::rax,
+                                        Reg::rbx, Reg::r12, Reg::r13, Reg::r14, Reg::r15};
+        for(Reg reg : order)
+        {
+            if(usable & reg_bit(reg)) return reg;
+        }
+        return Reg::rax;
+    }
+
+    // interval colouring: spilled ranges in order of their start, each taking a
+    // slot whose last owner has ended
+    inline void assign_slots()
+    {
+        std::sort(m_spilled.begin(), m_spilled.end(), [&](size_t a, size_t b){
+            return m_intervals[a].start != m_intervals[b].start ? m_intervals[a].start < m_intervals[b].start : m_intervals[a].value < m_intervals[b].value;
+        });
+        std::vector<uint32_t> slot_end; // per slot, where its current owner's range ends
+        for(size_t index : m_spilled)
+        {
+            const Interval& interval = m_intervals[index];
+            uint32_t slot = 0;
+            while(slot < slot_end.size() && slot_end[slot] >= interval.start)
+            {
+                slot++;
+            }
+            if(slot == slot_end.size())
+            {
+                slot_end.push_back(0);
+            }
+            slot_end[slot] = interval.end;
+            m_alloc.where[interval.value] = {.kind=Location::Kind::slot, .slot=slot};
+        }
+        m_alloc.slot_count = static_cast<uint32_t>(slot_end.size());
+    }
+
+    static constexpr RegMask allocatable = static_cast<RegMask>(caller_saved | callee_saved)
+                                         & static_cast<RegMask>(~(reg_bit(Reg::r10) | reg_bit(Reg::r11)));
+
+    const IrFunction& m_func;
+    Allocation m_alloc;
+    std::vector<uint32_t> m_pos; // per value
+    std::vector<BlockId> m_block_of; // per value
+    std::vector<uint32_t> m_block_start;
+    std::vector<uint32_t> m_block_end;
+    std::vector<uint32_t> m_call_points; // positions of instructions clobbering the caller-saved registers
+    std::vector<uint32_t> m_div_points;
+    std::vector<uint32_t> m_lo; // per value, live range so far
+    std::vector<uint32_t> m_hi;
+    std::vector<BlockId> m_live_in; // per block, the last value found live into it
+    std::vector<BlockId> m_work;
+    std::vector<Interval> m_intervals;
+    std::vector<size_t> m_spilled; // indices into m_intervals
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <thread>
+#include <vector>
+
+// Bounded single-producer/single-consumer ring. Slots are filled and read in
+// place, so nothing is allocated once the ring exists. The producer owns
+// m_head and the consumer owns m_tail; each only reads the other's index.
+// Both sides spin with a yield when the ring is full/empty.
+template <typename T, size_t Capacity>
+class SpscRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "ring capacity must be a power of two");
+
+public:
+    inline SpscRing() : m_slots(Capacity)
+    {}
+
+    inline SpscRing(const SpscRing&) = delete;
+    inline SpscRing& operator=(const SpscRing&) = delete;
+
+    // producer: next free slot, waits while the consumer is a full ring behind
+    inline T& producer_slot()
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        while(head - m_tail.load(std::memory_order_acquire) == Capacity)
+        {
+            std::this_thread::yield();
+        }
+        return m_slots[head & (Capacity - 1)];
+    }
+
+    // producer: hands the slot returned by producer_slot() to the consumer
+    inline void publish()
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // consumer: oldest published slot, waits while the ring is empty
+    inline T& consumer_slot()
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        while(m_head.load(std::memory_order_acquire) == tail)
+        {
+            std::this_thread::yield();
+        }
+        return m_slots[tail & (Capacity - 1)];
+    }
+
+    // consumer: gives the slot returned by consumer_slot() back to the producer
+    inline void release()
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    static constexpr size_t cache_line = 64;
+
+    alignas(cache_line) std::atomic<size_t> m_head {0};
+    alignas(cache_line) std::atomic<size_t> m_tail {0};
+    std::vector<T> m_slots;
+};
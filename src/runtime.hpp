@@ -0,0 +1,338 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "asm.hpp"
+
+// the runtime pieces link() only emits for programs that use them
+enum RuntimeHelper : uint8_t {
+    runtime_print_int = 1, // print_int
+    runtime_output = 2, // the output buffer, print_str and print_newline; exit_program flushes it
+    runtime_exit = 4, // exit_program
+};
+
+// bytes of output collected before a write
+inline constexpr int output_buffer_size = 65536;
+
+// The helpers a program calls, as code like a unit's, and their tables and buffers.
+struct RuntimeCode {
+    AsmCode code;
+    std::vector<AsmData> rodata;
+    std::vector<AsmData> bss;
+};
+
+// Builds the runtime one instruction at a time, naming each symbol once.
+class RuntimeBuilder {
+public:
+    inline RuntimeCode run(uint8_t runtime)
+    {
+        if(runtime & runtime_print_int)
+        {
+            const char* bench = std::getenv("BABY_PRINT_INT");
+            if(bench != nullptr && std::string_view(bench) == "div") print_int_div();
+            else print_int();
+        }
+        if(runtime & runtime_output) output();
+        if(runtime & runtime_exit) exit_program(runtime & runtime_output);
+        return std::move(m_out);
+    }
+
+private:
+    inline uint32_t sym(const std::string& name)
+    {
+        auto it = m_symbols.find(name);
+        if(it != m_symbols.end()) return it->second;
+        const uint32_t symbol = m_out.code.symbol(name);
+        m_symbols.emplace(name, symbol);
+        return symbol;
+    }
+
+    inline void op(AsmOp op, Operand a = {}, Operand b = {}, Operand c = {})
+    {
+        m_out.code.insts.push_back({.op=op, .a=a, .b=b, .c=c});
+    }
+
+    inline void label(const std::string& name)
+    {
+        op(AsmOp::label, sym_op(sym(name)));
+    }
+
+    inline void jump(AsmOp kind, const std::string& name)
+    {
+        op(kind, sym_op(sym(name)));
+    }
+
+    inline void jcc(Cond cc, const std::string& name)
+    {
+        m_out.code.insts.push_back({.op=AsmOp::jcc, .cc=cc, .a=sym_op(sym(name))});
+    }
+
+    inline Operand rip(const std::string& name, uint8_t width = 0)
+    {
+        return rip_op(sym(name), width);
+    }
+
+    static inline Operand r(Reg reg, uint8_t width = 64)
+    {
+        return reg_op(reg, width);
+    }
+
+    // rdi in decimal and a newline, straight into the buffer. The digits are
+    // counted first (the bit width * 1233 / 4096 is log10 or one short of it,
+    // one compare settles which), then written last first, two at a time from
+    // the pair table, dividing by 100 with a multiply by its reciprocal.
+    // INT64_MIN negates to itself, which read as unsigned is its magnitude.
+    inline void print_int()
+    {
+        label("print_int");
+        op(AsmOp::mov, r(Reg::rax), rip("out_len"));
+        op(AsmOp::cmp, r(Reg::rax), imm_op(output_buffer_size - 21)); // room for -9223372036854775808 and the newline
+        jcc(Cond::be, "print_int.room");
+        op(AsmOp::push, r(Reg::rdi));
+        jump(AsmOp::call, "flush_output");
+        op(AsmOp::pop, r(Reg::rdi));
+        op(AsmOp::xor_, r(Reg::rax, 32), r(Reg::rax, 32));
+        label("print_int.room");
+        op(AsmOp::lea, r(Reg::rsi), rip("out_buf"));
+        op(AsmOp::add, r(Reg::rsi), r(Reg::rax));
+        op(AsmOp::mov, r(Reg::r8), r(Reg::rdi));
+        op(AsmOp::test, r(Reg::rdi), r(Reg::rdi));
+        jcc(Cond::ns, "print_int.count");
+        op(AsmOp::neg, r(Reg::r8));
+        op(AsmOp::mov, mem_op(Reg::rsi, 0, 8), imm_op('-'));
+        op(AsmOp::inc, r(Reg::rsi));
+        label("print_int.count");
+        op(AsmOp::mov, r(Reg::rcx), r(Reg::r8));
+        op(AsmOp::or_, r(Reg::rcx), imm_op(1));
+        op(AsmOp::bsr, r(Reg::rcx), r(Reg::rcx));
+        op(AsmOp::inc, r(Reg::rcx, 32));
+        op(AsmOp::imul, r(Reg::rcx, 32), r(Reg::rcx, 32), imm_op(1233));
+        op(AsmOp::shr, r(Reg::rcx, 32), imm_op(12));
+        op(AsmOp::lea, r(Reg::r9), rip("print_int_tens"));
+        op(AsmOp::cmp, r(Reg::r8), addr_op(Reg::r9, Reg::rcx, 8));
+        op(AsmOp::sbb, r(Reg::rcx), imm_op(-1)); // one more digit unless below the table's power of ten
+        op(AsmOp::add, r(Reg::rsi), r(Reg::rcx));
+        op(AsmOp::mov, mem_op(Reg::rsi, 0, 8), imm_op(10));
+        op(AsmOp::lea, r(Reg::rdi), mem_op(Reg::rsi, 1));
+        op(AsmOp::lea, r(Reg::r10), rip("print_int_pairs"));
+        op(AsmOp::mov, r(Reg::rcx), imm_op(0x28F5C28F5C28F5C3)); // 2^68 / 100 rounded up
+        label("print_int.pair");
+        op(AsmOp::cmp, r(Reg::r8), imm_op(100));
+        jcc(Cond::b, "print_int.last");
+        op(AsmOp::mov, r(Reg::rax), r(Reg::r8));
+        op(AsmOp::shr, r(Reg::rax), imm_op(2));
+        op(AsmOp::mul, r(Reg::rcx));
+        op(AsmOp::shr, r(Reg::rdx), imm_op(2)); // x / 100
+        op(AsmOp::imul, r(Reg::rax), r(Reg::rdx), imm_op(100));
+        op(AsmOp::sub, r(Reg::r8), r(Reg::rax));
+        op(AsmOp::movzx, r(Reg::rax, 32), addr_op(Reg::r10, Reg::r8, 2, 0, 16));
+        op(AsmOp::sub, r(Reg::rsi), imm_op(2));
+        op(AsmOp::mov, mem_op(Reg::rsi, 0), r(Reg::rax, 16));
+        op(AsmOp::mov, r(Reg::r8), r(Reg::rdx));
+        jump(AsmOp::jmp, "print_int.pair");
+        label("print_int.last");
+        op(AsmOp::cmp, r(Reg::r8), imm_op(10));
+        jcc(Cond::b, "print_int.one");
+        op(AsmOp::movzx, r(Reg::rax, 32), addr_op(Reg::r10, Reg::r8, 2, 0, 16));
+        op(AsmOp::mov, mem_op(Reg::rsi, -2), r(Reg::rax, 16));
+        jump(AsmOp::jmp, "print_int.done");
+        label("print_int.one");
+        op(AsmOp::add, r(Reg::r8, 32), imm_op('0'));
+        op(AsmOp::mov, mem_op(Reg::rsi, -1), r(Reg::r8, 8));
+        label("print_int.done");
+        op(AsmOp::lea, r(Reg::rax), rip("out_buf"));
+        op(AsmOp::sub, r(Reg::rdi), r(Reg::rax));
+        op(AsmOp::mov, rip("out_len"), r(Reg::rdi));
+        jump(AsmOp::jmp, "line_end");
+
+        // 0 then the powers of ten from 10 up, and "00" to "99"
+        AsmData tens{.label="print_int_tens", .qwords=true};
+        uint64_t ten = 1;
+        for(int i = 0; i < 20; i++)
+        {
+            const uint64_t value = i == 0 ? 0 : (ten *= 10);
+            for(int b = 0; b < 8; b++) tens.bytes += static_cast<char>(value >> (8 * b));
+        }
+        AsmData pairs{.label="print_int_pairs"};
+        for(int i = 0; i < 100; i++)
+        {
+            pairs.bytes += static_cast<char>('0' + i / 10);
+            pairs.bytes += static_cast<char>('0' + i % 10);
+        }
+        m_out.rodata.push_back(std::move(tens));
+        m_out.rodata.push_back(std::move(pairs));
+    }
+
+    // The print_int this one replaced, only built for BABY_PRINT_INT=div so
+    // bench/print_int.by can time the two against each other: one div per digit,
+    // the digits pushed as they come out, last first, and popped into the buffer.
+    inline void print_int_div()
+    {
+        label("print_int");
+        op(AsmOp::mov, r(Reg::rax), rip("out_len"));
+        op(AsmOp::cmp, r(Reg::rax), imm_op(output_buffer_size - 21));
+        jcc(Cond::be, "print_int.room");
+        op(AsmOp::push, r(Reg::rdi));
+        jump(AsmOp::call, "flush_output");
+        op(AsmOp::pop, r(Reg::rdi));
+        op(AsmOp::xor_, r(Reg::rax, 32), r(Reg::rax, 32));
+        label("print_int.room");
+        op(AsmOp::lea, r(Reg::rsi), rip("out_buf"));
+        op(AsmOp::add, r(Reg::rsi), r(Reg::rax));
+        op(AsmOp::mov, r(Reg::rax), r(Reg::rdi));
+        op(AsmOp::test, r(Reg::rax), r(Reg::rax));
+        jcc(Cond::ns, "print_int.positive");
+        op(AsmOp::neg, r(Reg::rax));
+        op(AsmOp::mov, mem_op(Reg::rsi, 0, 8), imm_op('-'));
+        op(AsmOp::inc, r(Reg::rsi));
+        label("print_int.positive");
+        op(AsmOp::mov, r(Reg::r8), imm_op(10));
+        op(AsmOp::xor_, r(Reg::r9, 32), r(Reg::r9, 32));
+        label("print_int.divide");
+        op(AsmOp::xor_, r(Reg::rdx, 32), r(Reg::rdx, 32));
+        op(AsmOp::div, r(Reg::r8));
+        op(AsmOp::add, r(Reg::rdx, 32), imm_op('0'));
+        op(AsmOp::push, r(Reg::rdx));
+        op(AsmOp::inc, r(Reg::r9));
+        op(AsmOp::test, r(Reg::rax), r(Reg::rax));
+        jcc(Cond::ne, "print_int.divide");
+        label("print_int.store");
+        op(AsmOp::pop, r(Reg::rax));
+        op(AsmOp::mov, mem_op(Reg::rsi, 0), r(Reg::rax, 8));
+        op(AsmOp::inc, r(Reg::rsi));
+        op(AsmOp::dec, r(Reg::r9));
+        jcc(Cond::ne, "print_int.store");
+        op(AsmOp::mov, mem_op(Reg::rsi, 0, 8), imm_op(10));
+        op(AsmOp::inc, r(Reg::rsi));
+        op(AsmOp::lea, r(Reg::rax), rip("out_buf"));
+        op(AsmOp::sub, r(Reg::rsi), r(Reg::rax));
+        op(AsmOp::mov, rip("out_len"), r(Reg::rsi));
+        jump(AsmOp::jmp, "line_end");
+    }
+
+    // Output goes through one buffer, written when it fills up, at exit, and after
+    // every line when stdout is a terminal. Each helper takes its arguments in rdi,
+    // or rsi and rdx, and like any call may change the caller-saved registers.
+    inline void output()
+    {
+        // rdx bytes at rsi; what doesn't fit after a flush is written as it is.
+        // A string with a newline in it ends a line like print_newline does,
+        // which only a terminal needs, so a file or pipe doesn't look for one.
+        label("print_str");
+        op(AsmOp::mov, r(Reg::rax), rip("out_len"));
+        op(AsmOp::lea, r(Reg::rcx), addr_op(Reg::rax, Reg::rdx, 1));
+        op(AsmOp::cmp, r(Reg::rcx), imm_op(output_buffer_size));
+        jcc(Cond::a, "print_str.full");
+        op(AsmOp::lea, r(Reg::rdi), rip("out_buf"));
+        op(AsmOp::add, r(Reg::rdi), r(Reg::rax));
+        op(AsmOp::mov, rip("out_len"), r(Reg::rcx));
+        op(AsmOp::mov, r(Reg::rcx), r(Reg::rdx));
+        op(AsmOp::rep_movsb);
+        op(AsmOp::cmp, rip("out_mode", 8), imm_op(1));
+        jcc(Cond::e, "print_str.done");
+        op(AsmOp::mov, r(Reg::rcx), r(Reg::rdx));
+        op(AsmOp::sub, r(Reg::rdi), r(Reg::rdx)); // back to the copy, never 0 so ZF is clear if rcx is
+        op(AsmOp::mov, r(Reg::rax, 32), imm_op('\n'));
+        op(AsmOp::repne_scasb);
+        jcc(Cond::e, "line_end");
+        label("print_str.done");
+        op(AsmOp::ret);
+        label("print_str.full");
+        op(AsmOp::push, r(Reg::rsi));
+        op(AsmOp::push, r(Reg::rdx));
+        jump(AsmOp::call, "flush_output");
+        op(AsmOp::pop, r(Reg::rdx));
+        op(AsmOp::pop, r(Reg::rsi));
+        op(AsmOp::cmp, r(Reg::rdx), imm_op(output_buffer_size));
+        jcc(Cond::be, "print_str");
+        jump(AsmOp::jmp, "write_all");
+
+        label("print_newline");
+        op(AsmOp::mov, r(Reg::rax), rip("out_len"));
+        op(AsmOp::cmp, r(Reg::rax), imm_op(output_buffer_size));
+        jcc(Cond::b, "print_newline.room");
+        jump(AsmOp::call, "flush_output");
+        op(AsmOp::xor_, r(Reg::rax, 32), r(Reg::rax, 32));
+        label("print_newline.room");
+        op(AsmOp::lea, r(Reg::rcx), rip("out_buf"));
+        op(AsmOp::mov, addr_op(Reg::rcx, Reg::rax, 1, 0, 8), imm_op(10));
+        op(AsmOp::inc, r(Reg::rax));
+        op(AsmOp::mov, rip("out_len"), r(Reg::rax));
+        // fall through
+
+        // a line is done: on a terminal it's shown now. out_mode is 0 until
+        // the first line asks, then 1 for a file or pipe and 2 for a terminal
+        label("line_end");
+        op(AsmOp::mov, r(Reg::rax, 8), rip("out_mode"));
+        op(AsmOp::test, r(Reg::rax, 8), r(Reg::rax, 8));
+        jcc(Cond::ne, "line_end.known");
+        op(AsmOp::mov, r(Reg::rax, 32), imm_op(16)); // syscall: ioctl
+        op(AsmOp::mov, r(Reg::rdi, 32), imm_op(1));
+        op(AsmOp::mov, r(Reg::rsi, 32), imm_op(0x5401)); // TCGETS, which only a terminal answers
+        op(AsmOp::lea, r(Reg::rdx), rip("out_termios"));
+        op(AsmOp::syscall);
+        op(AsmOp::test, r(Reg::rax), r(Reg::rax));
+        m_out.code.insts.push_back({.op=AsmOp::setcc, .cc=Cond::e, .a=r(Reg::rax, 8)});
+        op(AsmOp::inc, r(Reg::rax, 8));
+        op(AsmOp::mov, rip("out_mode"), r(Reg::rax, 8));
+        label("line_end.known");
+        op(AsmOp::cmp, r(Reg::rax, 8), imm_op(2));
+        jcc(Cond::e, "flush_output");
+        op(AsmOp::ret);
+
+        label("flush_output");
+        op(AsmOp::lea, r(Reg::rsi), rip("out_buf"));
+        op(AsmOp::mov, r(Reg::rdx), rip("out_len"));
+        op(AsmOp::mov, rip("out_len", 64), imm_op(0));
+        // fall through
+
+        // rdx bytes at rsi to stdout, however many writes that takes
+        label("write_all");
+        op(AsmOp::test, r(Reg::rdx), r(Reg::rdx));
+        jcc(Cond::e, "write_all.done");
+        op(AsmOp::mov, r(Reg::rax, 32), imm_op(1)); // syscall: write
+        op(AsmOp::mov, r(Reg::rdi, 32), imm_op(1)); // stdout
+        op(AsmOp::syscall);
+        op(AsmOp::cmp, r(Reg::rax), imm_op(-4)); // EINTR, try again
+        jcc(Cond::e, "write_all");
+        op(AsmOp::test, r(Reg::rax), r(Reg::rax));
+        jcc(Cond::le, "write_all.done"); // nowhere to write to, the rest is dropped
+        op(AsmOp::add, r(Reg::rsi), r(Reg::rax));
+        op(AsmOp::sub, r(Reg::rdx), r(Reg::rax));
+        jump(AsmOp::jmp, "write_all");
+        label("write_all.done");
+        op(AsmOp::ret);
+
+        m_out.bss.push_back({.label="out_buf", .reserve=output_buffer_size});
+        m_out.bss.push_back({.label="out_len", .reserve=8});
+        m_out.bss.push_back({.label="out_termios", .reserve=64});
+        m_out.bss.push_back({.label="out_mode", .reserve=1});
+    }
+
+    // exit with status rdi, after the output when the program has any
+    inline void exit_program(bool flush)
+    {
+        label("exit_program");
+        if(flush)
+        {
+            op(AsmOp::push, r(Reg::rdi));
+            jump(AsmOp::call, "flush_output");
+            op(AsmOp::pop, r(Reg::rdi));
+        }
+        op(AsmOp::mov, r(Reg::rax, 32), imm_op(60)); // syscall: exit
+        op(AsmOp::syscall);
+    }
+
+    RuntimeCode m_out;
+    std::unordered_map<std::string, uint32_t> m_symbols;
+};
+
+// the runtime for the RuntimeHelper bits a program's units ask for
+inline RuntimeCode runtime_code(uint8_t runtime)
+{
+    return RuntimeBuilder().run(runtime);
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Bulk byte scanning used by the tokenizer to skip comments, string bodies
+// and whitespace runs without per-byte bookkeeping. Each kernel works on the
+// half-open range [p, end) and returns end when nothing matches. The widest
+// implementation the CPU supports is picked once at startup; BABY_SCAN=scalar,
+// sse2 or avx2 in the environment picks that one instead.
+struct ScanKernels {
+    const char* name;
+    const char* (*find_byte)(const char* p, const char* end, char c); // first c
+    const char* (*skip_space)(const char* p, const char* end);         // first non-whitespace
+    size_t (*count_byte)(const char* p, const char* end, char c);      // occurrences of c
+};
+
+inline bool is_scan_space(unsigned char c)
+{
+    return c == ' ' || static_cast<unsigned char>(c - '\t') < 5; // \t \n \v \f \r
+}
+
+inline const char* find_byte_scalar(const char* p, const char* end, char c)
+{
+    const void* hit = std::memchr(p, c, static_cast<size_t>(end - p));
+    return hit != nullptr ? static_cast<const char*>(hit) : end;
+}
+
+inline const char* skip_space_scalar(const char* p, const char* end)
+{
+    while(p < end && is_scan_space(static_cast<unsigned char>(*p)))
+    {
+        p++;
+    }
+    return p;
+}
+
+inline size_t count_byte_scalar(const char* p, const char* end, char c)
+{
+    size_t count = 0;
+    for(; p < end; p++)
+    {
+        count += (*p == c);
+    }
+    return count;
+}
+
+#if defined(__x86_64__)
+
+// SSE2 is part of the x86-64 baseline, so these need no target attribute.
+inline const char* find_byte_sse2(const char* p, const char* end, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    for(; end - p >= 16; p += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)));
+        if(mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_scalar(p, end, c);
+}
+
+inline const char* skip_space_sse2(const char* p, const char* end)
+{
+    const __m128i blank = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    for(; end - p >= 16; p += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const __m128i ctrl = _mm_sub_epi8(chunk, tab); // \t..\r become 0..4
+        const __m128i space = _mm_or_si128(_mm_cmpeq_epi8(chunk, blank),
+                                           _mm_cmpeq_epi8(_mm_min_epu8(ctrl, four), ctrl));
+        const unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(space)) & 0xFFFFu;
+        if(mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return skip_space_scalar(p, end);
+}
+
+inline size_t count_byte_sse2(const char* p, const char* end, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t count = 0;
+    for(; end - p >= 16; p += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        count += static_cast<size_t>(__builtin_popcount(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)))));
+    }
+    return count + count_byte_scalar(p, end, c);
+}
+
+__attribute__((target("avx2"))) inline const char* find_byte_avx2(const char* p, const char* end, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    for(; end - p >= 32; p += 32)
+    {
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)));
+        if(mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_sse2(p, end, c);
+}
+
+__attribute__((target("avx2"))) inline const char* skip_space_avx2(const char* p, const char* end)
+{
+    const __m256i blank = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8(4);
+    for(; end - p >= 32; p += 32)
+    {
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        const __m256i ctrl = _mm256_sub_epi8(chunk, tab);
+        const __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, blank),
+                                              _mm256_cmpeq_epi8(_mm256_min_epu8(ctrl, four), ctrl));
+        const unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(space));
+        if(mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return skip_space_sse2(p, end);
+}
+
+__attribute__((target("avx2,popcnt"))) inline size_t count_byte_avx2(const char* p, const char* end, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t count = 0;
+    for(; end - p >= 32; p += 32)
+    {
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        count += static_cast<size_t>(__builtin_popcount(static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)))));
+    }
+    return count + count_byte_sse2(p, end, c);
+}
+
+#endif
+
+// The kernel sets this CPU can run, narrowest first.
+inline std::vector<ScanKernels> available_scan_kernels()
+{
+    std::vector<ScanKernels> kernels {{"scalar", find_byte_scalar, skip_space_scalar, count_byte_scalar}};
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    kernels.push_back({"sse2", find_byte_sse2, skip_space_sse2, count_byte_sse2});
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    {
+        kernels.push_back({"avx2", find_byte_avx2, skip_space_avx2, count_byte_avx2});
+    }
+#endif
+    return kernels;
+}
+
+// The widest set, unless BABY_SCAN names another one this CPU can run.
+inline ScanKernels select_scan_kernels()
+{
+    const std::vector<ScanKernels> kernels = available_scan_kernels();
+    if(const char* forced = std::getenv("BABY_SCAN"))
+    {
+        for(const ScanKernels& k : kernels)
+        {
+            if(std::strcmp(k.name, forced) == 0) return k;
+        }
+    }
+    return kernels.back();
+}
+
+inline const ScanKernels scan_kernels = select_scan_kernels();
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "scan.hpp"
+
+// Read-only memory mapping of a source file. Tokens and AST nodes keep
+// string_views into this mapping, so it has to outlive the whole compile.
+// A file that can't be read leaves an empty view and says why in error(),
+// for the caller to report: --session has to keep running after one.
+class SourceFile {
+public:
+    inline explicit SourceFile(const char* path)
+    {
+        int fd = open(path, O_RDONLY);
+        if(fd < 0)
+        {
+            m_error = std::string("Could not open source file: ") + path;
+            return;
+        }
+        struct stat st {};
+        if(fstat(fd, &st) < 0)
+        {
+            m_error = std::string("Could not stat source file: ") + path;
+            close(fd);
+            return;
+        }
+        m_size = static_cast<size_t>(st.st_size);
+        if(m_size > UINT32_MAX) // token offsets are 32-bit
+        {
+            m_error = std::string("Source file is too large (4 GB max): ") + path;
+            m_size = 0;
+            close(fd);
+            return;
+        }
+        if(m_size > 0) // mmap rejects zero-length mappings, an empty file is just an empty view
+        {
+            void* mapping = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(mapping == MAP_FAILED)
+            {
+                m_error = std::string("Could not map source file: ") + path;
+                m_size = 0;
+                close(fd);
+                return;
+            }
+            madvise(mapping, m_size, MADV_SEQUENTIAL); // the tokenizer walks it front to back once
+            m_data = static_cast<const char*>(mapping);
+        }
+        close(fd); // the mapping stays valid after the descriptor is closed
+    }
+
+    inline SourceFile(const SourceFile&) = delete;
+    inline SourceFile& operator=(const SourceFile&) = delete;
+
+    inline ~SourceFile()
+    {
+        if(m_data != nullptr)
+        {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+    }
+
+    [[nodiscard]] inline std::string_view view() const
+    {
+        return {m_data == nullptr ? "" : m_data, m_size};
+    }
+
+    // why the file couldn't be read, empty when it was
+    [[nodiscard]] inline const std::string& error() const
+    {
+        return m_error;
+    }
+
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    std::string m_error;
+};
+
+struct SourceLocation {
+    int line;
+    int col;
+};
+
+// Offsets of every line start in a source. Nothing on the hot path tracks
+// line/column: the index is built the first time a diagnostic asks for a
+// location, after which each lookup is a binary search.
+class LineIndex {
+public:
+    inline explicit LineIndex(std::string_view source) : m_source(source)
+    {}
+
+    [[nodiscard]] inline std::string_view source() const
+    {
+        return m_source;
+    }
+
+    [[nodiscard]] inline SourceLocation locate(size_t offset) const
+    {
+        std::call_once(m_built, [this]{ build(); }); // diagnostics can come from the pipelined lexer thread
+        auto it = std::upper_bound(m_line_starts.begin(), m_line_starts.end(), static_cast<uint32_t>(offset));
+        const size_t line = static_cast<size_t>(it - m_line_starts.begin()); // 1-based, m_line_starts[0] == 0
+        return {.line=static_cast<int>(line), .col=static_cast<int>(offset - m_line_starts[line - 1]) + 1};
+    }
+
+    // location of a token, its text is a view into the same source
+    [[nodiscard]] inline SourceLocation locate(std::string_view text) const
+    {
+        return locate(static_cast<size_t>(text.data() - m_source.data()));
+    }
+
+private:
+    inline void build() const
+    {
+        const char* const begin = m_source.data();
+        const char* const end = begin + m_source.size();
+        m_line_starts.reserve(scan_kernels.count_byte(begin, end, '\n') + 1);
+        m_line_starts.push_back(0);
+        for(const char* p = scan_kernels.find_byte(begin, end, '\n'); p != end; p = scan_kernels.find_byte(p + 1, end, '\n'))
+        {
+            m_line_starts.push_back(static_cast<uint32_t>(p + 1 - begin));
+        }
+    }
+
+    std::string_view m_source;
+    mutable std::once_flag m_built;
+    mutable std::vector<uint32_t> m_line_starts;
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstddef>
+#include <cstdint>
+#include "types.hpp"
+
+enum class SymbolKind : uint8_t {
+    int_var, // hope, a variable of the enclosing function
+    string_var, // dillusion, a compile-time name for a string's data label
+};
+
+struct Symbol {
+    SymbolKind kind;
+    uint32_t var_id = 0; // int_var: numbers the function's variables, see Lowering
+    std::string label {}; // string_var
+    size_t len = 0; // string_var
+};
+
+// dillusion variables aren't scoped: a unit sees every one declared by the
+// units generated before it (the --session compiler passes them along).
+using StringVars = std::unordered_map<SymbolId, Symbol>;
+
+// Variables visible to the generator. Every SymbolId maps straight to its
+// innermost integer binding and each binding remembers the one it shadows, so
+// a lookup is one index, and leaving a scope unwinds only the bindings made in
+// it. A function body can't see the variables around it; entering one just
+// raises the floor below which bindings are invisible.
+class SymbolTable {
+public:
+    // string variables win over integers of the same name, as they always have
+    [[nodiscard]] inline const Symbol* lookup(SymbolId sym) const
+    {
+        if(auto str = m_strings.find(sym); str != m_strings.end())
+        {
+            return &str->second;
+        }
+        return find_int(sym);
+    }
+
+    [[nodiscard]] inline const Symbol* find_int(SymbolId sym) const
+    {
+        const uint32_t at = innermost(sym);
+        return at != none && at >= m_visible_from ? &m_bindings[at].symbol : nullptr;
+    }
+
+    [[nodiscard]] inline bool is_string(SymbolId sym) const
+    {
+        return m_strings.contains(sym);
+    }
+
+    // whether sym already has an integer binding in the innermost scope
+    [[nodiscard]] inline bool declared_in_scope(SymbolId sym) const
+    {
+        const uint32_t at = innermost(sym);
+        return at != none && at >= scope_start();
+    }
+
+    inline void declare_int(SymbolId sym, uint32_t var_id)
+    {
+        if(sym >= m_innermost.size())
+        {
+            m_innermost.resize(sym + 1, none);
+        }
+        m_bindings.push_back({.sym=sym, .shadowed=m_innermost[sym], .symbol={.kind=SymbolKind::int_var, .var_id=var_id}});
+        m_innermost[sym] = static_cast<uint32_t>(m_bindings.size() - 1);
+    }
+
+    // false if sym is already a string variable
+    inline bool declare_string(SymbolId sym, std::string label, size_t len)
+    {
+        return m_strings.emplace(sym, Symbol{.kind=SymbolKind::string_var, .label=std::move(label), .len=len}).second;
+    }
+
+    inline void push_scope()
+    {
+        m_scopes.push_back(static_cast<uint32_t>(m_bindings.size()));
+    }
+
+    // number of bindings the scope made
+    inline size_t pop_scope()
+    {
+        const size_t count = unwind(m_scopes.back());
+        m_scopes.pop_back();
+        return count;
+    }
+
+    // returns what leave_function() needs to restore the caller's view
+    inline uint32_t enter_function()
+    {
+        const uint32_t outer = m_visible_from;
+        m_visible_from = static_cast<uint32_t>(m_bindings.size());
+        return outer;
+    }
+
+    inline void leave_function(uint32_t outer)
+    {
+        unwind(m_visible_from);
+        m_visible_from = outer;
+    }
+
+    [[nodiscard]] inline const StringVars& strings() const
+    {
+        return m_strings;
+    }
+
+    inline void set_strings(StringVars strings)
+    {
+        m_strings = std::move(strings);
+    }
+
+private:
+    static constexpr uint32_t none = UINT32_MAX;
+
+    struct Binding {
+        SymbolId sym;
+        uint32_t shadowed; // binding of the same name this one hides, or none
+        Symbol symbol;
+    };
+
+    [[nodiscard]] inline uint32_t innermost(SymbolId sym) const
+    {
+        return sym < m_innermost.size() ? m_innermost[sym] : none;
+    }
+
+    [[nodiscard]] inline uint32_t scope_start() const
+    {
+        const uint32_t scope = m_scopes.empty() ? 0 : m_scopes.back();
+        return scope > m_visible_from ? scope : m_visible_from;
+    }
+
+    inline size_t unwind(uint32_t mark)
+    {
+        const size_t count = m_bindings.size() - mark;
+        while(m_bindings.size() > mark)
+        {
+            m_innermost[m_bindings.back().sym] = m_bindings.back().shadowed;
+            m_bindings.pop_back();
+        }
+        return count;
+    }
+
+    std::vector<Binding> m_bindings; // every live integer binding, innermost last
+    std::vector<uint32_t> m_innermost; // SymbolId -> index into m_bindings, or none
+    std::vector<uint32_t> m_scopes; // m_bindings size when each open scope began
+    uint32_t m_visible_from = 0; // bindings below this belong to an enclosing function
+    StringVars m_strings;
+};
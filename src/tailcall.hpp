@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+#include "ir.hpp"
+
+// Tail recursion: a function whose bye returns a call to itself jumps back to
+// its top instead, with the arguments as the parameters' new values. The entry
+// block keeps only the parameters and the rest of it becomes a loop header
+// with a phi per parameter, so accumulator style recursion runs in one frame
+// and the loop passes get to see it. True if the function changed.
+inline bool eliminate_tail_recursion(IrFunction& func)
+{
+    if(func.symbol == no_id || !func.blocks[0].preds.empty())
+    {
+        return false;
+    }
+    std::vector<BlockId> sites; // blocks ending in call self / ret of it
+    for(BlockId b = 0; b < func.blocks.size(); b++)
+    {
+        const std::vector<ValueId>& insts = func.blocks[b].insts;
+        if(insts.size() < 2) continue;
+        const IrInst& ret = func.insts[insts.back()];
+        const IrInst& call = func.insts[insts[insts.size() - 2]];
+        if(ret.op == IrOp::ret && ret.a == insts[insts.size() - 2] && call.op == IrOp::call
+           && call.imm == func.symbol && call.args.size() == func.param_count)
+        {
+            sites.push_back(b);
+        }
+    }
+    if(sites.empty())
+    {
+        return false;
+    }
+
+    const BlockId header = static_cast<BlockId>(func.blocks.size());
+    func.blocks.emplace_back();
+    std::vector<ValueId> params;
+    for(ValueId id : func.blocks[0].insts)
+    {
+        (func.insts[id].op == IrOp::param ? params : func.blocks[header].insts).push_back(id);
+    }
+    func.blocks[0].insts = params;
+    for(BlockId succ : func.succs(header))
+    {
+        for(BlockId& pred : func.blocks[succ].preds)
+        {
+            if(pred == 0) pred = header;
+        }
+    }
+    for(BlockId& site : sites)
+    {
+        if(site == 0) site = header;
+    }
+
+    // every use of a parameter reads its phi from now on, the call arguments included
+    std::vector<ValueId> phis;
+    for(size_t i = 0; i < params.size(); i++)
+    {
+        phis.push_back(func.add({.op=IrOp::phi}));
+    }
+    std::vector<ValueId> forward(func.insts.size());
+    for(ValueId v = 0; v < forward.size(); v++) forward[v] = v;
+    for(size_t i = 0; i < params.size(); i++) forward[params[i]] = phis[i];
+    func.substitute(forward);
+    std::vector<ValueId>& header_insts = func.blocks[header].insts;
+    header_insts.insert(header_insts.begin(), phis.begin(), phis.end());
+
+    func.blocks[0].insts.push_back(func.add({.op=IrOp::jmp, .target={header, no_id}}));
+    func.blocks[header].preds.push_back(0);
+    for(size_t i = 0; i < params.size(); i++)
+    {
+        func.insts[phis[i]].args.push_back(params[i]);
+    }
+    for(BlockId site : sites)
+    {
+        std::vector<ValueId>& insts = func.blocks[site].insts;
+        const std::vector<ValueId> args = func.insts[insts[insts.size() - 2]].args;
+        insts.resize(insts.size() - 2);
+        insts.push_back(func.add({.op=IrOp::jmp, .target={header, no_id}}));
+        func.blocks[header].preds.push_back(site);
+        for(size_t i = 0; i < params.size(); i++)
+        {
+            func.insts[phis[i]].args.push_back(args[static_cast<size_t>(func.insts[params[i]].imm)]);
+        }
+    }
+    return true;
+}
@@ -1,281 +1,495 @@
 #pragma once
 
-#include <string>
-#include <optional>
+#include <string_view>
+#include <array>
 #include <vector>
-#include <cctype>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <cstdlib>
+#include <string>
+#include <utility>
+#include <algorithm>
 #include "types.hpp"
+#include "source.hpp"
+#include "diagnostics.hpp"
+#include "interner.hpp"
+#include "scan.hpp"
+#include "ring.hpp"
 
-class Tokenizer {
+// Character classes, one table lookup per input byte instead of the locale
+// aware <cctype> calls. A character can be in several classes (bit flags).
+enum CharClass : uint8_t {
+    cc_other = 0,
+    cc_space = 1 << 0,
+    cc_alpha = 1 << 1, // can start an identifier or keyword
+    cc_digit = 1 << 2,
+    cc_under = 1 << 3,
+    cc_punct = 1 << 4, // always a single character token
+    cc_cmp   = 1 << 5, // = ! < > , may be followed by '='
+    cc_quote = 1 << 6,
+    cc_ident = cc_alpha | cc_digit | cc_under, // allowed after the first identifier character
+};
+
+inline constexpr std::array<uint8_t, 256> char_classes = []{
+    std::array<uint8_t, 256> table{};
+    for(int c = 'a'; c <= 'z'; c++) table[c] |= cc_alpha;
+    for(int c = 'A'; c <= 'Z'; c++) table[c] |= cc_alpha;
+    for(int c = '0'; c <= '9'; c++) table[c] |= cc_digit;
+    for(unsigned char c : std::string_view(" \t\n\v\f\r")) table[c] |= cc_space;
+    for(unsigned char c : std::string_view("();,+*-/{}")) table[c] |= cc_punct;
+    for(unsigned char c : std::string_view("=!<>")) table[c] |= cc_cmp;
+    table['_'] |= cc_under;
+    table['"'] |= cc_quote;
+    return table;
+}();
+
+// Token produced by a cc_punct / cc_cmp character. with_eq is the token when
+// the next character is '=', single is only valid when has_single is set ('!').
+struct PunctEntry {
+    TokenType single;
+    TokenType with_eq;
+    bool has_single;
+};
+
+inline constexpr std::array<PunctEntry, 256> punct_table = []{
+    std::array<PunctEntry, 256> table{};
+    auto set = [&](char c, TokenType type){ table[static_cast<unsigned char>(c)] = {type, type, true}; };
+    set('(', TokenType::open_paren);
+    set(')', TokenType::close_paren);
+    set(';', TokenType::semi);
+    set(',', TokenType::comma);
+    set('+', TokenType::plus);
+    set('*', TokenType::mul);
+    set('-', TokenType::sub);
+    set('/', TokenType::div);
+    set('{', TokenType::open_curly);
+    set('}', TokenType::close_curly);
+    table['='] = {TokenType::eq, TokenType::eq_eq, true};
+    table['!'] = {TokenType::neq, TokenType::neq, false};
+    table['<'] = {TokenType::lt, TokenType::lte, true};
+    table['>'] = {TokenType::gt, TokenType::gte, true};
+    return table;
+}();
+
+struct Keyword {
+    std::string_view text;
+    TokenType type;
+};
+
+// hide and secret are comment openers, they never reach the token stream
+inline constexpr std::array<Keyword, 11> keywords = {{
+    {"bye", TokenType::bye},
+    {"hope", TokenType::hope},
+    {"tell_me", TokenType::tell_me},
+    {"dillusion", TokenType::dillusion},
+    {"maybe", TokenType::maybe},
+    {"ormaybe", TokenType::ormaybe},
+    {"then", TokenType::then_tok},
+    {"secret", TokenType::secret},
+    {"moveon", TokenType::moveon},
+    {"wait", TokenType::wait},
+    {"hide", TokenType::hide},
+}};
+
+inline constexpr size_t keyword_min_len = 3;
+inline constexpr size_t keyword_max_len = 9;
+inline constexpr size_t keyword_slots = 16;
+
+// Perfect hash over the keyword set: second character and length are enough
+// to tell every keyword apart. Only valid for keyword_min_len <= size.
+constexpr size_t keyword_hash(std::string_view word)
+{
+    return (static_cast<unsigned char>(word[1]) * 3 + word.size()) & (keyword_slots - 1);
+}
+
+inline constexpr std::array<int8_t, keyword_slots> keyword_index = []{
+    std::array<int8_t, keyword_slots> table{};
+    table.fill(-1);
+    for(size_t i = 0; i < keywords.size(); i++)
+    {
+        table[keyword_hash(keywords[i].text)] = static_cast<int8_t>(i);
+    }
+    return table;
+}();
+
+constexpr bool keyword_hash_is_perfect()
+{
+    for(size_t i = 0; i < keywords.size(); i++)
+    {
+        const size_t len = keywords[i].text.size();
+        if(len < keyword_min_len || len > keyword_max_len) return false;
+        if(keyword_index[keyword_hash(keywords[i].text)] != static_cast<int8_t>(i)) return false; // collided with a later keyword
+    }
+    return true;
+}
+static_assert(keyword_hash_is_perfect(), "keyword hash has collisions, pick another hash for the keyword set");
+
+// Returns the keyword's token type, or TokenType::ident for anything else.
+inline TokenType lookup_keyword(std::string_view word)
+{
+    if(word.size() < keyword_min_len || word.size() > keyword_max_len)
+    {
+        return TokenType::ident;
+    }
+    const int8_t idx = keyword_index[keyword_hash(word)];
+    if(idx >= 0 && keywords[idx].text == word)
+    {
+        return keywords[idx].type;
+    }
+    return TokenType::ident;
+}
+
+// Pipelined mode hands tokens to the parser in fixed-size batches through an
+// SPSC ring, so at most token_ring_batches * token_batch_size tokens are live.
+inline constexpr size_t token_batch_size = 1024;
+inline constexpr size_t token_ring_batches = 16;
+
+struct TokenBatch {
+    std::array<Token, token_batch_size> tokens;
+    size_t count = 0;
+    bool last = false; // end of the token stream
+};
+
+using TokenRing = SpscRing<TokenBatch, token_ring_batches>;
+
+// Token sink that fills ring slots in place and publishes each one when full.
+class TokenBatchWriter {
+public:
+    inline explicit TokenBatchWriter(TokenRing& ring) : m_ring(ring), m_batch(&ring.producer_slot())
+    {
+        m_batch->count = 0;
+    }
+
+    inline void push_back(const Token& tok)
+    {
+        m_written++;
+        m_batch->tokens[m_batch->count++] = tok;
+        if(m_batch->count == token_batch_size)
+        {
+            m_batch->last = false;
+            m_ring.publish();
+            m_batch = &m_ring.producer_slot();
+            m_batch->count = 0;
+        }
+    }
+
+    inline void finish()
+    {
+        m_batch->last = true;
+        m_ring.publish();
+    }
+
+    [[nodiscard]] inline size_t written() const
+    {
+        return m_written;
+    }
+
+private:
+    TokenRing& m_ring;
+    TokenBatch* m_batch;
+    size_t m_written = 0;
+};
+
+// Packed struct-of-arrays token storage: 7 bytes per token (type, source
+// offset and a 16-bit slot) plus a symbol id per identifier, and no per-token
+// heap blocks. The slot holds the lexeme length, or for an identifier its
+// ordinal among the identifiers of its block of 64K tokens, which indexes the
+// symbol ids; an identifier's length is read back off the source instead, it
+// runs to the first character that can't be in one. Lengths that don't fit
+// are kept on the side. Token values are rebuilt as views into the source when
+// read back, without asking the interner, which the lexer may still be growing
+// on another thread in pipelined mode. line/column are never stored, see
+// LineIndex for how diagnostics recover them.
+class TokenStream {
 public:
-    inline explicit Tokenizer(std::string src) : source(std::move(src)) //constructor to initialize source string
+    inline explicit TokenStream(std::string_view source) : m_source(source)
+    {}
+
+    inline void reserve(size_t count)
     {
+        m_types.reserve(count);
+        m_offsets.reserve(count);
+        m_slots.reserve(count);
     }
 
-    inline std::vector<Token> tokenize()
+    inline void push_back(const Token& tok)
     {
-        std::string buf; //buffer to hold characters for multi-character tokens
-        std::vector<Token> tokens;
+        const size_t i = m_types.size();
+        if(i % block_tokens == 0)
+        {
+            m_block_syms.push_back(static_cast<uint32_t>(m_syms.size()));
+        }
+        m_types.push_back(tok.type);
+        m_offsets.push_back(static_cast<uint32_t>(tok.value.data() - m_source.data()));
+        if(tok.type == TokenType::ident)
+        {
+            m_slots.push_back(static_cast<uint16_t>(m_syms.size() - m_block_syms.back()));
+            m_syms.push_back(tok.sym);
+        }
+        else if(tok.value.size() < long_length)
+        {
+            m_slots.push_back(static_cast<uint16_t>(tok.value.size()));
+        }
+        else
+        {
+            m_slots.push_back(long_length);
+            m_long_lengths.emplace_back(static_cast<uint32_t>(i), static_cast<uint32_t>(tok.value.size()));
+        }
+    }
+
+    template <typename It> // range of Tokens
+    inline void append(It first, It last)
+    {
+        for(; first != last; ++first)
+        {
+            push_back(*first);
+        }
+    }
 
-        while(peek().has_value())
+    // drops the first count tokens, used by the parser's sliding window in pipelined mode;
+    // the rest are pushed again, since a token's block decides where its symbol id is
+    inline void erase_front(size_t count)
+    {
+        TokenStream rest(m_source);
+        rest.reserve(size() - count);
+        for(size_t i = count; i < size(); i++)
         {
-            int line = m_line;
-            int col = m_col;
-            char ch = peek().value();
+            rest.push_back((*this)[i]);
+        }
+        *this = std::move(rest);
+    }
 
-            if(std::isalpha(ch))
+    [[nodiscard]] inline Token operator[](size_t i) const
+    {
+        const uint32_t offset = m_offsets[i];
+        if(m_types[i] == TokenType::ident)
+        {
+            size_t end = offset + 1;
+            while(end < m_source.size() && (char_classes[static_cast<unsigned char>(m_source[end])] & cc_ident))
             {
+                end++;
+            }
+            return {.type=TokenType::ident, .value=m_source.substr(offset, end - offset), .sym=m_syms[m_block_syms[i / block_tokens] + m_slots[i]]};
+        }
+        return {.type=m_types[i], .value=m_source.substr(offset, length(i))};
+    }
 
-                buf.push_back(consume());
-                while(peek().has_value() && (std::isalnum(peek().value()) || peek().value() == '_'))
-                {
-                    buf.push_back(consume());
-                }
-                if(buf=="bye")
-                {
-                    tokens.push_back({.type=TokenType::bye, .line=line, .col=col});
-                    buf.clear();
-                    continue;
-                }
-                else if(buf=="hope")
-                {
-                    tokens.push_back({.type=TokenType::hope, .line=line, .col=col});
-                    buf.clear();
-                    continue;
-                }
-                else if(buf=="tell_me")
-                {
-                    tokens.push_back({.type=TokenType::tell_me, .line=line, .col=col});
-                    buf.clear();
-                    continue;
-                }
-                else if(buf=="dillusion")
-                {
-                    tokens.push_back({.type=TokenType::dillusion, .line=line, .col=col});
-                    buf.clear();
-                    continue;
-                }
-                else if(buf=="maybe")
+    [[nodiscard]] inline TokenType type(size_t i) const
+    {
+        return m_types[i];
+    }
+
+    [[nodiscard]] inline size_t size() const
+    {
+        return m_types.size();
+    }
+
+    [[nodiscard]] inline size_t bytes() const
+    {
+        return size() * (sizeof(TokenType) + sizeof(uint32_t) + sizeof(uint16_t)) + (m_syms.size() + m_block_syms.size()) * sizeof(uint32_t)
+             + m_long_lengths.size() * sizeof(m_long_lengths[0]);
+    }
+
+private:
+    static constexpr size_t block_tokens = 1 << 16; // so an ordinal within a block fits a slot
+    static constexpr uint16_t long_length = 0xFFFF; // the slot of a lexeme this long or longer
+
+    [[nodiscard]] inline size_t length(size_t i) const
+    {
+        if(m_slots[i] != long_length)
+        {
+            return m_slots[i];
+        }
+        auto it = std::lower_bound(m_long_lengths.begin(), m_long_lengths.end(), std::pair<uint32_t, uint32_t>(static_cast<uint32_t>(i), 0));
+        return it->second;
+    }
+
+    std::string_view m_source;
+    std::vector<TokenType> m_types;
+    std::vector<uint32_t> m_offsets;
+    std::vector<uint16_t> m_slots;
+    std::vector<SymbolId> m_syms; // of the identifiers, in order
+    std::vector<uint32_t> m_block_syms; // per block of tokens, its first identifier's index in m_syms
+    std::vector<std::pair<uint32_t, uint32_t>> m_long_lengths; // token index and length, in token order
+};
+
+class Tokenizer {
+public:
+    inline explicit Tokenizer(const LineIndex& lines, Interner& interner, Diagnostics& diags) : source(lines.source()), m_interner(interner), m_diags(diags) //source is a view into the mapped file, tokens point back into it
+    {
+    }
+
+    inline TokenStream tokenize()
+    {
+        TokenStream tokens(source);
+        tokens.reserve(source.size() / 4); // typical programs average a few bytes per token
+        tokenize_into(tokens);
+        return tokens;
+    }
+
+    // Pipelined mode, meant to run on its own thread while the parser drains the ring.
+    // Returns the number of tokens streamed.
+    inline size_t tokenize_into(TokenRing& ring)
+    {
+        TokenBatchWriter writer(ring);
+        tokenize_into(writer);
+        writer.finish();
+        return writer.written();
+    }
+
+    // whether the input ended inside a comment, so text appended to it could still be commented out
+    [[nodiscard]] inline bool ended_in_comment() const
+    {
+        return m_open_comment;
+    }
+
+private:
+
+    template <typename Sink> // anything with push_back(const Token&)
+    inline void tokenize_into(Sink& tokens)
+    {
+        while(position < source.size())
+        {
+            const size_t start = position;
+            const char ch = source[position];
+            const uint8_t cls = char_classes[static_cast<unsigned char>(ch)];
+
+            if(cls & cc_space)
+            {
+                if(!(char_classes[static_cast<unsigned char>(peek(1))] & cc_space))
                 {
-                    tokens.push_back({.type=TokenType::maybe, .line=line, .col=col});
-                    buf.clear();
+                    position++; // lone separator, not worth a kernel call
                     continue;
                 }
-                else if(buf=="ormaybe")
+                position = scan_kernels.skip_space(source.data() + position, source.data() + source.size()) - source.data();
+                continue;
+            }
+            else if(cls & cc_alpha)
+            {
+                position = scan_while(position + 1, cc_ident);
+                std::string_view word = source.substr(start, position - start); //view of the word, no copy
+                const TokenType type = lookup_keyword(word);
+                if(type == TokenType::secret)
                 {
-                    tokens.push_back({.type=TokenType::ormaybe, .line=line, .col=col});
-                    buf.clear();
-                    continue;
+                    position = find(position, '\n'); // the newline itself is left for the whitespace skip
+                    m_open_comment = position == source.size();
                 }
-                else if(buf=="then")
+                else if(type == TokenType::hide)
                 {
-                    tokens.push_back({.type=TokenType::then_tok, .line=line, .col=col});
-                    buf.clear();
-                    continue;
+                    const size_t body = position;
+                    position = find_block_comment_end(position);
+                    m_open_comment = position == source.size() && (position < body + 4 || source.compare(position - 4, 4, "hide") != 0);
                 }
-                else if(buf=="secret")
+                else if(type == TokenType::ident)
                 {
-                    while(peek().has_value() && peek().value() != '\n')
-                    {
-                        consume();
-                    }
-                    buf.clear();
-                    continue;
+                    tokens.push_back({.type=TokenType::ident, .value=word, .sym=m_interner.intern(word)});
                 }
-                else if(buf=="moveon")
+                else
                 {
-                    tokens.push_back({.type=TokenType::moveon, .line=line, .col=col});
-                    buf.clear();
-                    continue;
+                    tokens.push_back({.type=type, .value=word});
                 }
-                else if(buf=="wait")
+                continue;
+            }
+            else if(cls & cc_digit)
+            {
+                position = scan_while(position + 1, cc_digit);
+                tokens.push_back({.type=TokenType::int_lit, .value=source.substr(start, position - start)});
+                continue;
+            }
+            else if(cls & cc_punct)
+            {
+                position++;
+                tokens.push_back({.type=punct_table[static_cast<unsigned char>(ch)].single, .value=source.substr(start, 1)});
+                continue;
+            }
+            else if(cls & cc_cmp)
+            {
+                const PunctEntry& entry = punct_table[static_cast<unsigned char>(ch)];
+                position++;
+                if(peek() == '=')
                 {
-                    tokens.push_back({.type=TokenType::wait, .line=line, .col=col});
-                    buf.clear();
-                    continue;
+                    position++;
+                    tokens.push_back({.type=entry.with_eq, .value=source.substr(start, 2)});
                 }
-                else if(buf=="hide")
+                else if(entry.has_single)
                 {
-                    buf.clear();
-                    while(peek().has_value()) {
-                         if(peek().value() == 'h' && 
-                            peek(1).has_value() && peek(1).value() == 'i' &&
-                            peek(2).has_value() && peek(2).value() == 'd' && 
-                            peek(3).has_value() && peek(3).value() == 'e')
-                         {
-                             consume(); consume(); consume(); consume();
-                             break;
-                         }
-                         consume();
-                    }
-                    continue;
+                    tokens.push_back({.type=entry.single, .value=source.substr(start, 1)});
                 }
                 else
                 {
-                    tokens.push_back({.type=TokenType::ident, .line=line, .col=col, .value=buf});
-                    buf.clear();
-                    continue;
-                }
-            }
-            else if(std::isdigit(ch))
-            {
-                buf.push_back(consume());
-                while(peek().has_value() && std::isdigit(peek().value()))
-                {
-                    buf.push_back(consume());
+                    error(start, "Unexpected character '!' (did you mean '!='?)"); // dropped, lexing goes on after it
                 }
-                tokens.push_back({.type=TokenType::int_lit, .line=line, .col=col, .value=buf});
-                buf.clear();
-                continue;
-            }
-            else if(std::isspace(ch))
-            {           
-                consume();
                 continue;
             }
-            else
+            else if(cls & cc_quote)
             {
-                switch(ch)
+                // opening quote
+                position++;
+                tokens.push_back({.type=TokenType::double_quotes, .value=source.substr(start, 1)});
+                size_t end = find(position, '"');
+                if(end == source.size())
                 {
-                    case '(':
-                        consume();
-                        tokens.push_back({.type=TokenType::open_paren, .line=line, .col=col});
-                        break;
-                    case ')':
-                        consume();
-                        tokens.push_back({.type=TokenType::close_paren, .line=line, .col=col});
-                        break;
-                    case ';':
-                        consume();
-                        tokens.push_back({.type=TokenType::semi, .line=line, .col=col});
-                        break;
-                    case ',':
-                        consume();
-                        tokens.push_back({.type=TokenType::comma, .line=line, .col=col});
-                        break;
-                    case '=':
-                        consume();
-                        if(peek().has_value() && peek().value() == '='){
-                             consume();
-                             tokens.push_back({.type=TokenType::eq_eq, .line=line, .col=col});
-                        } else {
-                            tokens.push_back({.type=TokenType::eq, .line=line, .col=col});
-                        }
-                        break;
-                    case '!':
-                        consume();
-                         if(peek().has_value() && peek().value() == '='){
-                             consume();
-                             tokens.push_back({.type=TokenType::neq, .line=line, .col=col});
-                        } else {
-                            std::cerr << "Line " << line << ":" << col << " Unexpected character '!' (did you mean '!='?)" << std::endl;
-                            exit(EXIT_FAILURE);
-                        }
-                        break;
-                    case '<':
-                        consume();
-                        if(peek().has_value() && peek().value() == '='){
-                             consume();
-                             tokens.push_back({.type=TokenType::lte, .line=line, .col=col});
-                        } else {
-                            tokens.push_back({.type=TokenType::lt, .line=line, .col=col});
-                        }
-                        break;
-                     case '>':
-                        consume();
-                        if(peek().has_value() && peek().value() == '='){
-                             consume();
-                             tokens.push_back({.type=TokenType::gte, .line=line, .col=col});
-                        } else {
-                            tokens.push_back({.type=TokenType::gt, .line=line, .col=col});
-                        }
-                        break;
-                    case '+':
-                        consume();
-                        tokens.push_back({.type=TokenType::plus, .line=line, .col=col});
-                        break;
-                    case '*':
-                        consume();
-                        tokens.push_back({.type=TokenType::mul, .line=line, .col=col});
-                        break;
-                    case '-':
-                        consume();
-                        tokens.push_back({.type=TokenType::sub, .line=line, .col=col});
-                        break;
-                    case '/':
-                        consume();
-                        tokens.push_back({.type=TokenType::div, .line=line, .col=col});
-                        break;
-                    case '{':
-                        consume();
-                        tokens.push_back({.type=TokenType::open_curly, .line=line, .col=col});
-                        break;
-                    case '}':
-                        consume();
-                        tokens.push_back({.type=TokenType::close_curly, .line=line, .col=col});
-                        break;
-                    case '"':
-                        // opening quote
-                        consume();
-                        tokens.push_back({.type=TokenType::double_quotes, .line=line, .col=col});
-                        {
-                            std::string s;
-                            while(peek().has_value() && peek().value() != '"'){
-                                s.push_back(consume());
-                            }
-                            // push string literal token (content only)
-                            tokens.push_back({.type=TokenType::string_lit, .line=line, .col=col, .value=s});
-                            if(peek().has_value() && peek().value() == '"'){
-                                consume(); // closing quote
-                                tokens.push_back({.type=TokenType::double_quotes, .line=line, .col=col});
-                            } else {
-                                std::cerr << "Line " << line << ":" << col << " Unterminated string literal" << std::endl;
-                                exit(EXIT_FAILURE);
-                            }
-                        }
-                        break;
-                    
-                    default:
-                        std::cerr << "Line " << line << ":" << col << " you sucks! Unexpected character: '" << ch << "' (ASCII: " << (int)ch << ")" << std::endl;
-                        exit(EXIT_FAILURE);
+                    error(start, "Unterminated string literal");
+                    position = end; // the rest of the file is the string, nothing left to lex
+                    continue;
                 }
+                // push string literal token (content only)
+                tokens.push_back({.type=TokenType::string_lit, .value=source.substr(position, end - position)});
+                position = end + 1; // closing quote
+                tokens.push_back({.type=TokenType::double_quotes, .value=source.substr(end, 1)});
                 continue;
             }
+
+            error(start, std::string("you sucks! Unexpected character: '") + ch + "' (ASCII: " + std::to_string((int)ch) + ")");
+            position++; // skip it and carry on
         }
-        return tokens;
     }
-private:
 
-    [[nodiscard]] inline std::optional<char> peek(int offset=0) const //nodiscard : to indicate the return value should not be ignored
+    inline void error(size_t at, const std::string& msg)
     {
-        if(position+offset >= source.size())
-        {
-            return {};
-        }
-        else
+        m_diags.report({.offset=at, .at=" ", .msg=msg});
+    }
+
+    [[nodiscard]] inline char peek(size_t offset=0) const //'\0' past the end of the source
+    {
+        return position + offset < source.size() ? source[position + offset] : '\0';
+    }
+
+    // first index at or after pos whose character is not in any of the classes in mask
+    [[nodiscard]] inline size_t scan_while(size_t pos, uint8_t mask) const
+    {
+        while(pos < source.size() && (char_classes[static_cast<unsigned char>(source[pos])] & mask))
         {
-            return source[position+offset];
+            pos++;
         }
+        return pos;
+    }
+
+    // index of the first c at or after pos, source.size() when there is none
+    [[nodiscard]] inline size_t find(size_t pos, char c) const
+    {
+        return scan_kernels.find_byte(source.data() + pos, source.data() + source.size(), c) - source.data();
     }
 
-    inline char consume() //function to consume the current character and advance the position
+    // index just past the closing "hide" (which may sit inside a word), or the end of the source
+    [[nodiscard]] inline size_t find_block_comment_end(size_t pos) const
     {
-        char c = source[position++];
-        if(c == '\n') {
-            m_line++;
-            m_col = 1;
-        } else {
-            m_col++;
+        for(pos = find(pos, 'h'); pos < source.size(); pos = find(pos + 1, 'h'))
+        {
+            if(source.compare(pos, 4, "hide") == 0)
+            {
+                return pos + 4;
+            }
         }
-        return c;
+        return source.size();
     }
 
 
-    const std::string source;
+    const std::string_view source;
+    Interner& m_interner; // only this tokenizer writes to it, later stages just read names back
+    Diagnostics& m_diags;
+    bool m_open_comment = false; // the last comment reached the end of the input
     size_t position = 0;
-    int m_line = 1;
-    int m_col = 1;
 
-};
\ No newline at end of file
+};
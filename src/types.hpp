@@ -1,9 +1,10 @@
 #pragma once
 
-#include <string>
+#include <string_view>
 #include <optional>
+#include <cstdint>
 
-enum class TokenType {
+enum class TokenType : uint8_t {
     bye, // exit
     int_lit,
     semi,
@@ -78,9 +79,45 @@ std::optional<int> bin_prec(TokenType type){
 }
 
 
+// Operator of a bin_op AST node. Declared in precedence order only for readability.
+enum class BinOp : uint8_t {
+    add,
+    sub,
+    mul,
+    div,
+    eq, // ==
+    neq, // !=
+    lt, // <
+    gt, // >
+    lte, // <=
+    gte, // >=
+};
+
+// only meaningful when is_bin_op(type)
+inline BinOp to_bin_op(TokenType type){
+    switch(type){
+        case TokenType::plus: return BinOp::add;
+        case TokenType::sub: return BinOp::sub;
+        case TokenType::mul: return BinOp::mul;
+        case TokenType::div: return BinOp::div;
+        case TokenType::eq_eq: return BinOp::eq;
+        case TokenType::neq: return BinOp::neq;
+        case TokenType::lt: return BinOp::lt;
+        case TokenType::gt: return BinOp::gt;
+        case TokenType::lte: return BinOp::lte;
+        default: return BinOp::gte;
+    }
+}
+
+// Dense id of an interned identifier, see Interner.
+using SymbolId = uint32_t;
+
+// Unpacked view of one token. value is the lexeme in the mapped source (the
+// contents only for string_lit); its position in the source is also the
+// token's location, line/column are looked up from a LineIndex on demand.
+// Identifiers are interned while lexing, later stages use sym, not the text.
 struct Token {
     TokenType type;
-    int line;
-    int col;
-    std::optional<std::string> value {};
+    std::string_view value {};
+    SymbolId sym = 0; // only meaningful for ident
 };
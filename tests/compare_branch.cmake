@@ -0,0 +1,13 @@
+# A comparison that is printed and branched on as well: the branch can't be fused
+# with it, the 0 or 1 has to stay live up to the test. f calls itself only to
+# stay out of the inliner, so its branches are still there at -O1.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P compare_branch.cmake
+include(${CMAKE_CURRENT_LIST_DIR}/expect_output.cmake)
+
+expect_output(start "hope a = 2; hope b = 1; hope c = a < b; tell_me(c); then; maybe(c){ tell_me(111); }\n" "0\n\n")
+expect_output(function "hope f(hope a, hope b){ hope c = a < b; tell_me(c); maybe(c){ bye(100); } maybe(a > 1000){ bye(f(0, 1) + 1); } bye(200); }\ntell_me(f(2, 1));\ntell_me(f(1, 2));\n"
+              "0\n200\n1\n100\n")
+expect_asm(function O1 IN func_f HAS "\n    setl [^\n]*\n" HAS "\n    test [^\n]*\n    je ")
+# only the branch uses it, the fused cmp and jcc
+expect_output(fused "hope f(hope a, hope b){ maybe(a < b){ bye(100); } maybe(a > 1000){ bye(f(0, 1) + 1); } bye(200); }\ntell_me(f(2, 1) + f(1, 2));\n" "300\n")
+expect_asm(fused O1 IN func_f HAS "\n    cmp [^\n]*\n    jge " LACKS "set|test")
@@ -0,0 +1,67 @@
+# Division by a constant is done with shifts for a power of two and with a
+# multiply by the divisor's reciprocal otherwise, both truncating toward zero
+# like idiv: positive and negative dividends, divisors of either sign, small
+# and large ones, 1 and -1. check isn't inlined, it calls itself, so x is
+# unknown at -O1 too. INT64_MIN / -1 still traps when both are constants.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P constant_division.cmake
+include(${CMAKE_CURRENT_LIST_DIR}/expect_output.cmake)
+
+set(divisors 1 -1 2 -2 8 -8 3 -3 7 -7 10 641 -641 4611686018427387904 -4611686018427387904 1000000007)
+set(dividends 0 1 6 7 8 9 100 1923 1924 410881 9223372036854775807)
+
+# a negative constant is written 0 - n, the language has no unary minus
+function(literal n out)
+    if(n LESS 0)
+        string(SUBSTRING "${n}" 1 -1 magnitude)
+        set(n "(0 - ${magnitude})")
+    endif()
+    set(${out} "${n}" PARENT_SCOPE)
+endfunction()
+
+set(source "hope check(hope x, hope again){\n")
+foreach(d IN LISTS divisors)
+    literal(${d} d)
+    string(APPEND source "    tell_me(x / ${d});\n")
+endforeach()
+string(APPEND source "    maybe(again){\n        hope negated = check(0 - x, 0);\n    }\n    bye(x);\n}\n")
+set(output "")
+foreach(x IN LISTS dividends)
+    string(APPEND source "tell_me(check(${x}, 1));\n")
+    foreach(sign 1 -1)
+        foreach(d IN LISTS divisors)
+            math(EXPR q "(${sign} * ${x}) / (${d})")
+            string(APPEND output "${q}\n")
+        endforeach()
+    endforeach()
+    string(APPEND output "${x}\n")
+endforeach()
+expect_output(by_constants "${source}" "${output}")
+
+# INT64_MIN can't go through check: its negation is itself, and dividing it by -1
+# overflows. low calls itself only to stay out of the inliner.
+expect_output(min_dividend [=[
+hope low(hope x, hope again){
+    tell_me(x / 2);
+    tell_me(x / (0 - 8));
+    tell_me(x / 7);
+    tell_me(x / (0 - 641));
+    tell_me(x / 1000000007);
+    maybe(again){
+        hope same = low(x, 0);
+    }
+    bye(x / 1);
+}
+tell_me(low(0 - 9223372036854775807 - 1, 0));
+]=] [=[
+-4611686018427387904
+1152921504606846976
+-1317624576693539401
+14389035938931007
+-9223371972
+-9223372036854775808
+]=])
+expect_output(min_by_minus_one "tell_me((0 - 9223372036854775807 - 1) / (0 - 1));\n" "" "Floating-point exception")
+
+# at -O1 the only idiv left in check is its x / -1, the divisor that traps
+expect_asm(by_constants O1 IN func_check HAS "\n    imul r11\n" HAS "\n    sar r11, " HAS "mov r11, -1\n[^\n]*\n    cqo\n    idiv r11\n" LACKS "idiv.*idiv")
+expect_asm(min_dividend O1 IN func_low LACKS "idiv")
@@ -0,0 +1,26 @@
+# Branches on constants: at -O1 every one is folded and the dead arms removed,
+# -O0 takes them at run time. Both have to print the same, and a division by
+# zero in an arm that never runs mustn't be folded into anything.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P constant_folding.cmake
+include(${CMAKE_CURRENT_LIST_DIR}/expect_output.cmake)
+
+expect_output(branches [=[
+hope a = 6 * 7;
+maybe(a == 42){ tell_me(1); } moveon { tell_me(2); }
+maybe(a < 0){ tell_me(3); } ormaybe(a - 42 == 0){ tell_me(4); } moveon { tell_me(5); }
+hope b = a / 5 - 8;
+wait(b){ tell_me(6); b = 0; }
+hope x = 1;
+maybe(a > 40){ x = 2; } moveon { x = 3; }
+tell_me(x * 10 + b);
+tell_me((0 - 7) / 2);
+maybe(a == 0){ tell_me(a / 0); }
+hope i = 0;
+wait(i < 3 * 1){ i = i + 1; }
+tell_me(i);
+maybe(1 > 2){ bye(9); }
+bye(a - 40);
+]=] "1\n4\n20\n-3\n3\n" 2)
+# at -O1 what's left is the values, printed as constants
+expect_asm(branches O1 IN _start LACKS "cmp|test|\n    j[a-z]+ _start|idiv" HAS "\n    mov rdi, 20\n")
+expect_asm(branches O0 IN _start HAS "cmp")
@@ -0,0 +1,27 @@
+# What -O1 removes: a function nothing calls (its dillusion still prints, data is
+# kept whole), values and a loop variable nothing reads. At every level only the
+# runtime helpers a program uses are emitted: no print_int when it only prints
+# strings, and no output buffer or helpers at all when it prints nothing.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P dead_code.cmake
+include(${CMAKE_CURRENT_LIST_DIR}/expect_output.cmake)
+
+expect_output(dead_values [=[
+hope unused(hope a){ dillusion note = "kept"; tell_me(a); bye(a * 2); }
+hope helper(hope a){ bye(a + 1); }
+hope x = 5;
+hope dead = x * 1000 + 7;
+hope i = 0;
+hope junk = 1;
+wait(i < 4){ junk = junk * 3 + i; i = i + 1; }
+tell_me(note);
+then;
+tell_me(helper(x));
+bye(i);
+]=] "kept\n6\n" 4)
+expect_output(strings_only "tell_me(\"only strings\");\nthen;\ntell_me(\"no numbers\");\nthen;\n" "only strings\nno numbers\n")
+expect_output(newlines_only "then;\nthen;\n" "\n\n")
+expect_output(no_output "hope a = 3;\nbye(a * 4);\n" "" 12)
+foreach(level O0 O1)
+    expect_asm(strings_only ${level} HAS "\nprint_str:" LACKS "print_int")
+    expect_asm(no_output ${level} HAS "\nexit_program:" LACKS "print_|line_end|flush_output|write_all|out_buf")
+endforeach()
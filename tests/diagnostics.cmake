@@ -0,0 +1,42 @@
+# A compile with errors reports every one of them in a single run: the parser
+# recovers at the next statement, the generator still checks what did parse, and
+# the list comes out in source order whichever stage found each error. Past 100
+# the first ones in the source are listed and the rest only counted.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P diagnostics.cmake
+file(MAKE_DIRECTORY ${WORK})
+file(WRITE ${WORK}/several.by "hope a = ;\ntell_me(b);\nhope c = 1\nmaybe(1 { tell_me(1); }\nhope d = 2;\ntell_me(d +);\n")
+file(REMOVE ${WORK}/out)
+
+execute_process(COMMAND ${BABY} several.by WORKING_DIRECTORY ${WORK} RESULT_VARIABLE status ERROR_VARIABLE errors)
+set(expected "[Parser Error] Line 1:10 >>> Invalid Expression after 'hope'
+[Generator Error] Line 2:9 >>> Undeclared variable: b
+[Parser Error] Line 4:1 >>> expecting semicolon ';'
+[Parser Error] Line 6:12 >>> Invalid right-hand side expression
+4 errors
+")
+if(NOT status EQUAL 1 OR NOT errors STREQUAL expected)
+    message(FATAL_ERROR "expected exit 1 and\n${expected}got exit ${status} and\n${errors}")
+endif()
+if(EXISTS ${WORK}/out)
+    message(FATAL_ERROR "out was written for a program with errors")
+endif()
+
+# the generator's error on line 1 is reported after all the parser's, and still listed first
+set(source "tell_me(b);\n")
+foreach(i RANGE 2 106)
+    string(APPEND source "hope x${i} = ;\n")
+endforeach()
+file(WRITE ${WORK}/many.by "${source}")
+execute_process(COMMAND ${BABY} many.by WORKING_DIRECTORY ${WORK} RESULT_VARIABLE status ERROR_VARIABLE errors)
+string(REGEX MATCHALL "[^\n]*\n" lines "${errors}")
+list(LENGTH lines count)
+list(GET lines 0 first)
+list(GET lines 1 second)
+list(GET lines 99 last)
+if(NOT status EQUAL 1 OR NOT count EQUAL 102
+   OR NOT first STREQUAL "[Generator Error] Line 1:9 >>> Undeclared variable: b\n"
+   OR NOT second STREQUAL "[Parser Error] Line 2:11 >>> Invalid Expression after 'hope'\n"
+   OR NOT last STREQUAL "[Parser Error] Line 100:13 >>> Invalid Expression after 'hope'\n"
+   OR NOT errors MATCHES "\n\\.\\.\\. and 6 more\n106 errors\n$")
+    message(FATAL_ERROR "unexpected errors past the cap (exit ${status}):\n${errors}")
+endif()
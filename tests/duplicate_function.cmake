@@ -0,0 +1,21 @@
+# A second definition of a function is an error at the second one, also when a
+# --session edit adds it in a chunk of its own. The first one used to win silently.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P duplicate_function.cmake
+file(MAKE_DIRECTORY ${WORK})
+file(WRITE ${WORK}/twice.by "hope f(hope a){bye(a);}\nhope f(hope a){bye(a + 1);}\ntell_me(f(1));\n")
+file(WRITE ${WORK}/once.by "hope f(hope a){bye(a);}\ntell_me(f(1));\n")
+file(WRITE ${WORK}/requests "once.by\ntwice.by\n")
+file(REMOVE ${WORK}/out)
+
+execute_process(COMMAND ${BABY} twice.by WORKING_DIRECTORY ${WORK} RESULT_VARIABLE status ERROR_VARIABLE errors)
+if(status EQUAL 0 OR NOT errors MATCHES "Line 2:6 >>> Function already defined: f\n")
+    message(FATAL_ERROR "expected a duplicate function error (exit ${status}):\n${errors}")
+endif()
+if(EXISTS ${WORK}/out)
+    message(FATAL_ERROR "out was written for a program with an error")
+endif()
+
+execute_process(COMMAND ${BABY} --session INPUT_FILE ${WORK}/requests WORKING_DIRECTORY ${WORK} RESULT_VARIABLE status OUTPUT_VARIABLE replies)
+if(NOT status EQUAL 0 OR NOT replies MATCHES "^%%done 0\n.*Line 2:6 >>> Function already defined: f\n.*%%done 1\n$")
+    message(FATAL_ERROR "unexpected session replies (exit ${status}):\n${replies}")
+endif()
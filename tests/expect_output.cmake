@@ -0,0 +1,94 @@
+# expect_output(<name> <source> <output> [status]), for the tests that only check what a
+# program prints: compiles source at -O0 and at -O1, runs both, and fails unless each
+# prints output and exits with status (0 when not given). Needs BABY and WORK set.
+# The assembly of each is kept for expect_asm.
+function(expect_output name source output)
+    set(status 0)
+    if(ARGC GREATER 3)
+        set(status ${ARGV3})
+    endif()
+    foreach(level O0 O1)
+        set(dir ${WORK}/${name}/${level})
+        file(MAKE_DIRECTORY ${dir})
+        file(WRITE ${dir}/${name}.by "${source}")
+        file(REMOVE ${dir}/out)
+        execute_process(COMMAND ${BABY} -${level} --emit-asm ${name}.by WORKING_DIRECTORY ${dir} RESULT_VARIABLE compiled ERROR_VARIABLE errors)
+        if(NOT compiled EQUAL 0)
+            message(FATAL_ERROR "${name} -${level}: compile failed: ${errors}")
+        endif()
+        execute_process(COMMAND ./out WORKING_DIRECTORY ${dir} RESULT_VARIABLE exited OUTPUT_VARIABLE printed)
+        if(NOT printed STREQUAL output OR NOT exited STREQUAL status)
+            message(FATAL_ERROR "${name} -${level}: expected exit ${status} and output\n${output}got exit ${exited} and output\n${printed}")
+        endif()
+    endforeach()
+endfunction()
+
+# the HAS|LACKS <regex> pairs of expect_asm and expect_ir, against code
+function(expect_matches what code)
+    set(args ${ARGN})
+    list(LENGTH args count)
+    math(EXPR last "${count} - 1")
+    foreach(i RANGE 0 ${last} 2)
+        math(EXPR j "${i} + 1")
+        list(GET args ${i} kind)
+        list(GET args ${j} regex)
+        if(kind STREQUAL "HAS" AND NOT code MATCHES "${regex}")
+            message(FATAL_ERROR "${what}: expected ${regex}, got\n${code}")
+        elseif(kind STREQUAL "LACKS" AND code MATCHES "${regex}")
+            message(FATAL_ERROR "${what}: unexpected ${regex}, got\n${code}")
+        endif()
+    endforeach()
+endfunction()
+
+# expect_asm(<name> <level> [IN <label>] HAS|LACKS <regex> [HAS|LACKS <regex>...]), after
+# expect_output(<name> ...): fails unless the assembly compiled at -<level> matches, or
+# doesn't match, each regex. With IN only the code from <label> up to the next label
+# of a function or helper counts, so func_f's own body and not its blocks' neighbours.
+function(expect_asm name level)
+    file(READ ${WORK}/${name}/${level}/out.asm code)
+    set(args ${ARGN})
+    set(what "${name} -${level}")
+    list(GET args 0 first)
+    if(first STREQUAL "IN")
+        list(GET args 1 label)
+        list(REMOVE_AT args 0 1)
+        string(FIND "${code}" "\n${label}:\n" begin)
+        if(begin EQUAL -1)
+            message(FATAL_ERROR "${what}: no ${label} in\n${code}")
+        endif()
+        string(LENGTH "\n${label}:\n" skip)
+        math(EXPR begin "${begin} + ${skip}")
+        string(SUBSTRING "${code}" ${begin} -1 code)
+        if(code MATCHES "\n[A-Za-z_][A-Za-z0-9_]*:\n")
+            string(FIND "${code}" "${CMAKE_MATCH_0}" end)
+            string(SUBSTRING "${code}" 0 ${end} code)
+        endif()
+        string(APPEND what " in ${label}")
+    endif()
+    expect_matches("${what}" "${code}" ${args})
+endfunction()
+
+# expect_ir(<name> [IN <function>] HAS|LACKS <regex> [HAS|LACKS <regex>...]), after
+# expect_output(<name> ...): the same for the IR --emit-ir prints at -O1, where IN
+# takes one function, from its header up to the blank line after it.
+function(expect_ir name)
+    execute_process(COMMAND ${BABY} -O1 --emit-ir ${name}.by WORKING_DIRECTORY ${WORK}/${name}/O1 OUTPUT_VARIABLE code)
+    set(args ${ARGN})
+    set(what "${name} IR")
+    list(GET args 0 first)
+    if(first STREQUAL "IN")
+        list(GET args 1 func)
+        list(REMOVE_AT args 0 1)
+        string(FIND "${code}" "\nfunction ${func}(" begin)
+        if(begin EQUAL -1)
+            message(FATAL_ERROR "${what}: no ${func} in\n${code}")
+        endif()
+        string(SUBSTRING "${code}" ${begin} -1 code)
+        string(FIND "${code}" "\n\n" end)
+        if(NOT end EQUAL -1)
+            string(SUBSTRING "${code}" 0 ${end} code)
+        endif()
+        string(APPEND what " in ${func}")
+    endif()
+    expect_matches("${what}" "${code}" ${args})
+endfunction()
@@ -0,0 +1,42 @@
+# BABY_SCAN forces one scan kernel set: --stats names the one the lexer used, and
+# all of them compile a file of comments, strings and whitespace runs that end on
+# either side of the 16 and 32 byte blocks to the same diagnostics and assembly.
+# avx2 only runs where the CPU has it, elsewhere the widest set stands in.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P forced_scan.cmake
+file(MAKE_DIRECTORY ${WORK})
+
+set(source "")
+foreach(n RANGE 1 40)
+    string(REPEAT " " ${n} pad)
+    string(REPEAT "." ${n} dots)
+    string(APPEND source "hope v${n} = ${n};${pad}\n\t${pad}hide ${dots}h${dots} hide tell_me(v${n});secret ${dots}\n")
+    string(APPEND source "dillusion s${n} = \"${dots}\";${pad}tell_me(s${n});\n")
+endforeach()
+
+foreach(kernels scalar sse2 avx2)
+    set(dir ${WORK}/${kernels})
+    file(MAKE_DIRECTORY ${dir})
+    file(WRITE ${dir}/good.by "${source}")
+    file(WRITE ${dir}/bad.by "${source}tell_me(nope);\n")
+    execute_process(COMMAND ${CMAKE_COMMAND} -E env BABY_SCAN=${kernels} ${BABY} --emit-asm good.by WORKING_DIRECTORY ${dir})
+    file(READ ${dir}/out.asm asm${kernels})
+    execute_process(COMMAND ${CMAKE_COMMAND} -E env BABY_SCAN=${kernels} ${BABY} --stats bad.by
+                    WORKING_DIRECTORY ${dir} ERROR_VARIABLE errors)
+    string(REGEX MATCH "\\[stats\\] lexer \\(([a-z0-9]+)\\)" lexer "${errors}")
+    if(NOT CMAKE_MATCH_1 STREQUAL kernels AND NOT (kernels STREQUAL "avx2" AND CMAKE_MATCH_1 STREQUAL "sse2"))
+        message(FATAL_ERROR "BABY_SCAN=${kernels} lexed with ${CMAKE_MATCH_1}:\n${errors}")
+    endif()
+    string(REGEX REPLACE "\\[stats\\][^\n]*\n" "" diagnostics${kernels} "${errors}")
+endforeach()
+
+if(NOT diagnosticsscalar MATCHES "Line 121:9 >>> Undeclared variable: nope")
+    message(FATAL_ERROR "expected the undeclared variable on the last line, got\n${diagnosticsscalar}")
+endif()
+foreach(kernels sse2 avx2)
+    if(NOT diagnostics${kernels} STREQUAL diagnosticsscalar)
+        message(FATAL_ERROR "BABY_SCAN=${kernels} reported\n${diagnostics${kernels}}scalar reported\n${diagnosticsscalar}")
+    endif()
+    if(NOT asm${kernels} STREQUAL asmscalar)
+        message(FATAL_ERROR "BABY_SCAN=${kernels} emitted different assembly than scalar")
+    endif()
+endforeach()
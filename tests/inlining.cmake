@@ -0,0 +1,31 @@
+# Calls -O1 inlines: nested ones (a call's argument is another call, a function
+# made of calls), ones with several byes, ones in a loop, with the arguments still
+# evaluated right to left. A recursive function stays a call.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P inlining.cmake
+include(${CMAKE_CURRENT_LIST_DIR}/expect_output.cmake)
+
+expect_output(nested [=[
+hope show(hope v){ tell_me(v); bye(v); }
+hope sq(hope x){ bye(x * x); }
+hope add(hope a, hope b){ bye(a + b); }
+hope clamp(hope x, hope lo, hope hi){
+    maybe(x < lo){ bye(lo); }
+    maybe(x > hi){ bye(hi); }
+    bye(x);
+}
+hope outer(hope x){ bye(add(sq(x), sq(add(x, 1)))); }
+hope fact(hope n){ maybe(n < 2){ bye(1); } bye(n * fact(n - 1)); }
+tell_me(add(show(1), show(2)));
+tell_me(outer(3));
+tell_me(clamp(outer(1), 0, 4) + clamp(0 - 5, 0 - 2, 2) * 10 + clamp(1, 0, 9) * 100);
+tell_me(sq(sq(sq(2))));
+hope i = 0;
+hope s = 0;
+wait(i < 4){ s = add(s, outer(i)); i = i + 1; }
+tell_me(s);
+tell_me(fact(10) / fact(8));
+]=] "2\n1\n3\n25\n84\n256\n44\n90\n")
+# only fact is left to call, the inlined functions aren't emitted at all
+expect_asm(nested O1 IN _start HAS "call func_fact" LACKS "call func_(show|sq|add|clamp|outer)")
+expect_asm(nested O1 LACKS "\nfunc_(show|sq|add|clamp|outer):")
+expect_asm(nested O0 IN _start HAS "call func_outer")
@@ -0,0 +1,54 @@
+# wait loops as -O1 rewrites them: an invariant hoisted out (but not a division
+# that could trap, out of a loop that never runs), i * k strength-reduced to a
+# running sum, a counter that steps down or skips ahead inside a maybe, and loops
+# with constant trip counts that get unrolled.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P loops.cmake
+include(${CMAKE_CURRENT_LIST_DIR}/expect_output.cmake)
+
+expect_output(loops [=[
+hope sum_scaled(hope n, hope k){
+    hope i = 0;
+    hope s = 0;
+    wait(i < n){ s = s + i * k + (k * 3 + 1); i = i + 1; }
+    bye(s);
+}
+hope countdown(hope n){
+    hope s = 0;
+    wait(n > 0){ s = s * 2 + n; n = n - 3; }
+    bye(s);
+}
+hope never(hope n, hope z){
+    hope s = 7;
+    wait(n > 0){ s = s + 100 / z; n = n - 1; }
+    bye(s);
+}
+hope skips(hope n){
+    hope i = 0;
+    hope s = 0;
+    wait(i < n){
+        maybe(i == 3){ i = i + 2; } moveon { s = s + i * 5; }
+        i = i + 1;
+    }
+    bye(s * 1000 + i);
+}
+hope t = 0;
+wait(t < 10){ tell_me(sum_scaled(t, 4)); t = t + 3; }
+tell_me(sum_scaled(8, 0 - 2));
+tell_me(countdown(10));
+tell_me(countdown(0 - 1));
+tell_me(never(0, 0));
+tell_me(skips(9));
+hope fixed = 0;
+hope j = 0;
+wait(j < 7){ fixed = fixed + j * j; j = j + 1; }
+tell_me(fixed);
+hope m = 0;
+wait(m < 8){ fixed = fixed - m; m = m + 1; }
+tell_me(fixed);
+]=] "0\n51\n138\n261\n-96\n117\n0\n7\n120009\n91\n63\n")
+# nothing is multiplied in sum_scaled's loop: k * 3 + 1 is hoisted and i * k
+# a running sum; never's division stays in the loop; the constant loops in
+# _start are unrolled and folded to their sums
+expect_ir(loops IN func_sum_scaled HAS "mul %1, %4\n.*\nb1:" LACKS "\nb1:.* mul ")
+expect_ir(loops IN func_never HAS "\nb2:[^\n]*\n    %[0-9]+ = div ")
+expect_ir(loops IN _start HAS "const 91\n    print_int [^\n]*\n    %[0-9]+ = const 63\n")
@@ -0,0 +1,59 @@
+# With more than one job, a file of 64K tokens or more has its top-level
+# functions parsed on several threads, in units that are appended back in
+# source order, each one listed by --stats. --jobs=4 has to give what --jobs=1
+# gives: the same assembly and program, and for a unit that doesn't parse the
+# same diagnostics, which come from parsing the whole file again sequentially.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P parallel_parse.cmake
+file(MAKE_DIRECTORY ${WORK})
+
+# each function calls the one before it, so calls cross from unit to unit, and
+# statement runs between them make spans of both kinds
+set(source "hope f0(hope a){ bye(a); }\n")
+foreach(n RANGE 1 2000)
+    math(EXPR previous "${n} - 1")
+    string(APPEND source "hope f${n}(hope a){ hope b = a * ${n} + 1; maybe(b > ${n}){ bye(b - f${previous}(a / 2)); } bye(b); }\n")
+    math(EXPR run "${n} % 400")
+    if(run EQUAL 0)
+        string(APPEND source "tell_me(f${n}(${n}));\n")
+    endif()
+endforeach()
+string(APPEND source "tell_me(f2000(3));\n")
+file(WRITE ${WORK}/good.by "${source}")
+string(REPLACE "hope f1000(hope a){ hope b = a * 1000 + 1;" "hope f1000(hope a){ hope b = a * + 1;" broken "${source}")
+file(WRITE ${WORK}/broken.by "${broken}")
+
+foreach(jobs 1 4)
+    set(dir ${WORK}/jobs${jobs})
+    file(MAKE_DIRECTORY ${dir})
+    execute_process(COMMAND ${BABY} --stats --emit-asm --jobs=${jobs} ${WORK}/good.by WORKING_DIRECTORY ${dir} RESULT_VARIABLE status ERROR_VARIABLE stats)
+    if(NOT status EQUAL 0 OR NOT stats MATCHES " ([0-9]+) tokens in ")
+        message(FATAL_ERROR "--jobs=${jobs}: compile failed (exit ${status}):\n${stats}")
+    endif()
+    if(CMAKE_MATCH_1 LESS 65536)
+        message(FATAL_ERROR "good.by has ${CMAKE_MATCH_1} tokens, too few to be parsed in parallel")
+    endif()
+    string(REGEX MATCH "AST parts: ([0-9]+)," parts "${stats}")
+    set(parts${jobs} "${CMAKE_MATCH_1}")
+    file(READ ${dir}/out.asm asm${jobs})
+    execute_process(COMMAND ./out WORKING_DIRECTORY ${dir} RESULT_VARIABLE status OUTPUT_VARIABLE printed${jobs})
+    if(NOT status EQUAL 0)
+        message(FATAL_ERROR "--jobs=${jobs}: program exited with ${status}")
+    endif()
+    execute_process(COMMAND ${BABY} --jobs=${jobs} ${WORK}/broken.by WORKING_DIRECTORY ${dir} RESULT_VARIABLE status ERROR_VARIABLE errors${jobs})
+    if(NOT status EQUAL 1)
+        message(FATAL_ERROR "--jobs=${jobs}: broken.by compiled (exit ${status})")
+    endif()
+endforeach()
+
+if(NOT parts1 EQUAL 1 OR NOT parts4 GREATER 1)
+    message(FATAL_ERROR "--stats counted ${parts1} AST parts for --jobs=1 and ${parts4} for --jobs=4")
+endif()
+if(NOT asm1 STREQUAL asm4)
+    message(FATAL_ERROR "--jobs=4 emitted different assembly than --jobs=1")
+endif()
+if(NOT printed1 STREQUAL printed4 OR printed1 STREQUAL "")
+    message(FATAL_ERROR "--jobs=1 printed\n${printed1}--jobs=4 printed\n${printed4}")
+endif()
+if(NOT errors1 STREQUAL errors4 OR NOT errors1 MATCHES "Line 1003:[0-9]+ >>> ")
+    message(FATAL_ERROR "--jobs=1 reported\n${errors1}--jobs=4 reported\n${errors4}")
+endif()
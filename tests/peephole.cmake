@@ -0,0 +1,66 @@
+# Code each peephole rule rewrites at -O1, checked with the counts --stats
+# prints: a spilled value stored and loaded straight back, copies through r11
+# moved back and then overwritten, a call's result times a constant, x - 0, a
+# compare with zero and a jump to a jump. -O0 doesn't run the pass, so both
+# have to print the same.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P peephole.cmake
+include(${CMAKE_CURRENT_LIST_DIR}/expect_output.cmake)
+
+expect_output(rewrites [=[
+hope rec(hope n, hope acc){
+    maybe(n > 0){
+        bye(rec(n - 1, n) + (acc + (n > acc)));
+    }
+    acc = acc + ((10 - n) < (n != n));
+    acc = acc;
+    maybe(((n > n) <= acc) - n * (acc >= acc)){
+        maybe((acc < acc) + 5){
+            bye(n * n - (1000 <= n) + acc * 3);
+            tell_me(0);
+        }
+    }
+    bye(acc * 2);
+}
+hope pick(hope x){
+    hope y = (x * x + x < x) * (1 - (x < 100) * (x - x));
+    bye(8 / (y * y + 1));
+    tell_me(x);
+}
+hope mix(hope a, hope b, hope c){
+    a = c;
+    tell_me(a);
+    maybe(c <= (300 > (31 - a))){
+        c = c * 65536;
+        bye(c + a);
+    }
+    bye((c != 1) + b);
+}
+hope spill(hope a){
+    hope v1 = a + 1; hope v2 = a * 2 + 2; hope v3 = a * 3 + 3; hope v4 = a * 4 + 4; hope v5 = a * 5 + 5;
+    hope v6 = a * 6 + 6; hope v7 = a * 7 + 7; hope v8 = a * 8 + 8; hope v9 = a * 9 + 9; hope v10 = a * 10 + 10;
+    hope v11 = a * 11 + 11; hope v12 = a * 12 + 12; hope v13 = a * 13 + 13; hope v14 = a * 14 + 14;
+    hope w = v1 * v14;
+    tell_me(w);
+    bye(v1 + v2 + v3 + v4 + v5 + v6 + v7 + v8 + v9 + v10 + v11 + v12 + v13 + v14 + w);
+}
+hope quarter(hope a, hope b){ bye(b - a / 4); }
+hope same(hope a){ hope b = a - 0; bye(b * 3); }
+tell_me(rec(2, 65536) * 7 / 50);
+tell_me(rec(0, 4));
+tell_me(pick(123456789) + pick(0 - 3));
+tell_me(mix(8, 65536, 1));
+tell_me(mix(8, 65536, 0 - 2));
+hope i = 0;
+wait(i < 3){ tell_me(pick(i) * 5 + mix(i, i, i)); i = i + 1; }
+tell_me(spill(3));
+tell_me(quarter(40, 3));
+tell_me(quarter(0 - 9, 0));
+tell_me(same(7));
+]=] "9175\n12\n16\n1\n65537\n-2\n-131074\n0\n40\n1\n65577\n2\n43\n224\n644\n-7\n2\n21\n")
+
+execute_process(COMMAND ${BABY} -O1 --stats rewrites.by WORKING_DIRECTORY ${WORK}/rewrites/O1 ERROR_VARIABLE stats)
+foreach(rule store-load move-back dead-move imul-three-operand identity-arith compare-zero jump-thread)
+    if(NOT stats MATCHES " ${rule}=[1-9]")
+        message(FATAL_ERROR "${rule} never fired:\n${stats}")
+    endif()
+endforeach()
@@ -0,0 +1,35 @@
+# --pipeline on a program with 20k distinct identifiers: the lexer keeps
+# interning new names while the parser reads tokens, and the executable has to
+# come out the same as from the one-thread front end. Past the first 64K tokens
+# a string literal longer than a token's 16-bit length field has to come back
+# whole too.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P pipeline_identifiers.cmake
+set(count 20000)
+set(source "")
+foreach(i RANGE 1 ${count})
+    string(APPEND source "hope name_${i} = ${i};\n")
+endforeach()
+string(REPEAT "long text " 7000 long)
+string(APPEND source "dillusion long = \"${long}\";\ntell_me(long);\ntell_me(name_1 + name_${count});\n")
+file(MAKE_DIRECTORY ${WORK}/plain ${WORK}/pipeline)
+file(WRITE ${WORK}/identifiers.by "${source}")
+
+foreach(mode plain pipeline)
+    set(flags "")
+    if(mode STREQUAL "pipeline")
+        set(flags --pipeline)
+    endif()
+    execute_process(COMMAND ${BABY} ${flags} ../identifiers.by WORKING_DIRECTORY ${WORK}/${mode} RESULT_VARIABLE status ERROR_VARIABLE errors)
+    if(NOT status EQUAL 0)
+        message(FATAL_ERROR "${mode} compile failed: ${errors}")
+    endif()
+endforeach()
+
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK}/plain/out ${WORK}/pipeline/out RESULT_VARIABLE differ)
+if(NOT differ EQUAL 0)
+    message(FATAL_ERROR "--pipeline built a different executable")
+endif()
+execute_process(COMMAND ./out WORKING_DIRECTORY ${WORK}/pipeline OUTPUT_VARIABLE output)
+if(NOT output STREQUAL "${long}20001\n")
+    message(FATAL_ERROR "expected the long string and 20001, the program printed: ${output}")
+endif()
@@ -0,0 +1,33 @@
+# print_int counts digits from the highest set bit (bsr * 1233 >> 12, fixed up
+# against a power of ten) and writes two at a time, dividing by 100 with a
+# reciprocal multiply. The values around every power of ten are where the count
+# and the pairs go wrong, both signs, and the two ends of the range.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P print_int.cmake
+include(${CMAKE_CURRENT_LIST_DIR}/expect_output.cmake)
+
+set(values 0 1)
+set(power 1)
+foreach(k RANGE 1 18)
+    math(EXPR power "${power} * 10")
+    math(EXPR below "${power} - 1")
+    math(EXPR above "${power} + 1")
+    list(APPEND values ${below} ${power} ${above})
+endforeach()
+list(APPEND values 9223372036854775807)
+
+set(source "")
+set(output "")
+foreach(n IN LISTS values)
+    string(APPEND source "tell_me(${n});\ntell_me(0 - ${n});\n")
+    math(EXPR negated "0 - ${n}")
+    string(APPEND output "${n}\n${negated}\n")
+endforeach()
+string(APPEND source "tell_me(0 - 9223372036854775807 - 1);\n")
+string(APPEND output "-9223372036854775808\n")
+expect_output(powers_of_ten "${source}" "${output}")
+
+# the div-per-digit print_int bench/print_int.by is timed against still prints the same
+set(ENV{BABY_PRINT_INT} div)
+expect_output(div_per_digit "${source}" "${output}")
+expect_asm(div_per_digit O1 IN print_int HAS "\n    div r8\n" LACKS "print_int_pairs")
+unset(ENV{BABY_PRINT_INT})
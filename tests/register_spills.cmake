@@ -0,0 +1,35 @@
+# More values live at once than there are registers: sixteen in a function,
+# across print calls (only callee-saved registers survive them) and a division
+# (rax and rdx), and fourteen loop variables that are phis at the wait's header.
+# Some of them get stack slots, and slots are shared once their ranges end.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P register_spills.cmake
+include(${CMAKE_CURRENT_LIST_DIR}/expect_output.cmake)
+
+set(source "hope f(hope a){\n")
+set(sum "")
+foreach(k RANGE 1 16)
+    string(APPEND source "    hope v${k} = a * ${k} + ${k};\n")
+    string(APPEND sum "v${k} * ${k} + ")
+endforeach()
+string(APPEND source "    tell_me(v1 * v16);\n    hope q = v8 / (a - 97);\n    tell_me(q);\n    bye(${sum}q);\n}\ntell_me(f(100));\n")
+set(sum "")
+foreach(k RANGE 1 14)
+    string(APPEND source "hope s${k} = ${k};\n")
+    string(APPEND sum "s${k} + ")
+endforeach()
+string(APPEND source "hope i = f(0) - 1496;\nwait(i < 10){\n")
+foreach(k RANGE 1 14)
+    math(EXPR next "${k} % 14 + 1")
+    string(APPEND source "    s${k} = s${k} + i * ${k} + s${next};\n")
+endforeach()
+string(APPEND source "    i = i + 1;\n}\ntell_me(${sum}0);\ntell_me(s1 - s14);\n")
+
+expect_output(spills "${source}" "163216\n269\n151365\n16\n0\n247165\n-8847\n")
+# values live in registers and stack slots, never pushed and popped like the
+# old stack machine; slots are below the five saved registers at rbp - 8 .. 40
+foreach(level O0 O1)
+    foreach(func func_f _start)
+        expect_asm(spills ${level} IN ${func} LACKS "\n    pop |\n    push r([^b]|b[^p])" HAS "\n    mov r[a-z0-9]+, r[a-z0-9]+\n")
+    endforeach()
+    expect_asm(spills ${level} IN func_f HAS "QWORD \\[rbp - (4[89]|[5-9][0-9]|[1-9][0-9][0-9])\\]")
+endforeach()
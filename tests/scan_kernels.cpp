@@ -0,0 +1,94 @@
+// Every scan kernel set this CPU can run has to agree with the scalar one: on
+// every start and end around the 16 and 32 byte blocks the SSE2 and AVX2 loops
+// step through, and for a hide comment whose closing hide straddles a block.
+// Run with no arguments; prints the first disagreement and exits 1.
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../src/scan.hpp"
+
+static int failures = 0;
+
+static void expect(bool same, const char* kernels, const char* what, size_t begin, size_t end, int c)
+{
+    if(!same && failures++ == 0)
+    {
+        std::printf("%s %s disagrees with scalar on [%zu, %zu) for %d\n", kernels, what, begin, end, c);
+    }
+}
+
+// where the tokenizer's block comment scan ends: just past the first "hide" at or after pos
+static size_t comment_end(const ScanKernels& k, const std::string& text, size_t pos)
+{
+    const char* base = text.data();
+    const char* end = base + text.size();
+    for(pos = k.find_byte(base + pos, end, 'h') - base; pos < text.size(); pos = k.find_byte(base + pos + 1, end, 'h') - base)
+    {
+        if(text.compare(pos, 4, "hide") == 0) return pos + 4;
+    }
+    return text.size();
+}
+
+int main()
+{
+    // bytes the kernels compare against, placed around the block edges: needles,
+    // every whitespace character, and the ones either side of \t..\r and ' '
+    std::string text(160, 'x');
+    const size_t edges[] = {0, 1, 14, 15, 16, 17, 30, 31, 32, 33, 47, 48, 63, 64, 65, 95, 96, 127, 128};
+    const char fill[] = {'\n', 'h', ' ', '\t', '\r', '\v', '\f', '\x08', '\x0e', '\x1f', '!', '\x80', '\xff', 'h', '\n'};
+    size_t f = 0;
+    for(size_t edge : edges)
+    {
+        text[edge] = fill[f++ % std::size(fill)];
+    }
+    std::string spaces(160, ' '); // long whitespace runs, broken just past each edge
+    for(size_t edge : edges)
+    {
+        if(edge + 1 < spaces.size()) spaces[edge + 1] = (edge % 2 == 0) ? '\n' : '\t';
+    }
+    spaces[100] = 'y';
+
+    const std::vector<ScanKernels> kernels = available_scan_kernels();
+    for(const ScanKernels& k : kernels)
+    {
+        for(const std::string* buffer : {&text, &spaces})
+        {
+            const char* base = buffer->data();
+            for(size_t begin = 0; begin <= 70; begin++)
+            {
+                for(size_t end = begin; end <= buffer->size(); end++)
+                {
+                    for(int c : {'\n', 'h', ' ', 'x', '\xff', 'z'})
+                    {
+                        expect(k.find_byte(base + begin, base + end, static_cast<char>(c)) == find_byte_scalar(base + begin, base + end, static_cast<char>(c)),
+                               k.name, "find_byte", begin, end, c);
+                        expect(k.count_byte(base + begin, base + end, static_cast<char>(c)) == count_byte_scalar(base + begin, base + end, static_cast<char>(c)),
+                               k.name, "count_byte", begin, end, c);
+                    }
+                    expect(k.skip_space(base + begin, base + end) == skip_space_scalar(base + begin, base + end), k.name, "skip_space", begin, end, 0);
+                }
+            }
+        }
+
+        // hide ... hide with the closing one starting on each side of the 16 and 32 byte
+        // edges, and a few h's before it that aren't "hide"
+        for(size_t close = 8; close <= 72; close++)
+        {
+            std::string comment = "hide";
+            comment.append(close - comment.size(), '.');
+            for(size_t h = 5; h < close; h += 7) comment[h] = 'h';
+            comment += "hide tell_me(1);\n";
+            const size_t expected = comment_end(kernels.front(), comment, 4);
+            expect(expected == close + 4, "scalar", "comment end", 4, comment.size(), 'h');
+            expect(comment_end(k, comment, 4) == expected, k.name, "comment end", 4, comment.size(), 'h');
+        }
+    }
+
+    for(const ScanKernels& k : kernels)
+    {
+        std::printf("%s ", k.name);
+    }
+    std::printf(failures == 0 ? "agree\n" : "disagree\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,14 @@
+# --session given a path it can't read answers %%done 1 and goes on to the next one.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P session_bad_path.cmake
+file(MAKE_DIRECTORY ${WORK})
+file(WRITE ${WORK}/ok.by "hope x = 3;\ntell_me(x);\n")
+file(WRITE ${WORK}/requests "missing.by\nok.by\n")
+file(REMOVE ${WORK}/out)
+execute_process(COMMAND ${BABY} --session INPUT_FILE ${WORK}/requests WORKING_DIRECTORY ${WORK} RESULT_VARIABLE status OUTPUT_VARIABLE replies)
+if(NOT status EQUAL 0 OR NOT replies MATCHES "Could not open source file: missing.by\n%%done 1\n%%done 0\n$")
+    message(FATAL_ERROR "unexpected session replies (exit ${status}):\n${replies}")
+endif()
+execute_process(COMMAND ./out WORKING_DIRECTORY ${WORK} OUTPUT_VARIABLE output)
+if(NOT output STREQUAL "3\n")
+    message(FATAL_ERROR "expected 3, the program printed: ${output}")
+endif()
@@ -0,0 +1,24 @@
+# Past the 100 errors a compile lists, --session still counts every one: each
+# chunk caches how many it reported along with the ones it kept, and the cap is
+# applied once to the whole file, so the replies are what a one-shot compile prints.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P session_many_errors.cmake
+file(MAKE_DIRECTORY ${WORK})
+set(body "")
+set(run "")
+foreach(i RANGE 1 150)
+    string(APPEND body " tell_me(q${i});")
+endforeach()
+foreach(i RANGE 1 120)
+    string(APPEND run "tell_me(z${i});\n")
+endforeach()
+file(WRITE ${WORK}/many.by "hope f(hope a){${body} bye(a); }\n${run}hope x = ;\ntell_me(f(1));\n")
+file(WRITE ${WORK}/requests "many.by\nmany.by\n")
+
+execute_process(COMMAND ${BABY} many.by WORKING_DIRECTORY ${WORK} ERROR_VARIABLE expected)
+if(NOT expected MATCHES "\\.\\.\\. and 171 more\n271 errors\n$")
+    message(FATAL_ERROR "unexpected one-shot errors:\n${expected}")
+endif()
+execute_process(COMMAND ${BABY} --session INPUT_FILE ${WORK}/requests WORKING_DIRECTORY ${WORK} RESULT_VARIABLE status OUTPUT_VARIABLE replies)
+if(NOT status EQUAL 0 OR NOT replies STREQUAL "${expected}%%done 1\n${expected}%%done 1\n")
+    message(FATAL_ERROR "--session errors differ from a one-shot compile's (exit ${status}), expected\n${expected}got\n${replies}")
+endif()
@@ -0,0 +1,28 @@
+# A file whose braces don't balance can't be split into chunks, --session keeps
+# it whole. Its functions still count as defined, and the errors it reports are
+# the ones a one-shot compile reports, first compile of a session or after an edit.
+# So are a balanced file's whose syntax error makes the parser skip a function
+# definition further on, which a one-shot compile then reports calls to.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P session_unbalanced.cmake
+file(MAKE_DIRECTORY ${WORK})
+file(WRITE ${WORK}/balanced.by "hope f1(hope a){ bye(a + 1); }\nhope f2(hope b){ bye(b); }\ntell_me(f1(1) + f2(2));\n")
+file(WRITE ${WORK}/unbalanced.by "hope f1(hope a){ bye(a + q); }\nhope f2(hope b){ maybe(b){ bye(1); }\ntell_me(f1(1) + f2(2));\n")
+file(WRITE ${WORK}/stray.by "hope f1(hope a){ bye(a + 1); }\n+\nhope f2(hope b){ bye(b); }\ntell_me(f1(1) + f2(2));\ntell_me(f2(3));\n")
+
+execute_process(COMMAND ${BABY} unbalanced.by WORKING_DIRECTORY ${WORK} ERROR_VARIABLE unbalanced)
+if(NOT unbalanced MATCHES "Undeclared variable: q" OR unbalanced MATCHES "Undefined function")
+    message(FATAL_ERROR "unexpected one-shot errors:\n${unbalanced}")
+endif()
+execute_process(COMMAND ${BABY} stray.by WORKING_DIRECTORY ${WORK} ERROR_VARIABLE stray)
+if(NOT stray MATCHES "Line 4:17 >>> Undefined function: f2\n.*Line 5:9 >>> Undefined function: f2\n")
+    message(FATAL_ERROR "unexpected one-shot errors:\n${stray}")
+endif()
+
+foreach(file unbalanced stray)
+    file(WRITE ${WORK}/requests "${file}.by\nbalanced.by\n${file}.by\n")
+    execute_process(COMMAND ${BABY} --session INPUT_FILE ${WORK}/requests WORKING_DIRECTORY ${WORK} RESULT_VARIABLE status OUTPUT_VARIABLE replies)
+    set(expected "${${file}}")
+    if(NOT status EQUAL 0 OR NOT replies STREQUAL "${expected}%%done 1\n%%done 0\n${expected}%%done 1\n")
+        message(FATAL_ERROR "--session errors for ${file}.by differ from a one-shot compile's (exit ${status}), expected\n${expected}got\n${replies}")
+    endif()
+endforeach()
@@ -0,0 +1,48 @@
+# Tail calls: self recursion (a loop at -O1), mutual recursion, a call that swaps
+# its parameters, and calls to functions with more or fewer parameters than the
+# caller, whose frame is reused. Shallow enough for -O0's real calls; then once at
+# -O1 ten million deep, which only runs in constant stack.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P tail_calls.cmake
+include(${CMAKE_CURRENT_LIST_DIR}/expect_output.cmake)
+
+expect_output(tail_calls [=[
+hope count(hope n, hope acc){ maybe(n == 0){ bye(acc); } bye(count(n - 1, acc + 2)); }
+hope is_even(hope n){ maybe(n == 0){ bye(1); } bye(is_odd(n - 1)); }
+hope is_odd(hope n){ maybe(n == 0){ bye(0); } bye(is_even(n - 1)); }
+hope gcd(hope a, hope b){ maybe(b == 0){ bye(a); } bye(gcd(b, a - a / b * b)); }
+hope wide(hope a, hope b, hope c, hope d){ bye(a * 1000 + b * 100 + c * 10 + d); }
+hope narrow(hope x){ maybe(x > 5){ bye(wide(x, 4, 3, x - 5)); } bye(spread(x, x + 1, x + 2)); }
+hope spread(hope a, hope b, hope c){ maybe(a > 100){ bye(a + b + c); } bye(narrow(a + b + c)); }
+tell_me(count(20000, 0));
+tell_me(is_even(20001) * 10 + is_odd(20001));
+tell_me(gcd(1071, 462) + gcd(462, 1071) * 100);
+tell_me(narrow(1));
+tell_me(spread(2, 1, 0));
+]=] "40000\n1\n2121\n6431\n12437\n")
+
+set(dir ${WORK}/deep)
+file(MAKE_DIRECTORY ${dir})
+file(WRITE ${dir}/deep.by [=[
+hope count(hope n, hope acc){ maybe(n == 0){ bye(acc); } bye(count(n - 1, acc + 2)); }
+hope is_even(hope n){ maybe(n == 0){ bye(1); } bye(is_odd(n - 1)); }
+hope is_odd(hope n){ maybe(n == 0){ bye(0); } bye(is_even(n - 1)); }
+tell_me(count(10000000, 0));
+tell_me(is_even(10000001));
+]=])
+execute_process(COMMAND ${BABY} -O1 deep.by WORKING_DIRECTORY ${dir} RESULT_VARIABLE compiled ERROR_VARIABLE errors)
+if(NOT compiled EQUAL 0)
+    message(FATAL_ERROR "deep: compile failed: ${errors}")
+endif()
+execute_process(COMMAND ./out WORKING_DIRECTORY ${dir} RESULT_VARIABLE exited OUTPUT_VARIABLE printed)
+if(NOT printed STREQUAL "20000000\n0\n" OR NOT exited EQUAL 0)
+    message(FATAL_ERROR "deep: expected 20000000 and 0, got exit ${exited} and output\n${printed}")
+endif()
+
+# at -O1 count is a loop without calls, and the mutual recursion jumps instead of calling
+expect_ir(tail_calls IN func_count LACKS "call" HAS "phi")
+foreach(pair "is_even;is_odd" "is_odd;is_even" "narrow;spread" "spread;narrow")
+    list(GET pair 0 caller)
+    list(GET pair 1 callee)
+    expect_asm(tail_calls O1 IN func_${caller} HAS "\n    jmp func_${callee}\n" LACKS "call")
+    expect_asm(tail_calls O0 IN func_${caller} HAS "\n    call func_${callee}\n")
+endforeach()
@@ -0,0 +1,26 @@
+# A call to a function nothing defines is an error, not a crash, also when the
+# only definition went away in a --session edit. One defined further down is fine.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P undefined_function.cmake
+file(MAKE_DIRECTORY ${WORK})
+file(WRITE ${WORK}/undefined.by "hope x = 1;\ntell_me(nope(x));\n")
+file(WRITE ${WORK}/later.by "tell_me(twice(4));\nhope twice(hope a){bye(a * 2);}\n")
+file(WRITE ${WORK}/removed.by "tell_me(twice(4));\n")
+file(WRITE ${WORK}/requests "later.by\nremoved.by\n")
+file(REMOVE ${WORK}/out)
+
+execute_process(COMMAND ${BABY} undefined.by WORKING_DIRECTORY ${WORK} RESULT_VARIABLE status ERROR_VARIABLE errors)
+if(status EQUAL 0 OR NOT errors MATCHES "Line 2:9 >>> Undefined function: nope\n")
+    message(FATAL_ERROR "expected an undefined function error (exit ${status}):\n${errors}")
+endif()
+if(EXISTS ${WORK}/out)
+    message(FATAL_ERROR "out was written for a program with an error")
+endif()
+
+execute_process(COMMAND ${BABY} --session INPUT_FILE ${WORK}/requests WORKING_DIRECTORY ${WORK} RESULT_VARIABLE status OUTPUT_VARIABLE replies)
+if(NOT status EQUAL 0 OR NOT replies MATCHES "^%%done 0\n.*Line 1:9 >>> Undefined function: twice\n.*%%done 1\n$")
+    message(FATAL_ERROR "unexpected session replies (exit ${status}):\n${replies}")
+endif()
+execute_process(COMMAND ./out WORKING_DIRECTORY ${WORK} OUTPUT_VARIABLE output)
+if(NOT output STREQUAL "8\n")
+    message(FATAL_ERROR "expected 8 from the session's first compile, the program printed: ${output}")
+endif()
@@ -0,0 +1,13 @@
+# A division whose result nobody reads still traps when it divides by zero, or
+# INT64_MIN by -1, at -O0 as well as after dead code elimination at -O1. One by
+# a constant that can't trap is simply dropped.
+# cmake -DBABY=<compiler> -DWORK=<scratch dir> -P unused_division.cmake
+include(${CMAKE_CURRENT_LIST_DIR}/expect_output.cmake)
+
+expect_output(by_zero "hope z = 0;\nhope d = 5 / z;\nbye(3);\n" "" "Floating-point exception")
+expect_output(overflow "hope f(hope a, hope b){ hope q = a / b; bye(a); }\nbye(f(0 - 9223372036854775807 - 1, 0 - 1));\n" "" "Floating-point exception")
+expect_output(by_constant "hope f(hope a){ hope q = a / 7; bye(a); }\nbye(f(5));\n" "" 5)
+foreach(level O0 O1)
+    expect_asm(by_zero ${level} HAS "\n    idiv ")
+endforeach()
+expect_asm(by_constant O1 LACKS "idiv|imul|sar")